@@ -1,6 +1,4 @@
-#include "libs/postman.h"
-
-#define VERSION "0.0.1"
+#include "libs/microbench.h"
 
 /**
  * Entry point of the program. Parses command-line arguments and routes execution.
@@ -36,18 +34,36 @@ int main(int argc, const char *argv[]) {
         "                                       \e[33mprogram -l \e[0mor \e[33mprogram --listen\e[0m\n\n"
         "\e[32m-n or --neighbor <INT>                 \e[0mGet neighboring networks with the same connection.\n"
         "                                       <INT> is an optional argument for the name of the network interface used.\n"
-        "                                       By default, the argument of <INT> is wlan0.\n"
+        "                                       By default, every interface is searched. Devices found are remembered for --send.\n"
         "                                       Example:\n"
         "                                       \e[33mprogram -n wlan0 \e[0mor \e[33mprogram -neighbor wlan0\e[0m\n\n"
         "\e[32m-r or --receive <OUT_PATH>             \e[0mRun the program as a receiver (server mode).\n"
         "                                       <OUTPUT_PATH> is an optional argument for the output path of the received file.\n"
         "                                       By default <OUTPUT_PATH> is in the current directory.\n"
+        "                                       Use \"-\" to write piped input to stdout, e.g. \e[33mprogram -r - | tar x\e[0m; messages then go to stderr.\n"
         "                                       Example:\n"
         "                                       \e[33mprogram -r /home/user/Documents/file.tar \e[0mor \e[33mprogram -receive /home/user/Documents/file.tar\e[0m\n\n"
         "\e[32m-s or --send <DEST_IP> <FILE_PATH>     \e[0mSend the file to receiver (server) IP address filled in as the <DEST_IP> argument.\n"
         "                                       The <FILE_PATH> argument is the path of the file to be sent.\n"
+        "                                       A directory is sent recursively over a single connection and recreated by the receiver.\n"
+        "                                       Symbolic links are sent as links, FIFOs, sockets and devices are skipped.\n"
+        "                                       Use \"-\" to send stdin until it ends, e.g. \e[33mpg_dump db | program -s 192.168.1.100 -\e[0m\n"
+        "                                       <DEST_IP> may also be the hostname of a receiver on the network, as shown by --neighbor.\n"
+        "                                       Separate several destinations with commas, or use \"*\" for every receiver found on the network;\n"
+        "                                       the file is then read and encrypted once and written to every receiver.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/file.tar \e[0mor \e[33mprogram -send 192.168.1.100 /home/user/Documents/file.tar\e[0m\n"
+        "                                       \e[33mprogram -s 192.168.1.100,192.168.1.101,lab-pc-3 /home/user/Documents/file.tar\e[0m\n\n"
+        "\e[32m--bench [DIR]                          \e[0mBenchmark sender and receiver in this process over loopback and print a results table.\n"
+        "                                       Sweeps file sizes, chunk sizes, cipher modes, stream counts and thread counts.\n"
+        "                                       Test files go to DIR (default: $TMPDIR or /tmp). Add --bench-json <FILE> to save the results.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram --bench /mnt/nvme --bench-json results.json\e[0m\n\n"
+        "\e[32m--bench-crypto                         \e[0mMeasure sealing, opening and hashing of chunks on this machine and print a results table.\n"
+        "                                       Sweeps ciphers, buffer sizes from 1 KiB to 4 MiB, context reuse and thread counts.\n"
+        "                                       Add --bench-json <FILE> to save the results.\n"
         "                                       Example:\n"
-        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/file.tar \e[0mor \e[33mprogram -send 192.168.1.100 /home/user/Documents/file.tar\e[0m\n\n"
+        "                                       \e[33mprogram --bench-crypto --crypto-threads 8 --bench-json crypto.json\e[0m\n\n"
         "\e[32m-v or --version                        \e[0mDisplay the program version to the console.\n"
         "                                       No arguments are required for this option.\n"
         "                                       Example:\n"
@@ -56,8 +72,98 @@ int main(int argc, const char *argv[]) {
         "                                       No arguments are required for this option.\n"
         "                                       Example:\n"
         "                                       \e[33mprogram -w \e[0mor \e[33mprogram --whoami\e[0m\n\n"
+        "Transfer flags (can be combined with -s and -r):\n\n"
+        "\e[32m--crypto-threads <N>                   \e[0mNumber of threads that encrypt or decrypt chunks in parallel.\n"
+        "                                       By default <N> is the number of CPU cores.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/file.tar --crypto-threads 4\e[0m\n\n"
+        "\e[32m--streams <N>                          \e[0mSplit the file across <N> parallel TCP connections (sender only, ignored for directories).\n"
+        "                                       By default <N> is 1.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/disk.img --streams 4\e[0m\n\n"
+        "\e[32m--daemon                               \e[0mKeep receiving transfers from many senders at once (receiver only).\n"
+        "                                       <OUT_PATH> of -r becomes the directory every received file is written to.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -r /srv/inbox --daemon\e[0m\n\n"
+        "\e[32m--io-uring                             \e[0mBatch disk reads, disk writes and socket sends through io_uring (Linux 5.6+).\n"
+        "                                       Falls back to the default I/O path if the kernel does not allow it.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/disk.img --io-uring\e[0m\n\n"
+        "\e[32m--no-encrypt                           \e[0mSend file content unencrypted with sendfile() and splice() (trusted links only).\n"
+        "                                       Both sides must pass it; the handshake and metadata stay encrypted.\n"
+        "                                       Unencrypted transfers cannot be resumed and directories are always encrypted.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -r /srv/inbox/disk.img --no-encrypt\e[0m\n\n"
+        "\e[32m--ktls                                 \e[0mLet kernel TLS encrypt the file content so it can be sent with sendfile() (sender only).\n"
+        "                                       Needs the tls kernel module on both sides, otherwise the usual encryption is used.\n"
+        "                                       Kernel TLS transfers cannot be resumed.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/disk.img --ktls\e[0m\n\n"
+        "\e[32m--compress                             \e[0mDeflate chunks before encrypting them and report the ratio (sender only).\n"
+        "                                       Chunks that do not shrink, like JPEG or gzip data, are sent as they are.\n"
+        "                                       Ignored with --no-encrypt and --ktls, which never read the data.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /var/log/app.log --compress\e[0m\n\n"
+        "\e[32m--delta                                \e[0mIf the receiver already has a version of the file, send only the blocks it lacks (sender only).\n"
+        "                                       The receiver rebuilds the new version next to the old one, then replaces it.\n"
+        "                                       Uses a single stream and is ignored for directories, --no-encrypt and --ktls.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/VMs/disk.img --delta\e[0m\n\n"
+        "\e[32m--no-verify                            \e[0mSkip the tree hash comparison of both copies after a file transfer (sender only).\n"
+        "                                       By default every chunk is hashed as it is sent and received, and the roots are compared.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Videos/movie.mp4 --no-verify\e[0m\n\n"
+        "\e[32m--dedup                                \e[0mSkip content-defined chunks the receiver's chunk store already holds (sender only).\n"
+        "                                       Finds repeats at any offset, across files and senders. Uses a single stream.\n"
+        "                                       If the receiver also has an older copy of the file, --delta is used instead.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/builds/app.tar --dedup\e[0m\n\n"
+        "\e[32m--chunk-store <DIR>                    \e[0mKeep the chunks of deduplicated transfers in <DIR> and reuse them (receiver only).\n"
+        "                                       The store only grows; delete <DIR> to reclaim its space.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -r /srv/inbox --daemon --chunk-store /srv/chunks\e[0m\n\n"
+        "\e[32m--direct-io                            \e[0mWrite received files with O_DIRECT, bypassing the page cache (receiver only).\n"
+        "                                       Helps receivers with slow SD or USB storage keep memory free. Falls back to buffered\n"
+        "                                       writes where the file system refuses it. Not used with --no-encrypt and --ktls.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -r /media/usb --direct-io\e[0m\n\n"
+        "\e[32m--multicast                            \e[0mSend a file to all of its receivers at once as UDP multicast datagrams (sender only).\n"
+        "                                       Every datagram is encrypted and sent once per network, with parity to rebuild lost ones;\n"
+        "                                       receivers report what they still lack over their connection until every copy is complete.\n"
+        "                                       Receivers that do not support it get the file over their connection.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s \"*\" /home/user/Images/lab.iso --multicast\e[0m\n\n"
+        "\e[32m--multicast-rate <MBIT>                \e[0mRate in Mbit/s the multicast datagrams are sent at (sender only).\n"
+        "                                       By default <MBIT> is 200. Lower it if receivers on Wi-Fi keep losing datagrams.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s \"*\" /home/user/Images/lab.iso --multicast --multicast-rate 50\e[0m\n\n"
+        "\e[32m--session                              \e[0mSend through a session kept open to the receiver instead of connecting again (sender only).\n"
+        "                                       The first call opens the session in the background; later calls attach to it and\n"
+        "                                       their streams share its connection. It closes after 5 minutes without transfers.\n"
+        "                                       Only a receiver started with --daemon serves sessions, others are connected to directly.\n"
+        "                                       Example:\n"
+        "                                       \e[33mfor f in *.log; do program -s 192.168.1.100 \"$f\" --session; done\e[0m\n\n"
+        "\e[32m--stats-json <FILE>                    \e[0mWrite a summary of the transfer to <FILE> as JSON when it ends, including the time spent\n"
+        "                                       reading, encrypting, on the network and writing. Not used by --daemon.\n"
+        "                                       Example:\n"
+        "                                       \e[33mprogram -s 192.168.1.100 /home/user/Documents/file.tar --stats-json stats.json\e[0m\n\n"
         "See the GitHub page at \e[36mhttps://github.com/naufalhanif25/bytevalve.git\e[0m\n";
 
+    // Extract transfer flags so the positional arguments keep their places
+    transfer_options options;
+
+    default_options(&options);
+
+    if (parse_options(&argc, argv, &options) < 0) return -1;
+
+    // io_uring can be compiled in but disabled by the kernel or a seccomp profile
+    if (options.io_engine == IO_ENGINE_URING && !io_uring_available()) {
+        printf("\e[33mio_uring is not available, using the default I/O path\e[0m\n");
+        fflush(stdout);
+
+        options.io_engine = IO_ENGINE_POSIX;
+    }
+
     if (argc >= 2) {
         // Handle help option
         if ((strcmp(argv[1], "-h") == 0) || (strcmp(argv[1], "--help") == 0)) {
@@ -86,7 +192,23 @@ int main(int argc, const char *argv[]) {
         }
         // Handle receive/server mode
         else if ((strcmp(argv[1], "-r") == 0) || (strcmp(argv[1], "--receive") == 0)) {
-            const int server_return = server((argc == 3 && argv[2] != NULL) ? argv[2] : NULL);
+            const char *output_path = (argc == 3 && argv[2] != NULL) ? argv[2] : NULL;
+
+            // Piped input goes to stdout, so every message moves to stderr
+            if (output_path != NULL && strcmp(output_path, "-") == 0) {
+                if (options.daemon) {
+                    printf("\e[31mCommandError: A daemon cannot write to stdout\e[0m\n");
+                    fflush(stdout);
+
+                    return -1;
+                }
+
+                fflush(stdout);
+
+                options.output_fd = dup(STDOUT_FILENO);
+                dup2(STDERR_FILENO, STDOUT_FILENO);
+            }
+            const int server_return = (options.daemon) ? run_daemon(output_path, &options) : server(output_path, &options);
 
             if (server_return == -1) return -1;
             else return 0;
@@ -95,7 +217,9 @@ int main(int argc, const char *argv[]) {
         else if ((strcmp(argv[1], "-s") == 0) || (strcmp(argv[1], "--send") == 0)) {
             // Ensure required arguments are provided: DEST_IP and FILE_PATH
             if (argc > 3 && argv[2] != NULL && argv[3] != NULL) {
-                const int client_return = client((char *)argv[2], (char *)argv[3]);
+                // Several destinations, or every receiver found, share one read and encryption of the file
+                const int is_fanout = (strchr(argv[2], ',') != NULL || strcmp(argv[2], "*") == 0 || options.multicast);
+                const int client_return = (is_fanout) ? send_fanout(argv[2], (char *)argv[3], &options) : client((char *)argv[2], (char *)argv[3], &options);
 
                 if (client_return == -1) return -1;
                 else return 0;
@@ -109,6 +233,18 @@ int main(int argc, const char *argv[]) {
                 return -1;
             }
         }
+        // Handle loopback benchmark
+        else if (strcmp(argv[1], "--bench") == 0) {
+            const char *directory = (argc == 3 && argv[2] != NULL) ? argv[2] : NULL;
+
+            if (run_bench(directory, &options) == -1) return -1;
+            else return 0;
+        }
+        // Handle crypto kernel benchmark
+        else if (strcmp(argv[1], "--bench-crypto") == 0) {
+            if (run_microbench(&options) == -1) return -1;
+            else return 0;
+        }
         // Handle display version
         else if ((strcmp(argv[1], "-v") == 0) || (strcmp(argv[1], "--version") == 0)) {
             printf("\e[32mByteValve\e[0m %s\n", VERSION);
@@ -4,7 +4,7 @@
 NAME="ByteValve"
 
 # Define the program version
-VERSION="0.0.1"
+VERSION="0.1.0"
 
 # Define default installation path
 DEF_PATH="/usr/local/bin"
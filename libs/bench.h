@@ -0,0 +1,513 @@
+#include "daemon.h"
+
+#define BENCH_RUNS 3                    // Runs per case; the median run is reported
+#define BENCH_FILL_SIZE (1 << 20)       // Bytes of random data generated at once
+#define BENCH_ADDRESS "127.0.0.1"       // Both ends of a benchmark meet on loopback
+
+// Payload and cipher a benchmark case runs with
+typedef struct {
+    const char *name;           // Name shown in the results
+    int payload;                // PAYLOAD_* value
+    int cipher;                 // CIPHER_* value offered by the sender, or 0 to negotiate it
+} bench_mode;
+
+// Axes of the sweep; every combination is one case
+const uint64_t bench_sizes[] = {16ull << 20, 128ull << 20};
+const uint32_t bench_chunk_sizes[] = {64 << 10, 128 << 10, 1 << 20};
+const int bench_stream_counts[] = {1, 4};
+const bench_mode bench_modes[] = {
+    {"aes-256-gcm", PAYLOAD_SEALED, CIPHER_AES_256_GCM},
+    {"chacha20-poly1305", PAYLOAD_SEALED, CIPHER_CHACHA20_POLY1305},
+    {"plain", PAYLOAD_PLAIN, 0},
+};
+
+// Parameters and measurements of one benchmark case
+typedef struct {
+    uint64_t size;              // File size
+    uint32_t chunk_size;        // Plaintext bytes per record
+    const bench_mode *mode;     // Payload and cipher
+    int streams;                // TCP streams
+    int threads;                // Crypto threads of each end
+    int result;                 // 0 on success, -1 if the transfer failed
+    double seconds;             // Wall time of the transfer
+    double cpu_seconds;         // User and system time of both ends
+    int64_t syscalls;           // System calls of both ends, or -1 if they cannot be counted
+    uint64_t p50_us;            // Median chunk latency of the sender
+    uint64_t p99_us;            // 99th percentile chunk latency of the sender
+} bench_result;
+
+// Receiving end of a benchmark run
+typedef struct {
+    int listener;               // Loopback listening socket
+    const char *output_path;    // File the transfer is written to
+    transfer_options options;   // Receiver options
+    const char *error;          // NULL on success, otherwise the error message
+} bench_receiver;
+
+/**
+ * Creates the loopback listener the benchmark sends to, on a port picked by the kernel so a
+ * running receiver is not disturbed.
+ *
+ * @param port Output for the port.
+ * @return     The listening socket, or -1 on failure.
+ */
+int bench_listen(int *port) {
+    struct sockaddr_in address = {0};
+    socklen_t address_length = sizeof(address);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (listener < 0) return -1;
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0 ||
+        getsockname(listener, (struct sockaddr *)&address, &address_length) < 0) {
+        close(listener);
+
+        return -1;
+    }
+
+    // A sender that fails to connect must not hang the benchmark
+    set_receive_timeout(listener, HANDSHAKE_TIMEOUT);
+
+    *port = ntohs(address.sin_port);
+
+    return listener;
+}
+
+/**
+ * Receiver thread of a benchmark run: accepts every stream of one transfer and receives it
+ * the same way server() does.
+ *
+ * @param arg Pointer to a bench_receiver structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *bench_receive(void *arg) {
+    bench_receiver *receiver = (bench_receiver *)arg;
+    transfer_stream streams[MAX_STREAMS] = {0};
+    int stream_count = 0;
+
+    int accept_return = accept_stream(receiver->listener, &streams[0]);
+
+    if (accept_return == 0) stream_count = 1;
+
+    while (accept_return == 0 && stream_count < (int)streams[0].metadata.stream_count) {
+        if ((accept_return = accept_stream(receiver->listener, &streams[stream_count])) == 0) stream_count++;
+    }
+
+    if (accept_return < 0) {
+        receiver->error = "ConnectionError: Failed to receive incoming connections";
+
+        abort_streams(streams, stream_count, 0);
+        close_streams(streams, stream_count);
+    }
+    else receiver->error = receive_transfer(streams, stream_count, receiver->output_path, &receiver->options);
+
+    return NULL;
+}
+
+/**
+ * Sending end of a benchmark run: splits the file into streams and sends it like client()
+ * does, without the progress output.
+ *
+ * @param port    Port of the benchmark listener.
+ * @param file    File to send.
+ * @param run     Case to run.
+ * @param options Sender options.
+ * @return        0 on success, -1 on failure.
+ */
+int bench_send(int port, int file, const bench_result *run, const transfer_options *options) {
+    transfer_stream streams[MAX_STREAMS] = {0};
+    file_metadata metadata = {0};
+    struct stat file_stat;
+    unsigned char root[DIGEST_LENGTH];
+    int opened = 0, result = 0;
+
+    if (fstat(file, &file_stat) < 0 || source_identity(&file_stat, metadata.source_id) < 0) return -1;
+
+    strcpy(metadata.name, "bench.bin");
+    RAND_bytes(metadata.transfer_id, TRANSFER_ID_LENGTH);
+
+    metadata.size = file_stat.st_size;
+    metadata.mode = 0600;
+    metadata.chunk_size = run->chunk_size;
+    metadata.kind = TRANSFER_FILE;
+    metadata.payload = run->mode->payload;
+    metadata.verify = options->verify;
+
+    int stream_count = split_ranges(&metadata, streams, run->streams);
+
+    for (; opened < stream_count && result == 0; opened++) {
+        streams[opened].session.cipher = run->mode->cipher;
+
+        if (open_stream(BENCH_ADDRESS, port, &streams[opened]) < 0) {
+            result = -1;
+            break;
+        }
+
+        streams[opened].file = file;
+        streams[opened].threads = (run->threads > stream_count) ? run->threads / stream_count : 1;
+        streams[opened].engine = options->io_engine;
+        streams[opened].compress = options->compress;
+    }
+
+    if (result == 0 && send_streams(streams, stream_count, send_stream, run->threads, root) < 0) result = -1;
+
+    for (int index = 0; index < opened; index++) {
+        close(streams[index].socket);
+        free(streams[index].ranges);
+    }
+
+    return result;
+}
+
+/**
+ * Opens a counter of every system call made by this process and the threads it starts from
+ * now on. Needs the raw_syscalls tracepoint, so it only works where tracefs is mounted and
+ * perf events are allowed.
+ *
+ * @return The counter, or -1 if system calls cannot be counted.
+ */
+int open_syscall_counter(void) {
+    const char *paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id", "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+    struct perf_event_attr attributes = {0};
+    long long tracepoint = -1;
+
+    for (int index = 0; index < 2 && tracepoint < 0; index++) {
+        FILE *id_file = fopen(paths[index], "r");
+
+        if (id_file == NULL) continue;
+        if (fscanf(id_file, "%lld", &tracepoint) != 1) tracepoint = -1;
+
+        fclose(id_file);
+    }
+
+    if (tracepoint < 0) return -1;
+
+    attributes.type = PERF_TYPE_TRACEPOINT;
+    attributes.size = sizeof(attributes);
+    attributes.config = tracepoint;
+    attributes.inherit = 1;
+
+    return (int)syscall(__NR_perf_event_open, &attributes, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Reads a percentile from a latency histogram.
+ *
+ * @param histogram Histogram to read.
+ * @param fraction  Percentile as a fraction (0.5 for the median).
+ * @return          Middle of the bucket holding the percentile in microseconds, 0 if it is empty.
+ */
+uint64_t latency_percentile(const latency_histogram *histogram, double fraction) {
+    uint64_t total = 0, seen = 0;
+
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) total += histogram->buckets[bucket];
+
+    if (total == 0) return 0;
+
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+
+        if (seen < fraction * total) continue;
+        if (bucket < 4) return bucket;
+
+        // Undo latency_record(): four buckets per power of two
+        int exponent = bucket / 4 + 1;
+        uint64_t width = 1ull << (exponent - 2);
+
+        return (4 + bucket % 4) * width + width / 2;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs one benchmark case BENCH_RUNS times and keeps the measurements of the median run.
+ *
+ * @param run         Case to run; its measurements are filled in.
+ * @param file        File to send.
+ * @param output_path File the receiver writes.
+ * @param options     Options shared by both ends.
+ */
+void bench_case(bench_result *run, int file, const char *output_path, const transfer_options *options) {
+    bench_result runs[BENCH_RUNS];
+    latency_histogram histogram;
+    int port, listener = bench_listen(&port);
+
+    run->result = (listener < 0) ? -1 : 0;
+
+    for (int index = 0; run->result == 0 && index < BENCH_RUNS; index++) {
+        bench_receiver receiver = {listener, output_path, *options, NULL};
+        struct rusage before, after;
+        pthread_t thread;
+
+        // The receiver only accepts unencrypted data when told to
+        receiver.options.crypto_threads = run->threads;
+        receiver.options.payload = run->mode->payload;
+
+        memset(&histogram, 0, sizeof(histogram));
+        chunk_latency = &histogram;
+
+        int counter = open_syscall_counter();
+        uint64_t started = monotonic_ns();
+
+        getrusage(RUSAGE_SELF, &before);
+
+        if (pthread_create(&thread, NULL, bench_receive, &receiver) != 0) {
+            run->result = -1;
+            close(counter);
+            break;
+        }
+
+        int send_return = bench_send(port, file, run, options);
+
+        pthread_join(thread, NULL);
+
+        runs[index] = *run;
+        runs[index].seconds = (monotonic_ns() - started) / 1e9;
+
+        getrusage(RUSAGE_SELF, &after);
+
+        runs[index].cpu_seconds = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) +
+                                  ((after.ru_utime.tv_usec - before.ru_utime.tv_usec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec)) / 1e6;
+        runs[index].syscalls = -1;
+        runs[index].p50_us = latency_percentile(&histogram, 0.50);
+        runs[index].p99_us = latency_percentile(&histogram, 0.99);
+
+        if (counter >= 0) {
+            long long count;
+
+            if (read(counter, &count, sizeof(count)) == sizeof(count)) runs[index].syscalls = count;
+
+            close(counter);
+        }
+
+        if (send_return < 0 || receiver.error != NULL) run->result = -1;
+    }
+
+    chunk_latency = NULL;
+
+    if (listener >= 0) close(listener);
+    if (run->result < 0) return;
+
+    // Insertion sort by wall time; BENCH_RUNS is tiny
+    for (int index = 1; index < BENCH_RUNS; index++) {
+        for (int previous = index; previous > 0 && runs[previous].seconds < runs[previous - 1].seconds; previous--) {
+            bench_result swap = runs[previous];
+
+            runs[previous] = runs[previous - 1];
+            runs[previous - 1] = swap;
+        }
+    }
+
+    *run = runs[BENCH_RUNS / 2];
+}
+
+/**
+ * Writes size bytes of random data, so compression and deduplication cannot flatter the results.
+ *
+ * @param file File to fill.
+ * @param size Number of bytes.
+ * @return     0 on success, -1 on failure.
+ */
+int bench_fill(int file, uint64_t size) {
+    unsigned char *buffer = malloc(BENCH_FILL_SIZE);
+    int result = (buffer && ftruncate(file, 0) == 0) ? 0 : -1;
+
+    for (uint64_t offset = 0; result == 0 && offset < size; offset += BENCH_FILL_SIZE) {
+        size_t length = (size - offset < BENCH_FILL_SIZE) ? size - offset : BENCH_FILL_SIZE;
+
+        if (RAND_bytes(buffer, length) != 1 || pwrite_all(file, buffer, length, offset) < 0) result = -1;
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+/**
+ * Formats a byte count with the largest binary unit that divides it.
+ *
+ * @param bytes  Byte count.
+ * @param buffer Output buffer.
+ * @param length Size of buffer.
+ * @return       buffer.
+ */
+const char *format_bytes(uint64_t bytes, char *buffer, size_t length) {
+    if (bytes >= (1 << 30) && bytes % (1 << 30) == 0) snprintf(buffer, length, "%llu GiB", (unsigned long long)(bytes >> 30));
+    else if (bytes >= (1 << 20) && bytes % (1 << 20) == 0) snprintf(buffer, length, "%llu MiB", (unsigned long long)(bytes >> 20));
+    else if (bytes >= (1 << 10) && bytes % (1 << 10) == 0) snprintf(buffer, length, "%llu KiB", (unsigned long long)(bytes >> 10));
+    else snprintf(buffer, length, "%llu B", (unsigned long long)bytes);
+
+    return buffer;
+}
+
+/**
+ * Prints one row of the results table.
+ *
+ * @param run Finished case.
+ */
+void print_bench_row(const bench_result *run) {
+    char size[16], chunk_size[16];
+    double gigabytes = run->size / 1e9;
+
+    printf("%-9s %-9s %-18s %7d %7d ", format_bytes(run->size, size, sizeof(size)), format_bytes(run->chunk_size, chunk_size, sizeof(chunk_size)),
+           run->mode->name, run->streams, run->threads);
+
+    if (run->result < 0) printf("\e[31m%10s\e[0m\n", "failed");
+    else {
+        printf("%10.1f %9.2f ", run->size / 1e6 / run->seconds, run->cpu_seconds / gigabytes);
+
+        if (run->syscalls >= 0) printf("%12.0f ", run->syscalls / gigabytes);
+        else printf("%12s ", "-");
+
+        if (run->p50_us > 0) printf("%8llu %8llu\n", (unsigned long long)run->p50_us, (unsigned long long)run->p99_us);
+        else printf("%8s %8s\n", "-", "-");
+    }
+
+    fflush(stdout);
+}
+
+/**
+ * Writes every result as JSON, so runs of two releases can be compared by a script.
+ *
+ * @param path    Output file.
+ * @param runs    Finished cases.
+ * @param count   Number of cases.
+ * @param options Options shared by every case.
+ * @return        0 on success, -1 on failure.
+ */
+int write_bench_json(const char *path, const bench_result *runs, int count, const transfer_options *options) {
+    FILE *output = fopen(path, "w");
+
+    if (output == NULL) return -1;
+
+    fprintf(output, "{\n  \"protocol_version\": %d,\n  \"cpus\": %ld,\n  \"io_engine\": \"%s\",\n  \"compress\": %s,\n  \"verify\": %s,\n  \"runs_per_case\": %d,\n  \"results\": [",
+            PROTOCOL_VERSION, sysconf(_SC_NPROCESSORS_ONLN), (options->io_engine == IO_ENGINE_URING) ? "io_uring" : "posix",
+            (options->compress) ? "true" : "false", (options->verify) ? "true" : "false", BENCH_RUNS);
+
+    for (int index = 0; index < count; index++) {
+        const bench_result *run = &runs[index];
+        double gigabytes = run->size / 1e9;
+
+        fprintf(output, "%s\n    {\"size\": %llu, \"chunk_size\": %u, \"mode\": \"%s\", \"streams\": %d, \"threads\": %d, ", (index > 0) ? "," : "",
+                (unsigned long long)run->size, run->chunk_size, run->mode->name, run->streams, run->threads);
+
+        if (run->result < 0) {
+            fprintf(output, "\"ok\": false}");
+            continue;
+        }
+
+        fprintf(output, "\"ok\": true, \"seconds\": %.6f, \"mb_per_s\": %.1f, \"cpu_seconds_per_gb\": %.3f, ", run->seconds,
+                run->size / 1e6 / run->seconds, run->cpu_seconds / gigabytes);
+
+        if (run->syscalls >= 0) fprintf(output, "\"syscalls_per_gb\": %.0f, ", run->syscalls / gigabytes);
+        else fprintf(output, "\"syscalls_per_gb\": null, ");
+
+        if (run->p50_us > 0) fprintf(output, "\"p50_us\": %llu, \"p99_us\": %llu}", (unsigned long long)run->p50_us, (unsigned long long)run->p99_us);
+        else fprintf(output, "\"p50_us\": null, \"p99_us\": null}");
+    }
+
+    fprintf(output, "\n  ]\n}\n");
+
+    return (fclose(output) == 0) ? 0 : -1;
+}
+
+/**
+ * Runs sender and receiver in this process over loopback for every combination of file
+ * size, chunk size, payload mode, stream count and thread count, and prints the results.
+ *
+ * @param directory Directory for the test files, or NULL for $TMPDIR or /tmp.
+ * @param options   Options shared by every case (--io-uring, --compress, --no-verify,
+ *                  --crypto-threads and --bench-json are honoured).
+ * @return          0 if every case succeeded, -1 otherwise.
+ */
+int run_bench(const char *directory, const transfer_options *options) {
+    int thread_counts[2] = {1, options->crypto_threads};
+    int thread_axis = (options->crypto_threads > 1) ? 2 : 1;
+    int case_count = sizeof(bench_sizes) / sizeof(bench_sizes[0]) * sizeof(bench_chunk_sizes) / sizeof(bench_chunk_sizes[0]) *
+                     sizeof(bench_modes) / sizeof(bench_modes[0]) * sizeof(bench_stream_counts) / sizeof(bench_stream_counts[0]) * thread_axis;
+    bench_result *runs = calloc(case_count, sizeof(bench_result));
+    char input_path[PATH_MAX], output_path[PATH_MAX];
+    int count = 0, failed = 0;
+
+    if (directory == NULL) directory = (getenv("TMPDIR") != NULL) ? getenv("TMPDIR") : "/tmp";
+
+    snprintf(input_path, sizeof(input_path), "%s/bytevalve-bench-%d.in", directory, (int)getpid());
+    snprintf(output_path, sizeof(output_path), "%s/bytevalve-bench-%d.out", directory, (int)getpid());
+
+    int file = open(input_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (runs == NULL || file < 0) {
+        printf("\e[31mFileError: Failed to create the benchmark files in %s\e[0m\n", directory);
+        fflush(stdout);
+
+        if (file >= 0) close(file);
+
+        free(runs);
+        unlink(input_path);
+
+        return -1;
+    }
+
+    // Closed peers must not kill the benchmark
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("\e[33mBenchmarking over loopback, %d runs per case (CPU time and system calls cover both ends)\e[0m\n\n", BENCH_RUNS);
+    printf("%-9s %-9s %-18s %7s %7s %10s %9s %12s %8s %8s\n", "Size", "Chunk", "Mode", "Streams", "Threads", "MB/s", "CPU s/GB", "Syscalls/GB",
+           "p50 us", "p99 us");
+    fflush(stdout);
+
+    for (size_t size = 0; size < sizeof(bench_sizes) / sizeof(bench_sizes[0]); size++) {
+        if (bench_fill(file, bench_sizes[size]) < 0) {
+            printf("\e[31mFileError: Failed to write the benchmark file\e[0m\n");
+            fflush(stdout);
+
+            failed = 1;
+            break;
+        }
+
+        for (size_t chunk = 0; chunk < sizeof(bench_chunk_sizes) / sizeof(bench_chunk_sizes[0]); chunk++) {
+            for (size_t mode = 0; mode < sizeof(bench_modes) / sizeof(bench_modes[0]); mode++) {
+                for (size_t streams = 0; streams < sizeof(bench_stream_counts) / sizeof(bench_stream_counts[0]); streams++) {
+                    for (int threads = 0; threads < thread_axis; threads++) {
+                        bench_result *run = &runs[count++];
+
+                        run->size = bench_sizes[size];
+                        run->chunk_size = bench_chunk_sizes[chunk];
+                        run->mode = &bench_modes[mode];
+                        run->streams = bench_stream_counts[streams];
+                        run->threads = thread_counts[threads];
+
+                        bench_case(run, file, output_path, options);
+                        print_bench_row(run);
+
+                        if (run->result < 0) failed = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    close(file);
+    unlink(input_path);
+    unlink(output_path);
+
+    if (options->bench_json != NULL) {
+        if (write_bench_json(options->bench_json, runs, count, options) < 0) {
+            printf("\e[31mFileError: Failed to write %s\e[0m\n", options->bench_json);
+
+            failed = 1;
+        }
+        else printf("\nResults written to %s\n", options->bench_json);
+
+        fflush(stdout);
+    }
+
+    free(runs);
+
+    return (failed) ? -1 : 0;
+}
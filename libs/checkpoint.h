@@ -0,0 +1,314 @@
+#include "ring.h"
+
+#define CHECKPOINT_SUFFIX ".bvresume"       // Appended to the output path
+#define CHECKPOINT_MAGIC "BVRESUME"         // First bytes of a checkpoint file
+#define CHECKPOINT_VERSION 1                // Checkpoint file format version
+#define CHECKPOINT_HEADER_LENGTH 40         // magic, version, chunk size, file size, source id
+#define CHECKPOINT_FLUSH_CHUNKS 256         // Chunks written between two checkpoint flushes
+
+// Receiver-side record of which chunks of the output file are already verified. The file
+// holds a header, then one bit per chunk, then one SHA-256 digest per chunk.
+typedef struct {
+    char path[PATH_MAX];                        // Path of the checkpoint file
+    int file;                                   // Checkpoint file descriptor
+    int data_file;                              // Output file the checkpoint describes
+    uint32_t chunk_size;                        // Plaintext bytes per chunk
+    uint64_t size;                              // Output file size
+    uint64_t chunk_count;                       // Number of chunks
+    unsigned char source_id[SOURCE_ID_LENGTH];  // Source file version the chunks belong to
+    unsigned char *bitmap;                      // One bit per verified chunk
+    unsigned char *digests;                     // One digest per chunk
+    uint64_t verified;                          // Number of bits set in bitmap
+    uint64_t dirty;                             // Chunks marked since the last flush
+    pthread_mutex_t lock;                       // Serializes marks and flushes across streams
+} checkpoint;
+
+/**
+ * Derives the source id the sender puts in the metadata. It changes whenever the file is
+ * replaced or modified, which invalidates the receiver's checkpoint.
+ *
+ * @param file_stat Status of the file being sent.
+ * @param source_id Output for SOURCE_ID_LENGTH bytes.
+ * @return          0 on success, -1 on failure.
+ */
+int source_identity(const struct stat *file_stat, unsigned char *source_id) {
+    unsigned char identity[48], digest[DIGEST_LENGTH];
+
+    put_u64(identity, file_stat->st_dev);
+    put_u64(identity + 8, file_stat->st_ino);
+    put_u64(identity + 16, file_stat->st_size);
+    put_u64(identity + 24, file_stat->st_mtim.tv_sec);
+    put_u64(identity + 32, file_stat->st_mtim.tv_nsec);
+    put_u64(identity + 40, file_stat->st_ctim.tv_sec);
+
+    if (digest_chunk(identity, sizeof(identity), digest) < 0) return -1;
+
+    memcpy(source_id, digest, SOURCE_ID_LENGTH);
+
+    return 0;
+}
+
+/**
+ * Size of the bitmap in bytes.
+ *
+ * @param state Checkpoint.
+ * @return      Bitmap length.
+ */
+size_t checkpoint_bitmap_length(const checkpoint *state) {
+    return (state->chunk_count + 7) / 8;
+}
+
+/**
+ * Checks whether a chunk is marked as verified.
+ *
+ * @param state Checkpoint.
+ * @param chunk Chunk index.
+ * @return      1 if verified, 0 otherwise.
+ */
+int checkpoint_has(const checkpoint *state, uint64_t chunk) {
+    return (state->bitmap[chunk / 8] >> (chunk % 8)) & 1;
+}
+
+/**
+ * Writes the header and bitmap. The output file is synced first, so the bitmap never
+ * claims data that could still be lost in the page cache.
+ *
+ * @param state Checkpoint (lock held by the caller).
+ * @return      0 on success, -1 on failure.
+ */
+int checkpoint_flush_locked(checkpoint *state) {
+    unsigned char header[CHECKPOINT_HEADER_LENGTH];
+    uint32_t version = htonl(CHECKPOINT_VERSION), chunk_size = htonl(state->chunk_size);
+
+    memcpy(header, CHECKPOINT_MAGIC, 8);
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &chunk_size, 4);
+    put_u64(header + 16, state->size);
+    memcpy(header + 24, state->source_id, SOURCE_ID_LENGTH);
+
+    if (fdatasync(state->data_file) < 0) return -1;
+    if (pwrite(state->file, header, sizeof(header), 0) != sizeof(header)) return -1;
+    if (pwrite(state->file, state->bitmap, checkpoint_bitmap_length(state), sizeof(header)) != (ssize_t)checkpoint_bitmap_length(state)) return -1;
+
+    state->dirty = 0;
+
+    return 0;
+}
+
+/**
+ * Loads the checkpoint that matches the incoming file, or starts a new one. A checkpoint
+ * only matches if it was written for the same source version, size and chunk size.
+ *
+ * @param state       Checkpoint to initialize.
+ * @param output_path Path of the output file.
+ * @param metadata    Metadata of the incoming file.
+ * @return            1 if an existing checkpoint was loaded, 0 if a new one was started, -1 on failure.
+ */
+int checkpoint_open(checkpoint *state, const char *output_path, const file_metadata *metadata) {
+    unsigned char header[CHECKPOINT_HEADER_LENGTH];
+    int loaded = 0;
+
+    memset(state, 0, sizeof(*state));
+    pthread_mutex_init(&state->lock, NULL);
+
+    state->file = -1;
+    state->data_file = -1;
+    state->chunk_size = metadata->chunk_size;
+    state->size = metadata->size;
+    state->chunk_count = (metadata->size + metadata->chunk_size - 1) / metadata->chunk_size;
+
+    memcpy(state->source_id, metadata->source_id, SOURCE_ID_LENGTH);
+
+    if (snprintf(state->path, sizeof(state->path), "%s%s", output_path, CHECKPOINT_SUFFIX) >= (int)sizeof(state->path)) return -1;
+
+    state->bitmap = calloc(checkpoint_bitmap_length(state) + 1, 1);
+    state->digests = calloc(state->chunk_count + 1, DIGEST_LENGTH);
+    state->file = open(state->path, O_RDWR | O_CREAT, 0600);
+
+    if (!state->bitmap || !state->digests || state->file < 0) return -1;
+
+    // Reuse the stored bitmap and digests only if the header matches this transfer
+    if (pread(state->file, header, sizeof(header), 0) == sizeof(header)) {
+        uint32_t version, chunk_size;
+
+        memcpy(&version, header + 8, 4);
+        memcpy(&chunk_size, header + 12, 4);
+
+        loaded = memcmp(header, CHECKPOINT_MAGIC, 8) == 0 && ntohl(version) == CHECKPOINT_VERSION &&
+            ntohl(chunk_size) == state->chunk_size && get_u64(header + 16) == state->size &&
+            memcmp(header + 24, state->source_id, SOURCE_ID_LENGTH) == 0;
+    }
+
+    size_t bitmap_length = checkpoint_bitmap_length(state);
+    size_t digests_length = state->chunk_count * DIGEST_LENGTH;
+
+    if (loaded) {
+        loaded = pread(state->file, state->bitmap, bitmap_length, sizeof(header)) == (ssize_t)bitmap_length &&
+            pread(state->file, state->digests, digests_length, sizeof(header) + bitmap_length) == (ssize_t)digests_length;
+    }
+
+    if (!loaded) {
+        memset(state->bitmap, 0, bitmap_length);
+
+        // Size the file up front so the digests of every stream can be read back later
+        if (ftruncate(state->file, 0) < 0 || ftruncate(state->file, sizeof(header) + bitmap_length + digests_length) < 0) return -1;
+    }
+
+    return loaded;
+}
+
+/**
+ * Checks whether an interrupted transfer left a checkpoint next to an output file.
+ *
+ * @param output_path Path of the output file.
+ * @return            1 if a checkpoint file exists, 0 otherwise.
+ */
+int checkpoint_exists(const char *output_path) {
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s%s", output_path, CHECKPOINT_SUFFIX) >= (int)sizeof(path)) return 0;
+
+    return access(path, F_OK) == 0;
+}
+
+/**
+ * Re-reads every chunk the checkpoint claims and drops those whose digest no longer matches,
+ * so a torn write or an edited output file is simply sent again.
+ *
+ * @param state     Checkpoint loaded by checkpoint_open().
+ * @param data_file Output file descriptor.
+ * @return          0 on success, -1 on failure.
+ */
+int checkpoint_verify(checkpoint *state, int data_file) {
+    unsigned char *buffer = malloc(state->chunk_size);
+    unsigned char digest[DIGEST_LENGTH];
+
+    if (!buffer) return -1;
+
+    state->data_file = data_file;
+    state->verified = 0;
+
+    for (uint64_t chunk = 0; chunk < state->chunk_count; chunk++) {
+        if (!checkpoint_has(state, chunk)) continue;
+
+        uint64_t offset = chunk * state->chunk_size;
+        size_t length = (state->size - offset < state->chunk_size) ? state->size - offset : state->chunk_size;
+
+        if (pread(data_file, buffer, length, offset) != (ssize_t)length || digest_chunk(buffer, length, digest) < 0 ||
+            memcmp(digest, state->digests + chunk * DIGEST_LENGTH, DIGEST_LENGTH) != 0) {
+            state->bitmap[chunk / 8] &= ~(1 << (chunk % 8));
+        }
+        else state->verified++;
+    }
+
+    free(buffer);
+
+    return 0;
+}
+
+/**
+ * Lists the chunk-aligned ranges inside a stream's span that are not verified yet.
+ *
+ * @param state       Checkpoint.
+ * @param span        Span carried by the stream.
+ * @param ranges      Output for the allocated ranges (free with free()).
+ * @param range_count Output for the number of ranges.
+ * @return            0 on success, -1 on failure.
+ */
+int checkpoint_missing(const checkpoint *state, byte_range span, byte_range **ranges, uint32_t *range_count) {
+    uint64_t first = span.offset / state->chunk_size;
+    uint64_t last = (span.offset + span.length + state->chunk_size - 1) / state->chunk_size;
+    uint64_t end = span.offset + span.length;
+
+    *range_count = 0;
+    *ranges = calloc((last - first) / 2 + 2, sizeof(byte_range));
+
+    if (!*ranges) return -1;
+
+    // Merge runs of missing chunks into single ranges
+    for (uint64_t chunk = first; chunk < last; chunk++) {
+        if (checkpoint_has(state, chunk)) continue;
+
+        uint64_t offset = chunk * state->chunk_size;
+        uint64_t length = (end - offset < state->chunk_size) ? end - offset : state->chunk_size;
+
+        if (*range_count > 0 && (*ranges)[*range_count - 1].offset + (*ranges)[*range_count - 1].length == offset) {
+            (*ranges)[*range_count - 1].length += length;
+        }
+        else {
+            (*ranges)[*range_count].offset = offset;
+            (*ranges)[(*range_count)++].length = length;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Marks a chunk as written and stores its digest. Every CHECKPOINT_FLUSH_CHUNKS marks the
+ * bitmap is flushed to disk.
+ *
+ * @param state  Checkpoint.
+ * @param offset Offset of the chunk.
+ * @param digest Digest of the chunk plaintext.
+ * @return       0 on success, -1 on failure.
+ */
+int checkpoint_mark(checkpoint *state, uint64_t offset, const unsigned char *digest) {
+    uint64_t chunk = offset / state->chunk_size;
+    off_t position = CHECKPOINT_HEADER_LENGTH + checkpoint_bitmap_length(state) + chunk * DIGEST_LENGTH;
+    int result = 0;
+
+    // The digest goes to disk before the bit that vouches for it
+    if (pwrite(state->file, digest, DIGEST_LENGTH, position) != DIGEST_LENGTH) return -1;
+
+    pthread_mutex_lock(&state->lock);
+
+    memcpy(state->digests + chunk * DIGEST_LENGTH, digest, DIGEST_LENGTH);
+
+    if (!checkpoint_has(state, chunk)) {
+        state->bitmap[chunk / 8] |= 1 << (chunk % 8);
+        state->verified++;
+    }
+
+    if (++state->dirty >= CHECKPOINT_FLUSH_CHUNKS) result = checkpoint_flush_locked(state);
+
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
+
+/**
+ * Closes the checkpoint. It is removed once every chunk is verified, otherwise its latest
+ * state is flushed so the next attempt can resume. A checkpoint without a single verified
+ * chunk is removed too: it would save the next attempt nothing, and the output file it
+ * describes may never have been created.
+ *
+ * @param state Checkpoint.
+ * @return      1 if the file is complete, 0 if it is not, -1 if flushing failed.
+ */
+int checkpoint_close(checkpoint *state) {
+    int result = 0;
+
+    if (state->file >= 0) {
+        if (state->verified == state->chunk_count) {
+            unlink(state->path);
+
+            result = 1;
+        }
+        else if (state->verified == 0) unlink(state->path);
+        else if (state->data_file >= 0 && checkpoint_flush_locked(state) < 0) result = -1;
+
+        close(state->file);
+    }
+
+    pthread_mutex_destroy(&state->lock);
+
+    free(state->bitmap);
+    free(state->digests);
+
+    state->file = -1;
+    state->bitmap = NULL;
+    state->digests = NULL;
+
+    return result;
+}
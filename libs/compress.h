@@ -0,0 +1,132 @@
+#include "uring.h"
+
+#define COMPRESS_LEVEL 1                // zlib level: the fastest one still shrinks text several times
+#define COMPRESS_PROBE_LENGTH 4096      // Leading bytes compressed first to spot incompressible chunks
+#define COMPRESS_MIN_SAVING 16          // A chunk is only sent compressed if it shrinks by 1/16 or more
+
+// Per-worker deflate and inflate state, reset for every chunk
+typedef struct {
+    z_stream deflater;          // Raw deflate stream (the AEAD tag already covers integrity)
+    z_stream inflater;          // Raw inflate stream
+    int deflating;              // 1 once deflater is initialized
+    int inflating;              // 1 once inflater is initialized
+    unsigned char *scratch;     // Compressed data of the current chunk
+    size_t scratch_size;        // Capacity of scratch
+} chunk_compressor;
+
+// Compression totals of a transfer
+typedef struct {
+    uint64_t plain_bytes;       // Chunk bytes before compression
+    uint64_t packed_bytes;      // Bytes sealed into records after compression
+} compression_report;
+
+/**
+ * Prepares a worker's compressor.
+ *
+ * @param compressor Compressor to initialize.
+ * @param chunk_size Largest chunk it handles.
+ * @param deflating  1 on the sender, 0 on the receiver.
+ * @return           0 on success, -1 on failure.
+ */
+int compressor_init(chunk_compressor *compressor, int chunk_size, int deflating) {
+    memset(compressor, 0, sizeof(*compressor));
+
+    if (deflating) {
+        if (deflateInit2(&compressor->deflater, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+        compressor->deflating = 1;
+        compressor->scratch_size = deflateBound(&compressor->deflater, chunk_size);
+    }
+    else {
+        if (inflateInit2(&compressor->inflater, -15) != Z_OK) return -1;
+
+        compressor->inflating = 1;
+        compressor->scratch_size = chunk_size;
+    }
+
+    compressor->scratch = malloc(compressor->scratch_size);
+
+    return (compressor->scratch) ? 0 : -1;
+}
+
+/**
+ * Releases a compressor.
+ *
+ * @param compressor Compressor to free.
+ */
+void compressor_free(chunk_compressor *compressor) {
+    if (compressor->deflating) deflateEnd(&compressor->deflater);
+    if (compressor->inflating) inflateEnd(&compressor->inflater);
+
+    free(compressor->scratch);
+
+    memset(compressor, 0, sizeof(*compressor));
+}
+
+/**
+ * Deflates a buffer into the scratch buffer as one complete raw deflate stream.
+ *
+ * @param compressor Sender's compressor.
+ * @param input      Data to compress.
+ * @param length     Length of input.
+ * @return           Compressed length, or -1 on failure.
+ */
+int deflate_buffer(chunk_compressor *compressor, const unsigned char *input, int length) {
+    z_stream *stream = &compressor->deflater;
+
+    if (deflateReset(stream) != Z_OK) return -1;
+
+    stream->next_in = (unsigned char *)input;
+    stream->avail_in = length;
+    stream->next_out = compressor->scratch;
+    stream->avail_out = compressor->scratch_size;
+
+    return (deflate(stream, Z_FINISH) == Z_STREAM_END) ? (int)stream->total_out : -1;
+}
+
+/**
+ * Compresses a chunk into the scratch buffer if that pays off. The leading bytes are tried
+ * first, so already compressed data (JPEG, gzip, video) costs a few microseconds per chunk.
+ *
+ * @param compressor Sender's compressor.
+ * @param input      Chunk to compress.
+ * @param length     Length of input.
+ * @return           Compressed length, or 0 if the chunk should be sent as it is.
+ */
+int compress_chunk(chunk_compressor *compressor, const unsigned char *input, int length) {
+    if (length >= 2 * COMPRESS_PROBE_LENGTH) {
+        int probe = deflate_buffer(compressor, input, COMPRESS_PROBE_LENGTH);
+
+        if (probe < 0 || probe > COMPRESS_PROBE_LENGTH - COMPRESS_PROBE_LENGTH / COMPRESS_MIN_SAVING) return 0;
+    }
+
+    int packed = deflate_buffer(compressor, input, length);
+
+    return (packed > 0 && packed <= length - length / COMPRESS_MIN_SAVING) ? packed : 0;
+}
+
+/**
+ * Inflates a compressed chunk. The stream must end exactly at the end of the input and fit
+ * into the output, so a peer cannot make the receiver write past a chunk.
+ *
+ * @param compressor Receiver's compressor.
+ * @param input      Compressed chunk.
+ * @param length     Length of input.
+ * @param output     Destination.
+ * @param capacity   Size of output.
+ * @return           Inflated length, or -1 if the data is malformed or too large.
+ */
+int inflate_chunk(chunk_compressor *compressor, const unsigned char *input, int length, unsigned char *output, int capacity) {
+    z_stream *stream = &compressor->inflater;
+
+    if (inflateReset(stream) != Z_OK) return -1;
+
+    stream->next_in = (unsigned char *)input;
+    stream->avail_in = length;
+    stream->next_out = output;
+    stream->avail_out = capacity;
+
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_in != 0) return -1;
+
+    return (int)stream->total_out;
+}
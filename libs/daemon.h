@@ -0,0 +1,607 @@
+#include "fanout.h"
+
+#define DAEMON_MAX_EVENTS 64            // Events handled per epoll_wait() call
+#define DAEMON_SWEEP_INTERVAL 1000      // Milliseconds between two idle sweeps
+#define DAEMON_IDLE_TIMEOUT 300         // Seconds a connection may stay silent before it is dropped
+#define DAEMON_STREAM_TIMEOUT 30        // Seconds the streams of a transfer have to arrive
+
+// Connection parked in the event loop until its first bytes arrive. Idle peers hold no thread
+// and no buffers, so thousands of them cost little more than their sockets. The loop never
+// reads from a peer, so its socket stays blocking for the transfer thread.
+typedef struct daemon_peer {
+    int socket;                         // Accepted socket
+    struct in_addr address;             // Address of the sender, for the log
+    time_t accepted;                    // When the connection was accepted
+    struct daemon_peer *previous;       // Idle list, oldest first
+    struct daemon_peer *next;
+} daemon_peer;
+
+// Streams of a multi-stream transfer that are still waiting for their siblings
+typedef struct pending_transfer {
+    transfer_stream *streams;           // Streams accepted so far
+    int stream_count;                   // Number of streams the transfer announced
+    int accepted;                       // Number of streams accepted so far
+    time_t created;                     // When the first stream arrived
+    struct pending_transfer *next;
+} pending_transfer;
+
+// Output path of a transfer in progress
+typedef struct active_path {
+    char path[PATH_MAX];                // Output path
+    struct active_path *next;
+} active_path;
+
+// State shared by the event loop and the transfer threads
+typedef struct {
+    const char *output_dir;             // Directory received files are written to
+    const transfer_options *options;    // Transfer options
+    pthread_mutex_t lock;               // Protects pending and active
+    pending_transfer *pending;          // Transfers waiting for more streams
+    active_path *active;                // Output paths being written
+} daemon_state;
+
+// Argument of a connection thread
+typedef struct {
+    daemon_state *daemon;               // Shared daemon state
+    int socket;                         // Connection that became readable
+    struct in_addr address;             // Address of the sender
+} connection_args;
+
+// Sender of a session, shared by the threads of its channels
+typedef struct {
+    daemon_state *daemon;               // Shared daemon state
+    struct in_addr address;             // Address of the sender
+} session_context;
+
+// Argument of a channel thread
+typedef struct {
+    daemon_state *daemon;               // Shared daemon state
+    transfer_stream stream;             // Channel socket and keys; the metadata is read by the thread
+    struct in_addr address;             // Address of the sender
+} channel_args;
+
+static volatile sig_atomic_t daemon_stopping = 0;
+
+/**
+ * Signal handler that asks the event loop to stop.
+ *
+ * @param signal_number Received signal.
+ */
+void stop_daemon(int signal_number) {
+    (void)signal_number;
+
+    daemon_stopping = 1;
+}
+
+/**
+ * Claims an output path so two transfers never write the same file at once.
+ *
+ * @param daemon Daemon state.
+ * @param path   Output path.
+ * @return       0 if the path was free, -1 if it is in use or memory ran out.
+ */
+int claim_path(daemon_state *daemon, const char *path) {
+    int result = 0;
+
+    pthread_mutex_lock(&daemon->lock);
+
+    for (active_path *active = daemon->active; active && result == 0; active = active->next) {
+        if (strcmp(active->path, path) == 0) result = -1;
+    }
+
+    if (result == 0) {
+        active_path *active = malloc(sizeof(active_path));
+
+        if (active) {
+            snprintf(active->path, sizeof(active->path), "%s", path);
+
+            active->next = daemon->active;
+            daemon->active = active;
+        }
+        else result = -1;
+    }
+
+    pthread_mutex_unlock(&daemon->lock);
+
+    return result;
+}
+
+/**
+ * Releases an output path claimed with claim_path().
+ *
+ * @param daemon Daemon state.
+ * @param path   Output path.
+ */
+void release_path(daemon_state *daemon, const char *path) {
+    pthread_mutex_lock(&daemon->lock);
+
+    for (active_path **link = &daemon->active; *link; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            active_path *active = *link;
+
+            *link = active->next;
+            free(active);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+/**
+ * Receives a transfer whose streams have all arrived and logs the outcome.
+ *
+ * @param daemon       Daemon state.
+ * @param streams      Streams of the transfer (closed on return).
+ * @param stream_count Number of streams.
+ * @param address      Address of the sender.
+ */
+void run_transfer(daemon_state *daemon, transfer_stream *streams, int stream_count, struct in_addr address) {
+    char file_path[PATH_MAX];
+    char sender[INET_ADDRSTRLEN];
+    const char *error = NULL;
+    uint8_t refusal = 0;
+
+    inet_ntop(AF_INET, &address, sender, sizeof(sender));
+
+    // The sender is told why, not just that the transfer was turned down
+    if (snprintf(file_path, sizeof(file_path), "%s/%s", daemon->output_dir, streams[0].metadata.name) >= (int)sizeof(file_path)) {
+        error = "FileError: The output path is too long";
+        refusal = ERROR_PATH_INVALID;
+    }
+    else if (claim_path(daemon, file_path) < 0) {
+        error = "FileError: The output path is already being received";
+        refusal = ERROR_PATH_BUSY;
+    }
+
+    if (error != NULL) {
+        abort_streams(streams, stream_count, refusal);
+        close_streams(streams, stream_count);
+    }
+    else {
+        printf("Receiving \e[36m%s\e[0m from \e[36m%s\e[0m\n", streams[0].metadata.name, sender);
+        fflush(stdout);
+
+        error = receive_transfer(streams, stream_count, file_path, daemon->options);
+
+        release_path(daemon, file_path);
+    }
+
+    if (error != NULL) printf("\e[31m%s (%s from %s)\e[0m\n", error, streams[0].metadata.name, sender);
+    else printf("\e[32m%s successfully received from %s%s\e[0m\n", file_path, sender, (streams[0].metadata.verify) ? " and verified" : "");
+
+    fflush(stdout);
+}
+
+/**
+ * Adds a stream to its pending transfer. Streams are matched by transfer id; the stream that
+ * completes a transfer takes all of them out of the table.
+ *
+ * @param daemon Daemon state.
+ * @param stream Stream that finished its handshake.
+ * @return       The completed transfer (free its streams and itself), or NULL if streams are
+ *               still missing or the stream does not fit the transfer it claims to belong to.
+ */
+pending_transfer *join_transfer(daemon_state *daemon, const transfer_stream *stream) {
+    pending_transfer *found = NULL, *complete = NULL, **link;
+
+    pthread_mutex_lock(&daemon->lock);
+
+    for (link = &daemon->pending; *link; link = &(*link)->next) {
+        if (memcmp((*link)->streams[0].metadata.transfer_id, stream->metadata.transfer_id, TRANSFER_ID_LENGTH) == 0) {
+            found = *link;
+            break;
+        }
+    }
+
+    if (!found && (found = calloc(1, sizeof(pending_transfer))) != NULL) {
+        found->streams = calloc(stream->metadata.stream_count, sizeof(transfer_stream));
+        found->stream_count = stream->metadata.stream_count;
+        found->created = time(NULL);
+
+        if (found->streams) {
+            found->next = daemon->pending;
+            daemon->pending = found;
+            link = &daemon->pending;
+        }
+        else {
+            free(found);
+            found = NULL;
+        }
+    }
+
+    // A stream that disagrees on the stream count cannot be part of this transfer
+    if (found && found->stream_count != (int)stream->metadata.stream_count) found = NULL;
+
+    if (found) {
+        found->streams[found->accepted++] = *stream;
+
+        if (found->accepted == found->stream_count) {
+            *link = found->next;
+            complete = found;
+        }
+    }
+    else {
+        send_frame(stream->socket, FRAME_ERROR, 0, NULL, 0);
+        close(stream->socket);
+    }
+
+    pthread_mutex_unlock(&daemon->lock);
+
+    return complete;
+}
+
+/**
+ * Drops transfers whose streams did not all arrive in time.
+ *
+ * @param daemon Daemon state.
+ * @param now    Current time.
+ */
+void expire_transfers(daemon_state *daemon, time_t now) {
+    pthread_mutex_lock(&daemon->lock);
+
+    for (pending_transfer **link = &daemon->pending; *link;) {
+        pending_transfer *pending = *link;
+
+        if (now - pending->created < DAEMON_STREAM_TIMEOUT) {
+            link = &pending->next;
+            continue;
+        }
+
+        *link = pending->next;
+
+        printf("\e[31mConnectionError: Only %d of %d streams of %s arrived\e[0m\n", pending->accepted, pending->stream_count, pending->streams[0].metadata.name);
+        fflush(stdout);
+
+        abort_streams(pending->streams, pending->accepted, 0);
+        close_streams(pending->streams, pending->accepted);
+
+        free(pending->streams);
+        free(pending);
+    }
+
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+/**
+ * Receives a stream whose metadata arrived, either right away or once the other streams of its
+ * transfer arrived too.
+ *
+ * @param daemon  Daemon state.
+ * @param stream  Stream that finished its handshake.
+ * @param address Address of the sender.
+ */
+void receive_started(daemon_state *daemon, transfer_stream *stream, struct in_addr address) {
+    if (stream->metadata.stream_count == 1) {
+        run_transfer(daemon, stream, 1, address);
+
+        return;
+    }
+
+    pending_transfer *complete = join_transfer(daemon, stream);
+
+    if (complete) {
+        run_transfer(daemon, complete->streams, complete->stream_count, address);
+
+        free(complete->streams);
+        free(complete);
+    }
+}
+
+/**
+ * Channel thread: receives the metadata sent on a channel of a session, then the transfer
+ * like any other stream.
+ *
+ * @param arg Pointer to a channel_args structure (freed by the thread).
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *daemon_channel(void *arg) {
+    channel_args *args = (channel_args *)arg;
+    int accept_return = accept_metadata(&args->stream);
+
+    if (accept_return == -3) {
+        printf("\e[31mProtocolError: The file metadata from %s is malformed\e[0m\n", inet_ntoa(args->address));
+        fflush(stdout);
+    }
+
+    if (accept_return < 0) close(args->stream.socket);
+    else receive_started(args->daemon, &args->stream, args->address);
+
+    OPENSSL_cleanse(&args->stream.session, sizeof(args->stream.session));
+    free(args);
+
+    return NULL;
+}
+
+/**
+ * Accept callback of a session: every channel the sender opens gets a thread of its own.
+ *
+ * @param mux     Session, whose context is the session_context of the connection.
+ * @param socket  Channel socket.
+ * @param session Keys of the channel.
+ */
+void accept_channel(session_mux *mux, int socket, const crypto_session *session) {
+    session_context *context = (session_context *)mux->context;
+    channel_args *args = calloc(1, sizeof(channel_args));
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    if (!args) {
+        close(socket);
+
+        return;
+    }
+
+    args->daemon = context->daemon;
+    args->address = context->address;
+    args->stream.socket = socket;
+    args->stream.session = *session;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attributes, daemon_channel, args) != 0) {
+        close(socket);
+        free(args);
+    }
+
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Serves a session: accepts it, then carries its channels until the sender closes it.
+ *
+ * @param daemon  Daemon state.
+ * @param stream  Stream whose handshake asked for a session.
+ * @param address Address of the sender.
+ */
+void serve_session(daemon_state *daemon, transfer_stream *stream, struct in_addr address) {
+    session_context context = {daemon, address};
+    session_mux mux;
+
+    init_session(&mux, stream->socket, &stream->session, 0);
+
+    mux.accept = accept_channel;
+    mux.context = &context;
+
+    if (send_ack(stream->socket, 0) == 0) run_session(&mux);
+    else fail_session(&mux);
+
+    shutdown(stream->socket, SHUT_RDWR);
+    close_session(&mux);
+    close(stream->socket);
+}
+
+/**
+ * Connection thread: runs the handshake, then either receives the transfer, parks the stream
+ * until the other streams of its transfer arrive, or serves a session of many transfers.
+ *
+ * @param arg Pointer to a connection_args structure (freed by the thread).
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *daemon_connection(void *arg) {
+    connection_args *args = (connection_args *)arg;
+    transfer_stream stream = {0};
+
+    stream.socket = args->socket;
+
+    int start_return = start_stream(&stream);
+
+    if (start_return == -2) {
+        printf("\e[31mProtocolError: %s uses a ByteValve version incompatible with " VERSION "\e[0m\n", inet_ntoa(args->address));
+        fflush(stdout);
+    }
+    else if (start_return == -3) {
+        printf("\e[31mProtocolError: The file metadata from %s is malformed\e[0m\n", inet_ntoa(args->address));
+        fflush(stdout);
+    }
+    else if (start_return == 1) serve_session(args->daemon, &stream, args->address);
+    else if (start_return == 0) receive_started(args->daemon, &stream, args->address);
+
+    free(args);
+
+    return NULL;
+}
+
+/**
+ * Hands a readable connection to its own thread.
+ *
+ * @param daemon Daemon state.
+ * @param peer   Peer leaving the event loop (freed by the caller).
+ */
+void start_connection(daemon_state *daemon, const daemon_peer *peer) {
+    connection_args *args = malloc(sizeof(connection_args));
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    if (!args) {
+        close(peer->socket);
+
+        return;
+    }
+
+    args->daemon = daemon;
+    args->socket = peer->socket;
+    args->address = peer->address;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attributes, daemon_connection, args) != 0) {
+        close(peer->socket);
+        free(args);
+    }
+
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Removes a peer from the idle list.
+ *
+ * @param peer Peer to remove.
+ */
+void unlink_peer(daemon_peer *peer) {
+    peer->previous->next = peer->next;
+    peer->next->previous = peer->previous;
+}
+
+/**
+ * Runs a persistent receiver. One epoll loop accepts connections, answers discovery messages
+ * and holds idle peers; each connection moves to its own thread once its first bytes arrive,
+ * so many transfers run concurrently. Runs until SIGINT or SIGTERM.
+ *
+ * @param output_dir Directory received files are written to (NULL for the current directory).
+ * @param options    Transfer options.
+ * @return           0 after a clean shutdown, -1 if the receiver could not start.
+ */
+int run_daemon(const char *output_dir, const transfer_options *options) {
+    daemon_state daemon = {0};
+    daemon_peer listener = {0}, discovery[2] = {{0}}, idle = {0};
+    struct epoll_event event = {0}, events[DAEMON_MAX_EVENTS];
+    discovery_interface interfaces[MAX_INTERFACES];
+    char reply_prefix[BUFFER_SIZE];
+    struct rlimit limit;
+
+    // Idle peers are only bounded by the descriptor limit, so raise it as far as allowed
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    daemon.output_dir = (output_dir != NULL) ? output_dir : ".";
+    daemon.options = options;
+    pthread_mutex_init(&daemon.lock, NULL);
+
+    if ((listener.socket = open_listener()) < 0) return -1;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd < 0) {
+        printf("\e[31mConnectionError: Failed to create the event loop\e[0m\n");
+        fflush(stdout);
+
+        close(listener.socket);
+
+        return -1;
+    }
+
+    fcntl(listener.socket, F_SETFL, fcntl(listener.socket, F_GETFL) | O_NONBLOCK);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &listener;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener.socket, &event);
+
+    // Discovery is optional; another receiver on this host may already answer it
+    int interface_count = list_interfaces(NULL, interfaces, MAX_INTERFACES);
+
+    if (interface_count < 0) interface_count = 0;
+
+    discovery_reply_prefix(reply_prefix, sizeof(reply_prefix));
+
+    for (int family = 0; family < 2; family++) {
+        discovery[family].socket = open_discovery_listener((family == 0) ? AF_INET : AF_INET6, interfaces, interface_count);
+
+        if (discovery[family].socket < 0) continue;
+
+        fcntl(discovery[family].socket, F_SETFL, fcntl(discovery[family].socket, F_GETFL) | O_NONBLOCK);
+        fcntl(discovery[family].socket, F_SETFD, FD_CLOEXEC);
+
+        event.data.ptr = &discovery[family];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, discovery[family].socket, &event);
+    }
+
+    idle.previous = idle.next = &idle;
+
+    signal(SIGINT, stop_daemon);
+    signal(SIGTERM, stop_daemon);
+
+    printf("\e[33mReceiving into %s, press Ctrl+C to stop\e[0m\n", daemon.output_dir);
+    fflush(stdout);
+
+    while (!daemon_stopping) {
+        int count = epoll_wait(epoll_fd, events, DAEMON_MAX_EVENTS, DAEMON_SWEEP_INTERVAL);
+
+        for (int index = 0; index < count; index++) {
+            daemon_peer *peer = events[index].data.ptr;
+
+            if (peer == &listener) {
+                struct sockaddr_in address;
+                socklen_t address_len = sizeof(address);
+                int socket;
+
+                // Park every pending connection until it has something to say
+                while ((socket = accept(listener.socket, (struct sockaddr *)&address, &address_len)) >= 0) {
+                    daemon_peer *accepted = malloc(sizeof(daemon_peer));
+
+                    address_len = sizeof(address);
+                    event.events = EPOLLIN | EPOLLRDHUP;
+                    event.data.ptr = accepted;
+
+                    if (!accepted || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) < 0) {
+                        close(socket);
+                        free(accepted);
+                        continue;
+                    }
+
+                    accepted->socket = socket;
+                    accepted->address = address.sin_addr;
+                    accepted->accepted = time(NULL);
+                    accepted->next = &idle;
+                    accepted->previous = idle.previous;
+                    idle.previous->next = accepted;
+                    idle.previous = accepted;
+                }
+            }
+            else if (peer == &discovery[0] || peer == &discovery[1]) {
+                struct sockaddr_storage client;
+
+                while (answer_discovery(peer->socket, reply_prefix, interfaces, interface_count, &client) >= 0);
+            }
+            else {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+                unlink_peer(peer);
+
+                // A peer that hung up without sending anything is simply dropped
+                if (events[index].events & EPOLLIN) start_connection(&daemon, peer);
+                else close(peer->socket);
+
+                free(peer);
+            }
+        }
+
+        // The idle list is ordered by accept time, so expired peers are at its head
+        time_t now = time(NULL);
+
+        while (idle.next != &idle && now - idle.next->accepted >= DAEMON_IDLE_TIMEOUT) {
+            daemon_peer *peer = idle.next;
+
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+            unlink_peer(peer);
+            close(peer->socket);
+            free(peer);
+        }
+
+        expire_transfers(&daemon, now);
+    }
+
+    // Stop accepting; transfers still running end with the process
+    while (idle.next != &idle) {
+        daemon_peer *peer = idle.next;
+
+        unlink_peer(peer);
+        close(peer->socket);
+        free(peer);
+    }
+
+    for (int family = 0; family < 2; family++) {
+        if (discovery[family].socket >= 0) close(discovery[family].socket);
+    }
+
+    close(listener.socket);
+    close(epoll_fd);
+
+    printf("\r\e[33mReceiver stopped\e[0m\n");
+    fflush(stdout);
+
+    return 0;
+}
@@ -0,0 +1,684 @@
+#include "delta.h"
+
+#define CDC_MIN_CHUNK 4096                          // No cut point before this many bytes
+#define CDC_AVERAGE_CHUNK 16384                     // Cut points get easier to hit past this length
+#define CDC_MAX_CHUNK 65536                         // Forced cut point
+#define CDC_MASK_STRICT 0xfffe000000000000ull       // 15 fingerprint bits that must be zero before CDC_AVERAGE_CHUNK
+#define CDC_MASK_LOOSE 0xfff8000000000000ull        // 13 bits after it
+#define CDC_READ_SIZE (4 << 20)                     // Bytes read from disk at once
+#define DEDUP_MAX_CHUNKS (1 << 26)                  // Most chunks a chunk list may announce
+#define DEDUP_ENTRY_LENGTH (4 + DIGEST_LENGTH)      // Length and SHA-256 of a listed chunk
+#define DEDUP_NO_CHUNK UINT32_MAX                   // Hash not found
+#define STORE_PACK_NAME "chunks.pack"               // Chunk contents, appended back to back
+#define STORE_INDEX_NAME "chunks.index"             // One entry per stored chunk
+#define STORE_INDEX_ENTRY (DIGEST_LENGTH + 8 + 4)   // SHA-256, pack offset and length of a stored chunk
+
+// Where the receiver takes a chunk of the new file from
+#define CHUNK_WANTED 0      // The sender sends it
+#define CHUNK_STORED 1      // Copied from the chunk store
+#define CHUNK_REPEATED 2    // Copied from an earlier chunk of the same file
+
+// Chunk identified by its SHA-256
+typedef struct {
+    unsigned char hash[DIGEST_LENGTH];  // SHA-256 of the chunk
+    uint64_t offset;                    // Offset in the pack (stored chunks) or in the file (listed chunks)
+    uint32_t length;                    // Chunk length
+} chunk_entry;
+
+// Open-addressing table of chunk entries by hash
+typedef struct {
+    uint32_t *slots;    // Entry index + 1, or 0 for an empty slot
+    uint32_t mask;      // Number of slots - 1
+} chunk_table;
+
+// Persistent content-addressed chunk store of the receiver. Chunks are only ever appended, so
+// readers need no lock; writers take an exclusive flock() on the index.
+struct chunk_store {
+    int pack;                   // Chunk contents
+    int index;                  // STORE_INDEX_ENTRY per chunk, written after its contents
+    chunk_entry *entries;       // Index as loaded when the store was opened
+    uint32_t count;             // Number of entries
+    chunk_table table;          // Entries by hash
+};
+
+typedef struct chunk_store chunk_store;
+
+// Receiver's plan for the sender's chunk list: where every chunk of the new file comes from
+typedef struct {
+    chunk_store *store;         // Receiver's chunk store
+    int file;                   // Output file
+    chunk_entry *chunks;        // Sender's chunks, offsets in the file
+    uint32_t count;             // Number of chunks
+    uint8_t *origins;           // CHUNK_* value of every chunk
+    uint64_t *sources;          // File offset of the first copy of a repeated chunk
+    chunk_table wanted;         // Chunks the sender sends, by hash
+} dedup_plan;
+
+uint64_t cdc_gear[256];                             // Random value per byte, mixed into the fingerprint
+pthread_once_t cdc_gear_once = PTHREAD_ONCE_INIT;   // Fills cdc_gear once
+
+/**
+ * Fills the gear table from a fixed seed, so every sender cuts the same data at the same points.
+ */
+void cdc_fill_gear(void) {
+    uint64_t seed = 0x6279746576616c76ull;
+
+    // splitmix64
+    for (int index = 0; index < 256; index++) {
+        uint64_t value = (seed += 0x9e3779b97f4a7c15ull);
+
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+
+        cdc_gear[index] = value ^ (value >> 31);
+    }
+}
+
+/**
+ * Finds the next content-defined cut point (FastCDC). The first CDC_MIN_CHUNK bytes are
+ * skipped, a strict mask keeps chunks from ending early and a loose one from running long.
+ *
+ * @param data   Bytes from the start of the chunk.
+ * @param length Bytes available; at least CDC_MAX_CHUNK unless the file ends first.
+ * @return       Length of the chunk.
+ */
+size_t cdc_cut(const unsigned char *data, size_t length) {
+    size_t limit = (length < CDC_MAX_CHUNK) ? length : CDC_MAX_CHUNK;
+    size_t normal = (limit < CDC_AVERAGE_CHUNK) ? limit : CDC_AVERAGE_CHUNK;
+    size_t index = CDC_MIN_CHUNK;
+    uint64_t fingerprint = 0;
+
+    if (length <= CDC_MIN_CHUNK) return length;
+
+    for (; index < normal; index++) {
+        fingerprint = (fingerprint << 1) + cdc_gear[data[index]];
+
+        if (!(fingerprint & CDC_MASK_STRICT)) return index + 1;
+    }
+
+    for (; index < limit; index++) {
+        fingerprint = (fingerprint << 1) + cdc_gear[data[index]];
+
+        if (!(fingerprint & CDC_MASK_LOOSE)) return index + 1;
+    }
+
+    return limit;
+}
+
+/**
+ * Splits a file into content-defined chunks and hashes each of them.
+ *
+ * @param file   File descriptor.
+ * @param size   Size of the file.
+ * @param chunks Output for the allocated chunk list (free with free()).
+ * @param count  Output for the number of chunks.
+ * @return       0 on success, -1 on failure.
+ */
+int chunk_file(int file, uint64_t size, chunk_entry **chunks, uint32_t *count) {
+    size_t capacity = CDC_READ_SIZE + CDC_MAX_CHUNK, length = 0, start = 0, listed = 1024;
+    unsigned char *buffer = malloc(capacity);
+    uint64_t offset = 0;
+    int result = 0;
+
+    pthread_once(&cdc_gear_once, cdc_fill_gear);
+
+    *count = 0;
+    *chunks = malloc(listed * sizeof(chunk_entry));
+
+    if (!buffer || !*chunks) result = -1;
+
+    while (result == 0 && offset + start < size) {
+        // Keep a whole chunk ahead of the cursor unless the file ends first
+        if (length - start < CDC_MAX_CHUNK && offset + length < size) {
+            memmove(buffer, buffer + start, length - start);
+
+            offset += start;
+            length -= start;
+            start = 0;
+
+            size_t wanted = (size - offset - length < capacity - length) ? size - offset - length : capacity - length;
+
+            if (pread_all(file, buffer + length, wanted, offset + length) < 0) {
+                result = -1;
+                break;
+            }
+
+            length += wanted;
+        }
+
+        if (*count == listed) {
+            chunk_entry *grown = (listed < DEDUP_MAX_CHUNKS) ? realloc(*chunks, listed * 2 * sizeof(chunk_entry)) : NULL;
+
+            if (!grown) {
+                result = -1;
+                break;
+            }
+
+            *chunks = grown;
+            listed *= 2;
+        }
+
+        chunk_entry *chunk = &(*chunks)[*count];
+
+        chunk->length = cdc_cut(buffer + start, length - start);
+        chunk->offset = offset + start;
+
+        if (digest_chunk(buffer + start, chunk->length, chunk->hash) < 0) result = -1;
+
+        start += chunk->length;
+        (*count)++;
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+/**
+ * Sends the chunk list as CHUNK_LIST records, followed by an END frame. The offset of a
+ * record is the index of its first chunk.
+ *
+ * @param socket     Connected socket.
+ * @param session    Negotiated session.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param chunks     Chunks of the file, in order.
+ * @param count      Number of chunks.
+ * @return           0 on success, -1 on failure.
+ */
+int send_chunk_list(int socket, crypto_session *session, int chunk_size, const chunk_entry *chunks, uint32_t count) {
+    uint32_t per_record = chunk_size / DEDUP_ENTRY_LENGTH;
+    unsigned char *plain_text = malloc(chunk_size);
+    unsigned char *record = malloc(chunk_size + RECORD_OVERHEAD);
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 1);
+    int result = (plain_text && record && context && per_record > 0) ? 0 : -1;
+
+    for (uint32_t first = 0; result == 0 && first < count; first += per_record) {
+        uint32_t listed = (count - first < per_record) ? count - first : per_record;
+
+        for (uint32_t index = 0; index < listed; index++) {
+            unsigned char *entry = plain_text + index * DEDUP_ENTRY_LENGTH;
+            uint32_t length = htonl(chunks[first + index].length);
+
+            memcpy(entry, &length, 4);
+            memcpy(entry + 4, chunks[first + index].hash, DIGEST_LENGTH);
+        }
+
+        result = send_sealed(socket, context, session, first, RECORD_CHUNK_LIST, plain_text, listed * DEDUP_ENTRY_LENGTH, record);
+    }
+
+    EVP_CIPHER_CTX_free(context);
+
+    free(plain_text);
+    free(record);
+
+    if (result < 0) return -1;
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+/**
+ * Receives the sender's chunk list until the END frame. Only the last chunk may be shorter
+ * than CDC_MIN_CHUNK and the lengths must add up to the file size.
+ *
+ * @param socket     Connected socket.
+ * @param session    Negotiated session.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param size       Size of the file.
+ * @param chunks     Output for the allocated chunk list (free with free(), even on failure).
+ * @param count      Output for the number of chunks.
+ * @return           0 on success, -1 on failure or if the list is malformed.
+ */
+int receive_chunk_list(int socket, crypto_session *session, int chunk_size, uint64_t size, chunk_entry **chunks, uint32_t *count) {
+    unsigned char *record = malloc(chunk_size + RECORD_OVERHEAD);
+    unsigned char *plain_text = malloc(chunk_size);
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 0);
+    uint32_t listed = 0;
+    uint64_t offset = 0;
+    int result = (record && plain_text && context) ? 0 : -1;
+
+    *chunks = NULL;
+    *count = 0;
+
+    while (result == 0) {
+        frame_header header;
+        record_header opened;
+        int length;
+
+        if (recv_frame_header(socket, &header) < 0) result = -1;
+        else if (header.type == FRAME_END && header.length == 0) break;
+        else if (header.type != FRAME_DATA || header.length > (uint32_t)chunk_size + RECORD_OVERHEAD || recv_all(socket, record, header.length) < 0) result = -1;
+
+        if (result < 0) break;
+
+        length = open_record(context, session, record, header.length, &opened, plain_text);
+
+        if (length < DEDUP_ENTRY_LENGTH || length % DEDUP_ENTRY_LENGTH != 0 || opened.flags != RECORD_CHUNK_LIST || opened.offset != *count) {
+            result = -1;
+            break;
+        }
+
+        uint32_t entries = length / DEDUP_ENTRY_LENGTH;
+
+        if (*count + (uint64_t)entries > listed) {
+            uint32_t grown_count = (listed * 2 > *count + entries) ? listed * 2 : *count + entries;
+            chunk_entry *grown = (grown_count <= DEDUP_MAX_CHUNKS) ? realloc(*chunks, grown_count * sizeof(chunk_entry)) : NULL;
+
+            if (!grown) {
+                result = -1;
+                break;
+            }
+
+            *chunks = grown;
+            listed = grown_count;
+        }
+
+        for (uint32_t index = 0; result == 0 && index < entries; index++) {
+            const unsigned char *entry = plain_text + index * DEDUP_ENTRY_LENGTH;
+            chunk_entry *chunk = &(*chunks)[*count];
+            uint32_t chunk_length;
+
+            memcpy(&chunk_length, entry, 4);
+
+            chunk_length = ntohl(chunk_length);
+
+            if ((*count > 0 && chunk[-1].length < CDC_MIN_CHUNK) || chunk_length == 0 || chunk_length > CDC_MAX_CHUNK || chunk_length > size - offset) {
+                result = -1;
+                break;
+            }
+
+            memcpy(chunk->hash, entry + 4, DIGEST_LENGTH);
+
+            chunk->offset = offset;
+            chunk->length = chunk_length;
+            offset += chunk_length;
+            (*count)++;
+        }
+    }
+
+    EVP_CIPHER_CTX_free(context);
+
+    free(record);
+    free(plain_text);
+
+    return (result == 0 && offset == size) ? 0 : -1;
+}
+
+/**
+ * Creates an empty table for up to capacity entries.
+ *
+ * @param table    Table to initialize.
+ * @param capacity Most entries the table will hold.
+ * @return         0 on success, -1 on failure.
+ */
+int chunk_table_init(chunk_table *table, uint32_t capacity) {
+    uint32_t slots = 2;
+
+    while (slots < 2 * (uint64_t)capacity) slots <<= 1;
+
+    table->slots = calloc(slots, sizeof(uint32_t));
+    table->mask = slots - 1;
+
+    return (table->slots) ? 0 : -1;
+}
+
+/**
+ * Looks up a hash. The hash is uniformly distributed, so its first bytes pick the slot.
+ *
+ * @param table   Table to search.
+ * @param entries Entries the table indexes.
+ * @param hash    SHA-256 to find.
+ * @return        Index of the entry, or DEDUP_NO_CHUNK.
+ */
+uint32_t chunk_table_find(const chunk_table *table, const chunk_entry *entries, const unsigned char *hash) {
+    uint32_t slot;
+
+    memcpy(&slot, hash, 4);
+
+    for (slot &= table->mask; table->slots[slot] != 0; slot = (slot + 1) & table->mask) {
+        if (memcmp(entries[table->slots[slot] - 1].hash, hash, DIGEST_LENGTH) == 0) return table->slots[slot] - 1;
+    }
+
+    return DEDUP_NO_CHUNK;
+}
+
+/**
+ * Adds an entry whose hash is not in the table yet.
+ *
+ * @param table   Table to add to.
+ * @param entries Entries the table indexes.
+ * @param index   Index of the new entry.
+ */
+void chunk_table_insert(chunk_table *table, const chunk_entry *entries, uint32_t index) {
+    uint32_t slot;
+
+    memcpy(&slot, entries[index].hash, 4);
+
+    for (slot &= table->mask; table->slots[slot] != 0; slot = (slot + 1) & table->mask);
+
+    table->slots[slot] = index + 1;
+}
+
+/**
+ * Closes a chunk store.
+ *
+ * @param store Store opened by chunk_store_open().
+ */
+void chunk_store_close(chunk_store *store) {
+    if (store->pack >= 0) close(store->pack);
+    if (store->index >= 0) close(store->index);
+
+    free(store->entries);
+    free(store->table.slots);
+
+    memset(store, 0, sizeof(*store));
+
+    store->pack = -1;
+    store->index = -1;
+}
+
+/**
+ * Opens the chunk store in a directory, creating it if needed, and loads its index. Entries
+ * that point past the end of the pack were torn by a crash and are ignored.
+ *
+ * @param store     Store to open; close it with chunk_store_close() even on failure.
+ * @param directory Store directory.
+ * @return          0 on success, -1 on failure.
+ */
+int chunk_store_open(chunk_store *store, const char *directory) {
+    char path[PATH_MAX];
+    struct stat pack_stat, index_stat;
+    unsigned char *buffer = NULL;
+    int result = -1;
+
+    memset(store, 0, sizeof(*store));
+
+    store->pack = -1;
+    store->index = -1;
+
+    if (mkdir(directory, 0700) < 0 && errno != EEXIST) return -1;
+
+    if (snprintf(path, sizeof(path), "%s/%s", directory, STORE_PACK_NAME) >= (int)sizeof(path)) return -1;
+    if ((store->pack = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) return -1;
+    if (snprintf(path, sizeof(path), "%s/%s", directory, STORE_INDEX_NAME) >= (int)sizeof(path)) return -1;
+    if ((store->index = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) return -1;
+
+    // Writers hold the lock exclusively, so the index is read between two of their appends
+    if (flock(store->index, LOCK_SH) < 0) return -1;
+
+    if (fstat(store->pack, &pack_stat) == 0 && fstat(store->index, &index_stat) == 0 && index_stat.st_size / STORE_INDEX_ENTRY < DEDUP_MAX_CHUNKS) {
+        uint32_t total = index_stat.st_size / STORE_INDEX_ENTRY;
+
+        buffer = malloc((size_t)total * STORE_INDEX_ENTRY + 1);
+        store->entries = malloc(((size_t)total + 1) * sizeof(chunk_entry));
+
+        if (buffer && store->entries && chunk_table_init(&store->table, total) == 0 && pread_all(store->index, buffer, (size_t)total * STORE_INDEX_ENTRY, 0) == 0) {
+            for (uint32_t index = 0; index < total; index++) {
+                const unsigned char *entry = buffer + (size_t)index * STORE_INDEX_ENTRY;
+                chunk_entry *chunk = &store->entries[store->count];
+                uint32_t length;
+
+                memcpy(chunk->hash, entry, DIGEST_LENGTH);
+                memcpy(&length, entry + DIGEST_LENGTH + 8, 4);
+
+                chunk->offset = get_u64(entry + DIGEST_LENGTH);
+                chunk->length = ntohl(length);
+
+                if (chunk->length == 0 || chunk->length > CDC_MAX_CHUNK || chunk->offset + chunk->length > (uint64_t)pack_stat.st_size) continue;
+                if (chunk_table_find(&store->table, store->entries, chunk->hash) != DEDUP_NO_CHUNK) continue;
+
+                chunk_table_insert(&store->table, store->entries, store->count++);
+            }
+
+            result = 0;
+        }
+    }
+
+    flock(store->index, LOCK_UN);
+    free(buffer);
+
+    return result;
+}
+
+/**
+ * Copies a stored chunk into the output file if it still matches its hash.
+ *
+ * @param plan   Receiver's plan.
+ * @param stored Index of the store entry.
+ * @param chunk  Chunk of the new file.
+ * @param buffer Scratch buffer of CDC_MAX_CHUNK bytes.
+ * @return       1 if copied, 0 if the stored copy is unusable, -1 if the output file failed.
+ */
+int copy_stored_chunk(dedup_plan *plan, uint32_t stored, const chunk_entry *chunk, unsigned char *buffer) {
+    const chunk_entry *entry = &plan->store->entries[stored];
+    unsigned char digest[DIGEST_LENGTH];
+
+    if (entry->length != chunk->length || pread_all(plan->store->pack, buffer, entry->length, entry->offset) < 0) return 0;
+    if (digest_chunk(buffer, entry->length, digest) < 0 || memcmp(digest, chunk->hash, DIGEST_LENGTH) != 0) return 0;
+
+    return (pwrite_all(plan->file, buffer, chunk->length, chunk->offset) < 0) ? -1 : 1;
+}
+
+/**
+ * Decides where every chunk comes from and copies the stored ones into the output file right
+ * away. A stored chunk that no longer matches its hash is simply asked for again. Chunks that
+ * are not sent count as done.
+ *
+ * @param plan        Receiver's plan with the chunk list set.
+ * @param ranges      Output for the allocated ranges the sender must send (free with free()).
+ * @param range_count Output for the number of ranges.
+ * @return            0 on success, -1 on failure.
+ */
+int plan_chunks(dedup_plan *plan, byte_range **ranges, uint32_t *range_count) {
+    unsigned char *buffer = malloc(CDC_MAX_CHUNK);
+    int result = 0;
+
+    plan->origins = malloc(plan->count + 1);
+    plan->sources = malloc((plan->count + 1) * sizeof(uint64_t));
+
+    *range_count = 0;
+    *ranges = calloc(plan->count + 1, sizeof(byte_range));
+
+    if (!buffer || !plan->origins || !plan->sources || !*ranges || chunk_table_init(&plan->wanted, plan->count) < 0) result = -1;
+
+    for (uint32_t index = 0; result == 0 && index < plan->count; index++) {
+        const chunk_entry *chunk = &plan->chunks[index];
+        uint32_t stored = chunk_table_find(&plan->store->table, plan->store->entries, chunk->hash);
+        uint32_t first = chunk_table_find(&plan->wanted, plan->chunks, chunk->hash);
+        int copied = (stored != DEDUP_NO_CHUNK) ? copy_stored_chunk(plan, stored, chunk, buffer) : 0;
+
+        if (copied < 0) result = -1;
+        else if (copied) {
+            plan->origins[index] = CHUNK_STORED;
+
+            telemetry_skip(chunk->length);
+        }
+        else if (first != DEDUP_NO_CHUNK) {
+            plan->origins[index] = CHUNK_REPEATED;
+            plan->sources[index] = plan->chunks[first].offset;
+
+            telemetry_skip(chunk->length);
+        }
+        else {
+            plan->origins[index] = CHUNK_WANTED;
+
+            chunk_table_insert(&plan->wanted, plan->chunks, index);
+
+            // Neighbouring chunks the sender must send travel as one range
+            if (*range_count > 0 && (*ranges)[*range_count - 1].offset + (*ranges)[*range_count - 1].length == chunk->offset) {
+                (*ranges)[*range_count - 1].length += chunk->length;
+            }
+            else {
+                (*ranges)[*range_count].offset = chunk->offset;
+                (*ranges)[(*range_count)++].length = chunk->length;
+            }
+        }
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+/**
+ * Checks the chunks the sender sent against their hashes and appends them to the store, then
+ * fills in the chunks that repeat them. The pack is synced before the index points into it.
+ *
+ * @param plan Receiver's plan, after the wanted ranges arrived.
+ * @return     0 on success, -1 on failure or if a chunk does not match its hash.
+ */
+int store_chunks(dedup_plan *plan) {
+    unsigned char *buffer = malloc(CDC_MAX_CHUNK), digest[DIGEST_LENGTH];
+    unsigned char *entries = malloc((size_t)plan->count * STORE_INDEX_ENTRY + 1);
+    struct stat pack_stat = {0}, index_stat = {0};
+    size_t entries_length = 0;
+    int result = (buffer && entries) ? 0 : -1;
+
+    if (result == 0 && flock(plan->store->index, LOCK_EX) < 0) result = -1;
+    if (result == 0 && (fstat(plan->store->pack, &pack_stat) < 0 || fstat(plan->store->index, &index_stat) < 0)) result = -1;
+
+    uint64_t pack_end = pack_stat.st_size;
+
+    for (uint32_t index = 0; result == 0 && index < plan->count; index++) {
+        const chunk_entry *chunk = &plan->chunks[index];
+
+        if (plan->origins[index] != CHUNK_WANTED) continue;
+
+        if (pread_all(plan->file, buffer, chunk->length, chunk->offset) < 0 || digest_chunk(buffer, chunk->length, digest) < 0 ||
+            memcmp(digest, chunk->hash, DIGEST_LENGTH) != 0 || pwrite_all(plan->store->pack, buffer, chunk->length, pack_end) < 0) {
+            result = -1;
+            break;
+        }
+
+        unsigned char *entry = entries + entries_length;
+        uint32_t length = htonl(chunk->length);
+
+        memcpy(entry, chunk->hash, DIGEST_LENGTH);
+        put_u64(entry + DIGEST_LENGTH, pack_end);
+        memcpy(entry + DIGEST_LENGTH + 8, &length, 4);
+
+        pack_end += chunk->length;
+        entries_length += STORE_INDEX_ENTRY;
+    }
+
+    // A torn entry from a crashed writer is cut off so the new ones stay aligned
+    if (result == 0 && entries_length > 0) {
+        off_t index_end = index_stat.st_size - index_stat.st_size % STORE_INDEX_ENTRY;
+
+        if (fdatasync(plan->store->pack) < 0 || ftruncate(plan->store->index, index_end) < 0 || pwrite_all(plan->store->index, entries, entries_length, index_end) < 0) result = -1;
+    }
+
+    flock(plan->store->index, LOCK_UN);
+
+    for (uint32_t index = 0; result == 0 && index < plan->count; index++) {
+        const chunk_entry *chunk = &plan->chunks[index];
+
+        if (plan->origins[index] != CHUNK_REPEATED) continue;
+
+        if (pread_all(plan->file, buffer, chunk->length, plan->sources[index]) < 0 || pwrite_all(plan->file, buffer, chunk->length, chunk->offset) < 0) result = -1;
+    }
+
+    free(buffer);
+    free(entries);
+
+    return result;
+}
+
+/**
+ * Sends the chunk list of the file, then the ranges the receiver answers it lacks.
+ *
+ * @param stream Stream of a sender whose receiver asked for the chunk list.
+ * @return       0 on success, -1 on failure.
+ */
+int send_deduplicated(transfer_stream *stream) {
+    file_metadata *metadata = &stream->metadata;
+    chunk_entry *chunks = NULL;
+    uint32_t count = 0;
+    uint8_t flags = 0;
+    int result = chunk_file(stream->file, metadata->size, &chunks, &count);
+
+    if (result == 0) result = send_chunk_list(stream->socket, &stream->session, metadata->chunk_size, chunks, count);
+
+    free(chunks);
+    free(stream->ranges);
+
+    stream->ranges = NULL;
+    stream->range_count = 0;
+
+    if (result == 0) result = recv_ranges(stream->socket, stream_span(metadata), &stream->ranges, &stream->range_count, &flags);
+
+    // Chunks the receiver fills in from its store count as done
+    stream->reused_bytes = metadata->size - planned_bytes(stream);
+
+    if (result == 0) telemetry_skip(stream->reused_bytes);
+    if (result == 0) result = send_planned(stream, flags);
+
+    return result;
+}
+
+/**
+ * Stream thread of a sender that offered to reuse data the receiver already has. Depending on
+ * the receiver's answer it sends a delta against its copy, the chunks its store lacks, or the
+ * ranges it asked for; then it waits for the receiver's ACK.
+ *
+ * @param arg Pointer to a transfer_stream structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *send_reusing(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+
+    stream->result = recv_ranges(stream->socket, stream_span(&stream->metadata), &stream->ranges, &stream->range_count, &stream->plan_flags);
+
+    if (stream->result == 0 && (stream->plan_flags & RESUME_DELTA)) {
+        stream->result = encrypt_delta(stream->file, stream->metadata.size, stream->metadata.chunk_size, stream->socket, &stream->session,
+                                       stream->threads, stream_compresses(stream), &stream->report, &stream->reused_bytes);
+    }
+    else if (stream->result == 0 && (stream->plan_flags & RESUME_DEDUP)) stream->result = send_deduplicated(stream);
+    else if (stream->result == 0) {
+        telemetry_skip(stream->metadata.range_length - planned_bytes(stream));
+
+        stream->result = send_planned(stream, stream->plan_flags);
+    }
+
+    if (stream->result == 0) stream->result = receive_ack(stream->socket);
+
+    return NULL;
+}
+
+/**
+ * Stream thread of the deduplicating receiver: asks for the chunk list, fills in the chunks its
+ * store holds, receives the rest, adds them to the store and answers with an ACK.
+ *
+ * @param arg Pointer to a transfer_stream structure whose store is open.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *receive_dedup(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+    file_metadata *metadata = &stream->metadata;
+    byte_range span = stream_span(metadata);
+    dedup_plan plan = {0};
+
+    plan.store = stream->store;
+    plan.file = stream->file;
+
+    stream->result = send_ranges(stream->socket, &span, 1, RESUME_DEDUP);
+
+    if (stream->result == 0) stream->result = receive_chunk_list(stream->socket, &stream->session, metadata->chunk_size, metadata->size, &plan.chunks, &plan.count);
+    if (stream->result == 0) stream->result = plan_chunks(&plan, &stream->ranges, &stream->range_count);
+    if (stream->result == 0) stream->result = send_ranges(stream->socket, stream->ranges, stream->range_count, 0);
+
+    if (stream->result == 0) {
+        stream->result = decrypt_file(stream->file, stream->ranges, stream->range_count, metadata->chunk_size, stream->socket, &stream->session,
+                                      stream->threads, NULL, stream->engine, stream->direct, stream->tree);
+    }
+
+    if (stream->result == 0) stream->result = store_chunks(&plan);
+
+    send_ack(stream->socket, stream->result);
+
+    free(plan.chunks);
+    free(plan.origins);
+    free(plan.sources);
+    free(plan.wanted.slots);
+
+    return NULL;
+}
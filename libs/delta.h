@@ -0,0 +1,934 @@
+#include "piped.h"
+
+#define DELTA_MIN_BLOCK 2048                // Smallest block the receiver's copy is split into
+#define DELTA_MAX_BLOCK (1 << 20)           // Largest block
+#define DELTA_MAX_BLOCKS (1 << 22)          // Most blocks a signature list may describe
+#define DELTA_STRONG_LENGTH 16              // Bytes of SHA-256 kept per block
+#define DELTA_SIGNATURE_LENGTH (4 + DELTA_STRONG_LENGTH)    // Weak checksum and strong hash of a block
+#define DELTA_SIGNATURE_HEADER 12           // Block size and size of the copy, ahead of every signature record
+#define DELTA_OP_COPY 1                     // Copy a run of blocks from the receiver's copy
+#define DELTA_OP_LITERAL 2                  // Insert the bytes that follow
+#define DELTA_COPY_LENGTH 9                 // op, first block, block count
+#define DELTA_LITERAL_HEADER 5              // op, length
+#define DELTA_LITERAL_FLUSH (64 << 10)      // Unmatched bytes held back before they go out anyway
+#define DELTA_READ_SIZE (4 << 20)           // Bytes read from disk at once
+#define DELTA_NO_BLOCK UINT32_MAX           // No block matched, or end of a block table chain
+#define DELTA_SUFFIX ".bvdelta"             // Appended to the output path while the new version is rebuilt
+
+// State of the delta sending stages. The source slides a block-sized window over the file and
+// describes it as COPY instructions for blocks the receiver already has and LITERAL bytes.
+typedef struct {
+    send_state stream;              // Socket used by send_chunk(); must stay first
+    int file;                       // File being sent
+    uint64_t size;                  // Size of the file being sent
+    uint32_t block_size;            // Block size of the receiver's copy
+    uint64_t basis_size;            // Size of the receiver's copy
+    uint32_t block_count;           // Number of blocks of the receiver's copy
+    uint32_t *weak;                 // Weak checksum of every block
+    unsigned char *strong;          // Strong hash of every block
+    uint32_t *heads;                // First block of every weak checksum bucket
+    uint32_t *chain;                // Next block in the same bucket
+    int table_shift;                // 32 minus the number of bucket bits
+    unsigned char *window;          // File bytes from the pending literal on
+    size_t window_capacity;         // Size of window
+    uint64_t window_offset;         // File offset of window[0]
+    size_t window_length;           // Valid bytes in window
+    uint64_t position;              // Start of the block-sized span being matched
+    uint64_t literal_start;         // First unmatched byte not described yet
+    uint32_t sum_a, sum_b;          // Rolling checksum halves of the span at position
+    int rolling;                    // 1 if sum_a and sum_b belong to position
+    uint32_t match;                 // Block matched at position, or DELTA_NO_BLOCK
+    uint32_t next_block;            // Block after the last match, tried first
+    int at_end;                     // Every byte is either matched or part of the literal
+    uint64_t emitted;               // Bytes of the file described so far
+    uint64_t reused;                // Bytes described by COPY instructions
+    int last_copy;                  // Offset of the last COPY in the current job, or -1
+} delta_send_state;
+
+// State of the delta receiving stages
+typedef struct {
+    receive_state stream;           // Socket and chunk size used by receive_chunk(); must stay first
+    int basis;                      // Existing copy the blocks are copied from
+    uint64_t basis_size;            // Size of the existing copy
+    uint32_t block_size;            // Block size the signatures were computed with
+    uint32_t block_count;           // Number of blocks of the existing copy
+    uint64_t size;                  // Size of the new version
+    uint64_t written;               // Bytes of the new version rebuilt so far
+    int copy_range;                 // 1 while copy_file_range() works between the two files
+    unsigned char *buffer;          // Copy buffer once copy_file_range() gave up
+} delta_receive_state;
+
+/**
+ * Picks the block size for an existing copy: about the square root of its size, which balances
+ * the signature list against how finely changes are located.
+ *
+ * @param size Size of the existing copy.
+ * @return     A power of two between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK.
+ */
+uint32_t delta_block_size(uint64_t size) {
+    uint32_t block_size = DELTA_MIN_BLOCK;
+
+    while (block_size < DELTA_MAX_BLOCK && ((uint64_t)block_size * block_size < size || size / block_size >= DELTA_MAX_BLOCKS)) block_size <<= 1;
+
+    return block_size;
+}
+
+/**
+ * Length of a block; only the last one may be short.
+ *
+ * @param block_size Block size.
+ * @param size       Size of the copy the blocks belong to.
+ * @param block      Block index.
+ * @return           Length of the block in bytes.
+ */
+uint32_t delta_block_length(uint32_t block_size, uint64_t size, uint32_t block) {
+    uint64_t offset = (uint64_t)block * block_size;
+
+    return (size - offset < block_size) ? (uint32_t)(size - offset) : block_size;
+}
+
+/**
+ * Computes the rolling checksum of a block: two 16-bit sums that can be slid by one byte in
+ * constant time.
+ *
+ * @param data   Block bytes.
+ * @param length Block length.
+ * @param sum_a  Output for the plain sum.
+ * @param sum_b  Output for the position-weighted sum.
+ * @return       The weak checksum, sum_a in the low and sum_b in the high half.
+ */
+uint32_t weak_checksum(const unsigned char *data, uint32_t length, uint32_t *sum_a, uint32_t *sum_b) {
+    uint32_t a = 0, b = 0;
+
+    for (uint32_t index = 0; index < length; index++) {
+        a += data[index];
+        b += (length - index) * data[index];
+    }
+
+    *sum_a = a;
+    *sum_b = b;
+
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * Computes the strong hash of a block, confirming what the weak checksum suggests.
+ *
+ * @param data   Block bytes.
+ * @param length Block length.
+ * @param hash   Output for DELTA_STRONG_LENGTH bytes.
+ * @return       0 on success, -1 on failure.
+ */
+int strong_checksum(const unsigned char *data, uint32_t length, unsigned char *hash) {
+    unsigned char digest[DIGEST_LENGTH];
+
+    if (digest_chunk(data, length, digest) < 0) return -1;
+
+    memcpy(hash, digest, DELTA_STRONG_LENGTH);
+
+    return 0;
+}
+
+/**
+ * Seals a buffer into one record and sends it as a DATA frame.
+ *
+ * @param socket     Connected socket.
+ * @param context    Context from new_record_context(cipher, 1).
+ * @param session    Negotiated session.
+ * @param offset     Record offset.
+ * @param flags      RECORD_* flags.
+ * @param plain_text Data to seal.
+ * @param length     Length of plain_text.
+ * @param record     Scratch buffer, at least length + RECORD_OVERHEAD bytes.
+ * @return           0 on success, -1 on failure.
+ */
+int send_sealed(int socket, EVP_CIPHER_CTX *context, crypto_session *session, uint64_t offset, uint32_t flags,
+                const unsigned char *plain_text, int length, unsigned char *record) {
+    int record_len = seal_record(context, session, offset, flags, plain_text, length, record);
+
+    if (record_len < 0) return -1;
+
+    return send_frame(socket, FRAME_DATA, 0, record, record_len);
+}
+
+/**
+ * Opens the receiver's existing copy if the sender offered a delta against it. A file with a
+ * resume checkpoint is resumed instead, since the checkpoint knows which of its bytes are good.
+ *
+ * @param file_path Output path.
+ * @param metadata  Metadata of the incoming file.
+ * @return          Descriptor of the existing copy, or -1 if the file is received in full.
+ */
+int open_delta_basis(const char *file_path, const file_metadata *metadata) {
+    struct stat basis_stat;
+
+    if (!metadata->delta || metadata->size == 0 || metadata->chunk_size < DELTA_MIN_BLOCK || checkpoint_exists(file_path)) return -1;
+
+    int basis = open(file_path, O_RDONLY | O_CLOEXEC);
+
+    if (basis < 0) return -1;
+
+    if (fstat(basis, &basis_stat) < 0 || !S_ISREG(basis_stat.st_mode) || basis_stat.st_size == 0 ||
+        ((uint64_t)basis_stat.st_size + DELTA_MAX_BLOCK - 1) / DELTA_MAX_BLOCK > DELTA_MAX_BLOCKS) {
+        close(basis);
+
+        return -1;
+    }
+
+    return basis;
+}
+
+/**
+ * Sends the signature of every block of the existing copy as SIGNATURES records, followed by
+ * an END frame. Every record starts with the block size and the size of the copy and its
+ * offset is the index of its first block.
+ *
+ * @param socket     Connected socket.
+ * @param session    Negotiated session.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param basis      Existing copy.
+ * @param basis_size Size of the existing copy.
+ * @param block_size Block size from delta_block_size().
+ * @return           0 on success, -1 on failure.
+ */
+int send_signatures(int socket, crypto_session *session, int chunk_size, int basis, uint64_t basis_size, uint32_t block_size) {
+    unsigned char *data = malloc(DELTA_READ_SIZE);
+    unsigned char *plain_text = malloc(chunk_size);
+    unsigned char *record = malloc(chunk_size + RECORD_OVERHEAD);
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 1);
+    uint32_t block_count = (basis_size + block_size - 1) / block_size, block = 0, first = 0;
+    uint32_t net_block_size = htonl(block_size);
+    int length = 0, result = (data && plain_text && record && context) ? 0 : -1;
+
+    // DELTA_READ_SIZE is a multiple of every block size, so reads never split a block
+    for (uint64_t offset = 0; result == 0 && offset < basis_size; offset += DELTA_READ_SIZE) {
+        size_t count = (basis_size - offset < DELTA_READ_SIZE) ? basis_size - offset : DELTA_READ_SIZE;
+
+        if (pread_all(basis, data, count, offset) < 0) result = -1;
+
+        for (size_t start = 0; result == 0 && start < count; start += block_size) {
+            uint32_t block_length = (count - start < block_size) ? count - start : block_size;
+            uint32_t sum_a, sum_b, weak = htonl(weak_checksum(data + start, block_length, &sum_a, &sum_b));
+
+            if (length == 0) {
+                memcpy(plain_text, &net_block_size, 4);
+                put_u64(plain_text + 4, basis_size);
+
+                first = block;
+                length = DELTA_SIGNATURE_HEADER;
+            }
+
+            memcpy(plain_text + length, &weak, 4);
+
+            if (strong_checksum(data + start, block_length, plain_text + length + 4) < 0) result = -1;
+
+            length += DELTA_SIGNATURE_LENGTH;
+            block++;
+
+            if (result == 0 && (length + DELTA_SIGNATURE_LENGTH > chunk_size || block == block_count)) {
+                result = send_sealed(socket, context, session, first, RECORD_SIGNATURES, plain_text, length, record);
+                length = 0;
+            }
+        }
+    }
+
+    EVP_CIPHER_CTX_free(context);
+
+    free(data);
+    free(plain_text);
+    free(record);
+
+    if (result < 0) return -1;
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+/**
+ * Receives the receiver's block signatures until the END frame.
+ *
+ * @param state      Sending state; the block geometry and signatures are filled in.
+ * @param socket     Connected socket.
+ * @param session    Negotiated session.
+ * @param chunk_size Largest plaintext size of a record.
+ * @return           0 if every block arrived, -1 on failure or if the list is malformed.
+ */
+int receive_signatures(delta_send_state *state, int socket, crypto_session *session, int chunk_size) {
+    unsigned char *record = malloc(chunk_size + RECORD_OVERHEAD);
+    unsigned char *plain_text = malloc(chunk_size);
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 0);
+    uint32_t received = 0;
+    int result = (record && plain_text && context) ? 0 : -1;
+
+    while (result == 0) {
+        frame_header header;
+        record_header opened;
+        uint32_t block_size;
+        int length;
+
+        if (recv_frame_header(socket, &header) < 0) result = -1;
+        else if (header.type == FRAME_END && header.length == 0) break;
+        else if (header.type != FRAME_DATA || header.length > (uint32_t)chunk_size + RECORD_OVERHEAD || recv_all(socket, record, header.length) < 0) result = -1;
+
+        if (result < 0) break;
+
+        length = open_record(context, session, record, header.length, &opened, plain_text);
+
+        if (length < DELTA_SIGNATURE_HEADER + DELTA_SIGNATURE_LENGTH || opened.flags != RECORD_SIGNATURES || opened.offset != received ||
+            (length - DELTA_SIGNATURE_HEADER) % DELTA_SIGNATURE_LENGTH != 0) {
+            result = -1;
+            break;
+        }
+
+        memcpy(&block_size, plain_text, 4);
+
+        block_size = ntohl(block_size);
+
+        uint64_t basis_size = get_u64(plain_text + 4);
+        uint32_t count = (length - DELTA_SIGNATURE_HEADER) / DELTA_SIGNATURE_LENGTH;
+
+        // The first record fixes the geometry, the others must repeat it
+        if (received == 0) {
+            if (block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK || (block_size & (block_size - 1)) != 0 || basis_size == 0 ||
+                (basis_size + block_size - 1) / block_size > DELTA_MAX_BLOCKS) {
+                result = -1;
+                break;
+            }
+
+            state->block_size = block_size;
+            state->basis_size = basis_size;
+            state->block_count = (basis_size + block_size - 1) / block_size;
+            state->weak = malloc(state->block_count * sizeof(uint32_t));
+            state->strong = malloc((size_t)state->block_count * DELTA_STRONG_LENGTH);
+            state->chain = malloc(state->block_count * sizeof(uint32_t));
+
+            if (!state->weak || !state->strong || !state->chain) result = -1;
+        }
+        else if (block_size != state->block_size || basis_size != state->basis_size) result = -1;
+
+        if (result < 0 || count > state->block_count - received) {
+            result = -1;
+            break;
+        }
+
+        for (uint32_t index = 0; index < count; index++) {
+            const unsigned char *signature = plain_text + DELTA_SIGNATURE_HEADER + index * DELTA_SIGNATURE_LENGTH;
+            uint32_t weak;
+
+            memcpy(&weak, signature, 4);
+
+            state->weak[received + index] = ntohl(weak);
+
+            memcpy(state->strong + (size_t)(received + index) * DELTA_STRONG_LENGTH, signature + 4, DELTA_STRONG_LENGTH);
+        }
+
+        received += count;
+    }
+
+    EVP_CIPHER_CTX_free(context);
+
+    free(record);
+    free(plain_text);
+
+    return (result == 0 && received > 0 && received == state->block_count) ? 0 : -1;
+}
+
+/**
+ * Bucket of a weak checksum in the block table.
+ *
+ * @param state Sending state.
+ * @param weak  Weak checksum.
+ * @return      Bucket index.
+ */
+uint32_t delta_bucket(const delta_send_state *state, uint32_t weak) {
+    return (weak * 2654435761u) >> state->table_shift;
+}
+
+/**
+ * Indexes the full-size blocks by weak checksum. Identical blocks are kept once so a run of
+ * zeroes does not turn into one long chain; the short last block is only matched at the end.
+ *
+ * @param state Sending state with the signatures received.
+ * @return      0 on success, -1 on failure.
+ */
+int build_block_table(delta_send_state *state) {
+    int bits = 1;
+
+    while ((1u << bits) < 2 * state->block_count) bits++;
+
+    state->table_shift = 32 - bits;
+    state->heads = malloc(sizeof(uint32_t) << bits);
+
+    if (!state->heads) return -1;
+
+    memset(state->heads, 0xff, sizeof(uint32_t) << bits);
+
+    for (uint32_t block = 0; block < state->block_count; block++) {
+        uint32_t bucket = delta_bucket(state, state->weak[block]);
+        const unsigned char *strong = state->strong + (size_t)block * DELTA_STRONG_LENGTH;
+        int duplicate = 0;
+
+        state->chain[block] = DELTA_NO_BLOCK;
+
+        if (delta_block_length(state->block_size, state->basis_size, block) != state->block_size) continue;
+
+        for (uint32_t other = state->heads[bucket]; other != DELTA_NO_BLOCK && !duplicate; other = state->chain[other]) {
+            duplicate = state->weak[other] == state->weak[block] && memcmp(state->strong + (size_t)other * DELTA_STRONG_LENGTH, strong, DELTA_STRONG_LENGTH) == 0;
+        }
+
+        if (duplicate) continue;
+
+        state->chain[block] = state->heads[bucket];
+        state->heads[bucket] = block;
+    }
+
+    return 0;
+}
+
+/**
+ * Makes sure the window holds the file from the pending literal up to an offset, dropping
+ * the bytes that have been described already.
+ *
+ * @param state Sending state.
+ * @param end   Offset the window must reach.
+ * @return      0 on success, -1 on failure or if the file shrank.
+ */
+int delta_window(delta_send_state *state, uint64_t end) {
+    if (end <= state->window_offset + state->window_length) return 0;
+
+    if (state->literal_start >= state->window_offset + state->window_length) {
+        state->window_length = 0;
+    }
+    else {
+        size_t described = state->literal_start - state->window_offset;
+
+        memmove(state->window, state->window + described, state->window_length - described);
+
+        state->window_length -= described;
+    }
+
+    state->window_offset = state->literal_start;
+
+    while (state->window_offset + state->window_length < end) {
+        uint64_t next = state->window_offset + state->window_length;
+        size_t wanted = state->window_capacity - state->window_length;
+
+        if (state->size - next < wanted) wanted = state->size - next;
+        if (wanted == 0) return -1;
+
+        ssize_t count = pread(state->file, state->window + state->window_length, wanted, next);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+
+        state->window_length += count;
+    }
+
+    return 0;
+}
+
+/**
+ * Looks for a block of the receiver's copy equal to a span of the file.
+ *
+ * @param state Sending state.
+ * @param data  Span of block_size bytes.
+ * @param weak  Weak checksum of the span.
+ * @return      The matching block, or DELTA_NO_BLOCK.
+ */
+uint32_t find_block(delta_send_state *state, const unsigned char *data, uint32_t weak) {
+    unsigned char hash[DELTA_STRONG_LENGTH];
+    uint32_t preferred = state->next_block;
+    int hashed = 0;
+
+    // The block after the last match comes first, so runs of identical blocks stay one COPY
+    if (preferred < state->block_count && state->weak[preferred] == weak &&
+        delta_block_length(state->block_size, state->basis_size, preferred) == state->block_size) {
+        if (strong_checksum(data, state->block_size, hash) < 0) return DELTA_NO_BLOCK;
+
+        hashed = 1;
+
+        if (memcmp(hash, state->strong + (size_t)preferred * DELTA_STRONG_LENGTH, DELTA_STRONG_LENGTH) == 0) return preferred;
+    }
+
+    for (uint32_t block = state->heads[delta_bucket(state, weak)]; block != DELTA_NO_BLOCK; block = state->chain[block]) {
+        if (state->weak[block] != weak) continue;
+
+        if (!hashed && strong_checksum(data, state->block_size, hash) < 0) return DELTA_NO_BLOCK;
+
+        hashed = 1;
+
+        if (memcmp(hash, state->strong + (size_t)block * DELTA_STRONG_LENGTH, DELTA_STRONG_LENGTH) == 0) return block;
+    }
+
+    return DELTA_NO_BLOCK;
+}
+
+/**
+ * Matches the span at the current position, or slides the window by one byte. Near the end,
+ * the remaining bytes can only match the short last block of the receiver's copy.
+ *
+ * @param state Sending state.
+ * @return      0 on success, -1 on failure.
+ */
+int match_next(delta_send_state *state) {
+    uint32_t block_size = state->block_size;
+
+    if (state->size - state->position < block_size) {
+        uint32_t last = state->block_count - 1;
+        uint64_t tail = state->size - state->position;
+
+        if (tail > 0 && tail == delta_block_length(block_size, state->basis_size, last)) {
+            unsigned char hash[DELTA_STRONG_LENGTH];
+
+            if (delta_window(state, state->size) < 0) return -1;
+
+            if (strong_checksum(state->window + (state->position - state->window_offset), tail, hash) == 0 &&
+                memcmp(hash, state->strong + (size_t)last * DELTA_STRONG_LENGTH, DELTA_STRONG_LENGTH) == 0) state->match = last;
+        }
+
+        if (state->match == DELTA_NO_BLOCK) state->position = state->size;
+
+        state->at_end = 1;
+
+        return 0;
+    }
+
+    uint64_t end = state->position + block_size;
+
+    // Also load the byte that slides in next
+    if (delta_window(state, (end < state->size) ? end + 1 : end) < 0) return -1;
+
+    const unsigned char *data = state->window + (state->position - state->window_offset);
+
+    if (!state->rolling) {
+        weak_checksum(data, block_size, &state->sum_a, &state->sum_b);
+
+        state->rolling = 1;
+    }
+
+    state->match = find_block(state, data, (state->sum_a & 0xffff) | (state->sum_b << 16));
+
+    if (state->match != DELTA_NO_BLOCK) return 0;
+
+    if (end < state->size) {
+        state->sum_a += data[block_size] - data[0];
+        state->sum_b += state->sum_a - block_size * data[0];
+    }
+    else state->rolling = 0;
+
+    state->position++;
+
+    return 0;
+}
+
+/**
+ * Appends as much of the pending literal as the job has room for.
+ *
+ * @param state  Sending state.
+ * @param job    Job being filled.
+ * @param length Bytes of the job already used, updated in place.
+ * @return       1 if bytes were appended, 0 if the job is full, -1 on failure.
+ */
+int append_literal(delta_send_state *state, crypto_job *job, int *length) {
+    int room = state->stream.chunk_size - *length - DELTA_LITERAL_HEADER;
+    uint64_t pending = state->position - state->literal_start;
+
+    if (room <= 0) return 0;
+
+    uint32_t count = (pending < (uint64_t)room) ? pending : (uint32_t)room;
+    uint32_t net_count = htonl(count);
+    unsigned char *cursor = job->input + *length;
+
+    if (delta_window(state, state->literal_start + count) < 0) return -1;
+
+    cursor[0] = DELTA_OP_LITERAL;
+
+    memcpy(cursor + 1, &net_count, 4);
+    memcpy(cursor + DELTA_LITERAL_HEADER, state->window + (state->literal_start - state->window_offset), count);
+
+    *length += DELTA_LITERAL_HEADER + count;
+
+    state->literal_start += count;
+    state->emitted += count;
+    state->last_copy = -1;
+
+    return 1;
+}
+
+/**
+ * Appends the matched block as a COPY instruction, extending the previous one if the block
+ * follows its run.
+ *
+ * @param state  Sending state.
+ * @param job    Job being filled.
+ * @param length Bytes of the job already used, updated in place.
+ * @return       1 if the block was appended, 0 if the job is full.
+ */
+int append_copy(delta_send_state *state, crypto_job *job, int *length) {
+    uint32_t block = state->match, first, count;
+    uint32_t block_length = delta_block_length(state->block_size, state->basis_size, block);
+    int extended = 0;
+
+    if (state->last_copy >= 0) {
+        unsigned char *op = job->input + state->last_copy;
+
+        memcpy(&first, op + 1, 4);
+        memcpy(&count, op + 5, 4);
+
+        if (ntohl(first) + ntohl(count) == block) {
+            count = htonl(ntohl(count) + 1);
+
+            memcpy(op + 5, &count, 4);
+
+            extended = 1;
+        }
+    }
+
+    if (!extended) {
+        if (*length + DELTA_COPY_LENGTH > state->stream.chunk_size) return 0;
+
+        unsigned char *op = job->input + *length;
+
+        first = htonl(block);
+        count = htonl(1);
+        op[0] = DELTA_OP_COPY;
+
+        memcpy(op + 1, &first, 4);
+        memcpy(op + 5, &count, 4);
+
+        state->last_copy = *length;
+        *length += DELTA_COPY_LENGTH;
+    }
+
+    state->position += block_length;
+    state->literal_start = state->position;
+    state->emitted += block_length;
+    state->reused += block_length;
+    state->next_block = block + 1;
+    state->match = DELTA_NO_BLOCK;
+    state->rolling = 0;
+
+    return 1;
+}
+
+/**
+ * Source stage of the delta sender: fills a DELTA record with instructions. The record offset
+ * is the number of bytes of the file described before it.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Job to fill.
+ * @return         1 if a job was produced, 0 at the end, -1 on failure.
+ */
+int read_delta_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    delta_send_state *state = pipeline->state;
+    int length = 0;
+
+    job->offset = state->emitted;
+    job->flags = RECORD_DELTA;
+    state->last_copy = -1;
+
+    while (1) {
+        uint64_t pending = state->position - state->literal_start;
+
+        // Unmatched bytes go out before the match that ends them, and in pieces while none comes
+        if (pending > 0 && (pending >= DELTA_LITERAL_FLUSH || state->match != DELTA_NO_BLOCK || state->at_end)) {
+            int appended = append_literal(state, job, &length);
+
+            if (appended < 0) return -1;
+            if (appended == 0) break;
+
+            continue;
+        }
+
+        if (state->match != DELTA_NO_BLOCK) {
+            if (!append_copy(state, job, &length)) break;
+
+            continue;
+        }
+
+        if (state->at_end) break;
+        if (match_next(state) < 0) return -1;
+    }
+
+    job->length = length;
+
+    return (length > 0) ? 1 : 0;
+}
+
+/**
+ * Sink stage of the delta sender: sends a DELTA record, then reports the file bytes its
+ * instructions describe, literals as moved and copies as already in place.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Sealed job.
+ * @return         0 on success, -1 on failure.
+ */
+int send_delta_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    delta_send_state *state = pipeline->state;
+    const unsigned char *cursor = job->input, *end = job->input + job->length;
+    uint32_t first, count;
+
+    if (send_chunk(pipeline, job) < 0) return -1;
+
+    while (cursor < end) {
+        if (cursor[0] == DELTA_OP_COPY) {
+            memcpy(&first, cursor + 1, 4);
+            memcpy(&count, cursor + 5, 4);
+
+            uint64_t offset = (uint64_t)ntohl(first) * state->block_size;
+            uint64_t length = (uint64_t)ntohl(count) * state->block_size;
+
+            telemetry_skip((length < state->basis_size - offset) ? length : state->basis_size - offset);
+
+            cursor += DELTA_COPY_LENGTH;
+        }
+        else {
+            memcpy(&count, cursor + 1, 4);
+
+            telemetry_bytes(ntohl(count));
+
+            cursor += DELTA_LITERAL_HEADER + ntohl(count);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Receives the receiver's block signatures, then describes the file as DELTA records of COPY
+ * and LITERAL instructions and sends them in order, followed by an END frame.
+ *
+ * @param in_file    File descriptor of the file being sent.
+ * @param size       Size of the file.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param socket     Socket file descriptor to send data through.
+ * @param session    Negotiated session.
+ * @param threads    Number of crypto worker threads.
+ * @param compress   1 to deflate records that shrink before sealing them.
+ * @param report     Output for the compression totals, or NULL.
+ * @param reused     Output for the bytes the receiver copies from its existing copy.
+ * @return           0 on success, -1 on failure.
+ */
+int encrypt_delta(int in_file, uint64_t size, int chunk_size, int socket, crypto_session *session, int threads, int compress,
+                  compression_report *report, uint64_t *reused) {
+    delta_send_state *state = calloc(1, sizeof(delta_send_state));
+    transfer_pipeline pipeline = {0};
+    int result = -1;
+
+    if (!state) return -1;
+
+    state->stream.chunk_size = chunk_size;
+    state->stream.socket = socket;
+    state->file = in_file;
+    state->size = size;
+    state->match = DELTA_NO_BLOCK;
+
+    if (receive_signatures(state, socket, session, chunk_size) == 0 && build_block_table(state) == 0) {
+        state->window_capacity = DELTA_READ_SIZE + DELTA_LITERAL_FLUSH + 2 * (size_t)state->block_size;
+        state->window = malloc(state->window_capacity);
+    }
+
+    if (state->window) {
+        pipeline.session = session;
+        pipeline.encrypting = 1;
+        pipeline.compress = compress;
+        pipeline.source = read_delta_chunk;
+        pipeline.sink = send_delta_chunk;
+        pipeline.sink_counts = 1;
+        pipeline.state = state;
+
+        result = pipeline_run(&pipeline, threads, chunk_size, chunk_size + RECORD_OVERHEAD);
+
+        if (report) {
+            report->plain_bytes = pipeline.plain_bytes;
+            report->packed_bytes = pipeline.packed_bytes;
+        }
+
+        *reused = state->reused;
+    }
+
+    free(state->weak);
+    free(state->strong);
+    free(state->heads);
+    free(state->chain);
+    free(state->window);
+    free(state);
+
+    if (result < 0) return -1;
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+/**
+ * Appends a range of the existing copy to the new version. copy_file_range() lets the kernel
+ * (or the filesystem, with reflinks) move the bytes; reads and writes take over where it cannot.
+ *
+ * @param state  Receiving state.
+ * @param offset Offset in the existing copy.
+ * @param length Bytes to copy.
+ * @return       0 on success, -1 on failure.
+ */
+int copy_basis(delta_receive_state *state, uint64_t offset, uint64_t length) {
+    loff_t in = offset, out = state->written;
+
+    // The bytes never cross the network, they only count as done
+    telemetry_skip(length);
+
+    while (length > 0 && state->copy_range) {
+        ssize_t count = copy_file_range(state->basis, &in, state->stream.out_file, &out, length, 0);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count == 0) return -1;
+
+        if (count < 0) {
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+
+            state->copy_range = 0;
+        }
+        else {
+            length -= count;
+            state->written += count;
+        }
+    }
+
+    if (length > 0 && !state->buffer && !(state->buffer = malloc(DELTA_READ_SIZE))) return -1;
+
+    while (length > 0) {
+        size_t count = (length < DELTA_READ_SIZE) ? length : DELTA_READ_SIZE;
+
+        if (pread_all(state->basis, state->buffer, count, in) < 0 || pwrite_all(state->stream.out_file, state->buffer, count, out) < 0) return -1;
+
+        in += count;
+        out += count;
+        length -= count;
+        state->written += count;
+    }
+
+    return 0;
+}
+
+/**
+ * Sink stage of the delta receiver: carries out the instructions of a DELTA record.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Opened job.
+ * @return         0 on success, -1 on failure or if an instruction is malformed.
+ */
+int write_delta_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    delta_receive_state *state = pipeline->state;
+    const unsigned char *cursor = job->output, *end = job->output + job->result;
+
+    if (job->flags != RECORD_DELTA || job->offset != state->written) return -1;
+
+    while (cursor < end) {
+        uint32_t first, count;
+
+        if (cursor[0] == DELTA_OP_COPY && end - cursor >= DELTA_COPY_LENGTH) {
+            memcpy(&first, cursor + 1, 4);
+            memcpy(&count, cursor + 5, 4);
+
+            first = ntohl(first);
+            count = ntohl(count);
+
+            if (count == 0 || first >= state->block_count || count > state->block_count - first) return -1;
+
+            uint64_t offset = (uint64_t)first * state->block_size;
+            uint64_t length = (uint64_t)count * state->block_size;
+
+            if (length > state->basis_size - offset) length = state->basis_size - offset;
+            if (length > state->size - state->written || copy_basis(state, offset, length) < 0) return -1;
+
+            cursor += DELTA_COPY_LENGTH;
+        }
+        else if (cursor[0] == DELTA_OP_LITERAL && end - cursor >= DELTA_LITERAL_HEADER) {
+            memcpy(&count, cursor + 1, 4);
+
+            count = ntohl(count);
+
+            if (count > end - cursor - DELTA_LITERAL_HEADER || count > state->size - state->written) return -1;
+            if (pwrite_all(state->stream.out_file, cursor + DELTA_LITERAL_HEADER, count, state->written) < 0) return -1;
+
+            telemetry_bytes(count);
+
+            state->written += count;
+            cursor += DELTA_LITERAL_HEADER + count;
+        }
+        else return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Receives DELTA records until the END frame and rebuilds the new version from them and the
+ * existing copy.
+ *
+ * @param out_file   File descriptor the new version is written to.
+ * @param basis      Existing copy.
+ * @param basis_size Size of the existing copy.
+ * @param block_size Block size the signatures were computed with.
+ * @param size       Size of the new version.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param socket     Socket file descriptor to receive data from.
+ * @param session    Negotiated session.
+ * @param threads    Number of crypto worker threads.
+ * @return           0 if the whole new version was rebuilt, -1 on failure.
+ */
+int decrypt_delta(int out_file, int basis, uint64_t basis_size, uint32_t block_size, uint64_t size, int chunk_size, int socket,
+                  crypto_session *session, int threads) {
+    delta_receive_state state = {0};
+    transfer_pipeline pipeline = {0};
+
+    state.stream.out_file = out_file;
+    state.stream.chunk_size = chunk_size;
+    state.stream.socket = socket;
+    state.basis = basis;
+    state.basis_size = basis_size;
+    state.block_size = block_size;
+    state.block_count = (basis_size + block_size - 1) / block_size;
+    state.size = size;
+    state.copy_range = 1;
+
+    pipeline.session = session;
+    pipeline.encrypting = 0;
+    pipeline.source = receive_chunk;
+    pipeline.sink = write_delta_chunk;
+    pipeline.sink_counts = 1;
+    pipeline.state = &state;
+
+    int result = pipeline_run(&pipeline, threads, chunk_size + RECORD_OVERHEAD, chunk_size);
+
+    free(state.buffer);
+
+    return (result == 0 && state.written == size) ? 0 : -1;
+}
+
+/**
+ * Stream thread of the delta receiver: sends the signatures of the existing copy, rebuilds
+ * the new version from the sender's delta and answers with an ACK.
+ *
+ * @param arg Pointer to a transfer_stream structure whose basis is the existing copy.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *receive_delta(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+    file_metadata *metadata = &stream->metadata;
+    byte_range span = stream_span(metadata);
+    struct stat basis_stat;
+
+    stream->result = -1;
+
+    if (fstat(stream->basis, &basis_stat) == 0 && send_ranges(stream->socket, &span, 1, RESUME_DELTA) == 0) {
+        uint32_t block_size = delta_block_size(basis_stat.st_size);
+
+        stream->result = send_signatures(stream->socket, &stream->session, metadata->chunk_size, stream->basis, basis_stat.st_size, block_size);
+
+        if (stream->result == 0) {
+            stream->result = decrypt_delta(stream->file, stream->basis, basis_stat.st_size, block_size, metadata->size, metadata->chunk_size,
+                                           stream->socket, &stream->session, stream->threads);
+        }
+    }
+
+    send_ack(stream->socket, stream->result);
+
+    return NULL;
+}
@@ -0,0 +1,600 @@
+#include "multicast.h"
+
+#define BC_PORT 52121                           // UDP port receivers answer discovery probes on
+#define BC_DISCOVERY_MSG "DISCOVER_FILE_TRANSFER"
+#define DISCOVERY_GROUP_V4 "239.255.82.86"      // Administratively scoped group every receiver joins
+#define DISCOVERY_GROUP_V6 "ff02::5256"         // Link-local group every receiver joins
+#define DISCOVERY_TIMEOUT 2000                  // Milliseconds to wait for answers at most
+#define DISCOVERY_QUIET 300                     // Milliseconds without a new peer after which the search ends
+#define DISCOVERY_RESEND 250                    // Milliseconds between two rounds of probes
+#define DISCOVERY_ROUNDS 3                      // Rounds of probes, in case a datagram is lost
+#define MAX_INTERFACES 32                       // Interface addresses probed at most
+#define MAX_PEERS 64                            // Peers one search keeps at most
+#define PEER_NAME_LENGTH 256                    // Longest hostname plus its terminator
+#define PEER_CACHE_TTL (15 * 60)                // Seconds a discovered address is trusted without searching again
+#define PEER_CACHE_MAX 256                      // Entries the peer cache keeps at most
+
+// IPv4 address of a network interface that discovery probes go out on
+typedef struct {
+    char name[IFNAMSIZ];        // Interface name
+    int index;                  // Interface index
+    struct in_addr address;     // Address of this interface
+    struct in_addr broadcast;   // Broadcast address of its subnet (when has_broadcast is set)
+    int has_broadcast;          // 1 if the interface supports broadcast
+} discovery_interface;
+
+// Receiver that answered a discovery probe
+typedef struct {
+    char hostname[PEER_NAME_LENGTH];    // Hostname the receiver reported
+    char address[INET_ADDRSTRLEN];      // IPv4 address transfers connect to
+} discovered_peer;
+
+/**
+ * Lists the IPv4 addresses of the interfaces that are up and can broadcast or multicast.
+ * Loopback is only used when asked for by name.
+ *
+ * @param interface_name Only list this interface, or NULL for every interface.
+ * @param interfaces     Output array.
+ * @param max            Size of interfaces.
+ * @return               Number of addresses found, -1 if the interfaces cannot be listed.
+ */
+int list_interfaces(const char *interface_name, discovery_interface *interfaces, int max) {
+    struct ifaddrs *addresses;
+    int count = 0, control = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (control < 0 || getifaddrs(&addresses) < 0) {
+        if (control >= 0) close(control);
+
+        return -1;
+    }
+
+    for (struct ifaddrs *entry = addresses; entry != NULL && count < max; entry = entry->ifa_next) {
+        if (entry->ifa_addr == NULL || entry->ifa_addr->sa_family != AF_INET || !(entry->ifa_flags & IFF_UP)) continue;
+        if (interface_name != NULL && strcmp(entry->ifa_name, interface_name) != 0) continue;
+        if (interface_name == NULL && (entry->ifa_flags & IFF_LOOPBACK)) continue;
+
+        discovery_interface *interface = &interfaces[count];
+        struct ifreq request = {0};
+
+        strncpy(request.ifr_name, entry->ifa_name, IFNAMSIZ - 1);
+
+        if (ioctl(control, SIOCGIFINDEX, &request) < 0) continue;
+
+        memcpy(interface->name, request.ifr_name, IFNAMSIZ);
+
+        interface->index = request.ifr_ifindex;
+        interface->address = ((struct sockaddr_in *)entry->ifa_addr)->sin_addr;
+        interface->has_broadcast = (entry->ifa_flags & IFF_BROADCAST) && entry->ifa_broadaddr != NULL;
+
+        if (interface->has_broadcast) interface->broadcast = ((struct sockaddr_in *)entry->ifa_broadaddr)->sin_addr;
+
+        count++;
+    }
+
+    freeifaddrs(addresses);
+    close(control);
+
+    return count;
+}
+
+/**
+ * Opens the socket a receiver answers probes on: bound to BC_PORT, member of the discovery
+ * group on every interface and told which local address each probe arrived on.
+ *
+ * @param family     AF_INET or AF_INET6.
+ * @param interfaces Interfaces to join the group on.
+ * @param count      Number of interfaces.
+ * @return           The socket, or -1 on failure.
+ */
+int open_discovery_listener(int family, const discovery_interface *interfaces, int count) {
+    int listener = socket(family, SOCK_DGRAM, 0), enable = 1;
+    struct sockaddr_storage address = {0};
+    socklen_t address_length;
+
+    if (listener < 0) return -1;
+
+    if (family == AF_INET) {
+        struct sockaddr_in *address_v4 = (struct sockaddr_in *)&address;
+
+        address_v4->sin_family = AF_INET;
+        address_v4->sin_port = htons(BC_PORT);
+        address_v4->sin_addr.s_addr = htonl(INADDR_ANY);
+        address_length = sizeof(*address_v4);
+
+        setsockopt(listener, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable));
+    }
+    else {
+        struct sockaddr_in6 *address_v6 = (struct sockaddr_in6 *)&address;
+
+        address_v6->sin6_family = AF_INET6;
+        address_v6->sin6_port = htons(BC_PORT);
+        address_v6->sin6_addr = in6addr_any;
+        address_length = sizeof(*address_v6);
+
+        setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable));
+        setsockopt(listener, IPPROTO_IPV6, IPV6_RECVPKTINFO, &enable, sizeof(enable));
+    }
+
+    if (bind(listener, (struct sockaddr *)&address, address_length) < 0) {
+        close(listener);
+
+        return -1;
+    }
+
+    // Joining fails on interfaces without multicast; broadcast probes still reach them
+    for (int index = 0; index < count; index++) {
+        if (family == AF_INET) {
+            struct ip_mreqn membership = {0};
+
+            inet_pton(AF_INET, DISCOVERY_GROUP_V4, &membership.imr_multiaddr);
+            membership.imr_ifindex = interfaces[index].index;
+
+            setsockopt(listener, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership));
+        }
+        else {
+            struct ipv6_mreq membership = {0};
+
+            inet_pton(AF_INET6, DISCOVERY_GROUP_V6, &membership.ipv6mr_multiaddr);
+            membership.ipv6mr_interface = interfaces[index].index;
+
+            setsockopt(listener, IPPROTO_IPV6, IPV6_JOIN_GROUP, &membership, sizeof(membership));
+        }
+    }
+
+    return listener;
+}
+
+/**
+ * Builds the start of every discovery answer once, so probes are answered without looking
+ * up the hostname again. Older senders print the answer as it is.
+ *
+ * @param reply  Output buffer.
+ * @param length Size of reply.
+ */
+void discovery_reply_prefix(char *reply, size_t length) {
+    char hostname[PEER_NAME_LENGTH] = {0};
+
+    gethostname(hostname, sizeof(hostname) - 1);
+
+    snprintf(reply, length, "hostname: \e[36m%s\e[0m | ip_address: \e[36m", hostname);
+}
+
+/**
+ * Reads one datagram from a discovery socket and, if it is a probe, answers with this
+ * device's hostname and the IPv4 address the prober can connect to.
+ *
+ * @param listener     Socket from open_discovery_listener().
+ * @param reply_prefix Start of the answer from discovery_reply_prefix().
+ * @param interfaces   Interfaces of this device, to find the IPv4 address behind an IPv6 probe.
+ * @param count        Number of interfaces.
+ * @param client       Output for the address of the prober.
+ * @return             1 if a probe was answered, 0 if the datagram was ignored, -1 if nothing could be read.
+ */
+int answer_discovery(int listener, const char *reply_prefix, const discovery_interface *interfaces, int count, struct sockaddr_storage *client) {
+    char buffer[BUFFER_SIZE], control[256], local[INET_ADDRSTRLEN] = "";
+    struct iovec vector = {buffer, sizeof(buffer)};
+    struct msghdr message = {0};
+
+    message.msg_name = client;
+    message.msg_namelen = sizeof(*client);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(listener, &message, 0);
+
+    if (received < 0) return -1;
+
+    // Check if the message matches the expected discovery string
+    if (received != (ssize_t)strlen(BC_DISCOVERY_MSG) || memcmp(buffer, BC_DISCOVERY_MSG, received) != 0) return 0;
+
+    // Answer with the address the probe arrived on, which is the one the prober can reach
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(header);
+
+            inet_ntop(AF_INET, &info->ipi_spec_dst, local, sizeof(local));
+        }
+        else if (header->cmsg_level == IPPROTO_IPV6 && header->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *info = (struct in6_pktinfo *)CMSG_DATA(header);
+
+            for (int index = 0; index < count && local[0] == '\0'; index++) {
+                if (interfaces[index].index == (int)info->ipi6_ifindex) inet_ntop(AF_INET, &interfaces[index].address, local, sizeof(local));
+            }
+        }
+    }
+
+    char reply[BUFFER_SIZE];
+    int length = snprintf(reply, sizeof(reply), "%s%s\e[0m", reply_prefix, (local[0] != '\0') ? local : "unknown");
+
+    sendto(listener, reply, length, 0, (struct sockaddr *)client, message.msg_namelen);
+
+    return 1;
+}
+
+/**
+ * Copies the text between a marker and the next colour reset out of a discovery answer.
+ *
+ * @param reply  Answer, NUL-terminated.
+ * @param marker Text that precedes the field.
+ * @param out    Output buffer.
+ * @param length Size of out.
+ * @return       0 on success, -1 if the field is missing or too long.
+ */
+int reply_field(const char *reply, const char *marker, char *out, size_t length) {
+    const char *start = strstr(reply, marker);
+
+    if (start == NULL) return -1;
+
+    start += strlen(marker);
+
+    const char *end = strstr(start, "\e[0m");
+
+    if (end == NULL || end == start || (size_t)(end - start) >= length) return -1;
+
+    memcpy(out, start, end - start);
+    out[end - start] = '\0';
+
+    return 0;
+}
+
+/**
+ * Parses a discovery answer from a receiver of this or an older version.
+ *
+ * @param reply  Answer, NUL-terminated.
+ * @param sender Address the answer came from.
+ * @param peer   Output for the peer.
+ * @return       0 on success, -1 if the answer is malformed or carries no usable IPv4 address.
+ */
+int parse_discovery_reply(const char *reply, const struct sockaddr_storage *sender, discovered_peer *peer) {
+    char reported[INET6_ADDRSTRLEN];
+    struct in_addr address;
+
+    if (reply_field(reply, "hostname: \e[36m", peer->hostname, sizeof(peer->hostname)) < 0) return -1;
+
+    // The hostname ends up on the terminal and in the cache, so only plain hostname characters pass
+    for (const char *cursor = peer->hostname; *cursor; cursor++) {
+        if (!((*cursor >= 'a' && *cursor <= 'z') || (*cursor >= 'A' && *cursor <= 'Z') || (*cursor >= '0' && *cursor <= '9') ||
+              *cursor == '-' || *cursor == '.' || *cursor == '_')) return -1;
+    }
+
+    // Older receivers report the prober's address, so an IPv4 answer is taken from its source
+    if (sender->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)sender)->sin_addr, peer->address, sizeof(peer->address));
+
+        return 0;
+    }
+
+    if (reply_field(reply, "ip_address: \e[36m", reported, sizeof(reported)) < 0 || inet_pton(AF_INET, reported, &address) != 1) return -1;
+
+    inet_ntop(AF_INET, &address, peer->address, sizeof(peer->address));
+
+    return 0;
+}
+
+/**
+ * Sends one round of probes on every interface: to its broadcast address, to the IPv4
+ * group and to the IPv6 group.
+ *
+ * @param socket_v4  IPv4 socket with SO_BROADCAST set.
+ * @param socket_v6  IPv6 socket, or -1.
+ * @param interfaces Interfaces to probe.
+ * @param count      Number of interfaces.
+ */
+void send_probes(int socket_v4, int socket_v6, const discovery_interface *interfaces, int count) {
+    size_t length = strlen(BC_DISCOVERY_MSG);
+
+    for (int index = 0; index < count; index++) {
+        const discovery_interface *interface = &interfaces[index];
+        struct sockaddr_in target = {0};
+        struct ip_mreqn outgoing = {0};
+
+        target.sin_family = AF_INET;
+        target.sin_port = htons(BC_PORT);
+
+        if (interface->has_broadcast) {
+            target.sin_addr = interface->broadcast;
+
+            sendto(socket_v4, BC_DISCOVERY_MSG, length, 0, (struct sockaddr *)&target, sizeof(target));
+        }
+
+        outgoing.imr_ifindex = interface->index;
+        inet_pton(AF_INET, DISCOVERY_GROUP_V4, &target.sin_addr);
+
+        if (setsockopt(socket_v4, IPPROTO_IP, IP_MULTICAST_IF, &outgoing, sizeof(outgoing)) == 0) {
+            sendto(socket_v4, BC_DISCOVERY_MSG, length, 0, (struct sockaddr *)&target, sizeof(target));
+        }
+
+        if (socket_v6 < 0) continue;
+
+        struct sockaddr_in6 target_v6 = {0};
+
+        target_v6.sin6_family = AF_INET6;
+        target_v6.sin6_port = htons(BC_PORT);
+        target_v6.sin6_scope_id = interface->index;
+        inet_pton(AF_INET6, DISCOVERY_GROUP_V6, &target_v6.sin6_addr);
+
+        if (setsockopt(socket_v6, IPPROTO_IPV6, IPV6_MULTICAST_IF, &interface->index, sizeof(interface->index)) == 0) {
+            sendto(socket_v6, BC_DISCOVERY_MSG, length, 0, (struct sockaddr *)&target_v6, sizeof(target_v6));
+        }
+    }
+}
+
+/**
+ * Probes every interface at once and collects the receivers that answer. The search ends
+ * DISCOVERY_QUIET ms after the last new peer, as soon as the wanted peer answers, or after
+ * DISCOVERY_TIMEOUT ms.
+ *
+ * @param interface_name Only probe this interface, or NULL for every interface.
+ * @param wanted         Hostname to stop at, or NULL to collect every peer.
+ * @param peers          Output array.
+ * @param max            Size of peers.
+ * @param show           1 to print every peer as it answers.
+ * @return               Number of peers found, -1 if no interface could be probed.
+ */
+int discover_peers(const char *interface_name, const char *wanted, discovered_peer *peers, int max, int show) {
+    discovery_interface interfaces[MAX_INTERFACES];
+    int interface_count = list_interfaces(interface_name, interfaces, MAX_INTERFACES);
+    struct pollfd sockets[2] = {{socket(AF_INET, SOCK_DGRAM, 0), POLLIN, 0}, {socket(AF_INET6, SOCK_DGRAM, 0), POLLIN, 0}};
+    int enable = 1, rounds = 0, count = 0, found = 0;
+
+    if (interface_count <= 0 || sockets[0].fd < 0) {
+        if (sockets[0].fd >= 0) close(sockets[0].fd);
+        if (sockets[1].fd >= 0) close(sockets[1].fd);
+
+        return -1;
+    }
+
+    setsockopt(sockets[0].fd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+
+    uint64_t started = monotonic_ns() / 1000000, deadline = started + DISCOVERY_TIMEOUT, next_round = started;
+
+    while (!found) {
+        uint64_t now = monotonic_ns() / 1000000;
+
+        if (rounds < DISCOVERY_ROUNDS && now >= next_round) {
+            send_probes(sockets[0].fd, sockets[1].fd, interfaces, interface_count);
+
+            rounds++;
+            next_round = now + DISCOVERY_RESEND;
+        }
+
+        if (now >= deadline) break;
+
+        uint64_t wait = deadline - now;
+
+        if (rounds < DISCOVERY_ROUNDS && next_round - now < wait) wait = next_round - now;
+
+        // A closed IPv6 socket has fd -1, which poll() skips
+        if (poll(sockets, 2, (int)wait) <= 0) continue;
+
+        for (int index = 0; index < 2 && !found; index++) {
+            char buffer[BUFFER_SIZE];
+            struct sockaddr_storage sender;
+            socklen_t sender_length = sizeof(sender);
+            discovered_peer peer;
+
+            if (!(sockets[index].revents & POLLIN)) continue;
+
+            ssize_t received = recvfrom(sockets[index].fd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&sender, &sender_length);
+
+            if (received <= 0) continue;
+
+            buffer[received] = '\0';
+
+            if (parse_discovery_reply(buffer, &sender, &peer) < 0) continue;
+
+            // Every probe round and path answers again, keep each peer once
+            int known = 0;
+
+            for (int other = 0; other < count && !known; other++) {
+                known = (strcmp(peers[other].hostname, peer.hostname) == 0 && strcmp(peers[other].address, peer.address) == 0);
+            }
+
+            if (known || count == max) continue;
+
+            peers[count++] = peer;
+
+            if (show) {
+                printf("\rhostname: \e[36m%s\e[0m | ip_address: \e[36m%s\e[0m\e[K\n", peer.hostname, peer.address);
+                fflush(stdout);
+            }
+
+            // Without a wanted peer, every new peer leaves one quiet period for the next
+            if (wanted != NULL) found = (strcasecmp(peer.hostname, wanted) == 0);
+            else {
+                deadline = monotonic_ns() / 1000000 + DISCOVERY_QUIET;
+
+                if (deadline > started + DISCOVERY_TIMEOUT) deadline = started + DISCOVERY_TIMEOUT;
+            }
+        }
+    }
+
+    close(sockets[0].fd);
+
+    if (sockets[1].fd >= 0) close(sockets[1].fd);
+
+    return count;
+}
+
+/**
+ * Finds the peer cache file, $XDG_CACHE_HOME/bytevalve/peers or ~/.cache/bytevalve/peers,
+ * creating its directory if needed.
+ *
+ * @param path   Output buffer.
+ * @param length Size of path.
+ * @return       0 on success, -1 if there is no cache directory.
+ */
+int peer_cache_path(char *path, size_t length) {
+    const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char parent[PATH_MAX], directory[PATH_MAX];
+
+    if (cache != NULL && *cache == '/') snprintf(parent, sizeof(parent), "%s", cache);
+    else if (home != NULL && *home == '/') snprintf(parent, sizeof(parent), "%s/.cache", home);
+    else return -1;
+
+    if (snprintf(directory, sizeof(directory), "%s/bytevalve", parent) >= (int)sizeof(directory)) return -1;
+    if (mkdir(parent, 0700) < 0 && errno != EEXIST) return -1;
+    if (mkdir(directory, 0700) < 0 && errno != EEXIST) return -1;
+
+    return (snprintf(path, length, "%s/peers", directory) < (int)length) ? 0 : -1;
+}
+
+/**
+ * Reads the peer cache. Every line is "<unix time> <IPv4 address> <hostname>"; malformed and
+ * expired lines are skipped.
+ *
+ * @param path  Cache file.
+ * @param peers Output array.
+ * @param seen  Output for the time every peer was discovered.
+ * @param max   Size of peers and seen.
+ * @return      Number of fresh entries.
+ */
+int read_peer_cache(const char *path, discovered_peer *peers, time_t *seen, int max) {
+    FILE *cache = fopen(path, "r");
+    time_t now = time(NULL);
+    int count = 0;
+
+    if (cache == NULL) return 0;
+
+    while (count < max) {
+        long long discovered;
+        struct in_addr address;
+
+        int fields = fscanf(cache, "%lld %15s %255s", &discovered, peers[count].address, peers[count].hostname);
+
+        if (fields == EOF) break;
+        if (fields != 3) {
+            // Skip the rest of a malformed line
+            int character;
+
+            while ((character = fgetc(cache)) != EOF && character != '\n');
+
+            continue;
+        }
+
+        if (inet_pton(AF_INET, peers[count].address, &address) != 1 || now - discovered > PEER_CACHE_TTL || discovered > now) continue;
+
+        seen[count++] = (time_t)discovered;
+    }
+
+    fclose(cache);
+
+    return count;
+}
+
+/**
+ * Records freshly discovered peers in the cache, replacing older entries of the same
+ * hostnames and dropping expired ones.
+ *
+ * @param peers  Peers found just now.
+ * @param count  Number of peers.
+ * @param forget Hostname to drop from the cache, or NULL.
+ * @return       0 on success, -1 if the cache cannot be written.
+ */
+int update_peer_cache(const discovered_peer *peers, int count, const char *forget) {
+    discovered_peer cached[PEER_CACHE_MAX];
+    time_t seen[PEER_CACHE_MAX];
+    char path[PATH_MAX], temporary[PATH_MAX];
+    time_t now = time(NULL);
+
+    if (peer_cache_path(path, sizeof(path)) < 0) return -1;
+    if (snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) >= (int)sizeof(temporary)) return -1;
+
+    int cached_count = read_peer_cache(path, cached, seen, PEER_CACHE_MAX);
+    FILE *cache = fopen(temporary, "w");
+
+    if (cache == NULL) return -1;
+
+    for (int index = 0; index < count && index < PEER_CACHE_MAX; index++) {
+        fprintf(cache, "%lld %s %s\n", (long long)now, peers[index].address, peers[index].hostname);
+    }
+
+    for (int index = 0; index < cached_count && count + index < PEER_CACHE_MAX; index++) {
+        int replaced = (forget != NULL && strcasecmp(cached[index].hostname, forget) == 0);
+
+        for (int other = 0; other < count && !replaced; other++) replaced = (strcasecmp(cached[index].hostname, peers[other].hostname) == 0);
+
+        if (!replaced) fprintf(cache, "%lld %s %s\n", (long long)seen[index], cached[index].address, cached[index].hostname);
+    }
+
+    // Readers see either the old cache or the new one, never half of it
+    if (fclose(cache) != 0 || rename(temporary, path) < 0) {
+        unlink(temporary);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Turns the destination of -s into an IPv4 address: an address is used as it is, a
+ * hostname comes from the peer cache, from a discovery search that stops at that host,
+ * or from the system resolver, in that order.
+ *
+ * @param name    Address or hostname given by the user.
+ * @param address Output buffer of INET_ADDRSTRLEN bytes.
+ * @param refresh 1 to skip the cache, because its address did not answer.
+ * @return        1 if the address came from the cache, 0 if it was found otherwise, -1 if
+ *                the host cannot be found.
+ */
+int resolve_peer(const char *name, char *address, int refresh) {
+    struct in_addr literal;
+
+    if (inet_pton(AF_INET, name, &literal) == 1) {
+        inet_ntop(AF_INET, &literal, address, INET_ADDRSTRLEN);
+
+        return 0;
+    }
+
+    discovered_peer peers[PEER_CACHE_MAX];
+    time_t seen[PEER_CACHE_MAX];
+    char path[PATH_MAX];
+
+    if (!refresh && peer_cache_path(path, sizeof(path)) == 0) {
+        int count = read_peer_cache(path, peers, seen, PEER_CACHE_MAX);
+
+        for (int index = 0; index < count; index++) {
+            if (strcasecmp(peers[index].hostname, name) != 0) continue;
+
+            memcpy(address, peers[index].address, INET_ADDRSTRLEN);
+
+            return 1;
+        }
+    }
+
+    printf("\e[33mLooking for %s on the network...\e[0m", name);
+    fflush(stdout);
+
+    // Every peer that answers is worth remembering, not only the one asked for
+    int count = discover_peers(NULL, name, peers, MAX_PEERS, 0), found = 0;
+
+    for (int index = 0; index < count && !found; index++) {
+        if (strcasecmp(peers[index].hostname, name) != 0) continue;
+
+        memcpy(address, peers[index].address, INET_ADDRSTRLEN);
+
+        found = 1;
+    }
+
+    printf("\r\e[K");
+    fflush(stdout);
+
+    if (count > 0 || refresh) update_peer_cache(peers, (count > 0) ? count : 0, (found) ? NULL : name);
+    if (found) return 0;
+
+    // Not a ByteValve receiver nearby, it may still be a name the resolver knows
+    struct addrinfo hints = {0}, *result;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(name, NULL, &hints, &result) != 0) return -1;
+
+    inet_ntop(AF_INET, &((struct sockaddr_in *)result->ai_addr)->sin_addr, address, INET_ADDRSTRLEN);
+    freeaddrinfo(result);
+
+    return 0;
+}
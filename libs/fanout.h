@@ -0,0 +1,961 @@
+#include "postman.h"
+
+#define FANOUT_QUEUE_RECORDS 64                         // Records a receiver may fall behind before it continues on its own
+#define FANOUT_POOL_RECORDS (2 * FANOUT_QUEUE_RECORDS)  // Shared records: a queue for the receivers keeping up, one for those leaving
+
+// A sealed DATA frame shared by every receiver that still has to send it
+typedef struct fanout_record {
+    _Atomic int references;         // Receivers yet to send it, plus the sink while it deals it out
+    uint64_t offset;                // File offset of the chunk
+    size_t length;                  // Frame header plus record
+    unsigned char *data;            // Frame bytes
+    struct fanout_record *next;     // Next free record
+} fanout_record;
+
+struct fanout_state;
+
+// One receiver of a fan-out
+typedef struct {
+    char name[PEER_NAME_LENGTH];        // Destination shown to the user
+    char lookup[PEER_NAME_LENGTH];      // Address or hostname the destination is resolved from
+    transfer_stream stream;             // Connection, session, metadata and ranges
+    struct fanout_state *state;         // Fan-out the receiver belongs to
+    uint32_t range_index;               // Range cursor of the sink
+    spsc_ring queue;                    // Sink -> sending thread: shared records in file order
+    _Atomic int backlog;                // Records queued and not sent yet
+    _Atomic int detached;               // Set once the receiver stopped taking shared records
+    _Atomic int failed;                 // Set by the sending thread when the connection broke
+    uint64_t detach_offset;             // First record the sink did not queue (written before detached)
+    int connected;                      // 1 once the stream is open and its ranges arrived
+    int caught_up;                      // 1 if the receiver fell behind and got the rest on its own
+    int unicast;                        // 1 if a multicast receiver without multicast got the file over its connection
+    int tcp_repair;                     // 1 if the datagrams it lacked after the last repair round came over its connection
+} fanout_target;
+
+// State of a fan-out. The source stage is the sender's, so its state comes first.
+typedef struct fanout_state {
+    send_state source;                  // Reads the chunks any receiver needs
+    int file;                           // File being sent
+    int compress;                       // 1 if the shared records are deflated
+    int engine;                         // IO_ENGINE_* of the receivers served on their own
+    crypto_session content;             // Session of the content key every shared record is sealed with
+    fanout_target *targets;             // Receivers
+    int target_count;                   // Number of receivers
+    fanout_record records[FANOUT_POOL_RECORDS];
+    unsigned char *memory;              // Storage of every record
+    size_t memory_size;                 // Size of memory
+    fanout_record *free_records;        // Records nobody holds
+    pthread_mutex_t lock;               // Guards free_records
+    pthread_cond_t returned;            // Signalled when a record comes back
+    pthread_cond_t progress;            // Signalled when a receiver sent a record while the sink waits
+    _Atomic int sink_waiting;           // Set while the sink waits for the receivers to catch up
+    fanout_record end_marker;           // Queued to every receiver after the last record
+    int shared_result;                  // Result of the shared pass, set before the end markers
+    uint64_t datagrams;                 // Multicast: datagrams sent, parity included
+    uint64_t parity_datagrams;          // Multicast: parity datagrams among them
+    int repair_rounds;                  // Multicast: rounds that repaired what receivers lacked
+} fanout_state;
+
+/**
+ * Takes a free shared record, waiting until a receiver hands one back.
+ *
+ * @param state Fan-out state.
+ * @return      The record, holding one reference for the caller.
+ */
+fanout_record *fanout_take(fanout_state *state) {
+    pthread_mutex_lock(&state->lock);
+
+    while (state->free_records == NULL) pthread_cond_wait(&state->returned, &state->lock);
+
+    fanout_record *record = state->free_records;
+
+    state->free_records = record->next;
+
+    pthread_mutex_unlock(&state->lock);
+
+    record->references = 1;
+
+    return record;
+}
+
+/**
+ * Drops one reference to a shared record and frees it with the last one.
+ *
+ * @param state  Fan-out state.
+ * @param record Record to release.
+ */
+void fanout_release(fanout_state *state, fanout_record *record) {
+    if (atomic_fetch_sub(&record->references, 1) != 1) return;
+
+    pthread_mutex_lock(&state->lock);
+
+    record->next = state->free_records;
+    state->free_records = record;
+
+    pthread_cond_signal(&state->returned);
+    pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Tells whether a receiver asked for the chunk at an offset. Chunks arrive in file order, so
+ * the receiver's ranges are walked with a cursor.
+ *
+ * @param target Receiver.
+ * @param offset Offset of the chunk.
+ * @return       1 if the chunk is in one of its ranges, 0 otherwise.
+ */
+int target_wants(fanout_target *target, uint64_t offset) {
+    const transfer_stream *stream = &target->stream;
+
+    while (target->range_index < stream->range_count &&
+           stream->ranges[target->range_index].offset + stream->ranges[target->range_index].length <= offset) target->range_index++;
+
+    return target->range_index < stream->range_count && stream->ranges[target->range_index].offset <= offset;
+}
+
+/**
+ * Tells whether a receiver still takes the shared records.
+ *
+ * @param target Receiver.
+ * @return       1 if it does, 0 otherwise.
+ */
+int target_attached(const fanout_target *target) {
+    return target->connected && target->stream.metadata.content_keyed && !target->detached && !target->failed;
+}
+
+/**
+ * Finds the smallest backlog of the receivers still taking shared records.
+ *
+ * @param state Fan-out state.
+ * @return      The backlog of the receiver furthest ahead, 0 if none is attached.
+ */
+int leader_backlog(fanout_state *state) {
+    int smallest = -1;
+
+    for (int index = 0; index < state->target_count; index++) {
+        fanout_target *target = &state->targets[index];
+        int backlog = atomic_load(&target->backlog);
+
+        if (target_attached(target) && (smallest < 0 || backlog < smallest)) smallest = backlog;
+    }
+
+    return (smallest < 0) ? 0 : smallest;
+}
+
+/**
+ * Waits while even the receiver furthest ahead is half a queue behind. Then the file is read
+ * and sealed faster than any receiver takes it, which is no reason to detach one of them.
+ *
+ * @param state Fan-out state (sink thread).
+ */
+void wait_for_leader(fanout_state *state) {
+    while (leader_backlog(state) >= FANOUT_QUEUE_RECORDS / 2) {
+        pthread_mutex_lock(&state->lock);
+
+        state->sink_waiting = 1;
+
+        // Re-check after announcing the wait, so a record sent in between cannot be missed
+        if (leader_backlog(state) >= FANOUT_QUEUE_RECORDS / 2) pthread_cond_wait(&state->progress, &state->lock);
+
+        state->sink_waiting = 0;
+
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/**
+ * Sink stage of a fan-out: copies a sealed record once into a shared frame and queues it to
+ * every receiver that asked for the chunk. A receiver whose queue is full while another one
+ * keeps up is detached instead of holding back the others.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Sealed job.
+ * @return         0 on success, -1 once no receiver takes the shared records any more.
+ */
+int fan_out_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    fanout_state *state = (fanout_state *)pipeline->state;
+    fanout_record *record = NULL;
+    int attached = 0, queued = 0;
+
+    wait_for_leader(state);
+
+    for (int index = 0; index < state->target_count; index++) {
+        fanout_target *target = &state->targets[index];
+
+        if (!target_attached(target)) continue;
+
+        attached++;
+
+        if (!target_wants(target, job->offset)) continue;
+
+        if (atomic_load(&target->backlog) >= FANOUT_QUEUE_RECORDS) {
+            target->detach_offset = job->offset;
+            target->detached = 1;
+
+            continue;
+        }
+
+        if (!record) {
+            record = fanout_take(state);
+
+            put_frame_header(job->output - JOB_HEADROOM, FRAME_DATA, 0, job->result);
+
+            record->offset = job->offset;
+            record->length = job->result + JOB_HEADROOM;
+
+            memcpy(record->data, job->output - JOB_HEADROOM, record->length);
+        }
+
+        atomic_fetch_add(&record->references, 1);
+        atomic_fetch_add(&target->backlog, 1);
+
+        ring_push(&target->queue, record);
+
+        queued++;
+    }
+
+    if (record) fanout_release(state, record);
+
+    // The pipeline counts the chunk once, every further receiver moves it again
+    if (queued > 1) telemetry_bytes((uint64_t)job->length * (queued - 1));
+
+    return (attached > 0) ? 0 : -1;
+}
+
+/**
+ * Sends a receiver the parts of its ranges from an offset on, read and sealed for it alone.
+ * Receivers with a content key keep it, older ones get records of their own session.
+ *
+ * @param target Receiver whose ranges are known.
+ * @param from   First offset still to send (chunk-aligned).
+ * @return       0 on success, -1 on failure.
+ */
+int send_remaining(fanout_target *target, uint64_t from) {
+    transfer_stream *stream = &target->stream;
+    byte_range *ranges = malloc((stream->range_count + 1) * sizeof(byte_range));
+    crypto_session *session = (stream->metadata.content_keyed) ? &target->state->content : &stream->session;
+    uint32_t count = 0;
+
+    if (!ranges) return -1;
+
+    for (uint32_t index = 0; index < stream->range_count; index++) {
+        uint64_t start = stream->ranges[index].offset, end = start + stream->ranges[index].length;
+
+        if (end <= from) continue;
+
+        ranges[count].offset = (start > from) ? start : from;
+        ranges[count].length = end - ranges[count].offset;
+        count++;
+    }
+
+    int result = encrypt_file(target->state->file, ranges, count, stream->metadata.chunk_size, stream->socket, session, 1, target->state->engine,
+                              stream_compresses(stream), NULL, NULL);
+
+    free(ranges);
+
+    return result;
+}
+
+/**
+ * Sending thread of one receiver: sends the shared records queued to it, or everything on its
+ * own if it cannot take them, then waits for its ACK. Once detached it drops what is still
+ * queued and continues from the first record it did not send.
+ *
+ * @param arg Pointer to a fanout_target structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *fanout_sender(void *arg) {
+    fanout_target *target = (fanout_target *)arg;
+    fanout_state *state = target->state;
+    transfer_stream *stream = &target->stream;
+    uint64_t resume = UINT64_MAX;
+    int result = 0;
+
+    if (!stream->metadata.content_keyed) result = send_remaining(target, 0);
+    else {
+        while (1) {
+            fanout_record *record;
+
+            if (target->detached && !target->failed) {
+                while ((record = ring_try_pop(&target->queue)) != NULL && record != &state->end_marker) {
+                    if (resume == UINT64_MAX) resume = record->offset;
+
+                    fanout_release(state, record);
+                }
+
+                break;
+            }
+
+            // A broken connection keeps draining until the end, the sink may still be queueing to it
+            if ((record = ring_pop(&target->queue)) == &state->end_marker) break;
+
+            if (!target->failed) {
+                uint64_t clock = telemetry_clock();
+
+                if (send_all(stream->socket, record->data, record->length) < 0) target->failed = 1;
+
+                telemetry_stage(STAGE_NETWORK, clock);
+            }
+
+            atomic_fetch_sub(&target->backlog, 1);
+            fanout_release(state, record);
+
+            if (state->sink_waiting) {
+                pthread_mutex_lock(&state->lock);
+                pthread_cond_signal(&state->progress);
+                pthread_mutex_unlock(&state->lock);
+            }
+        }
+
+        if (target->failed) result = -1;
+        else if (target->detached) {
+            target->caught_up = 1;
+
+            result = send_remaining(target, (resume != UINT64_MAX) ? resume : target->detach_offset);
+        }
+        else if (state->shared_result < 0) result = -1;
+        else result = send_frame(stream->socket, FRAME_END, 0, NULL, 0);
+    }
+
+    if (result == 0) result = receive_ack(stream->socket);
+
+    stream->result = result;
+
+    return NULL;
+}
+
+/**
+ * Sending thread of a receiver served on its own: sends its ranges, then waits for its ACK.
+ *
+ * @param arg Pointer to a fanout_target structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *serve_alone(void *arg) {
+    fanout_target *target = (fanout_target *)arg;
+    int result = send_remaining(target, 0);
+
+    if (result == 0) result = receive_ack(target->stream.socket);
+
+    target->stream.result = result;
+
+    return NULL;
+}
+
+/**
+ * Compares two ranges by offset, for qsort().
+ */
+int compare_ranges(const void *first, const void *second) {
+    const byte_range *a = first, *b = second;
+
+    return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+/**
+ * Merges the ranges of every receiver taking shared records into the ranges the shared
+ * pass reads.
+ *
+ * @param state Fan-out state.
+ * @param count Output for the number of merged ranges.
+ * @return      The merged ranges (free with free()), or NULL on failure.
+ */
+byte_range *merge_target_ranges(fanout_state *state, uint32_t *count) {
+    uint32_t total = 0;
+
+    for (int index = 0; index < state->target_count; index++) {
+        if (target_attached(&state->targets[index])) total += state->targets[index].stream.range_count;
+    }
+
+    byte_range *ranges = malloc((total + 1) * sizeof(byte_range));
+
+    if (!ranges) return NULL;
+
+    *count = 0;
+
+    for (int index = 0; index < state->target_count; index++) {
+        transfer_stream *stream = &state->targets[index].stream;
+
+        if (!target_attached(&state->targets[index])) continue;
+
+        memcpy(ranges + *count, stream->ranges, stream->range_count * sizeof(byte_range));
+
+        *count += stream->range_count;
+    }
+
+    qsort(ranges, *count, sizeof(byte_range), compare_ranges);
+
+    uint32_t merged = 0;
+
+    for (uint32_t index = 0; index < *count; index++) {
+        uint64_t end = ranges[index].offset + ranges[index].length;
+
+        if (merged == 0 || ranges[index].offset > ranges[merged - 1].offset + ranges[merged - 1].length) ranges[merged++] = ranges[index];
+        else if (end > ranges[merged - 1].offset + ranges[merged - 1].length) ranges[merged - 1].length = end - ranges[merged - 1].offset;
+    }
+
+    *count = merged;
+
+    return ranges;
+}
+
+/**
+ * Reads and seals the chunks any receiver needs once, and deals the records out to the
+ * receivers' queues. Runs on the calling thread while the sending threads drain the queues.
+ *
+ * @param state   Fan-out state with the targets connected.
+ * @param threads Crypto worker threads.
+ * @param tree    Tree hash to record the chunks in, or NULL.
+ * @return        0 on success, -1 on failure.
+ */
+int fan_out_file(fanout_state *state, int threads, tree_digest *tree) {
+    transfer_pipeline pipeline = {0};
+    uint32_t range_count = 0;
+    byte_range *ranges = merge_target_ranges(state, &range_count);
+    int result;
+
+    if (!ranges) return -1;
+
+    state->source.in_file = state->file;
+    state->source.ranges = ranges;
+    state->source.range_count = range_count;
+    state->source.chunk_size = state->targets[0].stream.metadata.chunk_size;
+    state->source.socket = -1;
+    state->source.read_uring = (state->engine == IO_ENGINE_URING);
+    state->source.read_ring.fd = state->source.send_ring.fd = -1;
+
+    pipeline.session = &state->content;
+    pipeline.encrypting = 1;
+    pipeline.digest_chunks = (tree != NULL);
+    pipeline.tree = tree;
+    pipeline.compress = state->compress;
+    pipeline.sink = fan_out_chunk;
+    pipeline.state = state;
+
+    if (state->engine == IO_ENGINE_URING) pipeline.batch_source = read_chunks;
+    else pipeline.source = read_chunk;
+
+    result = pipeline_run(&pipeline, threads, state->source.chunk_size, state->source.chunk_size + RECORD_OVERHEAD);
+
+    io_ring_free(&state->source.read_ring);
+    free(ranges);
+
+    return result;
+}
+
+/**
+ * Sends a file to the receivers that joined its multicast group: one round of datagrams over
+ * the whole file, then repair rounds of whatever any receiver still lacks. What a receiver
+ * lacks after MULTICAST_ROUNDS repairs follows over its own connection. Receivers that cannot
+ * take datagrams get the whole file over their connection meanwhile.
+ *
+ * @param state    Fan-out state with the targets connected.
+ * @param metadata Metadata every receiver got, with the multicast group set.
+ * @param rate     Mbit/s the datagrams are paced to.
+ */
+void multicast_file(fanout_state *state, const file_metadata *metadata, int rate) {
+    multicast_sender sender;
+    int result = multicast_sender_open(&sender, state->file, metadata, &state->content, rate);
+
+    for (int index = 0; index < state->target_count; index++) {
+        fanout_target *target = &state->targets[index];
+        transfer_stream *stream = &target->stream;
+
+        if (!target->connected) continue;
+
+        if (stream->metadata.multicast_group != 0) {
+            if (result < 0 || multicast_add_path(&sender, stream->socket) < 0) target->failed = 1;
+
+            continue;
+        }
+
+        // Out of the rounds, but served at the same time
+        target->unicast = 1;
+        target->detached = 1;
+
+        if (pthread_create(&stream->thread, NULL, serve_alone, target) != 0) {
+            stream->thread = 0;
+            stream->result = -1;
+        }
+    }
+
+    for (int round = 0; result == 0; round++) {
+        uint32_t range_count = 0;
+        byte_range *ranges = merge_target_ranges(state, &range_count);
+
+        if (!ranges) {
+            result = -1;
+            break;
+        }
+
+        if (range_count == 0 || round > MULTICAST_ROUNDS) {
+            free(ranges);
+            break;
+        }
+
+        // A receiver that lost datagrams was overrun, so every repair goes at half the rate before it
+        if (round > 0 && sender.rate > 250000) sender.rate /= 2;
+
+        result = send_round(&sender, ranges, range_count, round == 0);
+
+        free(ranges);
+
+        if (round > 0) state->repair_rounds++;
+
+        // End the round everywhere first, so the receivers drain their sockets at the same time
+        for (int index = 0; result == 0 && index < state->target_count; index++) {
+            fanout_target *target = &state->targets[index];
+
+            if (target_attached(target) && send_frame(target->stream.socket, FRAME_END, END_ROUND, NULL, 0) < 0) target->failed = 1;
+        }
+
+        for (int index = 0; result == 0 && index < state->target_count; index++) {
+            fanout_target *target = &state->targets[index];
+            transfer_stream *stream = &target->stream;
+            uint8_t flags = 0;
+
+            if (!target_attached(target)) continue;
+
+            free(stream->ranges);
+
+            stream->ranges = NULL;
+
+            if (recv_ranges(stream->socket, stream_span(&stream->metadata), &stream->ranges, &stream->range_count, &flags) < 0) target->failed = 1;
+        }
+    }
+
+    state->datagrams = sender.datagrams;
+    state->parity_datagrams = sender.parity_datagrams;
+
+    multicast_sender_close(&sender);
+
+    // What is still missing goes over each connection, then every receiver confirms
+    for (int index = 0; index < state->target_count; index++) {
+        fanout_target *target = &state->targets[index];
+        transfer_stream *stream = &target->stream;
+
+        if (!target->connected || target->unicast) continue;
+
+        if (result < 0 || target->failed) {
+            stream->result = -1;
+            continue;
+        }
+
+        if (stream->range_count == 0) stream->result = send_frame(stream->socket, FRAME_END, 0, NULL, 0);
+        else {
+            target->tcp_repair = 1;
+
+            stream->result = send_frame(stream->socket, FRAME_END, END_UNICAST, NULL, 0);
+
+            if (stream->result == 0) stream->result = send_remaining(target, 0);
+        }
+
+        if (stream->result == 0) stream->result = receive_ack(stream->socket);
+    }
+}
+
+/**
+ * Adds a destination unless it is already listed.
+ *
+ * @param targets Array of MAX_PEERS targets.
+ * @param count   Number of targets, updated in place.
+ * @param name    Name shown to the user.
+ * @param lookup  Address or hostname to resolve.
+ * @return        0 on success, -1 if the array is full.
+ */
+int add_target(fanout_target *targets, int *count, const char *name, const char *lookup) {
+    for (int index = 0; index < *count; index++) {
+        if (strcasecmp(targets[index].lookup, lookup) == 0) return 0;
+    }
+
+    if (*count == MAX_PEERS) return -1;
+
+    snprintf(targets[*count].name, PEER_NAME_LENGTH, "%.*s", PEER_NAME_LENGTH - 1, name);
+    snprintf(targets[*count].lookup, PEER_NAME_LENGTH, "%.*s", PEER_NAME_LENGTH - 1, lookup);
+
+    (*count)++;
+
+    return 0;
+}
+
+/**
+ * Adds the destinations of a comma-separated list. "*" stands for every receiver that
+ * answers discovery on the local networks.
+ *
+ * @param destinations Comma-separated addresses and hostnames.
+ * @param targets      Output array of MAX_PEERS targets.
+ * @return             Number of destinations, -1 if the list is too long.
+ */
+int parse_destinations(const char *destinations, fanout_target *targets) {
+    char *list = strdup(destinations), *cursor = list, *item;
+    int count = 0, result = 0;
+
+    while (list && result == 0 && (item = strsep(&cursor, ",")) != NULL) {
+        if (*item == '\0') continue;
+
+        if (strcmp(item, "*") != 0) {
+            result = add_target(targets, &count, item, item);
+            continue;
+        }
+
+        discovered_peer peers[MAX_PEERS];
+
+        printf("\e[33mSearching for devices...\e[0m");
+        fflush(stdout);
+
+        int peer_count = discover_peers(NULL, NULL, peers, MAX_PEERS, 0);
+
+        printf("\r\e[K");
+        fflush(stdout);
+
+        if (peer_count > 0) update_peer_cache(peers, peer_count, NULL);
+
+        for (int index = 0; result == 0 && index < peer_count; index++) result = add_target(targets, &count, peers[index].hostname, peers[index].address);
+    }
+
+    free(list);
+
+    if (result < 0) {
+        printf("\e[31mCommandError: At most %d receivers can be sent to at once\e[0m\n", MAX_PEERS);
+        fflush(stdout);
+
+        return -1;
+    }
+
+    return count;
+}
+
+/**
+ * Connects to one receiver, sends it the metadata and waits for the ranges it lacks. The
+ * first receiver picks the cipher, the others are only offered that one, so every receiver
+ * can open the shared records.
+ *
+ * @param target   Target with lookup and the stream metadata set.
+ * @param cipher   CIPHER_* every receiver must use, or 0 to let this one choose.
+ * @return         0 on success, -1 on failure (the error has been printed).
+ */
+int connect_target(fanout_target *target, int cipher) {
+    transfer_stream *stream = &target->stream;
+    char address[INET_ADDRSTRLEN];
+    int resolved = resolve_peer(target->lookup, address, 0);
+    int open_return = -3;
+    uint8_t flags = 0;
+
+    stream->session.cipher = cipher;
+
+    if (resolved >= 0) open_return = open_stream(address, PORT, stream);
+
+    // A cached address that no longer answers is looked up again, once
+    if (open_return == -1 && resolved == 1 && resolve_peer(target->lookup, address, 1) >= 0) {
+        stream->session.cipher = cipher;
+
+        open_return = open_stream(address, PORT, stream);
+    }
+
+    if (open_return < 0) {
+        if (resolved < 0) printf("\e[31mConnectionError: Could not find %s on the network\e[0m\n", target->name);
+        else if (open_return == -2) printf("\e[31mProtocolError: %s did not answer the handshake (ByteValve older than " VERSION "?)\e[0m\n", target->name);
+        else printf("\e[31mConnectionError: Failed to connect to %s\e[0m\n", target->name);
+        fflush(stdout);
+
+        return -1;
+    }
+
+    if (recv_ranges(stream->socket, stream_span(&stream->metadata), &stream->ranges, &stream->range_count, &flags) < 0) {
+        printf("\e[31mTransferError: %s did not accept %s\e[0m\n", target->name, stream->metadata.name);
+        fflush(stdout);
+
+        close(stream->socket);
+
+        return -1;
+    }
+
+    target->connected = 1;
+
+    return 0;
+}
+
+/**
+ * Sends a file to several receivers at once. The file is read and sealed once with a fresh
+ * content key that every receiver gets in its own encrypted metadata; the sealed records are
+ * shared and written to every connection. Receivers that fall behind, and older receivers
+ * without content keys, are served on their own. Directories and unencrypted payloads are
+ * sent to one receiver after the other.
+ *
+ * @param destinations Comma-separated addresses and hostnames, "*" for every receiver found.
+ * @param file_path    A string containing the path to the file or directory to be sent.
+ * @param options      Transfer options.
+ * @return             0 if every receiver confirmed the file, -1 otherwise.
+ */
+int send_fanout(const char *destinations, char *file_path, const transfer_options *options) {
+    fanout_target *targets = calloc(MAX_PEERS, sizeof(fanout_target));
+    int target_count = (targets) ? parse_destinations(destinations, targets) : -1;
+    struct stat file_stat;
+    int result = 0;
+
+    if (target_count <= 0) {
+        if (target_count == 0) printf("\e[31mConnectionError: No receivers were found\e[0m\n");
+        fflush(stdout);
+
+        free(targets);
+
+        return -1;
+    }
+
+    // Trees and sendfile() payloads are not sealed in user space, so there is nothing to share
+    if (stat(file_path, &file_stat) == 0 && (S_ISDIR(file_stat.st_mode) || options->payload != PAYLOAD_SEALED)) {
+        for (int index = 0; index < target_count; index++) {
+            printf("\e[33mSending to %s\e[0m\n", targets[index].name);
+            fflush(stdout);
+
+            if (client(targets[index].lookup, file_path, options) < 0) result = -1;
+        }
+
+        free(targets);
+
+        return result;
+    }
+
+    int file = open(file_path, O_RDONLY);
+    char *file_name = strrchr(file_path, '/');
+
+    file_name = (file_name) ? file_name + 1 : file_path;
+
+    if (file < 0 || fstat(file, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) || *file_name == '\0' || strlen(file_name) > MAX_NAME_LENGTH) {
+        printf("\e[31mFileError: Failed to read the file\e[0m\n");
+        fflush(stdout);
+
+        if (file >= 0) close(file);
+
+        free(targets);
+
+        return -1;
+    }
+
+    if (options->delta || options->dedup || options->streams > 1) {
+        printf("\e[33m--delta, --dedup and --streams are not used when sending to several receivers\e[0m\n");
+        fflush(stdout);
+    }
+
+    // Every receiver gets the same metadata, including the content key of this transfer
+    file_metadata metadata = {0};
+
+    memcpy(metadata.name, file_name, strlen(file_name) + 1);
+    RAND_bytes(metadata.transfer_id, TRANSFER_ID_LENGTH);
+    RAND_bytes(metadata.content_key, CONTENT_KEY_LENGTH);
+
+    metadata.size = file_stat.st_size;
+    metadata.mode = file_stat.st_mode & 0777;
+    metadata.chunk_size = DEFAULT_CHUNK_SIZE;
+    metadata.kind = TRANSFER_FILE;
+    metadata.payload = PAYLOAD_SEALED;
+    metadata.verify = (options->verify && metadata.size / metadata.chunk_size < VERIFY_MAX_LEAVES);
+    metadata.content_keyed = 1;
+    metadata.stream_count = 1;
+    metadata.range_length = metadata.size;
+
+    if (options->multicast) {
+        metadata.multicast_group = inet_addr(MULTICAST_GROUP);
+        metadata.multicast_port = MULTICAST_PORT;
+        metadata.multicast_payload = MULTICAST_PAYLOAD;
+    }
+
+    if (source_identity(&file_stat, metadata.source_id) < 0) {
+        printf("\e[31mFileError: Failed to identify the file\e[0m\n");
+        fflush(stdout);
+
+        close(file);
+        free(targets);
+
+        return -1;
+    }
+
+    fanout_state state = {0};
+    int cipher = 0, connected = 0, is_verify = 0;
+
+    state.file = file;
+    state.engine = options->io_engine;
+    state.targets = targets;
+    state.target_count = target_count;
+    state.compress = options->compress;
+
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.returned, NULL);
+    pthread_cond_init(&state.progress, NULL);
+
+    for (int index = 0; index < target_count; index++) {
+        fanout_target *target = &targets[index];
+
+        target->state = &state;
+        target->stream.metadata = metadata;
+        target->stream.file = file;
+        target->stream.compress = options->compress;
+
+        if (ring_init(&target->queue, FANOUT_QUEUE_RECORDS + 1) < 0 || connect_target(target, cipher) < 0) {
+            result = -1;
+            continue;
+        }
+
+        cipher = target->stream.session.cipher;
+        connected++;
+
+        if (target->stream.metadata.verify) is_verify = 1;
+
+        // Shared records are only deflated if every receiver taking them can inflate them
+        if (target->stream.metadata.content_keyed && !stream_compresses(&target->stream)) state.compress = 0;
+    }
+
+    metadata.cipher = cipher;
+
+    content_session(&metadata, 1, &state.content);
+    OPENSSL_cleanse(metadata.content_key, CONTENT_KEY_LENGTH);
+
+    // One buffer per shared record, each big enough for a frame around a full chunk
+    size_t record_size = FRAME_HEADER_LENGTH + metadata.chunk_size + RECORD_OVERHEAD;
+
+    state.memory = (connected > 0 && !options->multicast) ? allocate_buffers(record_size * FANOUT_POOL_RECORDS, &state.memory_size) : NULL;
+
+    for (int index = 0; state.memory && index < FANOUT_POOL_RECORDS; index++) {
+        state.records[index].data = state.memory + (size_t)index * record_size;
+        state.records[index].references = 1;
+
+        fanout_release(&state, &state.records[index]);
+    }
+
+    transfer_telemetry telemetry;
+    tree_digest tree = {0};
+    unsigned char root[DIGEST_LENGTH];
+
+    if (is_verify && tree_digest_init(&tree, metadata.size, metadata.chunk_size) < 0) {
+        for (int index = 0; index < target_count; index++) targets[index].stream.metadata.verify = 0;
+
+        is_verify = 0;
+    }
+
+    // Multicast moves the file once for all receivers taking datagrams
+    int copies = (connected > 0) ? connected : 1;
+
+    if (options->multicast) {
+        copies = 0;
+
+        for (int index = 0; index < target_count; index++) {
+            if (targets[index].connected && targets[index].stream.metadata.multicast_group == 0) copies++;
+        }
+
+        copies += (copies < connected) ? 1 : 0;
+    }
+
+    telemetry_start(&telemetry, "Sending", metadata.size * (copies > 0 ? copies : 1), 1);
+
+    // Receivers that already hold parts of the file count them as done
+    for (int index = 0; index < target_count; index++) {
+        if (targets[index].connected) telemetry_skip(metadata.size - planned_bytes(&targets[index].stream));
+    }
+
+    // Start every sending thread, then read and seal the file once on this thread
+    for (int index = 0; state.memory && index < target_count; index++) {
+        fanout_target *target = &targets[index];
+
+        if (target->connected && pthread_create(&target->stream.thread, NULL, fanout_sender, target) != 0) {
+            target->stream.thread = 0;
+            target->stream.result = -1;
+            target->failed = 1;
+
+            shutdown(target->stream.socket, SHUT_RDWR);
+        }
+    }
+
+    if (state.memory) {
+        state.shared_result = fan_out_file(&state, options->crypto_threads, (is_verify) ? &tree : NULL);
+
+        for (int index = 0; index < target_count; index++) {
+            if (targets[index].stream.thread) ring_push(&targets[index].queue, &state.end_marker);
+        }
+    }
+    else if (options->multicast && connected > 0) multicast_file(&state, &metadata, options->multicast_rate);
+
+    for (int index = 0; index < target_count; index++) {
+        transfer_stream *stream = &targets[index].stream;
+
+        if (!targets[index].connected) continue;
+        if (stream->thread) pthread_join(stream->thread, NULL);
+        else if (!options->multicast || targets[index].unicast) stream->result = -1;
+    }
+
+    // Every receiver compares the same root, computed once
+    int has_root = is_verify && tree_digest_fill(&tree, file, options->crypto_threads) == 0 && tree_digest_root(&tree, root) == 0;
+
+    for (int index = 0; index < target_count; index++) {
+        transfer_stream *stream = &targets[index].stream;
+
+        if (!targets[index].connected || stream->result < 0 || !stream->metadata.verify) continue;
+
+        if (!has_root || send_verify(stream->socket, &stream->session, root) < 0 || receive_ack(stream->socket) < 0) stream->result = -2;
+    }
+
+    telemetry_stop(&telemetry);
+
+    // Report every receiver on its own line
+    int confirmed = 0;
+
+    for (int index = 0; index < target_count; index++) {
+        fanout_target *target = &targets[index];
+        transfer_stream *stream = &target->stream;
+
+        ring_free(&target->queue);
+
+        if (!target->connected) continue;
+
+        if (stream->result == -2) printf("\e[31mIntegrityError: The copy of %s on %s does not match the source\e[0m\n", file_name, target->name);
+        else if (stream->result < 0) printf("\e[31mTransferError: %s did not confirm %s\e[0m\n", target->name, file_name);
+        else {
+            printf("\e[32m%s successfully sent to %s%s\e[0m\n", file_name, target->name,
+                   (target->caught_up) ? " (it fell behind and got the rest on its own)" :
+                   (target->unicast) ? " (over its connection, it does not support multicast)" :
+                   (target->tcp_repair) ? " (the datagrams it lost came over its connection)" :
+                   (!stream->metadata.content_keyed) ? " (sealed for it alone, it does not support content keys)" : "");
+
+            confirmed++;
+        }
+
+        if (stream->result < 0) result = -1;
+
+        close(stream->socket);
+        free(stream->ranges);
+    }
+
+    if (is_verify && has_root && confirmed > 0) {
+        printf("Verified, tree hash ");
+
+        for (int index = 0; index < DIGEST_LENGTH; index++) printf("%02x", root[index]);
+
+        printf("\n");
+    }
+
+    if (options->multicast && state.datagrams > 0) {
+        printf("Multicast %llu datagrams (%llu parity) to %s:%d, %d repair round%s\n", (unsigned long long)state.datagrams,
+               (unsigned long long)state.parity_datagrams, MULTICAST_GROUP, MULTICAST_PORT, state.repair_rounds, (state.repair_rounds == 1) ? "" : "s");
+    }
+
+    if (connected > 0) print_telemetry(&telemetry, "Sent");
+
+    const char *error = (result < 0) ? "TransferError: Not every receiver confirmed the file" : NULL;
+
+    if (options->stats_json != NULL && write_stats_json(options->stats_json, &telemetry, "sender", &metadata, connected, error) < 0) {
+        printf("\e[31mFileError: Failed to write %s\e[0m\n", options->stats_json);
+    }
+
+    fflush(stdout);
+
+    OPENSSL_cleanse(&state.content, sizeof(state.content));
+
+    if (state.memory) munmap(state.memory, state.memory_size);
+    if (is_verify) tree_digest_free(&tree);
+
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.returned);
+    pthread_cond_destroy(&state.progress);
+
+    close(file);
+    free(targets);
+
+    return result;
+}
@@ -1,10 +1,19 @@
+// splice(), F_SETPIPE_SZ, fallocate() and O_DIRECT are GNU extensions
+#define _GNU_SOURCE
+
 // Include required libraries
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/auxv.h>
 
 // postman.h libraries
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <sys/time.h>
@@ -12,6 +21,52 @@
 #include <netinet/in.h>
 #include <linux/if.h>
 
+// compress.h libraries
+#include <zlib.h>
+
+// pipeline.h libraries
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// uring.h libraries
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// zerocopy.h libraries
+#include <sys/sendfile.h>
+
+// ktls.h libraries
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+// tree.h libraries
+#include <dirent.h>
+
+// dedup.h libraries
+#include <sys/file.h>
+
+// discovery.h libraries
+#include <poll.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+
+// session.h libraries
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// daemon.h libraries
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+// bench.h libraries
+#include <linux/perf_event.h>
+
 // security.h libraries
 #include <openssl/rand.h>
-#include <openssl/evp.h>
\ No newline at end of file
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
\ No newline at end of file
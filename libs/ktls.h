@@ -0,0 +1,122 @@
+#include "zerocopy.h"
+
+#define KTLS_IV_LENGTH 12       // TLS 1.3 per-direction IV (salt and explicit part)
+
+// Key and IV of one direction of a kernel TLS connection
+typedef struct {
+    unsigned char key[KEY_LENGTH];
+    unsigned char iv[KTLS_IV_LENGTH];
+} ktls_keys;
+
+/**
+ * Attaches the kernel TLS layer to a connected socket. Data keeps flowing in the clear until
+ * keys are installed, so a failed attach leaves the socket usable.
+ *
+ * @param socket Connected TCP socket.
+ * @return       0 on success, -1 if the kernel has no tls module.
+ */
+int ktls_attach(int socket) {
+    return (setsockopt(socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) ? -1 : 0;
+}
+
+/**
+ * Expands the session secret into one key and IV per direction, so the two directions of a
+ * kernel TLS connection never share a nonce.
+ *
+ * @param session   Negotiated session.
+ * @param to_server Output for the client-to-server direction.
+ * @param to_client Output for the server-to-client direction.
+ * @return          0 on success, -1 on failure.
+ */
+int derive_ktls_keys(const crypto_session *session, ktls_keys *to_server, ktls_keys *to_client) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    unsigned char material[2 * sizeof(ktls_keys)];
+    unsigned char info[] = "bytevalve ktls";
+    size_t material_len = sizeof(material);
+    int result = -1;
+
+    if (context && EVP_PKEY_derive_init(context) == 1 && EVP_PKEY_CTX_set_hkdf_md(context, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(context, session->secret, KEY_LENGTH) == 1 && EVP_PKEY_CTX_add1_hkdf_info(context, info, sizeof(info) - 1) == 1 &&
+        EVP_PKEY_derive(context, material, &material_len) == 1) {
+        memcpy(to_server->key, material, KEY_LENGTH);
+        memcpy(to_server->iv, material + KEY_LENGTH, KTLS_IV_LENGTH);
+        memcpy(to_client->key, material + sizeof(ktls_keys), KEY_LENGTH);
+        memcpy(to_client->iv, material + sizeof(ktls_keys) + KEY_LENGTH, KTLS_IV_LENGTH);
+
+        result = 0;
+    }
+
+    OPENSSL_cleanse(material, sizeof(material));
+    EVP_PKEY_CTX_free(context);
+
+    return result;
+}
+
+/**
+ * Hands the keys of one direction to the kernel as a TLS 1.3 context with the session cipher.
+ *
+ * @param socket    Socket with the tls layer attached.
+ * @param direction TLS_TX or TLS_RX.
+ * @param cipher    One of the CIPHER_* values.
+ * @param keys      Key and IV of the direction.
+ * @return          0 on success, -1 on failure.
+ */
+int ktls_set_direction(int socket, int direction, int cipher, const ktls_keys *keys) {
+    int result;
+
+    if (cipher == CIPHER_AES_256_GCM) {
+        struct tls12_crypto_info_aes_gcm_256 info = {0};
+
+        info.info.version = TLS_1_3_VERSION;
+        info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+
+        // TLS 1.3 builds the nonce from the 4-byte salt followed by the 8-byte IV
+        memcpy(info.salt, keys->iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(info.iv, keys->iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(info.key, keys->key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+
+        result = setsockopt(socket, SOL_TLS, direction, &info, sizeof(info));
+
+        OPENSSL_cleanse(&info, sizeof(info));
+    }
+    else if (cipher == CIPHER_CHACHA20_POLY1305) {
+        struct tls12_crypto_info_chacha20_poly1305 info = {0};
+
+        info.info.version = TLS_1_3_VERSION;
+        info.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+
+        memcpy(info.iv, keys->iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+        memcpy(info.key, keys->key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+
+        result = setsockopt(socket, SOL_TLS, direction, &info, sizeof(info));
+
+        OPENSSL_cleanse(&info, sizeof(info));
+    }
+    else result = -1;
+
+    return (result < 0) ? -1 : 0;
+}
+
+/**
+ * Installs the session keys on a socket. From then on the kernel seals everything this side
+ * sends, including sendfile() data, and opens everything it receives. Both sides must call
+ * this at the same point of the byte stream.
+ *
+ * @param socket    Socket with the tls layer attached.
+ * @param session   Negotiated session.
+ * @param is_client Non-zero on the side that connected.
+ * @return          0 on success, -1 on failure (the connection is unusable).
+ */
+int ktls_install(int socket, const crypto_session *session, int is_client) {
+    ktls_keys to_server, to_client;
+    int result = -1;
+
+    if (derive_ktls_keys(session, &to_server, &to_client) == 0 &&
+        ktls_set_direction(socket, TLS_TX, session->cipher, is_client ? &to_server : &to_client) == 0 &&
+        ktls_set_direction(socket, TLS_RX, session->cipher, is_client ? &to_client : &to_server) == 0) result = 0;
+
+    OPENSSL_cleanse(&to_server, sizeof(to_server));
+    OPENSSL_cleanse(&to_client, sizeof(to_client));
+
+    return result;
+}
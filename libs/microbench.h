@@ -0,0 +1,306 @@
+#include "bench.h"
+
+#define KERNEL_SEAL 0                   // seal_record()
+#define KERNEL_OPEN 1                   // open_record()
+#define KERNEL_DIGEST 2                 // SHA-256 of a chunk, as digest_chunk() computes it
+
+#define MICROBENCH_SECONDS 0.2          // Time every case is measured for
+#define MICROBENCH_WARMUP 0.02          // Time the threads run before measuring starts
+
+// Crypto kernel and cipher a microbenchmark case runs
+typedef struct {
+    const char *name;           // Name of the kernel shown in the results
+    const char *cipher_name;    // Name of the cipher shown in the results
+    int kernel;                 // KERNEL_* value
+    int cipher;                 // CIPHER_* value, 0 for the digest
+} microbench_kernel;
+
+// Axes of the sweep; every combination is one case
+const microbench_kernel microbench_kernels[] = {
+    {"seal", "aes-256-gcm", KERNEL_SEAL, CIPHER_AES_256_GCM},
+    {"seal", "chacha20-poly1305", KERNEL_SEAL, CIPHER_CHACHA20_POLY1305},
+    {"open", "aes-256-gcm", KERNEL_OPEN, CIPHER_AES_256_GCM},
+    {"open", "chacha20-poly1305", KERNEL_OPEN, CIPHER_CHACHA20_POLY1305},
+    {"digest", "sha-256", KERNEL_DIGEST, 0},
+};
+const int microbench_buffer_sizes[] = {1 << 10, 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20};
+
+// Parameters and measurements of one microbenchmark case
+typedef struct {
+    const microbench_kernel *kernel;    // Kernel and cipher
+    int buffer_size;                    // Plaintext bytes per call
+    int reuse;                          // 1 to keep one context per thread, 0 to create one per call
+    int threads;                        // Threads calling the kernel at once
+    int result;                         // 0 on success, -1 if a call failed
+    uint64_t calls;                     // Calls made by all threads while measuring
+    double seconds;                     // Time measured
+} microbench_result;
+
+// State shared by the threads of one case
+typedef struct {
+    microbench_result *run;             // Case being measured
+    crypto_session session;             // Session shared by every thread, as the pipeline's workers share it
+    _Atomic int ready;                  // Threads done preparing their buffers
+    _Atomic int phase;                  // 0 while warming up, 1 while measuring, 2 once time is up
+    _Atomic uint64_t calls;             // Calls made while measuring
+    _Atomic int failed;                 // 1 once a call failed
+} microbench_case;
+
+/**
+ * Makes one call of a kernel.
+ *
+ * @param kernel     Kernel and cipher.
+ * @param context    Cipher or digest context kept by the thread, or NULL to create and free
+ *                   one for this call.
+ * @param session    Session providing the key and the nonces.
+ * @param plain_text Plaintext of length bytes; the open kernel writes it.
+ * @param length     Plaintext bytes.
+ * @param record     Buffer of length + RECORD_OVERHEAD bytes; the seal kernel writes it and
+ *                   the open kernel reads it.
+ * @return           0 on success, -1 on failure.
+ */
+int microbench_call(const microbench_kernel *kernel, void *context, crypto_session *session, unsigned char *plain_text, int length, unsigned char *record) {
+    unsigned char digest[DIGEST_LENGTH];
+    record_header header;
+    int result;
+
+    if (kernel->kernel == KERNEL_DIGEST) {
+        // digest_chunk() sets up a new digest context on every chunk
+        if (context == NULL) return digest_chunk(plain_text, length, digest);
+
+        return (EVP_DigestInit_ex(context, EVP_sha256(), NULL) == 1 && EVP_DigestUpdate(context, plain_text, length) == 1 &&
+                EVP_DigestFinal_ex(context, digest, NULL) == 1) ? 0 : -1;
+    }
+
+    EVP_CIPHER_CTX *cipher_context = (context) ? context : new_record_context(kernel->cipher, kernel->kernel == KERNEL_SEAL);
+
+    if (cipher_context == NULL) return -1;
+
+    if (kernel->kernel == KERNEL_SEAL) result = (seal_record(cipher_context, session, 0, 0, plain_text, length, record) < 0) ? -1 : 0;
+    else result = (open_record(cipher_context, session, record, length + RECORD_OVERHEAD, &header, plain_text) < 0) ? -1 : 0;
+
+    if (context == NULL) EVP_CIPHER_CTX_free(cipher_context);
+
+    return result;
+}
+
+/**
+ * Microbenchmark thread: prepares its buffers, then calls the kernel until time is up and
+ * counts the calls made while measuring.
+ *
+ * @param arg Pointer to the shared microbench_case structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *microbench_worker(void *arg) {
+    microbench_case *shared = (microbench_case *)arg;
+    const microbench_kernel *kernel = shared->run->kernel;
+    int length = shared->run->buffer_size;
+    unsigned char *plain_text = malloc(length);
+    unsigned char *record = malloc(length + RECORD_OVERHEAD);
+    void *context = NULL;
+    uint64_t calls = 0;
+    int result = (plain_text && record && RAND_bytes(plain_text, length) == 1) ? 0 : -1;
+
+    // The open kernel needs a record this session sealed
+    if (result == 0 && kernel->kernel == KERNEL_OPEN) {
+        EVP_CIPHER_CTX *sealing = new_record_context(kernel->cipher, 1);
+
+        if (sealing == NULL || seal_record(sealing, &shared->session, 0, 0, plain_text, length, record) < 0) result = -1;
+
+        EVP_CIPHER_CTX_free(sealing);
+    }
+
+    if (result == 0 && shared->run->reuse) {
+        if (kernel->kernel == KERNEL_DIGEST) context = EVP_MD_CTX_new();
+        else context = new_record_context(kernel->cipher, kernel->kernel == KERNEL_SEAL);
+
+        if (context == NULL) result = -1;
+    }
+
+    atomic_fetch_add(&shared->ready, 1);
+
+    while (result == 0 && atomic_load(&shared->phase) < 2) {
+        int measuring = (atomic_load(&shared->phase) == 1);
+
+        result = microbench_call(kernel, context, &shared->session, plain_text, length, record);
+
+        if (measuring) calls++;
+    }
+
+    if (result < 0) atomic_store(&shared->failed, 1);
+
+    atomic_fetch_add(&shared->calls, calls);
+
+    if (kernel->kernel == KERNEL_DIGEST) EVP_MD_CTX_free(context);
+    else EVP_CIPHER_CTX_free(context);
+
+    free(plain_text);
+    free(record);
+
+    return NULL;
+}
+
+/**
+ * Sleeps for a fraction of a second.
+ *
+ * @param seconds Time to sleep.
+ */
+void microbench_sleep(double seconds) {
+    struct timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+}
+
+/**
+ * Runs one microbenchmark case: waits for its threads to get ready, lets them warm up, then
+ * counts their calls for MICROBENCH_SECONDS.
+ *
+ * @param run Case to run; its measurements are filled in.
+ */
+void microbench_case_run(microbench_result *run) {
+    microbench_case shared = {0};
+    pthread_t *threads = calloc(run->threads, sizeof(pthread_t));
+    int started = 0;
+
+    shared.run = run;
+    shared.session.cipher = run->kernel->cipher;
+
+    // Records sealed here are opened here, so both keys and both nonce prefixes are the same
+    RAND_bytes(shared.session.key, KEY_LENGTH);
+    RAND_bytes(shared.session.nonce_prefix, NONCE_PREFIX_LENGTH);
+    memcpy(shared.session.peer_key, shared.session.key, KEY_LENGTH);
+    memcpy(shared.session.peer_nonce_prefix, shared.session.nonce_prefix, NONCE_PREFIX_LENGTH);
+
+    for (; threads && started < run->threads; started++) {
+        if (pthread_create(&threads[started], NULL, microbench_worker, &shared) != 0) break;
+    }
+
+    if (started < run->threads) atomic_store(&shared.failed, 1);
+
+    // Measure only once every thread has its buffers and contexts
+    while (atomic_load(&shared.ready) < started) microbench_sleep(0.001);
+
+    microbench_sleep(MICROBENCH_WARMUP);
+
+    uint64_t measure_start = monotonic_ns();
+
+    atomic_store(&shared.phase, 1);
+    microbench_sleep(MICROBENCH_SECONDS);
+    atomic_store(&shared.phase, 2);
+
+    run->seconds = (monotonic_ns() - measure_start) / 1e9;
+
+    for (int index = 0; index < started; index++) pthread_join(threads[index], NULL);
+
+    run->calls = atomic_load(&shared.calls);
+    run->result = (atomic_load(&shared.failed) || run->calls == 0) ? -1 : 0;
+
+    free(threads);
+}
+
+/**
+ * Prints one row of the results table.
+ *
+ * @param run Finished case.
+ */
+void print_microbench_row(const microbench_result *run) {
+    char buffer_size[16];
+
+    printf("%-7s %-18s %-9s %-9s %7d ", run->kernel->name, run->kernel->cipher_name, format_bytes(run->buffer_size, buffer_size, sizeof(buffer_size)),
+           (run->reuse) ? "reused" : "per call", run->threads);
+
+    // Time per call is seen by one thread, so it is scaled back by the thread count
+    if (run->result < 0) printf("\e[31m%10s\e[0m\n", "failed");
+    else printf("%10.1f %12.0f\n", (double)run->calls * run->buffer_size / 1e6 / run->seconds, run->seconds * run->threads * 1e9 / run->calls);
+
+    fflush(stdout);
+}
+
+/**
+ * Writes every result as JSON, so runs of two releases can be compared by a script.
+ *
+ * @param path  Output file.
+ * @param runs  Finished cases.
+ * @param count Number of cases.
+ * @return      0 on success, -1 on failure.
+ */
+int write_microbench_json(const char *path, const microbench_result *runs, int count) {
+    FILE *output = fopen(path, "w");
+
+    if (output == NULL) return -1;
+
+    fprintf(output, "{\n  \"protocol_version\": %d,\n  \"cpus\": %ld,\n  \"aes_accelerated\": %s,\n  \"openssl\": \"%s\",\n  \"seconds_per_case\": %.2f,\n  \"results\": [",
+            PROTOCOL_VERSION, sysconf(_SC_NPROCESSORS_ONLN), (cpu_has_aes()) ? "true" : "false", OpenSSL_version(OPENSSL_VERSION), MICROBENCH_SECONDS);
+
+    for (int index = 0; index < count; index++) {
+        const microbench_result *run = &runs[index];
+
+        fprintf(output, "%s\n    {\"kernel\": \"%s\", \"cipher\": \"%s\", \"buffer_size\": %d, \"context\": \"%s\", \"threads\": %d, ", (index > 0) ? "," : "",
+                run->kernel->name, run->kernel->cipher_name, run->buffer_size, (run->reuse) ? "reused" : "per_call", run->threads);
+
+        if (run->result < 0) fprintf(output, "\"ok\": false}");
+        else fprintf(output, "\"ok\": true, \"calls\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.1f, \"ns_per_call\": %.0f}", (unsigned long long)run->calls,
+                     run->seconds, (double)run->calls * run->buffer_size / 1e6 / run->seconds, run->seconds * run->threads * 1e9 / run->calls);
+    }
+
+    fprintf(output, "\n  ]\n}\n");
+
+    return (fclose(output) == 0) ? 0 : -1;
+}
+
+/**
+ * Measures the crypto kernels the pipeline runs on every chunk (sealing, opening and
+ * hashing) for every combination of cipher, buffer size, context reuse and thread count,
+ * and prints the results.
+ *
+ * @param options Options of the run (--crypto-threads and --bench-json are honoured).
+ * @return        0 if every case succeeded, -1 otherwise.
+ */
+int run_microbench(const transfer_options *options) {
+    int thread_counts[2] = {1, options->crypto_threads};
+    int thread_axis = (options->crypto_threads > 1) ? 2 : 1;
+    int case_count = sizeof(microbench_kernels) / sizeof(microbench_kernels[0]) * sizeof(microbench_buffer_sizes) / sizeof(microbench_buffer_sizes[0]) * 2 * thread_axis;
+    microbench_result *runs = calloc(case_count, sizeof(microbench_result));
+    int count = 0, failed = 0;
+
+    if (runs == NULL) return -1;
+
+    printf("\e[33mMeasuring crypto kernels for %.1fs per case (AES acceleration: %s)\e[0m\n\n", MICROBENCH_SECONDS, (cpu_has_aes()) ? "yes" : "no");
+    printf("%-7s %-18s %-9s %-9s %7s %10s %12s\n", "Kernel", "Cipher", "Buffer", "Context", "Threads", "MB/s", "ns/call");
+    fflush(stdout);
+
+    for (size_t kernel = 0; kernel < sizeof(microbench_kernels) / sizeof(microbench_kernels[0]); kernel++) {
+        for (size_t size = 0; size < sizeof(microbench_buffer_sizes) / sizeof(microbench_buffer_sizes[0]); size++) {
+            for (int reuse = 1; reuse >= 0; reuse--) {
+                for (int threads = 0; threads < thread_axis; threads++) {
+                    microbench_result *run = &runs[count++];
+
+                    run->kernel = &microbench_kernels[kernel];
+                    run->buffer_size = microbench_buffer_sizes[size];
+                    run->reuse = reuse;
+                    run->threads = thread_counts[threads];
+
+                    microbench_case_run(run);
+                    print_microbench_row(run);
+
+                    if (run->result < 0) failed = 1;
+                }
+            }
+        }
+    }
+
+    if (options->bench_json != NULL) {
+        if (write_microbench_json(options->bench_json, runs, count) < 0) {
+            printf("\e[31mFileError: Failed to write %s\e[0m\n", options->bench_json);
+
+            failed = 1;
+        }
+        else printf("\nResults written to %s\n", options->bench_json);
+
+        fflush(stdout);
+    }
+
+    free(runs);
+
+    return (failed) ? -1 : 0;
+}
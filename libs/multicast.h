@@ -0,0 +1,665 @@
+#include "dedup.h"
+
+#define MULTICAST_GROUP "239.255.82.87"     // Administratively scoped group the datagrams of a transfer go to
+#define MULTICAST_PORT 52122                // UDP port of the group
+#define MULTICAST_DATAGRAM 1472             // UDP payload that fits a 1500-byte Ethernet frame unfragmented
+#define MULTICAST_TAG_LENGTH 8              // Leading bytes of the transfer id that start every datagram
+#define MULTICAST_PAYLOAD (MULTICAST_DATAGRAM - MULTICAST_TAG_LENGTH - RECORD_OVERHEAD)     // File bytes per datagram
+#define MULTICAST_MAX_PAYLOAD 8192          // Largest payload a receiver accepts (jumbo frames)
+#define MULTICAST_SPAN 16                   // Data datagrams one parity datagram covers
+#define MULTICAST_BATCH 16                  // Datagrams per sendmmsg() call, a burst small enough for switch buffers
+#define MULTICAST_RECEIVE_BATCH 64          // Datagrams per recvmmsg() call
+#define MULTICAST_ROUNDS 4                  // Repair rounds before the rest goes over each connection
+#define MULTICAST_QUIET 20                  // Milliseconds without a datagram after which a round is over
+#define MULTICAST_RECEIVE_BUFFER (16 << 20) // Socket receive buffer a receiver asks for
+#define MULTICAST_MAX_PATHS 16              // Local addresses a sender multicasts from at most
+
+// Sends the datagrams of one multicast transfer. Every datagram is the transfer tag followed by
+// a record sealed with the content key; the record offset numbers the datagram.
+typedef struct {
+    int sockets[MULTICAST_MAX_PATHS];           // One UDP socket per local address receivers were reached from
+    struct in_addr paths[MULTICAST_MAX_PATHS];  // Local address of every socket
+    int path_count;                             // Number of sockets
+    struct sockaddr_in group;                   // Group and port the datagrams go to
+    int file;                                   // File being sent
+    uint64_t size;                              // Size of the file
+    uint32_t payload;                           // File bytes per datagram
+    unsigned char tag[MULTICAST_TAG_LENGTH];    // Start of the transfer id
+    crypto_session *session;                   // Content session every datagram is sealed with
+    EVP_CIPHER_CTX *context;                    // Sealing context
+    uint64_t rate;                              // Bytes per second the datagrams are paced to
+    uint64_t round_started;                     // Monotonic nanoseconds at which the round started
+    uint64_t round_bytes;                       // Datagram bytes sent in the round
+    uint64_t datagrams;                         // Datagrams sent in every round
+    uint64_t parity_datagrams;                  // Parity datagrams among them
+    unsigned char *span;                        // Plaintext of the span being sent
+    unsigned char parity[MULTICAST_MAX_PAYLOAD];    // XOR of the span's payloads so far
+    unsigned char *datagrams_buffer;            // MULTICAST_BATCH datagrams waiting to be sent
+    size_t stride;                              // Bytes between two datagrams in datagrams_buffer
+    struct mmsghdr messages[MULTICAST_BATCH];
+    struct iovec vectors[MULTICAST_BATCH];
+    int queued;                                 // Datagrams waiting in datagrams_buffer
+} multicast_sender;
+
+// Receives the datagrams of one multicast transfer and writes their payload at its offset
+typedef struct {
+    int group;                                  // UDP socket joined to the group
+    int file;                                   // Output file
+    uint64_t size;                              // Size of the file
+    uint32_t payload;                           // File bytes per datagram
+    uint64_t slot_count;                        // Datagrams the file is cut into
+    uint64_t missing;                           // Datagrams not written yet
+    uint64_t recovered;                         // Datagrams rebuilt from parity
+    unsigned char *have;                        // Bitmap of the datagrams written
+    unsigned char tag[MULTICAST_TAG_LENGTH];    // Start of the transfer id
+    crypto_session session;                     // Content session the datagrams are opened with
+    EVP_CIPHER_CTX *context;                    // Opening context
+    unsigned char *datagrams_buffer;            // MULTICAST_RECEIVE_BATCH receive buffers
+    size_t stride;                              // Bytes between two buffers in datagrams_buffer
+    struct mmsghdr messages[MULTICAST_RECEIVE_BATCH];
+    struct iovec vectors[MULTICAST_RECEIVE_BATCH];
+    unsigned char plain[MULTICAST_MAX_PAYLOAD];     // Payload of the datagram being opened
+    unsigned char rebuilt[MULTICAST_MAX_PAYLOAD];   // Payload being rebuilt from parity
+    unsigned char scratch[MULTICAST_MAX_PAYLOAD];   // Payload read back from the file
+    int failed;                                 // Set when a write fails
+} multicast_receiver;
+
+/**
+ * Returns the number of file bytes in a datagram.
+ *
+ * @param size    Size of the file.
+ * @param payload File bytes per datagram.
+ * @param slot    Index of the datagram.
+ * @return        Bytes of the file the datagram carries.
+ */
+uint32_t slot_length(uint64_t size, uint32_t payload, uint64_t slot) {
+    uint64_t offset = slot * payload;
+
+    return (size - offset < payload) ? (uint32_t)(size - offset) : payload;
+}
+
+/**
+ * Adds a sending socket for the local address a receiver was reached from, unless there is
+ * one already. Receivers behind the same interface share the datagrams of that socket.
+ *
+ * @param sender     Multicast sender.
+ * @param connection Connected TCP socket of the receiver.
+ * @return           0 on success, -1 on failure.
+ */
+int multicast_add_path(multicast_sender *sender, int connection) {
+    struct sockaddr_in local = {0};
+    socklen_t length = sizeof(local);
+    unsigned char ttl = 1, loop = 1;
+    int buffer = MULTICAST_RECEIVE_BUFFER;
+
+    if (getsockname(connection, (struct sockaddr *)&local, &length) < 0 || local.sin_family != AF_INET) return -1;
+
+    for (int index = 0; index < sender->path_count; index++) {
+        if (sender->paths[index].s_addr == local.sin_addr.s_addr) return 0;
+    }
+
+    if (sender->path_count == MULTICAST_MAX_PATHS) return -1;
+
+    int path = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (path < 0) return -1;
+
+    // Stay on the link, and let receivers on this host hear the group too
+    if (setsockopt(path, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(local.sin_addr)) < 0 ||
+        setsockopt(path, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(path, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        close(path);
+
+        return -1;
+    }
+
+    setsockopt(path, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+
+    sender->sockets[sender->path_count] = path;
+    sender->paths[sender->path_count++] = local.sin_addr;
+
+    return 0;
+}
+
+/**
+ * Prepares the sender of a multicast transfer. Paths are added with multicast_add_path().
+ *
+ * @param sender   Sender to initialize.
+ * @param file     File being sent.
+ * @param metadata Metadata with the multicast group set.
+ * @param session  Content session the datagrams are sealed with.
+ * @param rate     Mbit/s the datagrams are paced to.
+ * @return         0 on success, -1 on failure.
+ */
+int multicast_sender_open(multicast_sender *sender, int file, const file_metadata *metadata, crypto_session *session, int rate) {
+    memset(sender, 0, sizeof(*sender));
+
+    sender->group.sin_family = AF_INET;
+    sender->group.sin_port = htons(metadata->multicast_port);
+    sender->group.sin_addr.s_addr = metadata->multicast_group;
+    sender->file = file;
+    sender->size = metadata->size;
+    sender->payload = metadata->multicast_payload;
+    sender->session = session;
+    sender->rate = (uint64_t)rate * 125000;
+    sender->stride = MULTICAST_TAG_LENGTH + sender->payload + RECORD_OVERHEAD;
+    sender->span = malloc((size_t)sender->payload * MULTICAST_SPAN);
+    sender->datagrams_buffer = malloc(sender->stride * MULTICAST_BATCH);
+    sender->context = new_record_context(session->cipher, 1);
+
+    memcpy(sender->tag, metadata->transfer_id, MULTICAST_TAG_LENGTH);
+
+    for (int index = 0; index < MULTICAST_BATCH; index++) {
+        sender->messages[index].msg_hdr.msg_name = &sender->group;
+        sender->messages[index].msg_hdr.msg_namelen = sizeof(sender->group);
+        sender->messages[index].msg_hdr.msg_iov = &sender->vectors[index];
+        sender->messages[index].msg_hdr.msg_iovlen = 1;
+    }
+
+    return (sender->span && sender->datagrams_buffer && sender->context) ? 0 : -1;
+}
+
+/**
+ * Releases everything held by a multicast sender.
+ *
+ * @param sender Sender opened with multicast_sender_open().
+ */
+void multicast_sender_close(multicast_sender *sender) {
+    for (int index = 0; index < sender->path_count; index++) close(sender->sockets[index]);
+
+    EVP_CIPHER_CTX_free(sender->context);
+    free(sender->span);
+    free(sender->datagrams_buffer);
+
+    sender->path_count = 0;
+}
+
+/**
+ * Hands the queued datagrams to the kernel on every path, then sleeps as long as the round
+ * is ahead of the rate. A socket buffer that is full for the moment is waited out.
+ *
+ * @param sender Multicast sender.
+ * @return       0 on success, -1 on failure.
+ */
+int flush_datagrams(multicast_sender *sender) {
+    uint64_t clock = telemetry_clock(), bytes = 0;
+
+    for (int index = 0; index < sender->queued; index++) bytes += sender->vectors[index].iov_len;
+
+    for (int path = 0; path < sender->path_count; path++) {
+        int sent = 0;
+
+        while (sent < sender->queued) {
+            int count = sendmmsg(sender->sockets[path], sender->messages + sent, sender->queued - sent, 0);
+
+            if (count < 0 && errno == EINTR) continue;
+
+            if (count < 0 && (errno == ENOBUFS || errno == EAGAIN)) {
+                sched_yield();
+                continue;
+            }
+
+            if (count < 0) return -1;
+
+            sent += count;
+        }
+    }
+
+    sender->datagrams += sender->queued;
+    sender->queued = 0;
+    sender->round_bytes += bytes;
+
+    // Pace the round so receivers on slower links are not flooded
+    uint64_t due = sender->round_started + sender->round_bytes * 1000000000ull / sender->rate, now = monotonic_ns();
+
+    if (due > now) {
+        struct timespec pause = {(due - now) / 1000000000ull, (due - now) % 1000000000ull};
+
+        nanosleep(&pause, NULL);
+    }
+
+    telemetry_stage(STAGE_NETWORK, clock);
+
+    return 0;
+}
+
+/**
+ * Seals a payload into the next datagram, sending the batch once it is full.
+ *
+ * @param sender Multicast sender.
+ * @param offset File offset of the payload (of the span for parity).
+ * @param flags  0, or RECORD_PARITY.
+ * @param plain  Payload.
+ * @param length Length of the payload.
+ * @return       0 on success, -1 on failure.
+ */
+int queue_datagram(multicast_sender *sender, uint64_t offset, uint32_t flags, const unsigned char *plain, uint32_t length) {
+    unsigned char *datagram = sender->datagrams_buffer + sender->queued * sender->stride;
+    uint64_t clock = telemetry_clock();
+
+    memcpy(datagram, sender->tag, MULTICAST_TAG_LENGTH);
+
+    int record_length = seal_record(sender->context, sender->session, offset, flags, plain, length, datagram + MULTICAST_TAG_LENGTH);
+
+    telemetry_stage(STAGE_CRYPTO, clock);
+
+    if (record_length < 0) return -1;
+
+    sender->vectors[sender->queued].iov_base = datagram;
+    sender->vectors[sender->queued].iov_len = MULTICAST_TAG_LENGTH + record_length;
+
+    if (flags & RECORD_PARITY) sender->parity_datagrams++;
+
+    return (++sender->queued == MULTICAST_BATCH) ? flush_datagrams(sender) : 0;
+}
+
+/**
+ * Multicasts the datagrams covering some ranges of the file. Every span of MULTICAST_SPAN
+ * datagrams sent in full is followed by their XOR, so a receiver that lost any one of them
+ * rebuilds it without asking.
+ *
+ * @param sender      Multicast sender with its paths added.
+ * @param ranges      Ranges to send, sorted and not overlapping.
+ * @param range_count Number of ranges.
+ * @param first       1 for the first round, whose bytes count as progress.
+ * @return            0 on success, -1 on failure.
+ */
+int send_round(multicast_sender *sender, const byte_range *ranges, uint32_t range_count, int first) {
+    uint64_t span_bytes = (uint64_t)sender->payload * MULTICAST_SPAN;
+
+    sender->round_started = monotonic_ns();
+    sender->round_bytes = 0;
+
+    for (uint32_t index = 0; index < range_count; index++) {
+        // Receivers report whole datagrams; widen anything else to them
+        uint64_t offset = ranges[index].offset - ranges[index].offset % sender->payload;
+        uint64_t end = ranges[index].offset + ranges[index].length;
+
+        end = (end % sender->payload) ? end + sender->payload - end % sender->payload : end;
+        end = (end < sender->size) ? end : sender->size;
+
+        while (offset < end) {
+            uint64_t span_start = offset - offset % span_bytes;
+            uint64_t span_end = (span_start + span_bytes < sender->size) ? span_start + span_bytes : sender->size;
+            uint64_t piece_end = (end < span_end) ? end : span_end;
+            int whole = (offset == span_start && piece_end == span_end);
+            uint64_t clock = telemetry_clock();
+
+            if (pread_all(sender->file, sender->span + (offset - span_start), piece_end - offset, offset) < 0) return -1;
+
+            telemetry_stage(STAGE_DISK_READ, clock);
+
+            if (whole) memset(sender->parity, 0, sender->payload);
+
+            for (uint64_t position = offset; position < piece_end; position += sender->payload) {
+                const unsigned char *plain = sender->span + (position - span_start);
+                uint32_t length = slot_length(sender->size, sender->payload, position / sender->payload);
+
+                for (uint32_t byte = 0; whole && byte < length; byte++) sender->parity[byte] ^= plain[byte];
+
+                if (queue_datagram(sender, position, 0, plain, length) < 0) return -1;
+            }
+
+            uint32_t parity_length = (span_end - span_start < sender->payload) ? (uint32_t)(span_end - span_start) : sender->payload;
+
+            if (whole && queue_datagram(sender, span_start, RECORD_PARITY, sender->parity, parity_length) < 0) return -1;
+
+            if (first) telemetry_bytes(piece_end - offset);
+
+            offset = piece_end;
+        }
+    }
+
+    return (sender->queued > 0) ? flush_datagrams(sender) : 0;
+}
+
+/**
+ * Opens the socket a receiver takes the datagrams of a transfer from, joined to its group on
+ * the interface the sender's connection arrived on. It must exist before the receiver sends
+ * its plan, since the sender starts multicasting once every receiver answered.
+ *
+ * @param connection Connected TCP socket of the transfer.
+ * @param metadata   Metadata with the multicast group set.
+ * @return           The socket, or -1 on failure.
+ */
+int join_multicast_group(int connection, const file_metadata *metadata) {
+    struct sockaddr_in local = {0}, address = {0};
+    socklen_t length = sizeof(local);
+    struct ip_mreqn membership = {0};
+    int group = socket(AF_INET, SOCK_DGRAM, 0), enable = 1, disable = 0, buffer = MULTICAST_RECEIVE_BUFFER;
+
+    if (group < 0) return -1;
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(metadata->multicast_port);
+    address.sin_addr.s_addr = metadata->multicast_group;
+
+    membership.imr_multiaddr.s_addr = metadata->multicast_group;
+
+    // Transfers running at once share the group and tell their datagrams apart by the tag
+    setsockopt(group, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    // A burst must fit in the socket buffer while the thread is busy writing
+    if (setsockopt(group, SOL_SOCKET, SO_RCVBUFFORCE, &buffer, sizeof(buffer)) < 0) setsockopt(group, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    if (getsockname(connection, (struct sockaddr *)&local, &length) < 0 || local.sin_family != AF_INET ||
+        bind(group, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(group);
+
+        return -1;
+    }
+
+    membership.imr_address = local.sin_addr;
+
+    if (setsockopt(group, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        close(group);
+
+        return -1;
+    }
+
+    // Only this group, not every group another socket of the host joined on the same port
+    setsockopt(group, IPPROTO_IP, IP_MULTICAST_ALL, &disable, sizeof(disable));
+
+    return group;
+}
+
+/**
+ * Rebuilds the one datagram of a span that is still missing from the span's parity and the
+ * datagrams already written.
+ *
+ * @param receiver Multicast receiver.
+ * @param first    First datagram of the span.
+ * @param parity   Opened parity payload.
+ * @param length   Length of parity.
+ */
+void rebuild_slot(multicast_receiver *receiver, uint64_t first, const unsigned char *parity, uint32_t length) {
+    uint64_t last = (first + MULTICAST_SPAN < receiver->slot_count) ? first + MULTICAST_SPAN : receiver->slot_count;
+    uint64_t lost = UINT64_MAX;
+
+    for (uint64_t slot = first; slot < last; slot++) {
+        if (receiver->have[slot / 8] & (1 << (slot % 8))) continue;
+        if (lost != UINT64_MAX) return;
+
+        lost = slot;
+    }
+
+    if (lost == UINT64_MAX || slot_length(receiver->size, receiver->payload, lost) > length) return;
+
+    memcpy(receiver->rebuilt, parity, length);
+
+    for (uint64_t slot = first; slot < last; slot++) {
+        uint32_t slot_bytes = slot_length(receiver->size, receiver->payload, slot);
+
+        if (slot == lost) continue;
+        if (slot_bytes > length || pread_all(receiver->file, receiver->scratch, slot_bytes, slot * receiver->payload) < 0) return;
+
+        for (uint32_t byte = 0; byte < slot_bytes; byte++) receiver->rebuilt[byte] ^= receiver->scratch[byte];
+    }
+
+    uint32_t lost_bytes = slot_length(receiver->size, receiver->payload, lost);
+
+    if (pwrite_all(receiver->file, receiver->rebuilt, lost_bytes, lost * receiver->payload) < 0) {
+        receiver->failed = 1;
+
+        return;
+    }
+
+    receiver->have[lost / 8] |= 1 << (lost % 8);
+    receiver->missing--;
+    receiver->recovered++;
+
+    telemetry_bytes(lost_bytes);
+}
+
+/**
+ * Opens one datagram and writes its payload, or rebuilds a lost datagram from a parity
+ * datagram. Datagrams of other transfers, forged ones and repeats are dropped.
+ *
+ * @param receiver Multicast receiver.
+ * @param datagram Datagram bytes.
+ * @param length   Length of the datagram.
+ * @return         1 if the datagram belongs to this transfer, 0 otherwise.
+ */
+int accept_datagram(multicast_receiver *receiver, unsigned char *datagram, size_t length) {
+    record_header header;
+
+    if (length < MULTICAST_TAG_LENGTH + RECORD_OVERHEAD || memcmp(datagram, receiver->tag, MULTICAST_TAG_LENGTH) != 0) return 0;
+
+    uint64_t clock = telemetry_clock();
+    int plain_length = open_record(receiver->context, &receiver->session, datagram + MULTICAST_TAG_LENGTH, length - MULTICAST_TAG_LENGTH, &header,
+                                   receiver->plain);
+
+    telemetry_stage(STAGE_CRYPTO, clock);
+
+    if (plain_length < 0 || header.offset % receiver->payload != 0 || header.offset >= receiver->size) return plain_length >= 0;
+
+    uint64_t slot = header.offset / receiver->payload;
+
+    if (header.flags == RECORD_PARITY) {
+        if (slot % MULTICAST_SPAN == 0) rebuild_slot(receiver, slot, receiver->plain, plain_length);
+
+        return 1;
+    }
+
+    if (header.flags != 0 || (uint32_t)plain_length != slot_length(receiver->size, receiver->payload, slot)) return 1;
+    if (receiver->have[slot / 8] & (1 << (slot % 8))) return 1;
+
+    clock = telemetry_clock();
+
+    if (pwrite_all(receiver->file, receiver->plain, plain_length, header.offset) < 0) receiver->failed = 1;
+
+    telemetry_stage(STAGE_DISK_WRITE, clock);
+
+    if (receiver->failed) return 1;
+
+    receiver->have[slot / 8] |= 1 << (slot % 8);
+    receiver->missing--;
+
+    telemetry_bytes(plain_length);
+
+    return 1;
+}
+
+/**
+ * Takes every datagram queued on the group socket without waiting.
+ *
+ * @param receiver Multicast receiver.
+ * @return         Number of datagrams of this transfer taken.
+ */
+int receive_datagrams(multicast_receiver *receiver) {
+    int taken = 0, count;
+
+    do {
+        uint64_t clock = telemetry_clock();
+
+        count = recvmmsg(receiver->group, receiver->messages, MULTICAST_RECEIVE_BATCH, MSG_DONTWAIT, NULL);
+
+        telemetry_stage(STAGE_NETWORK, clock);
+
+        for (int index = 0; index < count; index++) {
+            if (receiver->messages[index].msg_hdr.msg_flags & MSG_TRUNC) continue;
+
+            taken += accept_datagram(receiver, receiver->datagrams_buffer + index * receiver->stride, receiver->messages[index].msg_len);
+        }
+    } while (count == MULTICAST_RECEIVE_BATCH);
+
+    return taken;
+}
+
+/**
+ * Takes the datagrams still on their way once the sender ended a round: waits until none of
+ * this transfer arrived for MULTICAST_QUIET milliseconds.
+ *
+ * @param receiver Multicast receiver.
+ */
+void drain_datagrams(multicast_receiver *receiver) {
+    uint64_t quiet_until = monotonic_ns() + MULTICAST_QUIET * 1000000ull, now;
+
+    while ((now = monotonic_ns()) < quiet_until) {
+        struct pollfd ready = {receiver->group, POLLIN, 0};
+
+        int ready_count = poll(&ready, 1, (int)((quiet_until - now) / 1000000) + 1);
+
+        if (ready_count < 0 && errno == EINTR) continue;
+        if (ready_count <= 0) break;
+
+        if (receive_datagrams(receiver) > 0) quiet_until = monotonic_ns() + MULTICAST_QUIET * 1000000ull;
+    }
+}
+
+/**
+ * Lists the runs of datagrams not written yet as byte ranges.
+ *
+ * @param receiver    Multicast receiver.
+ * @param ranges      Output for the ranges (free with free()).
+ * @param range_count Output for the number of ranges.
+ * @return            0 on success, -1 on failure.
+ */
+int missing_ranges(const multicast_receiver *receiver, byte_range **ranges, uint32_t *range_count) {
+    uint32_t count = 0;
+
+    for (uint64_t slot = 0; slot < receiver->slot_count; slot++) {
+        int lost = !(receiver->have[slot / 8] & (1 << (slot % 8)));
+        int lost_before = slot > 0 && !(receiver->have[(slot - 1) / 8] & (1 << ((slot - 1) % 8)));
+
+        if (lost && !lost_before) count++;
+    }
+
+    *ranges = malloc((count + 1) * sizeof(byte_range));
+    *range_count = 0;
+
+    if (!*ranges) return -1;
+
+    for (uint64_t slot = 0; slot < receiver->slot_count; slot++) {
+        if (receiver->have[slot / 8] & (1 << (slot % 8))) continue;
+
+        uint64_t offset = slot * receiver->payload, end = offset + slot_length(receiver->size, receiver->payload, slot);
+        byte_range *last = (*range_count > 0) ? &(*ranges)[*range_count - 1] : NULL;
+
+        if (last && last->offset + last->length == offset) last->length = end - last->offset;
+        else (*ranges)[(*range_count)++] = (byte_range){offset, end - offset};
+    }
+
+    return 0;
+}
+
+/**
+ * Releases everything held by a multicast receiver; the group socket stays open.
+ *
+ * @param receiver Receiver opened with multicast_receiver_open().
+ */
+void multicast_receiver_close(multicast_receiver *receiver) {
+    EVP_CIPHER_CTX_free(receiver->context);
+    free(receiver->have);
+    free(receiver->datagrams_buffer);
+
+    OPENSSL_cleanse(&receiver->session, sizeof(receiver->session));
+}
+
+/**
+ * Prepares the receiving side of a multicast transfer.
+ *
+ * @param receiver Receiver to initialize.
+ * @param stream   Stream of the transfer, with its group socket and output file set.
+ * @return         0 on success, -1 on failure.
+ */
+int multicast_receiver_open(multicast_receiver *receiver, transfer_stream *stream) {
+    const file_metadata *metadata = &stream->metadata;
+
+    memset(receiver, 0, sizeof(*receiver));
+
+    receiver->group = stream->group;
+    receiver->file = stream->file;
+    receiver->size = metadata->size;
+    receiver->payload = metadata->multicast_payload;
+    receiver->slot_count = (metadata->size + receiver->payload - 1) / receiver->payload;
+    receiver->missing = receiver->slot_count;
+    receiver->stride = MULTICAST_TAG_LENGTH + MULTICAST_MAX_PAYLOAD + RECORD_OVERHEAD;
+    receiver->have = calloc(receiver->slot_count / 8 + 1, 1);
+    receiver->datagrams_buffer = malloc(receiver->stride * MULTICAST_RECEIVE_BATCH);
+    receiver->context = new_record_context(metadata->cipher, 0);
+
+    memcpy(receiver->tag, metadata->transfer_id, MULTICAST_TAG_LENGTH);
+    content_session(metadata, 0, &receiver->session);
+
+    for (int index = 0; index < MULTICAST_RECEIVE_BATCH; index++) {
+        receiver->vectors[index].iov_base = receiver->datagrams_buffer + index * receiver->stride;
+        receiver->vectors[index].iov_len = receiver->stride;
+        receiver->messages[index].msg_hdr.msg_iov = &receiver->vectors[index];
+        receiver->messages[index].msg_hdr.msg_iovlen = 1;
+    }
+
+    return (receiver->have && receiver->datagrams_buffer && receiver->context) ? 0 : -1;
+}
+
+/**
+ * Stream thread of a receiver taking the file as multicast datagrams. Whenever the sender ends
+ * a round on the connection, the receiver answers with the ranges it still lacks; after the
+ * last round those ranges may follow as DATA frames on the connection instead.
+ *
+ * @param arg Pointer to a transfer_stream structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *receive_multicast(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+    multicast_receiver *receiver = calloc(1, sizeof(multicast_receiver));
+    byte_range *missing = NULL;
+    uint32_t missing_count = 0;
+    int result = (receiver && stream->metadata.multicast_payload > 0 && stream->metadata.multicast_payload <= MULTICAST_MAX_PAYLOAD) ? 0 : -1;
+
+    if (result == 0 && multicast_receiver_open(receiver, stream) < 0) result = -1;
+
+    while (result == 0) {
+        struct pollfd ready[2] = {{receiver->group, POLLIN, 0}, {stream->socket, POLLIN, 0}};
+
+        if (poll(ready, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+
+            result = -1;
+            break;
+        }
+
+        if (ready[0].revents & POLLIN) receive_datagrams(receiver);
+
+        if (receiver->failed) result = -1;
+        if (result < 0 || ready[1].revents == 0) continue;
+
+        frame_header header;
+
+        if (recv_frame_header(stream->socket, &header) < 0 || header.type != FRAME_END || header.length != 0) {
+            result = -1;
+            break;
+        }
+
+        // The sender repairs exactly the ranges reported last
+        if (header.flags & END_UNICAST) {
+            result = decrypt_file(stream->file, missing, missing_count, stream->metadata.chunk_size, stream->socket, &receiver->session,
+                                  stream->threads, NULL, stream->engine, stream->direct, NULL);
+            break;
+        }
+
+        // Datagrams sent before the frame may still be queued
+        drain_datagrams(receiver);
+        free(missing);
+
+        missing = NULL;
+
+        if (receiver->failed || missing_ranges(receiver, &missing, &missing_count) < 0) result = -1;
+        else if (!(header.flags & END_ROUND)) {
+            result = (missing_count == 0) ? 0 : -1;
+            break;
+        }
+        else if (send_ranges(stream->socket, missing, missing_count, 0) < 0) result = -1;
+    }
+
+    if (receiver) multicast_receiver_close(receiver);
+
+    free(receiver);
+    free(missing);
+
+    send_ack(stream->socket, result);
+
+    stream->result = result;
+
+    return NULL;
+}
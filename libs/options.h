@@ -0,0 +1,147 @@
+#include "security.h"
+
+#define IO_ENGINE_POSIX 0       // pread, pwrite, send and recv system calls
+#define IO_ENGINE_URING 1       // Batched io_uring submissions
+#define MULTICAST_DEFAULT_RATE 200  // Mbit/s a multicast sender paces its datagrams to by default
+
+// Transfer settings shared by the sender and the receiver
+typedef struct {
+    int crypto_threads;     // Worker threads that seal and open records
+    int streams;            // TCP connections a file is split across
+    int daemon;             // 1 to keep receiving transfers from many clients
+    int io_engine;          // IO_ENGINE_* used for file and socket I/O
+    int compress;           // 1 to deflate chunks that shrink before sealing them
+    int payload;            // PAYLOAD_* the sender uses; a receiver only accepts PAYLOAD_PLAIN if set to it
+    int delta;              // 1 to send only the blocks the receiver's copy lacks
+    int dedup;              // 1 to skip chunks the receiver's chunk store already holds
+    const char *chunk_store; // Directory of the receiver's chunk store, or NULL
+    int verify;             // 1 to compare tree hashes of both copies after a file transfer
+    int direct_io;          // 1 if the receiver writes files with O_DIRECT
+    int multicast;          // 1 to send a file to its receivers as UDP multicast datagrams
+    int multicast_rate;     // Mbit/s the multicast datagrams are paced to
+    int session;            // 1 to send through a session kept open to the receiver
+    const char *bench_json; // File the benchmark writes its results to as JSON, or NULL
+    const char *stats_json; // File a transfer writes its summary to as JSON, or NULL
+    int output_fd;          // Descriptor piped input is written to when the output path is "-", or -1
+} transfer_options;
+
+/**
+ * Fills the options with their defaults.
+ *
+ * @param options Options to initialize.
+ */
+void default_options(transfer_options *options) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    options->crypto_threads = (cores > 0) ? (int)cores : 1;
+    options->streams = 1;
+    options->daemon = 0;
+    options->io_engine = IO_ENGINE_POSIX;
+    options->compress = 0;
+    options->payload = PAYLOAD_SEALED;
+    options->delta = 0;
+    options->dedup = 0;
+    options->chunk_store = NULL;
+    options->verify = 1;
+    options->direct_io = 0;
+    options->multicast = 0;
+    options->multicast_rate = MULTICAST_DEFAULT_RATE;
+    options->session = 0;
+    options->bench_json = NULL;
+    options->stats_json = NULL;
+    options->output_fd = -1;
+}
+
+/**
+ * Parses a positive integer flag value.
+ *
+ * @param flag  Flag name, used in the error message.
+ * @param value String to parse (may be NULL if the flag was the last argument).
+ * @param max   Largest accepted value.
+ * @param out   Output for the parsed value.
+ * @return      0 on success, -1 if the value is missing or out of range.
+ */
+int parse_count(const char *flag, const char *value, long max, int *out) {
+    char *end;
+    long number = (value != NULL) ? strtol(value, &end, 10) : 0;
+
+    if (value == NULL || *value == '\0' || *end != '\0' || number < 1 || number > max) {
+        printf("\e[31mCommandError: '%s' expects a number between 1 and %ld\e[0m\n", flag, max);
+        fflush(stdout);
+
+        return -1;
+    }
+
+    *out = (int)number;
+
+    return 0;
+}
+
+/**
+ * Extracts transfer flags from the command line. Recognized flags and their values are
+ * removed so the remaining arguments keep their usual positions.
+ *
+ * @param argc    Pointer to the argument count, updated on return.
+ * @param argv    Argument vector, compacted in place.
+ * @param options Options to fill; must be initialized with default_options() first.
+ * @return        0 on success, -1 if a flag has an invalid value.
+ */
+int parse_options(int *argc, const char *argv[], transfer_options *options) {
+    int kept = 1;
+
+    for (int index = 1; index < *argc; index++) {
+        if (strcmp(argv[index], "--crypto-threads") == 0) {
+            if (parse_count(argv[index], argv[index + 1], 256, &options->crypto_threads) < 0) return -1;
+
+            index++;
+        }
+        else if (strcmp(argv[index], "--streams") == 0) {
+            if (parse_count(argv[index], argv[index + 1], MAX_STREAMS, &options->streams) < 0) return -1;
+
+            index++;
+        }
+        else if (strcmp(argv[index], "--daemon") == 0) options->daemon = 1;
+        else if (strcmp(argv[index], "--io-uring") == 0) options->io_engine = IO_ENGINE_URING;
+        else if (strcmp(argv[index], "--no-encrypt") == 0) options->payload = PAYLOAD_PLAIN;
+        else if (strcmp(argv[index], "--ktls") == 0) options->payload = PAYLOAD_KTLS;
+        else if (strcmp(argv[index], "--compress") == 0) options->compress = 1;
+        else if (strcmp(argv[index], "--delta") == 0) options->delta = 1;
+        else if (strcmp(argv[index], "--dedup") == 0) options->dedup = 1;
+        else if (strcmp(argv[index], "--no-verify") == 0) options->verify = 0;
+        else if (strcmp(argv[index], "--direct-io") == 0) options->direct_io = 1;
+        else if (strcmp(argv[index], "--multicast") == 0) options->multicast = 1;
+        else if (strcmp(argv[index], "--session") == 0) options->session = 1;
+        else if (strcmp(argv[index], "--multicast-rate") == 0) {
+            if (parse_count(argv[index], argv[index + 1], 100000, &options->multicast_rate) < 0) return -1;
+
+            index++;
+        }
+        else if (strcmp(argv[index], "--chunk-store") == 0) {
+            if (argv[index + 1] == NULL || *argv[index + 1] == '\0') {
+                printf("\e[31mCommandError: '%s' expects a directory\e[0m\n", argv[index]);
+                fflush(stdout);
+
+                return -1;
+            }
+
+            options->chunk_store = argv[++index];
+        }
+        else if (strcmp(argv[index], "--bench-json") == 0 || strcmp(argv[index], "--stats-json") == 0) {
+            if (argv[index + 1] == NULL || *argv[index + 1] == '\0') {
+                printf("\e[31mCommandError: '%s' expects a file\e[0m\n", argv[index]);
+                fflush(stdout);
+
+                return -1;
+            }
+
+            if (strcmp(argv[index], "--bench-json") == 0) options->bench_json = argv[++index];
+            else options->stats_json = argv[++index];
+        }
+        else argv[kept++] = argv[index];
+    }
+
+    *argc = kept;
+    argv[kept] = NULL;
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include "tree.h"
+
+#define PIPED_NAME "stdin"          // Name piped input is announced with; a receiver without an output path uses it
+#define PIPED_TRAILER_LENGTH 8      // Total length carried by the last record of piped input
+
+// State of the piped sending stages. The input is read in order until its end, so records
+// are numbered by the byte they start at.
+typedef struct {
+    send_state stream;          // Socket used by send_chunk(); must stay first
+    int in_file;                // Pipe, terminal or file the input is read from
+    uint64_t offset;            // Bytes read so far
+    int finished;               // 1 once the input ended, 2 once the trailer was produced
+} piped_send_state;
+
+// State of the piped receiving stages
+typedef struct {
+    receive_state stream;       // Socket and chunk size used by receive_chunk(); must stay first
+    int out_file;               // Pipe, terminal or file the output is written to
+    uint64_t offset;            // Bytes written so far, where the next record must start
+    int complete;               // 1 once the trailer confirmed the total length
+} piped_receive_state;
+
+/**
+ * Source stage of the piped sender: fills a record with the next bytes of the input. Once
+ * the input ends, a sealed trailer with the total length follows the last record, so a
+ * connection cut short cannot pass for the end of the input.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Job to fill.
+ * @return         1 if a record was produced, 0 after the trailer, -1 on failure.
+ */
+int read_piped_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    piped_send_state *state = pipeline->state;
+    int length = 0;
+
+    if (state->finished == 2) return 0;
+
+    // A pipe hands over what its writer produced so far; records are filled up to the chunk size
+    while (!state->finished && length < state->stream.chunk_size) {
+        ssize_t count = read(state->in_file, job->input + length, state->stream.chunk_size - length);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return -1;
+        if (count == 0) state->finished = 1;
+
+        length += count;
+    }
+
+    job->offset = state->offset;
+
+    if (length > 0) {
+        job->flags = 0;
+        job->length = length;
+
+        state->offset += length;
+    }
+    else {
+        put_u64(job->input, state->offset);
+
+        job->flags = RECORD_TRAILER;
+        job->length = PIPED_TRAILER_LENGTH;
+
+        state->finished = 2;
+    }
+
+    return 1;
+}
+
+/**
+ * Sends piped input over one connection until it ends, then the END frame.
+ *
+ * @param in_file    Descriptor the input is read from.
+ * @param chunk_size Plaintext bytes per record.
+ * @param socket     Socket file descriptor to send data through.
+ * @param session    Negotiated session.
+ * @param threads    Number of crypto worker threads.
+ * @param compress   1 to deflate records that shrink before sealing them.
+ * @param report     Output for the compression totals, or NULL.
+ * @param total      Output for the number of bytes read from the input.
+ * @return           0 on success, -1 on failure.
+ */
+int encrypt_piped(int in_file, int chunk_size, int socket, crypto_session *session, int threads, int compress, compression_report *report, uint64_t *total) {
+    piped_send_state state = {0};
+    transfer_pipeline pipeline = {0};
+
+    state.stream.chunk_size = chunk_size;
+    state.stream.socket = socket;
+    state.in_file = in_file;
+
+    pipeline.session = session;
+    pipeline.encrypting = 1;
+    pipeline.compress = compress;
+    pipeline.source = read_piped_chunk;
+    pipeline.sink = send_chunk;
+    pipeline.state = &state;
+
+    int result = pipeline_run(&pipeline, threads, chunk_size, chunk_size + RECORD_OVERHEAD);
+
+    if (report) {
+        report->plain_bytes = pipeline.plain_bytes;
+        report->packed_bytes = pipeline.packed_bytes;
+    }
+
+    *total = state.offset;
+
+    if (result < 0) return -1;
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+/**
+ * Sink stage of the piped receiver: writes every record right after the previous one and
+ * checks the trailer against the bytes written.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Opened job.
+ * @return         0 on success, -1 on failure.
+ */
+int write_piped_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    piped_receive_state *state = pipeline->state;
+    int offset = 0;
+
+    if (state->complete || job->offset != state->offset) return -1;
+
+    if (job->flags == RECORD_TRAILER) {
+        if (job->result != PIPED_TRAILER_LENGTH || get_u64(job->output) != state->offset) return -1;
+
+        state->complete = 1;
+
+        return 0;
+    }
+
+    if (job->flags != 0) return -1;
+
+    while (offset < job->result) {
+        ssize_t count = write(state->out_file, job->output + offset, job->result - offset);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+
+        offset += count;
+    }
+
+    state->offset += job->result;
+
+    return 0;
+}
+
+/**
+ * Receives piped input until the END frame and writes it out in order.
+ *
+ * @param out_file   Descriptor the output is written to.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param socket     Socket file descriptor to receive data from.
+ * @param session    Negotiated session.
+ * @param threads    Number of crypto worker threads.
+ * @param total      Output for the number of bytes written.
+ * @return           0 if the input arrived up to its trailer, -1 on failure.
+ */
+int decrypt_piped(int out_file, int chunk_size, int socket, crypto_session *session, int threads, uint64_t *total) {
+    piped_receive_state state = {0};
+    transfer_pipeline pipeline = {0};
+
+    state.stream.chunk_size = chunk_size;
+    state.stream.socket = socket;
+    state.out_file = out_file;
+
+    pipeline.session = session;
+    pipeline.encrypting = 0;
+    pipeline.source = receive_chunk;
+    pipeline.sink = write_piped_chunk;
+    pipeline.state = &state;
+
+    int result = pipeline_run(&pipeline, threads, chunk_size + RECORD_OVERHEAD, chunk_size);
+
+    *total = state.offset;
+
+    return (result == 0 && state.complete) ? 0 : -1;
+}
+
+/**
+ * Stream thread of the piped sender: sends the input, then waits for the receiver's ACK. The
+ * metadata size is set to the number of bytes sent, which is only known once the input ends.
+ *
+ * @param arg Pointer to a transfer_stream structure whose file is the input.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *send_piped(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+
+    stream->result = encrypt_piped(stream->file, stream->metadata.chunk_size, stream->socket, &stream->session, stream->threads,
+                                   stream_compresses(stream), &stream->report, &stream->metadata.size);
+
+    // A receiver that refused the output hung up while the input was being sent
+    stream->result = (stream->result == 0) ? receive_ack(stream->socket) : receive_refusal(stream->socket);
+
+    return NULL;
+}
+
+/**
+ * Stream thread of the piped receiver: writes the input out and answers with an ACK. The
+ * metadata size is set to the number of bytes received.
+ *
+ * @param arg Pointer to a transfer_stream structure whose file is the output.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *receive_piped(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+
+    stream->result = decrypt_piped(stream->file, stream->metadata.chunk_size, stream->socket, &stream->session, stream->threads, &stream->metadata.size);
+
+    send_ack(stream->socket, stream->result);
+
+    return NULL;
+}
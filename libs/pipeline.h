@@ -0,0 +1,956 @@
+#include "sparse.h"
+
+#define JOBS_PER_THREAD 4                   // Buffers in flight per crypto thread
+#define HUGE_PAGE_SIZE (2 << 20)            // Size of a transparent huge page
+#define JOB_HEADROOM FRAME_HEADER_LENGTH    // Bytes reserved before every output buffer for a frame header
+#define LATENCY_BUCKETS 256                 // Buckets of a chunk latency histogram
+
+// One chunk travelling through the pipeline
+typedef struct {
+    uint64_t offset;            // File offset of the chunk
+    int length;                 // Input length in bytes
+    int result;                 // Output length, or -1 if sealing or opening failed
+    uint32_t flags;             // Record flags (filled in when opening)
+    unsigned char *input;       // Plaintext when sealing, record when opening
+    unsigned char *output;      // Record when sealing, plaintext when opening (JOB_HEADROOM bytes free before it)
+    unsigned char digest[DIGEST_LENGTH];    // Plaintext digest (when the pipeline digests chunks)
+    uint64_t started;           // Monotonic nanoseconds at which the source produced the job (while chunk_latency is set)
+} crypto_job;
+
+// Log-scale histogram of chunk latencies in microseconds, four buckets per power of two
+typedef struct {
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+latency_histogram *chunk_latency = NULL;    // Sending pipelines record how long each chunk took from read to send while set
+
+typedef struct transfer_pipeline transfer_pipeline;
+
+// Source stage: fills a job. Returns 1 if a job was produced, 0 at the end, -1 on failure.
+typedef int (*source_stage)(transfer_pipeline *pipeline, crypto_job *job);
+
+// Sink stage: consumes a processed job in order. Returns 0 on success, -1 on failure.
+typedef int (*sink_stage)(transfer_pipeline *pipeline, crypto_job *job);
+
+// Batched source stage: fills up to count jobs at once. Returns the number of jobs produced;
+// fewer than count means the end was reached. Returns -1 on failure.
+typedef int (*batch_source_stage)(transfer_pipeline *pipeline, crypto_job **jobs, int count);
+
+// Flush stage: completes the I/O a retaining sink has queued and releases its jobs. Called
+// before the sink waits for more work and once at the end, even after a failure.
+typedef int (*flush_stage)(transfer_pipeline *pipeline);
+
+// Three-stage pipeline: a source thread, crypto worker threads and a sink on the calling
+// thread, linked by single-producer/single-consumer rings. Job k always travels through
+// worker k % thread_count, so the sink restores file order by visiting the workers in turn.
+struct transfer_pipeline {
+    crypto_session *session;    // Session shared by every worker
+    int encrypting;             // 1 to seal records, 0 to open them
+    int digest_chunks;          // 1 to hash every chunk's plaintext on the workers
+    tree_digest *tree;          // Tree hash fed with the chunk digests in order, or NULL
+    int compress;               // 1 to deflate chunks before sealing them
+    int input_size;             // Input buffer size per job
+    int output_size;            // Output buffer size per job
+    _Atomic uint64_t plain_bytes;   // Chunk bytes sealed, before compression
+    _Atomic uint64_t packed_bytes;  // Chunk bytes sealed, after compression
+    int thread_count;           // Number of crypto worker threads
+    int job_count;              // Number of preallocated jobs
+    crypto_job *jobs;           // Preallocated jobs
+    unsigned char *buffers;     // Single allocation backing every job buffer
+    size_t buffers_size;        // Size of the buffers allocation
+
+    spsc_ring free_jobs;        // Sink -> source: jobs ready for reuse
+    spsc_ring *work;            // Source -> worker k
+    spsc_ring *done;            // Worker k -> sink
+    crypto_job end_marker;      // Pushed to every worker after the last job
+
+    pthread_t source_thread;    // Runs the source stage
+    pthread_t *workers;         // Crypto worker threads
+
+    source_stage source;        // Produces jobs
+    batch_source_stage batch_source;    // Produces several jobs at once (used instead of source when set)
+    sink_stage sink;            // Consumes jobs in order
+    int sink_retains;           // 1 if the sink keeps jobs until flush releases them
+    int sink_counts;            // 1 if the sink reports the file bytes of every job to the telemetry itself
+    flush_stage flush;          // Completes the sink's queued I/O, or NULL
+    void *state;                // Stage specific state
+    _Atomic int failed;         // Set by any stage that fails
+};
+
+// Worker thread argument
+typedef struct {
+    transfer_pipeline *pipeline;    // Owning pipeline
+    int index;                      // Worker index
+} worker_args;
+
+/**
+ * Adds one latency to a histogram.
+ *
+ * @param histogram   Histogram to update.
+ * @param nanoseconds Latency to add.
+ */
+void latency_record(latency_histogram *histogram, uint64_t nanoseconds) {
+    uint64_t micros = nanoseconds / 1000;
+    int bucket = (int)micros;
+
+    // Below 4 us every microsecond has its own bucket, above it every power of two has four
+    if (micros >= 4) {
+        int exponent = 63 - __builtin_clzll(micros);
+
+        bucket = 4 * (exponent - 1) + (int)((micros >> (exponent - 2)) & 3);
+    }
+
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+}
+
+/**
+ * Allocates one block for all job buffers, backed by huge pages when the system has them.
+ *
+ * @param size Requested size in bytes.
+ * @param out  Output for the rounded allocation size (needed to free it).
+ * @return     The buffer, or NULL on failure.
+ */
+unsigned char *allocate_buffers(size_t size, size_t *out) {
+    size_t rounded = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    void *buffer = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    // Fall back to regular pages and ask for transparent huge pages instead
+    if (buffer == MAP_FAILED) {
+        buffer = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buffer == MAP_FAILED) return NULL;
+
+        madvise(buffer, rounded, MADV_HUGEPAGE);
+    }
+
+    *out = rounded;
+
+    return buffer;
+}
+
+/**
+ * Seals or opens a single job with the given context. Chunks that shrink are sealed in their
+ * compressed form and inflated again after opening.
+ *
+ * @param pipeline   Pipeline the job belongs to.
+ * @param context    Worker's cipher context.
+ * @param compressor Worker's compressor.
+ * @param job        Job to process.
+ */
+void run_crypto_job(transfer_pipeline *pipeline, EVP_CIPHER_CTX *context, chunk_compressor *compressor, crypto_job *job) {
+    if (pipeline->encrypting) {
+        if (pipeline->digest_chunks && digest_chunk(job->input, job->length, job->digest) < 0) {
+            job->result = -1;
+            return;
+        }
+
+        int packed = (compressor->deflating) ? compress_chunk(compressor, job->input, job->length) : 0;
+
+        if (packed > 0) {
+            job->result = seal_record(context, pipeline->session, job->offset, job->flags | RECORD_COMPRESSED, compressor->scratch, packed, job->output);
+        }
+        else job->result = seal_record(context, pipeline->session, job->offset, job->flags, job->input, job->length, job->output);
+
+        atomic_fetch_add_explicit(&pipeline->plain_bytes, job->length, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pipeline->packed_bytes, (packed > 0) ? packed : job->length, memory_order_relaxed);
+    }
+    else {
+        record_header header;
+        uint32_t net_flags = 0;
+
+        // Peek at the flags so a compressed record opens into scratch; open_record() still
+        // authenticates them
+        if (job->length >= RECORD_HEADER_LENGTH) memcpy(&net_flags, job->input + 12, 4);
+
+        unsigned char *plain_text = (ntohl(net_flags) & RECORD_COMPRESSED) ? compressor->scratch : job->output;
+
+        job->result = open_record(context, pipeline->session, job->input, job->length, &header, plain_text);
+        job->offset = header.offset;
+        job->flags = header.flags & ~RECORD_COMPRESSED;
+
+        if (job->result >= 0 && plain_text != job->output) {
+            if (!(header.flags & RECORD_COMPRESSED)) job->result = -1;
+            else job->result = inflate_chunk(compressor, plain_text, job->result, job->output, pipeline->output_size);
+        }
+
+        if (job->result >= 0 && pipeline->digest_chunks && digest_chunk(job->output, job->result, job->digest) < 0) job->result = -1;
+    }
+}
+
+/**
+ * Crypto worker thread: processes jobs from its work ring until the end marker arrives.
+ * Each worker keeps its own cipher context for the whole transfer.
+ *
+ * @param arg Pointer to a worker_args structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *crypto_worker(void *arg) {
+    worker_args *args = (worker_args *)arg;
+    transfer_pipeline *pipeline = args->pipeline;
+    EVP_CIPHER_CTX *context = new_record_context(pipeline->session->cipher, pipeline->encrypting);
+    chunk_compressor compressor;
+    int ready = (context != NULL);
+
+    memset(&compressor, 0, sizeof(compressor));
+
+    // Senders only deflate when asked to, receivers can always inflate
+    if (ready && (pipeline->compress || !pipeline->encrypting)) {
+        ready = compressor_init(&compressor, (pipeline->encrypting) ? pipeline->input_size : pipeline->output_size, pipeline->encrypting) == 0;
+    }
+
+    while (1) {
+        crypto_job *job = ring_pop(&pipeline->work[args->index]);
+
+        if (job != &pipeline->end_marker) {
+            uint64_t clock = telemetry_clock();
+
+            if (ready && !pipeline->failed) run_crypto_job(pipeline, context, &compressor, job);
+            else job->result = -1;
+
+            telemetry_stage(STAGE_CRYPTO, clock);
+        }
+
+        ring_push(&pipeline->done[args->index], job);
+
+        if (job == &pipeline->end_marker) break;
+    }
+
+    EVP_CIPHER_CTX_free(context);
+    compressor_free(&compressor);
+
+    return NULL;
+}
+
+/**
+ * Source thread: fills free jobs and deals them to the workers in round-robin order.
+ *
+ * @param arg Pointer to the transfer_pipeline.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *source_worker(void *arg) {
+    transfer_pipeline *pipeline = (transfer_pipeline *)arg;
+    crypto_job *batch[URING_ENTRIES];
+    uint64_t sequence = 0;
+
+    while (!pipeline->failed) {
+        int count = 1, produced;
+
+        batch[0] = ring_pop(&pipeline->free_jobs);
+
+        // Waiting for a free job is back-pressure, not work of this stage
+        uint64_t clock = telemetry_clock();
+
+        // A batched source takes every job that is free right now, so batches grow exactly
+        // when the source is the bottleneck
+        if (pipeline->batch_source) {
+            while (count < URING_ENTRIES && (batch[count] = ring_try_pop(&pipeline->free_jobs)) != NULL) count++;
+
+            produced = pipeline->batch_source(pipeline, batch, count);
+        }
+        else produced = pipeline->source(pipeline, batch[0]);
+
+        telemetry_stage((pipeline->encrypting) ? STAGE_DISK_READ : STAGE_NETWORK, clock);
+
+        if (produced < 0) pipeline->failed = 1;
+
+        if (chunk_latency && pipeline->encrypting) {
+            uint64_t now = monotonic_ns();
+
+            for (int index = 0; index < produced; index++) batch[index]->started = now;
+        }
+
+        for (int index = 0; index < produced; index++) ring_push(&pipeline->work[sequence++ % pipeline->thread_count], batch[index]);
+
+        if (produced < count) break;
+    }
+
+    // One end marker per worker, starting where the sink expects the next job
+    for (int index = 0; index < pipeline->thread_count; index++) {
+        ring_push(&pipeline->work[(sequence + index) % pipeline->thread_count], &pipeline->end_marker);
+    }
+
+    return NULL;
+}
+
+/**
+ * Releases everything allocated by pipeline_run().
+ *
+ * @param pipeline Pipeline to clean up.
+ */
+void pipeline_free(transfer_pipeline *pipeline) {
+    for (int index = 0; pipeline->work && index < pipeline->thread_count; index++) ring_free(&pipeline->work[index]);
+    for (int index = 0; pipeline->done && index < pipeline->thread_count; index++) ring_free(&pipeline->done[index]);
+
+    ring_free(&pipeline->free_jobs);
+
+    if (pipeline->buffers) munmap(pipeline->buffers, pipeline->buffers_size);
+
+    free(pipeline->work);
+    free(pipeline->done);
+    free(pipeline->jobs);
+    free(pipeline->workers);
+}
+
+/**
+ * Hands a job retained by the sink back to the source. Must be called on the sink's thread.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Job whose I/O has completed.
+ */
+void pipeline_release(transfer_pipeline *pipeline, crypto_job *job) {
+    ring_push(&pipeline->free_jobs, job);
+}
+
+/**
+ * Runs a transfer through the pipeline. All buffers are allocated once up front, so the
+ * steady state makes no allocations; the stages only hand job pointers to each other.
+ *
+ * @param pipeline     Pipeline with session, encrypting, source (or batch_source), sink and state set.
+ * @param thread_count Number of crypto worker threads.
+ * @param input_size   Input buffer size per job.
+ * @param output_size  Output buffer size per job.
+ * @return             0 on success, -1 if any stage failed.
+ */
+int pipeline_run(transfer_pipeline *pipeline, int thread_count, int input_size, int output_size) {
+    worker_args *args = calloc(thread_count, sizeof(worker_args));
+    int started = 0, source_started = 0;
+
+    pipeline->thread_count = thread_count;
+    pipeline->input_size = input_size;
+    pipeline->output_size = output_size;
+    pipeline->job_count = thread_count * JOBS_PER_THREAD;
+    pipeline->failed = 0;
+    pipeline->jobs = calloc(pipeline->job_count, sizeof(crypto_job));
+    pipeline->work = calloc(thread_count, sizeof(spsc_ring));
+    pipeline->done = calloc(thread_count, sizeof(spsc_ring));
+    pipeline->workers = calloc(thread_count, sizeof(pthread_t));
+    pipeline->buffers = allocate_buffers((size_t)pipeline->job_count * (input_size + JOB_HEADROOM + output_size), &pipeline->buffers_size);
+
+    // Rings are sized so a push never finds them full
+    int ready = args && pipeline->jobs && pipeline->work && pipeline->done && pipeline->workers && pipeline->buffers &&
+        ring_init(&pipeline->free_jobs, pipeline->job_count) == 0;
+
+    for (int index = 0; ready && index < thread_count; index++) {
+        if (ring_init(&pipeline->work[index], pipeline->job_count + thread_count) < 0) ready = 0;
+        if (ring_init(&pipeline->done[index], pipeline->job_count + thread_count) < 0) ready = 0;
+    }
+
+    if (!ready) {
+        pipeline_free(pipeline);
+        free(args);
+
+        return -1;
+    }
+
+    for (int index = 0; index < pipeline->job_count; index++) {
+        crypto_job *job = &pipeline->jobs[index];
+
+        job->input = pipeline->buffers + (size_t)index * (input_size + JOB_HEADROOM + output_size);
+        job->output = job->input + input_size + JOB_HEADROOM;
+
+        ring_push(&pipeline->free_jobs, job);
+    }
+
+    // Start the workers, then the source
+    for (int index = 0; index < thread_count; index++) {
+        args[index].pipeline = pipeline;
+        args[index].index = index;
+
+        if (pthread_create(&pipeline->workers[index], NULL, crypto_worker, &args[index]) != 0) break;
+
+        started++;
+    }
+
+    if (started == thread_count && pthread_create(&pipeline->source_thread, NULL, source_worker, pipeline) == 0) source_started = 1;
+
+    // Sink stage: collect jobs in order; after a failure keep draining so the source never blocks
+    if (source_started) {
+        int sink_stage = (pipeline->encrypting) ? STAGE_NETWORK : STAGE_DISK_WRITE;
+
+        for (uint64_t sequence = 0;; sequence++) {
+            spsc_ring *done = &pipeline->done[sequence % thread_count];
+            crypto_job *job = ring_try_pop(done);
+            int retained = 0;
+
+            // Complete queued I/O before waiting, so retained jobs flow back to the source
+            if (!job) {
+                uint64_t clock = telemetry_clock();
+
+                if (pipeline->flush && pipeline->flush(pipeline) < 0) pipeline->failed = 1;
+
+                telemetry_stage(sink_stage, clock);
+
+                job = ring_pop(done);
+            }
+
+            if (job == &pipeline->end_marker) break;
+
+            if (!pipeline->failed) {
+                uint64_t started = job->started, clock = telemetry_clock();
+                uint64_t plain_length = (pipeline->encrypting) ? job->length : job->result;
+
+                // A retaining sink may hand the job back before it returns, so the leaf goes first
+                if (job->result >= 0) tree_digest_leaf(pipeline->tree, job->offset, plain_length, job->digest);
+
+                if (job->result < 0 || pipeline->sink(pipeline, job) < 0) pipeline->failed = 1;
+                else {
+                    retained = pipeline->sink_retains;
+
+                    if (!pipeline->sink_counts) telemetry_bytes(plain_length);
+                }
+
+                telemetry_stage(sink_stage, clock);
+
+                if (chunk_latency && pipeline->encrypting) latency_record(chunk_latency, monotonic_ns() - started);
+            }
+
+            if (!retained) ring_push(&pipeline->free_jobs, job);
+        }
+
+        // The kernel may still own retained buffers, so this runs even after a failure
+        uint64_t clock = telemetry_clock();
+
+        if (pipeline->flush && pipeline->flush(pipeline) < 0) pipeline->failed = 1;
+
+        telemetry_stage(sink_stage, clock);
+
+        pthread_join(pipeline->source_thread, NULL);
+    }
+    else {
+        pipeline->failed = 1;
+
+        for (int index = 0; index < started; index++) ring_push(&pipeline->work[index], &pipeline->end_marker);
+    }
+
+    for (int index = 0; index < started; index++) pthread_join(pipeline->workers[index], NULL);
+
+    int result = pipeline->failed ? -1 : 0;
+
+    pipeline_free(pipeline);
+    free(args);
+
+    return result;
+}
+
+/**
+ * Sets up a stage's ring on first use, on the thread that runs the stage. The job buffers
+ * and the stage's descriptor are registered when the kernel allows it.
+ *
+ * @param pipeline Running pipeline.
+ * @param ring     Ring of the stage (fd -1 until set up).
+ * @param enabled  1 while the stage uses io_uring; cleared if the ring cannot be created.
+ * @param file     Descriptor the stage works on.
+ * @return         1 if the ring is usable, 0 if the stage uses plain system calls.
+ */
+int stage_ring(transfer_pipeline *pipeline, io_ring *ring, int *enabled, int file) {
+    if (!*enabled) return 0;
+    if (ring->fd >= 0) return 1;
+
+    if (io_ring_init(ring, URING_ENTRIES) < 0) {
+        *enabled = 0;
+
+        return 0;
+    }
+
+    io_ring_register_buffer(ring, pipeline->buffers, pipeline->buffers_size);
+    io_ring_register_file(ring, file);
+
+    return 1;
+}
+
+// State of the sending stages
+typedef struct {
+    int in_file;                // File descriptor of the file being sent
+    const byte_range *ranges;   // Ranges to send, in order
+    uint32_t range_count;       // Number of ranges
+    uint32_t range_index;       // Range currently being read
+    uint64_t offset;            // Offset of the next chunk to read
+    int chunk_size;             // Plaintext bytes per record
+    int socket;                 // Connected socket
+    int read_uring;             // 1 if reads go through read_ring
+    int send_uring;             // 1 if sends go through send_ring
+    io_ring read_ring;          // Ring of the source stage
+    io_ring send_ring;          // Ring of the sink stage
+    crypto_job *queued[URING_ENTRIES];  // Sealed jobs waiting for flush_chunks()
+    int queued_count;           // Number of queued jobs
+} send_state;
+
+/**
+ * Moves a range cursor past finished ranges.
+ *
+ * @param ranges      Ranges in order.
+ * @param range_count Number of ranges.
+ * @param index       Current range index, updated in place.
+ * @param offset      Current offset, updated in place.
+ * @return            1 if the cursor points into a range, 0 if every range is finished.
+ */
+int next_range_offset(const byte_range *ranges, uint32_t range_count, uint32_t *index, uint64_t *offset) {
+    while (*index < range_count) {
+        const byte_range *range = &ranges[*index];
+
+        if (*offset < range->offset) *offset = range->offset;
+        if (*offset < range->offset + range->length) return 1;
+
+        (*index)++;
+    }
+
+    return 0;
+}
+
+/**
+ * Assigns the next chunk of the current range to a job without reading it.
+ *
+ * @param state Sending state.
+ * @param job   Job to fill in.
+ * @return      1 if a chunk was assigned, 0 after the last range.
+ */
+int plan_chunk(send_state *state, crypto_job *job) {
+    if (!next_range_offset(state->ranges, state->range_count, &state->range_index, &state->offset)) return 0;
+
+    const byte_range *range = &state->ranges[state->range_index];
+    uint64_t remaining = range->offset + range->length - state->offset;
+
+    job->offset = state->offset;
+    job->length = (remaining < (uint64_t)state->chunk_size) ? (int)remaining : state->chunk_size;
+    job->flags = 0;
+
+    state->offset += job->length;
+
+    return 1;
+}
+
+/**
+ * Source stage of the sender: reads the next chunk of the current range.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Job to fill.
+ * @return         1 if a chunk was read, 0 after the last range, -1 on failure.
+ */
+int read_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    send_state *state = pipeline->state;
+
+    if (!plan_chunk(state, job)) return 0;
+
+    // pread only returns short counts at the end of the file, which means it shrank
+    return (pread_all(state->in_file, job->input, job->length, job->offset) < 0) ? -1 : 1;
+}
+
+/**
+ * Batched source stage of the sender: reads up to count chunks with one io_uring submission.
+ *
+ * @param pipeline Running pipeline.
+ * @param jobs     Jobs to fill.
+ * @param count    Number of jobs.
+ * @return         Number of chunks read, -1 on failure.
+ */
+int read_chunks(transfer_pipeline *pipeline, crypto_job **jobs, int count) {
+    send_state *state = pipeline->state;
+    io_ring *ring = &state->read_ring;
+    int results[URING_ENTRIES];
+    int produced = 0;
+
+    while (produced < count && plan_chunk(state, jobs[produced])) produced++;
+
+    if (produced == 0) return 0;
+
+    if (!stage_ring(pipeline, ring, &state->read_uring, state->in_file)) {
+        for (int index = 0; index < produced; index++) {
+            if (pread_all(state->in_file, jobs[index]->input, jobs[index]->length, jobs[index]->offset) < 0) return -1;
+        }
+
+        return produced;
+    }
+
+    for (int index = 0; index < produced; index++) {
+        struct io_uring_sqe *sqe = io_ring_sqe(ring);
+
+        io_ring_target(ring, sqe, ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, state->in_file);
+
+        sqe->addr = (uintptr_t)jobs[index]->input;
+        sqe->len = jobs[index]->length;
+        sqe->off = jobs[index]->offset;
+        sqe->user_data = index;
+    }
+
+    if (io_ring_run(ring, results, produced) < 0) return -1;
+
+    // Finish short reads the plain way; they only happen near the end of the file
+    for (int index = 0; index < produced; index++) {
+        crypto_job *job = jobs[index];
+
+        if (results[index] < 0) return -1;
+        if (results[index] < job->length && pread_all(state->in_file, job->input + results[index], job->length - results[index], job->offset + results[index]) < 0) return -1;
+    }
+
+    return produced;
+}
+
+/**
+ * Sink stage of the sender: sends a sealed record as a DATA frame. The frame header goes
+ * into the headroom before the record, so both leave in one system call.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Sealed job.
+ * @return         0 on success, -1 on failure.
+ */
+int send_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    send_state *state = pipeline->state;
+
+    put_frame_header(job->output - JOB_HEADROOM, FRAME_DATA, 0, job->result);
+
+    return send_all(state->socket, job->output - JOB_HEADROOM, job->result + JOB_HEADROOM);
+}
+
+/**
+ * Flush stage of the sender: sends every queued DATA frame with a single sendmsg and hands
+ * the jobs back to the source.
+ *
+ * @param pipeline Running pipeline.
+ * @return         0 on success, -1 on failure.
+ */
+int flush_chunks(transfer_pipeline *pipeline) {
+    send_state *state = pipeline->state;
+    io_ring *ring = &state->send_ring;
+    struct iovec vectors[URING_ENTRIES];
+    struct msghdr message = {0};
+    int result = 0, sent = 0;
+
+    if (state->queued_count == 0) return 0;
+
+    for (int index = 0; index < state->queued_count; index++) {
+        vectors[index].iov_base = state->queued[index]->output - JOB_HEADROOM;
+        vectors[index].iov_len = state->queued[index]->result + JOB_HEADROOM;
+    }
+
+    message.msg_iov = vectors;
+    message.msg_iovlen = state->queued_count;
+
+    if (pipeline->failed) result = -1;
+    else if (stage_ring(pipeline, ring, &state->send_uring, state->socket)) {
+        struct io_uring_sqe *sqe = io_ring_sqe(ring);
+
+        io_ring_target(ring, sqe, IORING_OP_SENDMSG, state->socket);
+
+        sqe->addr = (uintptr_t)&message;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = 0;
+
+        if (io_ring_run(ring, &sent, 1) < 0 || sent < 0) result = -1;
+    }
+
+    // Whatever the ring did not send goes out the plain way, in order
+    for (int index = 0; result == 0 && index < state->queued_count; index++) {
+        size_t length = vectors[index].iov_len;
+
+        if ((size_t)sent >= length) {
+            sent -= length;
+            continue;
+        }
+
+        if (send_all(state->socket, (unsigned char *)vectors[index].iov_base + sent, length - sent) < 0) result = -1;
+
+        sent = 0;
+    }
+
+    for (int index = 0; index < state->queued_count; index++) pipeline_release(pipeline, state->queued[index]);
+
+    state->queued_count = 0;
+
+    return result;
+}
+
+/**
+ * Retaining sink stage of the sender: frames a sealed record and queues it for flush_chunks().
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Sealed job.
+ * @return         0 on success, -1 on failure.
+ */
+int queue_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    send_state *state = pipeline->state;
+
+    put_frame_header(job->output - JOB_HEADROOM, FRAME_DATA, 0, job->result);
+
+    state->queued[state->queued_count++] = job;
+
+    return (state->queued_count == URING_ENTRIES) ? flush_chunks(pipeline) : 0;
+}
+
+/**
+ * Encrypts the given ranges of a file into records and sends them over a socket as DATA
+ * frames in order, followed by an END frame. Disk reads, sealing and socket writes run
+ * concurrently. Ranges must start on chunk boundaries.
+ *
+ * @param in_file     File descriptor of the input file.
+ * @param ranges      Ranges to send, sorted by offset.
+ * @param range_count Number of ranges.
+ * @param chunk_size  Plaintext bytes per record.
+ * @param socket      Socket file descriptor to send data through.
+ * @param session     Negotiated session.
+ * @param threads     Number of crypto worker threads.
+ * @param engine      IO_ENGINE_* used for disk reads and socket writes.
+ * @param compress    1 to deflate chunks that shrink before sealing them.
+ * @param report      Output for the compression totals, or NULL.
+ * @param tree        Tree hash to record the sent chunks in, or NULL.
+ * @return            0 on success, -1 on failure.
+ */
+int encrypt_file(int in_file, const byte_range *ranges, uint32_t range_count, int chunk_size, int socket, crypto_session *session, int threads, int engine,
+                 int compress, compression_report *report, tree_digest *tree) {
+    send_state state = {.in_file = in_file, .ranges = ranges, .range_count = range_count, .chunk_size = chunk_size, .socket = socket};
+    transfer_pipeline pipeline = {0};
+    int result;
+
+    state.read_uring = state.send_uring = (engine == IO_ENGINE_URING);
+    state.read_ring.fd = state.send_ring.fd = -1;
+
+    pipeline.session = session;
+    pipeline.encrypting = 1;
+    pipeline.digest_chunks = (tree != NULL);
+    pipeline.tree = tree;
+    pipeline.compress = compress;
+    pipeline.state = &state;
+
+    // io_uring batches disk reads and socket writes; the rings fall back to plain calls per stage
+    if (engine == IO_ENGINE_URING) {
+        pipeline.batch_source = read_chunks;
+        pipeline.sink = queue_chunk;
+        pipeline.sink_retains = 1;
+        pipeline.flush = flush_chunks;
+    }
+    else {
+        pipeline.source = read_chunk;
+        pipeline.sink = send_chunk;
+    }
+
+    result = pipeline_run(&pipeline, threads, chunk_size, chunk_size + RECORD_OVERHEAD);
+
+    io_ring_free(&state.read_ring);
+    io_ring_free(&state.send_ring);
+
+    if (report) {
+        report->plain_bytes = pipeline.plain_bytes;
+        report->packed_bytes = pipeline.packed_bytes;
+    }
+
+    if (result < 0) return -1;
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+// State of the receiving stages
+typedef struct {
+    int out_file;               // File descriptor of the file being written
+    const byte_range *ranges;   // Ranges expected, in order
+    uint32_t range_count;       // Number of ranges
+    uint32_t range_index;       // Range currently being received
+    uint64_t offset;            // Offset the next record must start at
+    int chunk_size;             // Largest plaintext size of a record
+    int socket;                 // Connected socket
+    checkpoint *resume;         // Checkpoint updated after every write
+    int write_uring;            // 1 if writes go through write_ring
+    io_ring write_ring;         // Ring of the sink stage
+    write_behind *writer;       // Write-behind thread the sink hands chunks to, or NULL
+    crypto_job *queued[URING_ENTRIES];  // Opened jobs waiting for flush_writes()
+    int queued_count;           // Number of queued jobs
+} receive_state;
+
+/**
+ * Source stage of the receiver: receives the next DATA frame.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Job to fill.
+ * @return         1 if a record was received, 0 at the END frame, -1 on failure.
+ */
+int receive_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    receive_state *state = pipeline->state;
+    frame_header header;
+
+    if (recv_frame_header(state->socket, &header) < 0) return -1;
+    if (header.type == FRAME_END && header.length == 0) return 0;
+    if (header.type != FRAME_DATA || header.length > (uint32_t)state->chunk_size + RECORD_OVERHEAD) return -1;
+    if (recv_all(state->socket, job->input, header.length) < 0) return -1;
+
+    job->length = header.length;
+
+    return 1;
+}
+
+/**
+ * Checks an opened record's position against the expected ranges and advances past it.
+ *
+ * @param state Receiving state.
+ * @param job   Opened job.
+ * @return      0 if the record is the next one expected, -1 otherwise.
+ */
+int accept_chunk(receive_state *state, const crypto_job *job) {
+    if (!next_range_offset(state->ranges, state->range_count, &state->range_index, &state->offset)) return -1;
+
+    const byte_range *range = &state->ranges[state->range_index];
+
+    if (job->flags != 0 || job->offset != state->offset || (uint64_t)job->result > range->offset + range->length - state->offset) return -1;
+
+    state->offset += job->result;
+
+    return 0;
+}
+
+/**
+ * Sink stage of the receiver: checks the record position against the expected ranges,
+ * writes its plaintext at its offset and records it in the checkpoint. Streams carrying
+ * other ranges can write the same file concurrently.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Opened job.
+ * @return         0 on success, -1 on failure.
+ */
+int write_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    receive_state *state = pipeline->state;
+
+    if (accept_chunk(state, job) < 0) return -1;
+    if (pwrite_all(state->out_file, job->output, job->result, job->offset) < 0) return -1;
+    if (state->resume && checkpoint_mark(state->resume, job->offset, job->digest) < 0) return -1;
+
+    return 0;
+}
+
+/**
+ * Sink stage of the receiver with a write-behind thread: checks the record position and
+ * copies its plaintext into the block the thread writes next.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Opened job.
+ * @return         0 on success, -1 on failure.
+ */
+int gather_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    receive_state *state = pipeline->state;
+
+    if (accept_chunk(state, job) < 0) return -1;
+
+    return writeback_write(state->writer, job->output, job->result, job->offset, job->digest);
+}
+
+/**
+ * Flush stage of the receiver: writes every queued record with one io_uring submission,
+ * records them in the checkpoint once they are written and hands the jobs back to the source.
+ *
+ * @param pipeline Running pipeline.
+ * @return         0 on success, -1 on failure.
+ */
+int flush_writes(transfer_pipeline *pipeline) {
+    receive_state *state = pipeline->state;
+    io_ring *ring = &state->write_ring;
+    int results[URING_ENTRIES];
+    int result = 0;
+
+    if (state->queued_count == 0) return 0;
+
+    if (pipeline->failed) result = -1;
+    else if (stage_ring(pipeline, ring, &state->write_uring, state->out_file)) {
+        for (int index = 0; index < state->queued_count; index++) {
+            struct io_uring_sqe *sqe = io_ring_sqe(ring);
+            crypto_job *job = state->queued[index];
+
+            io_ring_target(ring, sqe, ring->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, state->out_file);
+
+            sqe->addr = (uintptr_t)job->output;
+            sqe->len = job->result;
+            sqe->off = job->offset;
+            sqe->user_data = index;
+        }
+
+        if (io_ring_run(ring, results, state->queued_count) < 0) result = -1;
+    }
+    else memset(results, 0, sizeof(results));
+
+    for (int index = 0; result == 0 && index < state->queued_count; index++) {
+        crypto_job *job = state->queued[index];
+        int written = results[index];
+
+        // Short or unsupported writes are finished the plain way
+        if (written < 0 || pwrite_all(state->out_file, job->output + written, job->result - written, job->offset + written) < 0) result = -1;
+        else if (state->resume && checkpoint_mark(state->resume, job->offset, job->digest) < 0) result = -1;
+    }
+
+    for (int index = 0; index < state->queued_count; index++) pipeline_release(pipeline, state->queued[index]);
+
+    state->queued_count = 0;
+
+    return result;
+}
+
+/**
+ * Retaining sink stage of the receiver: checks a record's position and queues it for
+ * flush_writes().
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Opened job.
+ * @return         0 on success, -1 on failure.
+ */
+int queue_write(transfer_pipeline *pipeline, crypto_job *job) {
+    receive_state *state = pipeline->state;
+
+    if (accept_chunk(state, job) < 0) return -1;
+
+    state->queued[state->queued_count++] = job;
+
+    return (state->queued_count == URING_ENTRIES) ? flush_writes(pipeline) : 0;
+}
+
+/**
+ * Receives DATA frames from a socket until the END frame, verifies and decrypts the records,
+ * and writes them at their offsets. Socket reads, opening and disk writes run concurrently;
+ * unless io_uring batches them, writes go through a write-behind thread in large blocks.
+ *
+ * @param out_file    File descriptor of the output file.
+ * @param ranges      Ranges the sender was asked for, sorted by offset.
+ * @param range_count Number of ranges.
+ * @param chunk_size  Largest plaintext size of a record.
+ * @param socket      Socket file descriptor to receive data from.
+ * @param session     Negotiated session.
+ * @param threads     Number of crypto worker threads.
+ * @param resume      Checkpoint to update, or NULL.
+ * @param engine      IO_ENGINE_* used for disk writes.
+ * @param direct      1 to write with O_DIRECT where the file system allows it.
+ * @param tree        Tree hash to record the received chunks in, or NULL.
+ * @return            0 if every range arrived intact, -1 on failure.
+ */
+int decrypt_file(int out_file, const byte_range *ranges, uint32_t range_count, int chunk_size, int socket, crypto_session *session, int threads, checkpoint *resume, int engine,
+                 int direct, tree_digest *tree) {
+    receive_state state = {.out_file = out_file, .ranges = ranges, .range_count = range_count, .chunk_size = chunk_size, .socket = socket, .resume = resume};
+    transfer_pipeline pipeline = {0};
+    write_behind writer;
+    int result;
+
+    state.write_uring = (engine == IO_ENGINE_URING);
+    state.write_ring.fd = -1;
+
+    pipeline.session = session;
+    pipeline.encrypting = 0;
+    pipeline.digest_chunks = (resume != NULL || tree != NULL);
+    pipeline.tree = tree;
+    pipeline.source = receive_chunk;
+    pipeline.state = &state;
+
+    // Socket reads stay plain: the length of a frame is only known once its header arrived
+    if (engine == IO_ENGINE_URING && !direct) {
+        pipeline.sink = queue_write;
+        pipeline.sink_retains = 1;
+        pipeline.flush = flush_writes;
+    }
+    else if (writeback_open(&writer, out_file, chunk_size, resume, direct) == 0) {
+        pipeline.sink = gather_chunk;
+        state.writer = &writer;
+    }
+    else pipeline.sink = write_chunk;
+
+    result = pipeline_run(&pipeline, threads, chunk_size + RECORD_OVERHEAD, chunk_size);
+
+    // Every block must be on disk before the receiver answers or reads the file back
+    if (state.writer && writeback_close(state.writer) < 0) result = -1;
+
+    io_ring_free(&state.write_ring);
+
+    if (result < 0) return -1;
+
+    return next_range_offset(ranges, range_count, &state.range_index, &state.offset) ? -1 : 0;
+}
@@ -1,16 +1,4 @@
-#include "header.h"
-#include "security.h"
-
-#define PORT 52120          // TCP Server Port
-#define BUFFER_SIZE 1024
-#define BC_PORT 52121       // UDP Broadcast Port
-#define BC_DISCOVERY_MSG "DISCOVER_FILE_TRANSFER"
-
-// Structure to pass multiple arguments to the spinner thread
-typedef struct {
-    int *loading_state;     // Pointer to flag that indicates when to stop the spinner
-    const char *message;    // Message to be shown with the spinner animation
-} spinner_args;
+#include "session.h"
 
 // Prototype functions
 char *get_broadcast_address(const char *interface_name);
@@ -19,45 +7,240 @@ void *listen_bc(void *show_log);
 int get_neighbor(const char *interface_name);
 
 /**
- * Spinner thread function that displays a rotating animation in the terminal.
+ * Sends an ERROR frame on every stream of a transfer that will not be received.
  *
- * @param arg Pointer to a spinner_args structure containing:
- *            - loading_state: shared int pointer used to stop the spinner when set to 1
- *            - message: label text to display alongside the spinner
- * @return    NULL (no return value as it is intended to be used with pthreads)
+ * @param streams      Accepted streams.
+ * @param stream_count Number of streams.
+ * @param flags        ERROR_* flags telling the sender why, or 0.
  */
-void *loading_spinner(void *arg) {
-    spinner_args *args = (spinner_args *)arg;
-    const char spinner[] = {'-', '\\', '|', '/'};
+void abort_streams(transfer_stream *streams, int stream_count, uint8_t flags) {
+    for (int index = 0; index < stream_count; index++) send_frame(streams[index].socket, FRAME_ERROR, flags, NULL, 0);
+}
 
-    int index = 0;
+/**
+ * Closes the sockets of a transfer and releases their resume plans and extents.
+ *
+ * @param streams      Streams to close.
+ * @param stream_count Number of streams.
+ */
+void close_streams(transfer_stream *streams, int stream_count) {
+    for (int index = 0; index < stream_count; index++) {
+        close(streams[index].socket);
+        free(streams[index].ranges);
+        free(streams[index].extents);
+
+        streams[index].ranges = NULL;
+        streams[index].extents = NULL;
+    }
+}
 
-    // Display spinner until loading is complete
-    while (*(args->loading_state) == 0) {
-        printf("\r%s [\e[33m%c\e[0m]", args->message, spinner[index++ % 4]);
+/**
+ * Receives one transfer whose streams have all been accepted. Every stream writes its range of
+ * the output file at its offset; a directory tree is recreated under the output path instead.
+ * The streams are closed on return.
+ *
+ * @param streams      Accepted streams of the transfer.
+ * @param stream_count Number of streams.
+ * @param file_path    Output path of the received file or directory.
+ * @param options      Transfer options.
+ * @return             NULL on success, otherwise the error message to show.
+ */
+const char *receive_transfer(transfer_stream *streams, int stream_count, const char *file_path, const transfer_options *options) {
+    file_metadata *metadata = &streams[0].metadata;
+    const char *error = NULL;
+    checkpoint resume = {0};
+    int resume_return = -1, received_file = -1;
 
-        fflush(stdout);
-        usleep(100000);  // Sleep for 100ms between frames
+    if (check_ranges(streams, stream_count) < 0) error = "ProtocolError: The file metadata is malformed";
+
+    // Unencrypted data is only accepted by a receiver that asked for it
+    if (error == NULL && metadata->payload == PAYLOAD_PLAIN && options->payload != PAYLOAD_PLAIN) {
+        error = "SecurityError: The sender does not encrypt the data, start the receiver with --no-encrypt to accept it";
+    }
+
+    // A directory tree is recreated under the output path over its single stream
+    int is_tree = (error == NULL && metadata->kind == TRANSFER_TREE);
+
+    // Piped input arrives in order over its single stream and is written as it comes
+    int is_piped = (error == NULL && metadata->kind == TRANSFER_PIPED);
+
+    // Everything else is written at offsets, which a pipe cannot take
+    if (error == NULL && !is_piped && options->output_fd >= 0) error = "FileError: Only piped input (sent from \"-\") can be written to stdout";
+
+    // Zero-copy content never reaches user space, so it cannot be digested for a checkpoint
+    int is_zero_copy = (error == NULL && !is_tree && accept_zero_copy(streams, stream_count));
+
+    // Multicast datagrams are smaller than a chunk and arrive in any order, so they skip the checkpoint too
+    int is_multicast = (error == NULL && !is_tree && !is_zero_copy && metadata->multicast_group != 0);
+    int group = -1;
+
+    // A sparse file only gets its data extents, the rest of it is left as holes
+    int is_sparse = (error == NULL && !is_tree && metadata->sparse);
+
+    // A file that is already here is rebuilt next to it from its own blocks and the sender's changes
+    int basis = (error == NULL && !is_tree && !is_zero_copy && !is_multicast) ? open_delta_basis(file_path, metadata) : -1;
+    char delta_path[PATH_MAX];
+
+    // Otherwise the chunks of the file that the chunk store already holds are copied from it
+    int is_dedup = (error == NULL && !is_tree && !is_zero_copy && !is_multicast && basis < 0 && metadata->dedup && options->chunk_store != NULL &&
+                    metadata->size > 0 && metadata->chunk_size >= CDC_MIN_CHUNK && !checkpoint_exists(file_path));
+    chunk_store store = {0};
+
+    if (is_dedup && chunk_store_open(&store, options->chunk_store) < 0) error = "FileError: Failed to open the chunk store";
+
+    // The chunks every stream opens feed a tree hash of the file, compared with the sender's at the end
+    int is_verify = (error == NULL && !is_tree && metadata->verify);
+    tree_digest tree = {0};
+
+    if (is_verify && tree_digest_init(&tree, metadata->size, metadata->chunk_size) < 0) error = "TransferError: Failed to allocate the tree hash";
+
+    if (is_tree && (received_file = open_tree_root(file_path, metadata->mode)) < 0) {
+        error = "FileError: Failed to create the output directory";
+    }
+
+    if (is_piped) {
+        received_file = (options->output_fd >= 0) ? dup(options->output_fd) : open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (received_file < 0) error = "FileError: Failed to write received file";
+    }
+
+    if (basis >= 0) {
+        if (snprintf(delta_path, sizeof(delta_path), "%s%s", file_path, DELTA_SUFFIX) >= (int)sizeof(delta_path) ||
+            (received_file = open(delta_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+            error = "FileError: Failed to write received file";
+        }
+    }
+
+    // Pick up an interrupted transfer of the same source file, if its checkpoint is still there
+    if (error == NULL && !is_tree && !is_piped && !is_zero_copy && !is_multicast && basis < 0 && !is_dedup && (resume_return = checkpoint_open(&resume, file_path, metadata)) < 0) {
+        error = "FileError: Failed to create the resume checkpoint";
+    }
+
+    // Open the file for writing and size it so every stream can write its range; a resumed
+    // file keeps its contents and only the chunks that still match are kept
+    if (error == NULL && !is_tree && !is_piped && basis < 0) {
+        int flags = O_RDWR | O_CREAT | ((resume_return == 1) ? 0 : O_TRUNC);
+
+        received_file = open(file_path, flags, (metadata->mode != 0) ? metadata->mode & 0777 : 0644);
+
+        // Reserving the whole file up front reports a full disk before any data moves; a sparse
+        // file reserves its data extents, and a resumed one gets its holes punched out again
+        int sized = (received_file >= 0 && !is_sparse) ? preallocate_file(received_file, metadata->size) :
+                    (received_file >= 0) ? ftruncate(received_file, metadata->size) : -1;
+
+        for (int index = 0; sized == 0 && is_sparse && index < stream_count; index++) {
+            sized = allocate_extents(received_file, stream_span(&streams[index].metadata), streams[index].extents, streams[index].extent_count, resume_return == 1);
+        }
+
+        if (sized < 0 && received_file >= 0 && errno == ENOSPC) error = "FileError: Not enough disk space for the received file";
+        else if (sized < 0 || (resume_return >= 0 && checkpoint_verify(&resume, received_file) < 0)) {
+            error = "FileError: Failed to write received file";
+        }
+        else if (metadata->mode != 0) fchmod(received_file, metadata->mode & 0777);
+    }
+
+    // Chunks in holes are never sent: the checkpoint counts them as written and the tree hashes them as zeros
+    for (int index = 0; error == NULL && is_sparse && index < stream_count; index++) {
+        if (mark_hole_chunks(stream_span(&streams[index].metadata), metadata->size, streams[index].extents, streams[index].extent_count,
+                             metadata->chunk_size, (resume_return >= 0) ? &resume : NULL, (is_verify) ? &tree : NULL) < 0) {
+            error = "FileError: Failed to write the resume checkpoint";
+        }
+    }
+
+    // The group is joined before the plan, which lets the sender start multicasting
+    if (error == NULL && is_multicast && (group = join_multicast_group(streams[0].socket, metadata)) < 0) {
+        error = "ConnectionError: Failed to join the multicast group";
+    }
+
+    // Tell every stream which parts of its range are still missing
+    if (error == NULL && !is_tree && !is_piped && basis < 0 && !is_dedup &&
+        send_resume_plans(streams, stream_count, (is_zero_copy || is_multicast) ? NULL : &resume) < 0) {
+        error = "ConnectionError: Failed to send the resume plan";
+    }
+
+    // Chunks the checkpoint already holds count as done
+    for (int index = 0; error == NULL && !is_tree && !is_piped && basis < 0 && !is_dedup && index < stream_count; index++) {
+        telemetry_skip(streams[index].metadata.range_length - planned_bytes(&streams[index]));
+    }
+
+    // Receive every stream in parallel, sharing the crypto threads between them
+    if (error == NULL) {
+        for (int index = 0; index < stream_count; index++) {
+            streams[index].file = received_file;
+            streams[index].threads = (options->crypto_threads > stream_count) ? options->crypto_threads / stream_count : 1;
+            streams[index].engine = options->io_engine;
+            streams[index].direct = options->direct_io;
+            streams[index].group = group;
+            streams[index].basis = basis;
+            streams[index].store = &store;
+            streams[index].tree = (is_verify) ? &tree : NULL;
+
+            void *(*receive)(void *) = (is_tree) ? receive_tree : (is_piped) ? receive_piped : (is_multicast) ? receive_multicast : (basis >= 0) ? receive_delta :
+                                       (is_dedup) ? receive_dedup : receive_stream;
+
+            if (pthread_create(&streams[index].thread, NULL, receive, &streams[index]) != 0) {
+                streams[index].result = -1;
+                streams[index].thread = 0;
+            }
+        }
+
+        for (int index = 0; index < stream_count; index++) {
+            if (streams[index].thread) pthread_join(streams[index].thread, NULL);
+            if (streams[index].result < 0) error = "TransferError: The received file is incomplete or corrupted";
+        }
+    }
+    else abort_streams(streams, stream_count, 0);
+
+    // Keep the checkpoint for the next attempt unless every chunk arrived, or none did
+    if (resume_return >= 0 && checkpoint_close(&resume) != 1 && error == NULL) {
+        error = "TransferError: The received file is incomplete or corrupted";
+    }
+
+    // Hash the leaves no stream saw while the sender does the same, then compare the roots
+    if (is_verify && error == NULL) {
+        transfer_stream *first = &streams[0];
+        unsigned char root[DIGEST_LENGTH], sender_root[DIGEST_LENGTH];
+
+        for (int index = 0; index < stream_count; index++) {
+            if (streams[index].metadata.stream_index == 0) first = &streams[index];
+        }
+
+        if (tree_digest_fill(&tree, received_file, options->crypto_threads) < 0 || tree_digest_root(&tree, root) < 0 ||
+            receive_verify(first->socket, &first->session, sender_root) < 0) {
+            error = "TransferError: Failed to verify the received file";
+        }
+        else if (CRYPTO_memcmp(root, sender_root, DIGEST_LENGTH) != 0) error = "IntegrityError: The received file does not match the source";
+
+        send_ack(first->socket, (error == NULL) ? 0 : -1);
     }
 
-    printf("\r");  // Clear line after done
+    // The new version replaces the existing copy only once it is complete
+    if (basis >= 0 && received_file >= 0) {
+        if (error == NULL && metadata->mode != 0) fchmod(received_file, metadata->mode & 0777);
+
+        if (error == NULL && rename(delta_path, file_path) < 0) error = "FileError: Failed to write received file";
+        if (error != NULL) unlink(delta_path);
+    }
+
+    close_streams(streams, stream_count);
+
+    if (group >= 0) close(group);
+    if (received_file >= 0) close(received_file);
+    if (basis >= 0) close(basis);
+    if (is_dedup) chunk_store_close(&store);
+    if (is_verify) tree_digest_free(&tree);
+
+    return error;
 }
 
 /**
- * Runs the server to receive an encrypted file from a client over a socket connection.
+ * Creates the TCP socket that receives transfers and starts listening on PORT.
  *
- * @param output_path A string containing the output path of the received file.
- * @return 0 on success, -1 on any failure during socket operations, file access, or decryption.
+ * @return The listening socket, or -1 on failure (the error has been printed).
  */
-int server(const char *output_path) {
-    int server_fd, new_socket;
+int open_listener() {
+    int server_fd;
     struct sockaddr_in address;
-    int address_len = sizeof(address);
-
-    unsigned char key[KEY_LENGTH];   // 32-byte symmetric encryption key
-    unsigned char iv[IV_LENGTH];     // 16-byte initialization vector
-
-    FILE *received_file;
 
     // Create a TCP socket
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -69,6 +252,11 @@ int server(const char *output_path) {
         return -1;
     }
 
+    // Allow quick restarts while the previous connection is still in TIME_WAIT
+    int reuse_address = 1;
+
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address));
+
     // Configure address and port
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -79,17 +267,41 @@ int server(const char *output_path) {
         printf("\e[31mConnectionError: Failed to bind the socket to the port\e[0m\n");
         fflush(stdout);
 
+        close(server_fd);
+
         return -1;
     }
 
-    // Start listening for incoming connections
-    if (listen(server_fd, 3) < 0) {
+    // Start listening for incoming connections; every stream of a transfer connects at once
+    if (listen(server_fd, SOMAXCONN) < 0) {
         printf("\e[31mConnectionError: Failed to listen for incoming connections\e[0m\n");
         fflush(stdout);
 
+        close(server_fd);
+
         return -1;
     }
 
+    return server_fd;
+}
+
+/**
+ * Runs the server to receive an encrypted file from a client. The client may split the file
+ * across several TCP streams; each stream writes its range of the output file at its offset.
+ * A directory tree arrives over a single stream and is recreated under the output path.
+ *
+ * @param output_path A string containing the output path of the received file or directory.
+ * @param options Transfer options.
+ * @return 0 on success, -1 on any failure during socket operations, file access, or decryption.
+ */
+int server(const char *output_path, const transfer_options *options) {
+    transfer_stream streams[MAX_STREAMS] = {0};
+    int stream_count = 0;
+    const char *error = NULL;
+    int server_fd = open_listener();
+
+    if (server_fd < 0) return -1;
+
     printf("\e[33mWaiting for connection...\e[0m");
     fflush(stdout);
 
@@ -97,8 +309,8 @@ int server(const char *output_path) {
 
     pthread_create(&listen_thread, NULL, listen_bc, (void *)1);
 
-    // Accept a client connection
-    new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&address_len);
+    // Accept the first stream, which announces how many streams follow
+    int accept_return = accept_stream(server_fd, &streams[0]);
 
     pthread_cancel(listen_thread);
     pthread_join(listen_thread, NULL);
@@ -106,235 +318,405 @@ int server(const char *output_path) {
     printf("\r\e[32mConnected                \e[0m");
     fflush(stdout);
 
-    // Setup spinner for receiving
-    spinner_args args;
-    pthread_t thread;
+    // Show live progress while the transfer runs
+    transfer_telemetry telemetry;
+
+    telemetry_start(&telemetry, "Receiving", (accept_return == 0 && streams[0].metadata.kind == TRANSFER_FILE) ? streams[0].metadata.size : 0, 1);
 
-    int loading_state = 0;
+    if (accept_return == 0) stream_count = 1;
 
-    args.loading_state = &loading_state;
-    args.message = "Receiving";
+    // Accept the remaining streams of the same transfer
+    set_receive_timeout(server_fd, HANDSHAKE_TIMEOUT);
 
-    pthread_create(&thread, NULL, loading_spinner, &args);
+    while (accept_return == 0 && stream_count < (int)streams[0].metadata.stream_count) {
+        if ((accept_return = accept_stream(server_fd, &streams[stream_count])) == 0) stream_count++;
+    }
 
-    if (new_socket < 0) {
-        loading_state = 1;
+    if (accept_return == -1) error = "ConnectionError: Failed to receive incoming connections";
+    else if (accept_return == -2) error = "ProtocolError: The sender uses a ByteValve version incompatible with " VERSION;
+    else if (accept_return == -3) error = "ProtocolError: The file metadata is malformed";
 
-        pthread_join(thread, NULL);
+    const char *file_path = (output_path != NULL) ? output_path : streams[0].metadata.name;
 
-        printf("\e[31mConnectionError: Failed to receive incoming connections\e[0m\n");
-        fflush(stdout);
-        
-        return -1;
+    if (error == NULL) error = receive_transfer(streams, stream_count, file_path, options);
+    else {
+        abort_streams(streams, stream_count, 0);
+        close_streams(streams, stream_count);
     }
 
-    // Receive encryption key
-    if (read(new_socket, key, sizeof(key)) <= 0) {
-        loading_state = 1;
+    telemetry_stop(&telemetry);
 
-        pthread_join(thread, NULL);
-
-        printf("\e[31mConnectionError: Failed to receive the key\e[0m\n");
-        fflush(stdout);
+    close(server_fd);
 
-        return -1;
+    if (error != NULL) printf("\e[31m%s\e[0m\n", error);
+    else {
+        printf("\e[32m%s successfully received%s\e[0m\n", (options->output_fd >= 0) ? streams[0].metadata.name : file_path,
+               (streams[0].metadata.verify) ? " and verified" : "");
+        print_telemetry(&telemetry, "Received");
     }
 
-    // Receive IV
-    if (read(new_socket, iv, sizeof(iv)) <= 0) {
-        loading_state = 1;
+    if (options->stats_json != NULL && write_stats_json(options->stats_json, &telemetry, "receiver", &streams[0].metadata, stream_count, error) < 0) {
+        printf("\e[31mFileError: Failed to write %s\e[0m\n", options->stats_json);
+    }
 
-        pthread_join(thread, NULL);
+    fflush(stdout);
 
-        printf("\e[31mConnectionError: Failed to receive IV\e[0m\n");
-        fflush(stdout);
+    return (error != NULL) ? -1 : 0;
+}
 
-        return -1;
+/**
+ * Runs the sending thread of every connected stream and waits for the receiver's ACK on each.
+ * If the streams announced it, the tree hash the pipelines fed is then completed with the
+ * leaves they did not see (resumed, reused or zero-copy chunks) and compared by the receiver.
+ *
+ * @param streams      Connected streams sharing one file.
+ * @param stream_count Number of streams.
+ * @param send         Thread function of every stream.
+ * @param threads      Threads hashing the leaves the pipelines did not see.
+ * @param root         Output for the root of the tree hash, when verified.
+ * @return             0 on success, -1 if a stream failed, -2 if the receiver's copy does not match,
+ *                     -3 if the receiver's output path is busy, -4 if it cannot be used.
+ */
+int send_streams(transfer_stream *streams, int stream_count, void *(*send)(void *), int threads, unsigned char *root) {
+    file_metadata *metadata = &streams[0].metadata;
+    tree_digest tree = {0};
+    int result = 0;
+
+    // Every stream carries the same verify flag, cleared by open_stream() for older receivers;
+    // without a tree the root is never sent and the receiver fails the transfer
+    if (metadata->verify && tree_digest_init(&tree, metadata->size, metadata->chunk_size) < 0) metadata->verify = 0;
+
+    int is_verify = metadata->verify;
+
+    // The holes of a sparse file are never read, their leaves are the digest of zeros
+    for (int index = 0; is_verify && index < stream_count; index++) {
+        if (streams[index].metadata.sparse) {
+            mark_hole_chunks(stream_span(&streams[index].metadata), metadata->size, streams[index].extents, streams[index].extent_count,
+                             metadata->chunk_size, NULL, &tree);
+        }
     }
 
-    // Receive encrypted file name
-    unsigned char cipher_text[BUFFER_SIZE + EVP_MAX_BLOCK_LENGTH];
-    int cipher_text_len;
+    for (int index = 0; index < stream_count; index++) {
+        streams[index].tree = (is_verify) ? &tree : NULL;
 
-    if ((cipher_text_len = read(new_socket, cipher_text, sizeof(cipher_text))) <= 0) {
-        loading_state = 1;
+        if (pthread_create(&streams[index].thread, NULL, send, &streams[index]) != 0) {
+            streams[index].result = -1;
+            streams[index].thread = 0;
 
-        pthread_join(thread, NULL);
+            shutdown(streams[index].socket, SHUT_RDWR);
+        }
+    }
 
-        printf("\e[31mConnectionError: Failed to receive the file name\e[0m\n");
-        fflush(stdout);
+    for (int index = 0; index < stream_count; index++) {
+        if (streams[index].thread) pthread_join(streams[index].thread, NULL);
 
-        return -1;
+        // The receiver's reason for refusing says more than the streams that broke off
+        if (streams[index].result < -2) result = streams[index].result;
+        else if (streams[index].result < 0 && result == 0) result = -1;
     }
 
-    // Decrypt the file name
-    unsigned char file_name[256];
-    int decrypted_len = decrypt(cipher_text, cipher_text_len, key, iv, file_name);
+    if (is_verify && result == 0) {
+        if (tree_digest_fill(&tree, streams[0].file, threads) < 0 || tree_digest_root(&tree, root) < 0 ||
+            send_verify(streams[0].socket, &streams[0].session, root) < 0 || receive_ack(streams[0].socket) < 0) result = -2;
+    }
 
-    file_name[decrypted_len] = '\0';
+    tree_digest_free(&tree);
 
-    // Open file for writing
-    received_file = fopen((output_path != NULL) ? output_path : (char *)file_name, "wb");
+    return result;
+}
 
-    if (received_file == NULL) {
-        loading_state = 1;
+/**
+ * Sends an encrypted file to the server, split across options->streams TCP connections. A
+ * directory is sent recursively over a single connection.
+ *
+ * @param server_ip A string containing the server's IPv4 address or hostname.
+ * @param file_path A string containing the path to the file or directory to be sent.
+ * @param options Transfer options.
+ * @return 0 on success, -1 on any failure during socket operations, file access, or encryption.
+ */
+int client(char *server_ip, char *file_path, const transfer_options *options) {
+    transfer_stream streams[MAX_STREAMS] = {0};
+    char address[INET_ADDRSTRLEN];
+    struct stat file_stat;
+    int file;
 
-        pthread_join(thread, NULL);
+    // Hostnames are looked up in the peer cache first, then on the network
+    int resolved = resolve_peer(server_ip, address, 0);
 
-        printf("\e[31mFileError: Failed to write received file\e[0m\n");
+    if (resolved < 0) {
+        printf("\e[31mConnectionError: Could not find %s on the network\e[0m\n", server_ip);
         fflush(stdout);
-        
+
         return -1;
     }
 
-    // Decrypt and receive file content
-    decrypt_file(received_file, BUFFER_SIZE, new_socket, key, iv);
+    // "-" sends standard input until it ends, without staging it in a file
+    int is_piped = (strcmp(file_path, "-") == 0);
 
-    // Finish spinner
-    loading_state = 1;
+    // Open the file to be sent
+    file = (is_piped) ? dup(STDIN_FILENO) : open(file_path, O_RDONLY);
 
-    pthread_join(thread, NULL);
+    if (file < 0 || fstat(file, &file_stat) < 0 || !(is_piped || S_ISREG(file_stat.st_mode) || S_ISDIR(file_stat.st_mode))) {
+        printf("\e[31mFileError: Failed to read the file\e[0m\n");
+        fflush(stdout);
 
-    printf("\e[32m%s successfully received\e[0m\n", (output_path != NULL) ? (unsigned char *)(strrchr(output_path, '/') + 1) : file_name);
-    fflush(stdout);
+        if (file >= 0) close(file);
 
-    // Clean up the memory
-    fclose(received_file);
-    close(new_socket);
-    close(server_fd);
-    
-    return 0;
-}
+        return -1;
+    }
 
-/**
- * Sends an encrypted file to the server over a socket connection.
- *
- * @param server_ip A string containing the server's IPv4 address.
- * @param file_path A string containing the path to the file to be sent.
- * @return 0 on success, -1 on any failure during socket operations, file access, or encryption.
- */
-int client(char *server_ip, char *file_path) {
-    int client_socket = 0;
-    struct sockaddr_in serv_address;
-    char buffer[BUFFER_SIZE] = {0};
+    int is_tree = (!is_piped && S_ISDIR(file_stat.st_mode));
+    int is_file = (!is_piped && !is_tree);
 
-    unsigned char key[KEY_LENGTH];   // 32-byte AES encryption key
-    unsigned char iv[IV_LENGTH];     // 16-byte initialization vector
+    // Extract file name from the full path; directories are named after their resolved path
+    // so that "." or "dir/" still get a usable name
+    char resolved_path[PATH_MAX];
 
-    // Generate random key and IV
-    RAND_bytes(key, sizeof(key));
-    RAND_bytes(iv, sizeof(iv));
+    if (is_tree && realpath(file_path, resolved_path) != NULL) file_path = resolved_path;
 
-    FILE *file;
+    char *file_name = strrchr(file_path, '/');
 
-    // Create socket
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    file_name = (is_piped) ? PIPED_NAME : (file_name) ? file_name + 1 : file_path;
 
-    if (client_socket < 0) {
-        printf("\e[31mConnectionError: Failed to create the client socket\e[0m\n");
+    if (*file_name == '\0' || strlen(file_name) > MAX_NAME_LENGTH) {
+        printf("\e[31mFileError: Failed to read the file\e[0m\n");
         fflush(stdout);
-        
+
+        close(file);
+
         return -1;
     }
 
-    // Configure server address
-    serv_address.sin_family = AF_INET;
-    serv_address.sin_port = htons(PORT);
+    // Describe the file with length-prefixed metadata records and split it into ranges
+    file_metadata metadata = {0};
+
+    memcpy(metadata.name, file_name, strlen(file_name) + 1);
+    RAND_bytes(metadata.transfer_id, TRANSFER_ID_LENGTH);
+
+    metadata.size = (is_file) ? file_stat.st_size : 0;
+    metadata.mode = (is_piped) ? 0 : file_stat.st_mode & 0777;
+    metadata.chunk_size = DEFAULT_CHUNK_SIZE;
+    metadata.kind = (is_tree) ? TRANSFER_TREE : (is_piped) ? TRANSFER_PIPED : TRANSFER_FILE;
+    metadata.payload = (is_file) ? options->payload : PAYLOAD_SEALED;
+    metadata.delta = (options->delta && is_file && metadata.payload == PAYLOAD_SEALED);
+    metadata.dedup = (options->dedup && is_file && metadata.payload == PAYLOAD_SEALED && metadata.size / CDC_MIN_CHUNK < DEDUP_MAX_CHUNKS);
+    metadata.verify = (options->verify && is_file && metadata.size / metadata.chunk_size < VERIFY_MAX_LEAVES);
 
-    if(inet_pton(AF_INET, server_ip, &serv_address.sin_addr) <= 0) {
-        printf("\e[31mConnectionError: Invalid server IP address format\e[0m\n");
+    // sendfile() has no MSG_NOSIGNAL, a receiver that goes away must not kill the sender
+    if (metadata.payload != PAYLOAD_SEALED) signal(SIGPIPE, SIG_IGN);
+
+    // Identify this version of the file so the receiver only resumes from matching chunks
+    if (is_file && source_identity(&file_stat, metadata.source_id) < 0) {
+        printf("\e[31mFileError: Failed to identify the file\e[0m\n");
         fflush(stdout);
-        
+
+        close(file);
+
         return -1;
     }
 
-    // Connect to the server
-    if (connect(client_socket, (struct sockaddr *)&serv_address, sizeof(serv_address)) < 0) {
-        printf("\e[31mConnectionError: Failed to connect to the server\e[0m\n");
-        fflush(stdout);
-        
-        return -1;
+    // Deltas and stored chunks are matched against the whole file, so they take a single stream
+    int is_reusing = (metadata.delta || metadata.dedup);
+
+    // Only the data extents of a sparse file are sent; the receiver recreates the holes
+    byte_range *extents = NULL;
+    uint32_t extent_count = 0;
+
+    if (is_file && !is_reusing && map_data_extents(file, metadata.size, metadata.chunk_size, &extents, &extent_count) == 0) {
+        metadata.sparse = (range_bytes(extents, extent_count) < metadata.size);
     }
 
-    // Send key and IV
-    if (send(client_socket, key, sizeof(key), 0) < 0) {
-        printf("\e[31mConnectionError: Failed to send the key to the server\e[0m\n");
+    int stream_count = split_ranges(&metadata, streams, (is_file && !is_reusing) ? options->streams : 1);
+
+    for (int index = 0; metadata.sparse && index < stream_count; index++) {
+        if (clip_ranges(extents, extent_count, stream_span(&streams[index].metadata), &streams[index].extents, &streams[index].extent_count) < 0) {
+            printf("\e[31mFileError: Failed to map the file's extents\e[0m\n");
+            fflush(stdout);
+
+            for (int cleanup = 0; cleanup < index; cleanup++) free(streams[cleanup].extents);
+
+            free(extents);
+            close(file);
+
+            return -1;
+        }
+    }
+
+    // A session kept open to the receiver carries the streams as channels of its connection
+    int attach_return = (options->session) ? attach_session(address, streams, stream_count) : -1;
+
+    if (options->session && attach_return < 0) {
+        printf("\e[33m%s, connecting directly\e[0m\n", (attach_return == -2) ? "The receiver does not serve sessions" : "Failed to open a session");
         fflush(stdout);
+    }
 
-        return -1;
+    // Connect every stream before sending so the receiver can accept them together
+    for (int index = 0; index < stream_count; index++) {
+        int open_return = (attach_return == 0) ? announce_stream(&streams[index]) : open_stream(address, PORT, &streams[index]);
+
+        // A cached address that no longer answers is looked up again, once
+        if (open_return == -1 && attach_return < 0 && index == 0 && resolved == 1 && (resolved = resolve_peer(server_ip, address, 1)) >= 0) {
+            open_return = open_stream(address, PORT, &streams[index]);
+        }
+
+        if (open_return < 0) {
+            if (open_return == -3) printf("\e[31mConnectionError: Invalid server IP address format\e[0m\n");
+            else if (open_return == -2) printf("\e[31mProtocolError: The server did not answer the handshake (ByteValve older than " VERSION "?)\e[0m\n");
+            else printf("\e[31mConnectionError: Failed to connect to the server\e[0m\n");
+            fflush(stdout);
+
+            // Channels of a session were all handed over at once
+            for (int cleanup = 0; cleanup < ((attach_return == 0) ? stream_count : index); cleanup++) close(streams[cleanup].socket);
+            for (int cleanup = 0; cleanup < stream_count; cleanup++) free(streams[cleanup].extents);
+
+            free(extents);
+            close(file);
+
+            return -1;
+        }
+
+        streams[index].file = file;
+        streams[index].threads = (options->crypto_threads > stream_count) ? options->crypto_threads / stream_count : 1;
+        streams[index].engine = options->io_engine;
+        streams[index].compress = options->compress;
     }
 
-    if (send(client_socket, iv, sizeof(iv), 0) < 0) {
-        printf("\e[31mConnectionError: Failed to send IV to the server\e[0m\n");
+    // Older receivers refuse the metadata of piped input
+    if (is_piped && !(streams[0].session.peer_flags & HELLO_PIPED)) {
+        printf("\e[31mProtocolError: The receiver cannot take piped input (older ByteValve version)\e[0m\n");
         fflush(stdout);
 
+        close(streams[0].socket);
+        close(file);
+
         return -1;
     }
 
-    // Setup spinner for sending
-    spinner_args args;
-    pthread_t thread;
+    if (metadata.payload == PAYLOAD_KTLS && streams[0].metadata.payload != PAYLOAD_KTLS) {
+        printf("\e[33mKernel TLS is not available, encrypting in user space\e[0m\n");
+        fflush(stdout);
+    }
 
-    int loading_state = 0;
+    // Show live progress while the transfer runs
+    transfer_telemetry telemetry;
+
+    telemetry_start(&telemetry, "Sending", metadata.size, 1);
+
+    // Send every range in parallel, then wait for the receiver's verdict on each stream
+    unsigned char root[DIGEST_LENGTH];
+    uint64_t sent_bytes = 0, reused_bytes = 0, skipped_entries = 0;
+    compression_report report = {0, 0};
+    void *(*send)(void *) = (is_tree) ? send_tree : (is_piped) ? send_piped : (is_reusing) ? send_reusing : send_stream;
+    int send_return = send_streams(streams, stream_count, send, options->crypto_threads, root);
+    int is_verify = streams[0].metadata.verify;
+    uint64_t hole_bytes = (streams[0].metadata.sparse) ? metadata.size - range_bytes(extents, extent_count) : 0;
+
+    for (int index = 0; index < stream_count; index++) {
+        sent_bytes += planned_bytes(&streams[index]);
+        reused_bytes += streams[index].reused_bytes;
+        skipped_entries += streams[index].skipped_entries;
+        report.plain_bytes += streams[index].report.plain_bytes;
+        report.packed_bytes += streams[index].report.packed_bytes;
+    }
 
-    args.loading_state = &loading_state;
-    args.message = "Sending";
+    telemetry_stop(&telemetry);
 
-    pthread_create(&thread, NULL, loading_spinner, &args);
+    const char *error = (send_return == -1) ? "TransferError: The server did not confirm the file" :
+                        (send_return == -2) ? "IntegrityError: The server's copy does not match the source" :
+                        (send_return == -3) ? "TransferError: The output path is busy on the receiver" :
+                        (send_return == -4) ? "TransferError: The receiver cannot use the output path" : NULL;
 
-    // Open the file to be sent
-    file = fopen(file_path, "rb");
+    if (options->stats_json != NULL && write_stats_json(options->stats_json, &telemetry, "sender", &streams[0].metadata, stream_count, error) < 0) {
+        printf("\e[31mFileError: Failed to write %s\e[0m\n", options->stats_json);
+        fflush(stdout);
+    }
 
-    if (file == NULL) {
-        loading_state = 1;
+    // Clean up the memory
+    for (int index = 0; index < stream_count; index++) {
+        close(streams[index].socket);
+        free(streams[index].ranges);
+        free(streams[index].extents);
+    }
 
-        pthread_join(thread, NULL);
+    free(extents);
+    close(file);
 
-        printf("\e[31mFileError: Failed to read the file\e[0m\n");
+    if (send_return == -1) {
+        printf("\e[31mTransferError: The server did not confirm %s\e[0m\n", file_name);
         fflush(stdout);
-        
+
         return -1;
     }
 
-    // Extract file name from the full path
-    char *file_name = strrchr(file_path, '/');
-
-    file_name = (file_name) ? file_name + 1 : file_path;
+    if (send_return == -2) {
+        printf("\e[31mIntegrityError: The server's copy of %s does not match the source\e[0m\n", file_name);
+        fflush(stdout);
 
-    // Encrypt and send the file name
-    unsigned char cipher_text[BUFFER_SIZE + EVP_MAX_BLOCK_LENGTH];
-    int cipher_text_len = encrypt((unsigned char *)file_name, strlen(file_name), key, iv, cipher_text);
+        return -1;
+    }
 
-    if (send(client_socket, cipher_text, cipher_text_len, 0) < 0) {
-        loading_state = 1;
+    if (send_return == -3) {
+        printf("\e[31mTransferError: The output path of %s is busy on the receiver, another transfer is writing it\e[0m\n", file_name);
+        fflush(stdout);
 
-        pthread_join(thread, NULL);
+        return -1;
+    }
 
-        printf("\e[31mConnectionError: Failed to send the file name to the server\e[0m\n");
+    if (send_return == -4) {
+        printf("\e[31mTransferError: The receiver cannot use the output path of %s (too long)\e[0m\n", file_name);
         fflush(stdout);
 
         return -1;
     }
 
-    // Optional delay to ensure file name is processed
-    sleep(1);
-
-    // Encrypt and send file content
-    encrypt_file(file, BUFFER_SIZE, client_socket, key, iv);
+    // The receiver has everything the walker found, but not the whole tree
+    if (skipped_entries > 0) {
+        printf("\e[33m%s sent without %llu special files (FIFOs, sockets or devices), the copy is incomplete\e[0m\n", file_name,
+               (unsigned long long)skipped_entries);
+    }
+    else if (is_piped) {
+        printf("\e[32m%s successfully sent (%llu bytes)\e[0m\n", file_name, (unsigned long long)streams[0].metadata.size);
+    }
+    else if (streams[0].plan_flags & RESUME_DEDUP) {
+        printf("\e[32m%s successfully sent (deduplicated, %llu of %llu bytes came from the receiver's chunk store)\e[0m\n", file_name,
+               (unsigned long long)reused_bytes, (unsigned long long)metadata.size);
+    }
+    else if (reused_bytes > 0) {
+        printf("\e[32m%s successfully sent (delta, %llu of %llu bytes were reused from the receiver's copy)\e[0m\n", file_name,
+               (unsigned long long)reused_bytes, (unsigned long long)metadata.size);
+    }
+    else if (sent_bytes + hole_bytes < metadata.size) {
+        printf("\e[32m%s successfully sent (resumed, %llu of %llu bytes were already there)\e[0m\n", file_name,
+               (unsigned long long)(metadata.size - hole_bytes - sent_bytes), (unsigned long long)metadata.size);
+    }
+    else if (hole_bytes > 0) {
+        printf("\e[32m%s successfully sent (sparse, %llu of %llu bytes are holes and were not sent)\e[0m\n", file_name,
+               (unsigned long long)hole_bytes, (unsigned long long)metadata.size);
+    }
+    else printf("\e[32m%s successfully sent\e[0m\n", file_name);
 
-    // Finish spinner
-    loading_state = 1;
+    // Show the root so both copies can also be compared by hand
+    if (is_verify) {
+        printf("Verified, tree hash ");
 
-    pthread_join(thread, NULL);
+        for (int index = 0; index < DIGEST_LENGTH; index++) printf("%02x", root[index]);
 
-    printf("\e[32m%s successfully sent\e[0m\n", file_name);
-    fflush(stdout);
+        printf("\n");
+    }
+    else if (options->verify && is_file) printf("\e[33mThe receiver cannot verify %s, its integrity was not checked\e[0m\n", file_name);
+
+    // Report how much the compression saved so the setting can be tuned per link
+    if (options->compress && metadata.payload == PAYLOAD_SEALED) {
+        if (!stream_compresses(&streams[0])) printf("\e[33mThe receiver cannot inflate chunks, %s was sent uncompressed\e[0m\n", file_name);
+        else if (report.packed_bytes > 0) {
+            printf("Compressed %.2f MiB into %.2f MiB (%.2fx)\n", report.plain_bytes / 1048576.0, report.packed_bytes / 1048576.0,
+                   (double)report.plain_bytes / report.packed_bytes);
+        }
+    }
 
-    // Clean up the memory
-    fclose(file);
-    close(client_socket);
+    print_telemetry(&telemetry, "Sent");
     
-    return 0;
+    return (skipped_entries > 0) ? -1 : 0;
 }
 
 /**
@@ -438,34 +820,30 @@ void get_info(const char *interface_name) {
 }
 
 /**
- * Listens for incoming UDP broadcast discovery messages and responds with this device's hostname and IP address.
+ * Listens for discovery probes (broadcast, and multicast over IPv4 and IPv6 on every
+ * interface) and responds with this device's hostname and IP address.
  *
  * @param show_log 0 to show every message or log and 1 to hide them
  * @return NULL (no return value)
  */
 void *listen_bc(void *show_log) {
-    int client_socket;
-    struct sockaddr_in address, client;
-    char buffer[BUFFER_SIZE];
-    socklen_t client_len = sizeof(client);
+    discovery_interface interfaces[MAX_INTERFACES];
+    int interface_count = list_interfaces(NULL, interfaces, MAX_INTERFACES);
+    struct sockaddr_storage client;
+    char reply_prefix[BUFFER_SIZE];
 
-    // Create an UDP socket to listen for broadcast messages
-    client_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (interface_count < 0) interface_count = 0;
 
-    if (client_socket < 0) {
+    // IPv6 is optional, the IPv4 socket also receives broadcasts
+    struct pollfd sockets[2] = {{open_discovery_listener(AF_INET, interfaces, interface_count), POLLIN, 0},
+                                {open_discovery_listener(AF_INET6, interfaces, interface_count), POLLIN, 0}};
+
+    if (sockets[0].fd < 0) {
         printf("\e[31mConnectionError: Failed to create the socket\e[0m\n");
         fflush(stdout);
     }
 
-    // Configure socket to accept messages from any address on the broadcast port
-    memset(&address, 0, sizeof(address));
-
-    address.sin_family = AF_INET;
-    address.sin_port = htons(BC_PORT);
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    // Bind socket to the specified port and address
-    bind(client_socket, (struct sockaddr*)&address, sizeof(address));
+    discovery_reply_prefix(reply_prefix, sizeof(reply_prefix));
 
     if (show_log == 0) {
         printf("\e[33mWaiting for connection...\e[0m");
@@ -474,110 +852,62 @@ void *listen_bc(void *show_log) {
 
     int is_first_line = 0;
 
-    while (1) {
-        // Clear buffer and wait for incoming message
-        memset(buffer, 0, BUFFER_SIZE);
-        recvfrom(client_socket, buffer, BUFFER_SIZE, 0, (struct sockaddr*)&client, &client_len);
-
-        // Check if the message matches the expected discovery string
-        if (strncmp(buffer, BC_DISCOVERY_MSG, 23) == 0) {
-            char hostname[128];
-
-            gethostname(hostname, sizeof(hostname));  // Get this device's hostname
-
-            char reply[BUFFER_SIZE];
-
-            // Construct reply message with hostname and IP address
-            snprintf(reply, sizeof(reply), "hostname: \e[36m%s\e[0m | ip_address: \e[36m%s\e[0m", hostname, inet_ntoa(client.sin_addr));
-
-            // Send the reply back to the broadcasting client
-            sendto(client_socket, reply, strlen(reply), 0, (struct sockaddr*)&client, client_len);
+    while (poll(sockets, 2, -1) >= 0 || errno == EINTR) {
+        for (int index = 0; index < 2; index++) {
+            if (!(sockets[index].revents & POLLIN)) continue;
+            if (answer_discovery(sockets[index].fd, reply_prefix, interfaces, interface_count, &client) != 1) continue;
 
             if (is_first_line == 0) {
                 printf("\r");
-                
+
                 is_first_line = 1;
             }
 
             // Log the sender's IP address
             if (show_log == 0) {
-                printf("Receive packets from \e[36m%s\e[0m\n", inet_ntoa(client.sin_addr));
+                char address[INET6_ADDRSTRLEN];
+
+                if (client.ss_family == AF_INET) inet_ntop(AF_INET, &((struct sockaddr_in *)&client)->sin_addr, address, sizeof(address));
+                else inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&client)->sin6_addr, address, sizeof(address));
+
+                printf("Receive packets from \e[36m%s\e[0m\n", address);
                 fflush(stdout);
             }
         }
     }
 
-    close(client_socket);
+    for (int index = 0; index < 2; index++) {
+        if (sockets[index].fd >= 0) close(sockets[index].fd);
+    }
 }
 
 /**
- * Sends a broadcast discovery message to the local network to find other devices.
+ * Probes every interface, or only the given one, for receivers and lists them as they answer.
+ * The peers found are remembered so that -s accepts their hostnames right away.
  *
  * @param interface_name An optional string representing the name of the network interface.
- * @return 0 on success, -1 if socket creation fails or no devices respond.
+ * @return 0 on success, -1 if no interface can be probed.
  */
 int get_neighbor(const char *interface_name) {
-    int neighbor_socket;
-    struct sockaddr_in addr, sender;
-    char buffer[BUFFER_SIZE];
-    socklen_t sender_len = sizeof(sender);
+    discovered_peer peers[MAX_PEERS];
 
-    // Create an UDP socket for broadcasting
-    neighbor_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    printf("\e[33mSearching for devices...\e[0m");
+    fflush(stdout);
 
-    if (neighbor_socket < 0) {
-        printf("\e[31mConnectionError: Failed to create the socket\e[0m\n");
+    int count = discover_peers(interface_name, NULL, peers, MAX_PEERS, 1);
+
+    if (count < 0) {
+        if (interface_name != NULL) printf("\r\e[31mConnectionError: Failed to probe the interface %s\e[0m\e[K\n", interface_name);
+        else printf("\r\e[31mConnectionError: No network interface to probe\e[0m\e[K\n");
         fflush(stdout);
 
         return -1;
     }
 
-    // Enable broadcast option on socket
-    int broadcast_enable = 1;
-    char *ip_broadcast = get_broadcast_address((interface_name != NULL) ? interface_name : (const char *)"wlan0");
-
-    setsockopt(neighbor_socket, SOL_SOCKET, SO_BROADCAST, &broadcast_enable, sizeof(broadcast_enable));
-
-    // Configure broadcast address
-    memset(&addr, 0, sizeof(addr));
+    if (count == 0) printf("\rNo other devices were found on this network\e[K\n");
+    else update_peer_cache(peers, count, NULL);
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(BC_PORT);
-    addr.sin_addr.s_addr = inet_addr(ip_broadcast);
-
-    // Send discovery message
-    sendto(neighbor_socket, BC_DISCOVERY_MSG, strlen(BC_DISCOVERY_MSG), 0,
-           (struct sockaddr*)&addr, sizeof(addr));
-
-    printf("\e[33mBroadcasting discovery...\e[0m");
-    fflush(stdout);
-
-    // Set timeout for receiving responses
-    struct timeval timeout = {2, 0};
-
-    setsockopt(neighbor_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-
-        // Wait for response from other devices
-        int devices = recvfrom(neighbor_socket, buffer, BUFFER_SIZE, 0, (struct sockaddr*)&sender, &sender_len);
-
-        if (devices > 0) {
-            buffer[devices] = '\0';  // Null-terminate response
-
-            printf("\r%s\n", buffer);
-            fflush(stdout);
-        } 
-        else {
-            break;  // Timeout reached, no more devices found
-        }
-    }
-
-    printf("\rNo other devices were found on this network\n");
     fflush(stdout);
 
-    close(neighbor_socket);
-
     return 0;
 }
@@ -0,0 +1,736 @@
+#include "header.h"
+
+#define VERSION "0.1.0"                // ByteValve release, reported by -v and in handshake errors
+#define PROTOCOL_MAGIC 0x42565632      // "BVV2" marker at the start of every handshake
+#define PROTOCOL_VERSION 2             // Wire protocol version spoken by this build
+#define HANDSHAKE_TIMEOUT 5            // Seconds to wait for the peer's handshake
+#define FRAME_HEADER_LENGTH 8          // Size of a serialized frame header in bytes
+#define MAX_FRAME_LENGTH (16 << 20)    // Upper bound for a single frame payload
+#define MAX_NAME_LENGTH 255            // Longest file name accepted in metadata
+#define MAX_STREAMS 64                 // Most TCP streams a single transfer may use
+#define TRANSFER_ID_LENGTH 16          // Random identifier shared by the streams of a transfer
+#define SOURCE_ID_LENGTH 16            // Fingerprint of the source file version
+#define KEY_SHARE_LENGTH 32            // X25519 public key carried in the handshake
+#define CONTENT_KEY_LENGTH (32 + 4)    // Key and nonce prefix of a content key shared by several receivers
+#define HELLO_LENGTH (12 + KEY_SHARE_LENGTH)
+
+// Handshake flags
+#define HELLO_AES_ACCEL 0x1     // Sender's CPU accelerates AES
+#define HELLO_DEFLATE 0x2       // Peer inflates RECORD_COMPRESSED records
+#define HELLO_VERIFY 0x4        // Peer compares tree hashes once every stream finished
+#define HELLO_CONTENT_KEY 0x8   // Peer opens data records with a content key sent in the metadata
+#define HELLO_MULTICAST 0x10    // Peer receives files as multicast datagrams repaired over the connection
+#define HELLO_SPARSE 0x20       // Peer keeps the holes of a sparse file described by an EXTENTS frame
+#define HELLO_PIPED 0x40        // Peer receives piped input of unknown length
+#define HELLO_SESSION 0x80      // Client: the connection multiplexes channels; server: it can serve them
+
+// Frame types carried in the frame header
+#define FRAME_HELLO 1       // Versioned handshake header
+#define FRAME_METADATA 2    // Length-prefixed metadata records
+#define FRAME_DATA 3        // Encrypted file content
+#define FRAME_END 4         // No more data frames follow
+#define FRAME_ACK 5         // Receiver status after the END frame
+#define FRAME_ERROR 6       // Peer aborted the transfer
+#define FRAME_RESUME 7      // Ranges the receiver still needs
+#define FRAME_VERIFY 8      // Root of the sender's tree hash, answered with an ACK
+#define FRAME_EXTENTS 9     // Data extents of a sparse file, the rest of the stream's span is holes
+#define FRAME_CHANNEL 10    // Bytes of a channel of a multiplexed session
+#define FRAME_WINDOW 11     // More bytes a channel may carry (uint32)
+
+// Metadata record tags
+#define META_NAME 1         // File name (without directories)
+#define META_SIZE 2         // File size in bytes (uint64)
+#define META_MODE 3         // File permission bits (uint32)
+#define META_CIPHER 4       // Cipher used for the data frames (uint32)
+#define META_CHUNK_SIZE 5   // Plaintext bytes per data frame (uint32)
+#define META_TRANSFER_ID 6  // Identifier shared by every stream of the transfer
+#define META_STREAM 7       // Stream index and stream count (2 x uint32)
+#define META_RANGE 8        // Offset and length of the bytes this stream carries (2 x uint64)
+#define META_SOURCE_ID 9    // Fingerprint of the source file, used to match resume checkpoints
+#define META_KIND 10        // TRANSFER_* value (uint32)
+#define META_PAYLOAD 11     // PAYLOAD_* value (uint32)
+#define META_DELTA 12       // 1 if the sender can send a delta against the receiver's copy (uint32)
+#define META_DEDUP 13       // 1 if the sender can skip chunks found in the receiver's chunk store (uint32)
+#define META_VERIFY 14      // 1 if a VERIFY frame follows once every stream finished (uint32)
+#define META_CONTENT_KEY 15 // Key and nonce prefix the data records are sealed with instead of the session key
+#define META_MULTICAST 16   // IPv4 group, UDP port and payload size of the datagrams carrying the file (3 x uint32)
+#define META_SPARSE 17      // 1 if an EXTENTS frame follows the metadata (uint32)
+
+// Transfer kinds
+#define TRANSFER_FILE 0     // A single regular file
+#define TRANSFER_TREE 1     // A directory tree sent as entry batches and packed contents
+#define TRANSFER_PIPED 2    // Input of unknown length read until its end, written in order
+
+// How the file content travels after the handshake
+#define PAYLOAD_SEALED 0    // AEAD records sealed in user space
+#define PAYLOAD_PLAIN 1     // Unencrypted bytes moved by sendfile() and splice()
+#define PAYLOAD_KTLS 2      // Bytes moved by sendfile() and splice(), sealed by kernel TLS
+
+// RESUME frame flags
+#define RESUME_KTLS 0x1     // Receiver installs kernel TLS right after this frame
+#define RESUME_DELTA 0x2    // Block signatures of the receiver's copy follow this frame
+#define RESUME_DEDUP 0x4    // Receiver wants the sender's chunk list, then sends the ranges it lacks
+
+// CHANNEL frame flags
+#define CHANNEL_OPEN 0x1    // First frame of a new channel
+#define CHANNEL_CLOSE 0x2   // The sender of the frame writes nothing more on the channel
+#define CHANNEL_ABORT 0x4   // The sender of the frame reads nothing more from the channel
+
+// ERROR frame flags, telling the sender why the receiver turned the transfer down
+#define ERROR_PATH_BUSY 0x1     // Another transfer is writing the output path
+#define ERROR_PATH_INVALID 0x2  // The output path cannot be used, e.g. it is too long
+
+// END frame flags of a multicast transfer
+#define END_ROUND 0x1       // A round of datagrams is over; the receiver answers with the ranges it lacks
+#define END_UNICAST 0x2     // The ranges the receiver lacks follow as DATA frames on the connection
+
+// Header that precedes every frame on the wire
+typedef struct {
+    uint8_t type;       // One of the FRAME_* values
+    uint8_t flags;      // Frame specific flags
+    uint16_t channel;   // Channel of a multiplexed session, zero otherwise
+    uint32_t length;    // Payload length in bytes
+} frame_header;
+
+// Handshake header exchanged right after the connection is established
+typedef struct {
+    uint32_t magic;                             // Must be PROTOCOL_MAGIC
+    uint16_t version;                           // PROTOCOL_VERSION of the sender
+    uint16_t flags;                             // HELLO_* feature flags
+    uint16_t ciphers;                           // Client: bitmask of supported ciphers, server: chosen cipher
+    unsigned char key_share[KEY_SHARE_LENGTH];  // Ephemeral X25519 public key
+} hello_message;
+
+// Metadata describing the file that follows
+typedef struct {
+    char name[MAX_NAME_LENGTH + 1];                 // File name
+    uint64_t size;                                  // File size in bytes
+    uint32_t mode;                                  // File permission bits
+    uint32_t cipher;                                // Cipher used for the data frames
+    uint32_t chunk_size;                            // Plaintext bytes per data frame
+    unsigned char transfer_id[TRANSFER_ID_LENGTH];  // Identifier shared by every stream
+    uint32_t stream_index;                          // Index of this stream
+    uint32_t stream_count;                          // Number of streams of the transfer
+    uint64_t range_offset;                          // First byte carried by this stream
+    uint64_t range_length;                          // Number of bytes carried by this stream
+    unsigned char source_id[SOURCE_ID_LENGTH];      // Fingerprint of the source file version
+    uint32_t kind;                                  // TRANSFER_* value
+    uint32_t payload;                               // PAYLOAD_* value
+    uint32_t delta;                                 // 1 if the sender can send a delta
+    uint32_t dedup;                                 // 1 if the sender can skip stored chunks
+    uint32_t verify;                                // 1 if the sender compares tree hashes at the end
+    uint32_t content_keyed;                         // 1 if the data records are sealed with content_key
+    unsigned char content_key[CONTENT_KEY_LENGTH];  // Content key shared by every receiver of a fan-out
+    uint32_t multicast_group;                       // IPv4 group of the datagrams in network byte order, 0 over TCP
+    uint32_t multicast_port;                        // UDP port of the group
+    uint32_t multicast_payload;                     // File bytes carried by one datagram
+    uint32_t sparse;                                // 1 if only the data extents of the span are sent
+} file_metadata;
+
+// Contiguous span of bytes
+typedef struct {
+    uint64_t offset;    // First byte
+    uint64_t length;    // Number of bytes
+} byte_range;
+
+/**
+ * Writes a 64-bit integer in network byte order.
+ *
+ * @param buffer Destination buffer, at least 8 bytes long.
+ * @param value  Value to store.
+ */
+void put_u64(unsigned char *buffer, uint64_t value) {
+    for (int index = 7; index >= 0; index--) {
+        buffer[index] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/**
+ * Reads a 64-bit integer stored in network byte order.
+ *
+ * @param buffer Source buffer, at least 8 bytes long.
+ * @return       The decoded value.
+ */
+uint64_t get_u64(const unsigned char *buffer) {
+    uint64_t value = 0;
+
+    for (int index = 0; index < 8; index++) value = (value << 8) | buffer[index];
+
+    return value;
+}
+
+/**
+ * Sends the whole buffer, retrying on short writes and interrupts.
+ *
+ * @param socket Socket file descriptor.
+ * @param buffer Data to send.
+ * @param length Number of bytes to send.
+ * @return       0 on success, -1 on failure.
+ */
+int send_all(int socket, const void *buffer, size_t length) {
+    const unsigned char *cursor = buffer;
+
+    while (length > 0) {
+        ssize_t sent = send(socket, cursor, length, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+
+        cursor += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+/**
+ * Receives exactly length bytes, retrying on short reads and interrupts.
+ *
+ * @param socket Socket file descriptor.
+ * @param buffer Destination buffer.
+ * @param length Number of bytes to receive.
+ * @return       0 on success, -1 on failure or if the peer closed the connection.
+ */
+int recv_all(int socket, void *buffer, size_t length) {
+    unsigned char *cursor = buffer;
+
+    while (length > 0) {
+        ssize_t received = recv(socket, cursor, length, 0);
+
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return -1;
+
+        cursor += received;
+        length -= received;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets or clears the receive timeout of a socket.
+ *
+ * @param socket  Socket file descriptor.
+ * @param seconds Timeout in seconds, or 0 to block indefinitely.
+ * @return        0 on success, -1 on failure.
+ */
+int set_receive_timeout(int socket, int seconds) {
+    struct timeval timeout = {seconds, 0};
+
+    return setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * Disables Nagle's algorithm on a socket. Frames are written as a header followed by a body,
+ * and the small handshake, VERIFY and ACK frames would otherwise wait out the peer's delayed
+ * ACK on every exchange.
+ *
+ * @param socket Connected TCP socket.
+ * @return       0 on success, -1 on failure.
+ */
+int set_no_delay(int socket) {
+    int enable = 1;
+
+    return setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+/**
+ * Serializes a frame header.
+ *
+ * @param header Destination, FRAME_HEADER_LENGTH bytes.
+ * @param type   One of the FRAME_* values.
+ * @param flags  Frame specific flags.
+ * @param length Payload length in bytes.
+ */
+void put_frame_header(unsigned char *header, uint8_t type, uint8_t flags, uint32_t length) {
+    uint32_t net_length = htonl(length);
+
+    header[0] = type;
+    header[1] = flags;
+    header[2] = 0;
+    header[3] = 0;
+
+    memcpy(header + 4, &net_length, sizeof(net_length));
+}
+
+/**
+ * Sends a frame header followed by its payload.
+ *
+ * @param socket  Socket file descriptor.
+ * @param type    One of the FRAME_* values.
+ * @param flags   Frame specific flags.
+ * @param payload Payload bytes (may be NULL when length is 0).
+ * @param length  Payload length in bytes.
+ * @return        0 on success, -1 on failure.
+ */
+int send_frame(int socket, uint8_t type, uint8_t flags, const void *payload, uint32_t length) {
+    unsigned char header[FRAME_HEADER_LENGTH];
+
+    put_frame_header(header, type, flags, length);
+
+    if (send_all(socket, header, sizeof(header)) < 0) return -1;
+    if (length > 0 && send_all(socket, payload, length) < 0) return -1;
+
+    return 0;
+}
+
+/**
+ * Receives and decodes a frame header.
+ *
+ * @param socket Socket file descriptor.
+ * @param header Output for the decoded header.
+ * @return       0 on success, -1 on failure or if the payload length is out of range.
+ */
+int recv_frame_header(int socket, frame_header *header) {
+    unsigned char raw[FRAME_HEADER_LENGTH];
+    uint32_t net_length;
+
+    if (recv_all(socket, raw, sizeof(raw)) < 0) return -1;
+
+    memcpy(&net_length, raw + 4, sizeof(net_length));
+
+    header->type = raw[0];
+    header->flags = raw[1];
+    header->channel = (raw[2] << 8) | raw[3];
+    header->length = ntohl(net_length);
+
+    return (header->length > MAX_FRAME_LENGTH) ? -1 : 0;
+}
+
+/**
+ * Maps an ERROR frame that arrived in place of the expected frame to the reason the receiver
+ * gave.
+ *
+ * @param header Header of the frame.
+ * @return       -3 if the output path is busy, -4 if it cannot be used, -1 otherwise.
+ */
+int refusal_result(const frame_header *header) {
+    if (header->type != FRAME_ERROR) return -1;
+
+    return (header->flags & ERROR_PATH_BUSY) ? -3 : (header->flags & ERROR_PATH_INVALID) ? -4 : -1;
+}
+
+/**
+ * Sends the handshake header.
+ *
+ * @param socket Socket file descriptor.
+ * @param hello  Handshake to send; magic and version are filled in here.
+ * @return       0 on success, -1 on failure.
+ */
+int send_hello(int socket, hello_message *hello) {
+    unsigned char payload[HELLO_LENGTH];
+    uint32_t magic = htonl(PROTOCOL_MAGIC);
+    uint16_t version = htons(PROTOCOL_VERSION);
+    uint16_t flags = htons(hello->flags);
+    uint16_t ciphers = htons(hello->ciphers);
+
+    hello->magic = PROTOCOL_MAGIC;
+    hello->version = PROTOCOL_VERSION;
+
+    memcpy(payload, &magic, 4);
+    memcpy(payload + 4, &version, 2);
+    memcpy(payload + 6, &flags, 2);
+    memcpy(payload + 8, &ciphers, 2);
+    memset(payload + 10, 0, 2);
+    memcpy(payload + 12, hello->key_share, KEY_SHARE_LENGTH);
+
+    return send_frame(socket, FRAME_HELLO, 0, payload, sizeof(payload));
+}
+
+/**
+ * Receives and validates the peer's handshake header. Peers running ByteValve older than
+ * 0.1.0 start with raw key bytes instead of a HELLO frame and are rejected here.
+ *
+ * @param socket Socket file descriptor.
+ * @param hello  Output for the decoded handshake.
+ * @return       0 on success, -1 on I/O failure, -2 if the peer speaks another protocol version.
+ */
+int recv_hello(int socket, hello_message *hello) {
+    frame_header header;
+    unsigned char payload[HELLO_LENGTH];
+
+    if (recv_all(socket, payload, FRAME_HEADER_LENGTH) < 0) return -1;
+
+    // Decode the header by hand so a legacy peer never triggers a huge payload read
+    uint32_t net_length;
+
+    memcpy(&net_length, payload + 4, sizeof(net_length));
+
+    header.type = payload[0];
+    header.length = ntohl(net_length);
+
+    if (header.type != FRAME_HELLO || header.length != sizeof(payload)) return -2;
+    if (recv_all(socket, payload, sizeof(payload)) < 0) return -1;
+
+    uint32_t magic;
+    uint16_t version, flags, ciphers;
+
+    memcpy(&magic, payload, 4);
+    memcpy(&version, payload + 4, 2);
+    memcpy(&flags, payload + 6, 2);
+    memcpy(&ciphers, payload + 8, 2);
+
+    hello->magic = ntohl(magic);
+    hello->version = ntohs(version);
+    hello->flags = ntohs(flags);
+    hello->ciphers = ntohs(ciphers);
+
+    if (hello->magic != PROTOCOL_MAGIC || hello->version != PROTOCOL_VERSION) return -2;
+
+    memcpy(hello->key_share, payload + 12, KEY_SHARE_LENGTH);
+
+    return 0;
+}
+
+/**
+ * Appends a length-prefixed metadata record (tag, length, value).
+ *
+ * @param buffer   Destination buffer.
+ * @param offset   Current write offset in buffer.
+ * @param capacity Total size of buffer.
+ * @param tag      One of the META_* values.
+ * @param value    Record value.
+ * @param length   Record value length in bytes.
+ * @return         New write offset, or -1 if the record does not fit.
+ */
+int put_metadata_record(unsigned char *buffer, int offset, int capacity, uint16_t tag, const void *value, uint32_t length) {
+    if (offset < 0 || (size_t)offset + 6 + length > (size_t)capacity) return -1;
+
+    uint16_t net_tag = htons(tag);
+    uint32_t net_length = htonl(length);
+
+    memcpy(buffer + offset, &net_tag, 2);
+    memcpy(buffer + offset + 2, &net_length, 4);
+    memcpy(buffer + offset + 6, value, length);
+
+    return offset + 6 + length;
+}
+
+/**
+ * Serializes file metadata into a sequence of length-prefixed records.
+ *
+ * @param metadata Metadata to serialize.
+ * @param buffer   Destination buffer.
+ * @param capacity Size of buffer.
+ * @return         Number of bytes written, or -1 if the buffer is too small.
+ */
+int encode_metadata(const file_metadata *metadata, unsigned char *buffer, int capacity) {
+    unsigned char size[8], range[16];
+    uint32_t stream[2] = {htonl(metadata->stream_index), htonl(metadata->stream_count)};
+    uint32_t mode = htonl(metadata->mode);
+    uint32_t cipher = htonl(metadata->cipher);
+    uint32_t chunk_size = htonl(metadata->chunk_size);
+    uint32_t kind = htonl(metadata->kind);
+    uint32_t payload = htonl(metadata->payload);
+    uint32_t delta = htonl(metadata->delta);
+    uint32_t dedup = htonl(metadata->dedup);
+    uint32_t verify = htonl(metadata->verify);
+    uint32_t sparse = htonl(metadata->sparse);
+    int offset = 0;
+
+    put_u64(size, metadata->size);
+    put_u64(range, metadata->range_offset);
+    put_u64(range + 8, metadata->range_length);
+
+    offset = put_metadata_record(buffer, offset, capacity, META_NAME, metadata->name, strlen(metadata->name));
+    offset = put_metadata_record(buffer, offset, capacity, META_SIZE, size, sizeof(size));
+    offset = put_metadata_record(buffer, offset, capacity, META_MODE, &mode, sizeof(mode));
+    offset = put_metadata_record(buffer, offset, capacity, META_CIPHER, &cipher, sizeof(cipher));
+    offset = put_metadata_record(buffer, offset, capacity, META_CHUNK_SIZE, &chunk_size, sizeof(chunk_size));
+    offset = put_metadata_record(buffer, offset, capacity, META_TRANSFER_ID, metadata->transfer_id, TRANSFER_ID_LENGTH);
+    offset = put_metadata_record(buffer, offset, capacity, META_STREAM, stream, sizeof(stream));
+    offset = put_metadata_record(buffer, offset, capacity, META_RANGE, range, sizeof(range));
+    offset = put_metadata_record(buffer, offset, capacity, META_SOURCE_ID, metadata->source_id, SOURCE_ID_LENGTH);
+    offset = put_metadata_record(buffer, offset, capacity, META_KIND, &kind, sizeof(kind));
+    offset = put_metadata_record(buffer, offset, capacity, META_PAYLOAD, &payload, sizeof(payload));
+    offset = put_metadata_record(buffer, offset, capacity, META_DELTA, &delta, sizeof(delta));
+    offset = put_metadata_record(buffer, offset, capacity, META_DEDUP, &dedup, sizeof(dedup));
+    offset = put_metadata_record(buffer, offset, capacity, META_VERIFY, &verify, sizeof(verify));
+
+    if (metadata->sparse) offset = put_metadata_record(buffer, offset, capacity, META_SPARSE, &sparse, sizeof(sparse));
+
+    if (metadata->content_keyed) offset = put_metadata_record(buffer, offset, capacity, META_CONTENT_KEY, metadata->content_key, CONTENT_KEY_LENGTH);
+
+    if (metadata->multicast_group != 0) {
+        uint32_t multicast[3] = {metadata->multicast_group, htonl(metadata->multicast_port), htonl(metadata->multicast_payload)};
+
+        offset = put_metadata_record(buffer, offset, capacity, META_MULTICAST, multicast, sizeof(multicast));
+    }
+
+    return offset;
+}
+
+/**
+ * Parses a sequence of length-prefixed metadata records. Unknown tags are skipped so
+ * newer senders can add records without breaking this receiver.
+ *
+ * @param buffer   Serialized records.
+ * @param length   Length of buffer.
+ * @param metadata Output for the decoded metadata.
+ * @return         0 on success, -1 if a record is malformed or the name is missing.
+ */
+int decode_metadata(const unsigned char *buffer, int length, file_metadata *metadata) {
+    int offset = 0;
+
+    memset(metadata, 0, sizeof(*metadata));
+
+    // Senders that do not split the file use a single stream covering everything
+    metadata->stream_count = 1;
+    metadata->range_length = UINT64_MAX;
+
+    while (offset + 6 <= length) {
+        uint16_t tag;
+        uint32_t value_length, value32;
+
+        memcpy(&tag, buffer + offset, 2);
+        memcpy(&value_length, buffer + offset + 2, 4);
+
+        tag = ntohs(tag);
+        value_length = ntohl(value_length);
+        offset += 6;
+
+        if (value_length > (uint32_t)(length - offset)) return -1;
+
+        const unsigned char *value = buffer + offset;
+
+        switch (tag) {
+            case META_NAME:
+                if (value_length == 0 || value_length > MAX_NAME_LENGTH) return -1;
+
+                memcpy(metadata->name, value, value_length);
+                metadata->name[value_length] = '\0';
+                break;
+            case META_SIZE:
+                if (value_length != 8) return -1;
+
+                metadata->size = get_u64(value);
+                break;
+            case META_MODE:
+            case META_CIPHER:
+            case META_CHUNK_SIZE:
+            case META_KIND:
+            case META_PAYLOAD:
+            case META_DELTA:
+            case META_DEDUP:
+            case META_VERIFY:
+            case META_SPARSE:
+                if (value_length != 4) return -1;
+
+                memcpy(&value32, value, 4);
+                value32 = ntohl(value32);
+
+                if (tag == META_MODE) metadata->mode = value32;
+                else if (tag == META_CIPHER) metadata->cipher = value32;
+                else if (tag == META_KIND) metadata->kind = value32;
+                else if (tag == META_PAYLOAD) metadata->payload = value32;
+                else if (tag == META_DELTA) metadata->delta = value32;
+                else if (tag == META_DEDUP) metadata->dedup = value32;
+                else if (tag == META_VERIFY) metadata->verify = value32;
+                else if (tag == META_SPARSE) metadata->sparse = value32;
+                else metadata->chunk_size = value32;
+                break;
+            case META_TRANSFER_ID:
+                if (value_length != TRANSFER_ID_LENGTH) return -1;
+
+                memcpy(metadata->transfer_id, value, TRANSFER_ID_LENGTH);
+                break;
+            case META_STREAM:
+                if (value_length != 8) return -1;
+
+                memcpy(&value32, value, 4);
+                metadata->stream_index = ntohl(value32);
+                memcpy(&value32, value + 4, 4);
+                metadata->stream_count = ntohl(value32);
+                break;
+            case META_CONTENT_KEY:
+                if (value_length != CONTENT_KEY_LENGTH) return -1;
+
+                memcpy(metadata->content_key, value, CONTENT_KEY_LENGTH);
+                metadata->content_keyed = 1;
+                break;
+            case META_MULTICAST:
+                if (value_length != 12) return -1;
+
+                memcpy(&metadata->multicast_group, value, 4);
+                memcpy(&value32, value + 4, 4);
+                metadata->multicast_port = ntohl(value32);
+                memcpy(&value32, value + 8, 4);
+                metadata->multicast_payload = ntohl(value32);
+                break;
+            case META_SOURCE_ID:
+                if (value_length != SOURCE_ID_LENGTH) return -1;
+
+                memcpy(metadata->source_id, value, SOURCE_ID_LENGTH);
+                break;
+            case META_RANGE:
+                if (value_length != 16) return -1;
+
+                metadata->range_offset = get_u64(value);
+                metadata->range_length = get_u64(value + 8);
+                break;
+            default:
+                break;
+        }
+
+        offset += value_length;
+    }
+
+    // Refuse names that could escape the output directory
+    if (offset != length || metadata->name[0] == '\0' || strchr(metadata->name, '/') != NULL) return -1;
+    if (strcmp(metadata->name, ".") == 0 || strcmp(metadata->name, "..") == 0) return -1;
+
+    if (metadata->range_length == UINT64_MAX) metadata->range_length = metadata->size - metadata->range_offset;
+
+    // The stream must carry a range inside the file
+    if (metadata->stream_count == 0 || metadata->stream_count > MAX_STREAMS || metadata->stream_index >= metadata->stream_count) return -1;
+    if (metadata->range_offset > metadata->size || metadata->range_length > metadata->size - metadata->range_offset) return -1;
+
+    // Trees and piped input always travel over a single stream
+    if (metadata->kind > TRANSFER_PIPED || (metadata->kind != TRANSFER_FILE && metadata->stream_count != 1)) return -1;
+
+    // Trees and piped input are packed in user space, so only single files skip the records
+    if (metadata->payload > PAYLOAD_KTLS || (metadata->kind != TRANSFER_FILE && metadata->payload != PAYLOAD_SEALED)) return -1;
+
+    // The length of piped input is only known once it ends
+    if (metadata->kind == TRANSFER_PIPED && metadata->size != 0) return -1;
+
+    // Deltas and stored chunks need sealed records of a single file over a single stream
+    if (metadata->delta > 1 || metadata->dedup > 1) return -1;
+    if ((metadata->delta || metadata->dedup) && (metadata->kind != TRANSFER_FILE || metadata->stream_count != 1 || metadata->payload != PAYLOAD_SEALED)) return -1;
+
+    // Tree hashes cover single files
+    if (metadata->verify > 1 || (metadata->verify && metadata->kind != TRANSFER_FILE)) return -1;
+
+    // Datagrams carry sealed records of a whole file under the content key, sent to a multicast group
+    if (metadata->multicast_group != 0) {
+        if (!IN_MULTICAST(ntohl(metadata->multicast_group)) || metadata->multicast_port == 0 || metadata->multicast_port > 65535) return -1;
+        if (!metadata->content_keyed || metadata->kind != TRANSFER_FILE || metadata->stream_count != 1 || metadata->payload != PAYLOAD_SEALED) return -1;
+        if (metadata->delta || metadata->dedup || metadata->range_offset != 0 || metadata->range_length != metadata->size) return -1;
+    }
+
+    // Holes are only kept in a single file rebuilt from the records of its own data extents
+    if (metadata->sparse > 1) return -1;
+    if (metadata->sparse && (metadata->kind != TRANSFER_FILE || metadata->delta || metadata->dedup || metadata->multicast_group != 0)) return -1;
+
+    return 0;
+}
+
+/**
+ * Sends a list of byte ranges as a frame of the given type.
+ *
+ * @param socket      Connected socket.
+ * @param type        FRAME_RESUME or FRAME_EXTENTS.
+ * @param ranges      Ranges to send.
+ * @param range_count Number of ranges.
+ * @param flags       Frame flags.
+ * @return            0 on success, -1 on failure.
+ */
+int send_range_frame(int socket, uint8_t type, const byte_range *ranges, uint32_t range_count, uint8_t flags) {
+    uint32_t length = 4 + range_count * 16;
+    unsigned char *payload = malloc(length);
+    uint32_t net_count = htonl(range_count);
+    int result;
+
+    if (!payload) return -1;
+
+    memcpy(payload, &net_count, 4);
+
+    for (uint32_t index = 0; index < range_count; index++) {
+        put_u64(payload + 4 + index * 16, ranges[index].offset);
+        put_u64(payload + 12 + index * 16, ranges[index].length);
+    }
+
+    result = send_frame(socket, type, flags, payload, length);
+
+    free(payload);
+
+    return result;
+}
+
+/**
+ * Receives a list of byte ranges sent as a frame of the given type. The ranges must be sorted,
+ * non-overlapping and inside the span the stream carries.
+ *
+ * @param socket      Connected socket.
+ * @param type        FRAME_RESUME or FRAME_EXTENTS.
+ * @param within      Span the ranges must lie in.
+ * @param ranges      Output for the allocated ranges (free with free()).
+ * @param range_count Output for the number of ranges.
+ * @param flags       Output for the frame flags.
+ * @return            0 on success, -1 on failure or if the ranges are malformed, -3 or -4 if
+ *                    an ERROR frame with a reason came instead (see refusal_result()).
+ */
+int recv_range_frame(int socket, uint8_t type, byte_range within, byte_range **ranges, uint32_t *range_count, uint8_t *flags) {
+    frame_header header;
+    uint32_t net_count;
+    uint64_t cursor = within.offset, end = within.offset + within.length;
+
+    if (recv_frame_header(socket, &header) < 0) return -1;
+    if (header.type != type || header.length < 4) return refusal_result(&header);
+    if (recv_all(socket, &net_count, 4) < 0) return -1;
+
+    *flags = header.flags;
+    *range_count = ntohl(net_count);
+
+    if (header.length != 4 + (uint64_t)*range_count * 16) return -1;
+
+    unsigned char *payload = malloc(header.length);
+
+    *ranges = calloc(*range_count + 1, sizeof(byte_range));
+
+    if (!payload || !*ranges || recv_all(socket, payload, header.length - 4) < 0) {
+        free(payload);
+        free(*ranges);
+
+        return -1;
+    }
+
+    for (uint32_t index = 0; index < *range_count; index++) {
+        byte_range *range = &(*ranges)[index];
+
+        range->offset = get_u64(payload + index * 16);
+        range->length = get_u64(payload + 8 + index * 16);
+
+        if (range->offset < cursor || range->offset > end || range->length > end - range->offset) {
+            free(payload);
+            free(*ranges);
+
+            return -1;
+        }
+
+        cursor = range->offset + range->length;
+    }
+
+    free(payload);
+
+    return 0;
+}
+
+/**
+ * Sends a list of byte ranges as a RESUME frame.
+ *
+ * @param socket      Connected socket.
+ * @param ranges      Ranges to send.
+ * @param range_count Number of ranges.
+ * @param flags       RESUME_* flags.
+ * @return            0 on success, -1 on failure.
+ */
+int send_ranges(int socket, const byte_range *ranges, uint32_t range_count, uint8_t flags) {
+    return send_range_frame(socket, FRAME_RESUME, ranges, range_count, flags);
+}
+
+/**
+ * Receives a RESUME frame.
+ *
+ * @param socket      Connected socket.
+ * @param within      Span the ranges must lie in.
+ * @param ranges      Output for the allocated ranges (free with free()).
+ * @param range_count Output for the number of ranges.
+ * @param flags       Output for the RESUME_* flags.
+ * @return            0 on success, -1 on failure or if the ranges are malformed, -3 or -4 if
+ *                    the receiver refused the output path (see refusal_result()).
+ */
+int recv_ranges(int socket, byte_range within, byte_range **ranges, uint32_t *range_count, uint8_t *flags) {
+    return recv_range_frame(socket, FRAME_RESUME, within, ranges, range_count, flags);
+}
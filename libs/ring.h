@@ -0,0 +1,114 @@
+#include "options.h"
+
+#define RING_SPIN_LIMIT 16      // Yields before a waiting consumer sleeps on the futex
+
+// Bounded single-producer/single-consumer ring of pointers. The producer only writes tail,
+// the consumer only writes head, so neither side takes a lock.
+typedef struct {
+    void **slots;                   // Ring storage, capacity is a power of two
+    uint32_t mask;                  // Capacity minus one
+    _Atomic uint32_t head;          // Next position to pop (consumer)
+    _Atomic uint32_t tail;          // Next position to push (producer)
+    _Atomic int consumer_waiting;   // Set while the consumer sleeps on tail
+} spsc_ring;
+
+/**
+ * Initializes a ring that can hold at least min_capacity items.
+ *
+ * @param ring         Ring to initialize.
+ * @param min_capacity Minimum number of items.
+ * @return             0 on success, -1 on failure.
+ */
+int ring_init(spsc_ring *ring, uint32_t min_capacity) {
+    uint32_t capacity = 1;
+
+    while (capacity < min_capacity) capacity <<= 1;
+
+    ring->slots = calloc(capacity, sizeof(void *));
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->consumer_waiting = 0;
+
+    return (ring->slots) ? 0 : -1;
+}
+
+/**
+ * Releases the ring storage.
+ *
+ * @param ring Ring to free.
+ */
+void ring_free(spsc_ring *ring) {
+    free(ring->slots);
+
+    ring->slots = NULL;
+}
+
+/**
+ * Pushes an item and wakes the consumer if it is sleeping.
+ *
+ * @param ring Ring to push to (producer side only).
+ * @param item Non-NULL item to push.
+ * @return     0 on success, -1 if the ring is full.
+ */
+int ring_push(spsc_ring *ring, void *item) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) > ring->mask) return -1;
+
+    ring->slots[tail & ring->mask] = item;
+
+    atomic_store(&ring->tail, tail + 1);
+
+    if (atomic_load(&ring->consumer_waiting) && atomic_exchange(&ring->consumer_waiting, 0)) {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+
+    return 0;
+}
+
+/**
+ * Pops an item without blocking.
+ *
+ * @param ring Ring to pop from (consumer side only).
+ * @return     The item, or NULL if the ring is empty.
+ */
+void *ring_try_pop(spsc_ring *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) return NULL;
+
+    void *item = ring->slots[head & ring->mask];
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return item;
+}
+
+/**
+ * Pops an item, yielding briefly and then sleeping on a futex while the ring is empty.
+ *
+ * @param ring Ring to pop from (consumer side only).
+ * @return     The item.
+ */
+void *ring_pop(spsc_ring *ring) {
+    for (int spin = 0;; spin++) {
+        void *item = ring_try_pop(ring);
+
+        if (item) return item;
+
+        if (spin < RING_SPIN_LIMIT) {
+            sched_yield();
+            continue;
+        }
+
+        // Announce the sleep, then re-check so a concurrent push cannot be missed
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        atomic_store(&ring->consumer_waiting, 1);
+
+        if (atomic_load(&ring->tail) == head) syscall(SYS_futex, &ring->tail, FUTEX_WAIT_PRIVATE, head, NULL, NULL, 0);
+
+        atomic_store(&ring->consumer_waiting, 0);
+    }
+}
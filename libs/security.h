@@ -1,132 +1,381 @@
-#include "header.h"
+#include "protocol.h"
 
-#define KEY_LENGTH 32  // AES-256 key size in bytes
-#define IV_LENGTH 16   // AES block size in bytes
+#define KEY_LENGTH 32           // AES-256 / ChaCha20 key size in bytes
+#define NONCE_LENGTH 12         // AEAD nonce size in bytes
+#define NONCE_PREFIX_LENGTH 4   // Per-direction part of the nonce, the rest is a record counter
+#define NONCE_TO_SERVER 0x01    // First nonce byte of records sealed by the client
+#define NONCE_TO_CLIENT 0x02    // First nonce byte of records sealed by the server
+#define TAG_LENGTH 16           // AEAD authentication tag size in bytes
+#define DIGEST_LENGTH 32        // SHA-256 digest size in bytes
+
+#define RECORD_HEADER_LENGTH (8 + 4 + 4 + NONCE_LENGTH)         // offset, length, flags, nonce
+#define RECORD_OVERHEAD (RECORD_HEADER_LENGTH + TAG_LENGTH)     // Bytes a record adds to its plaintext
+#define DEFAULT_CHUNK_SIZE (128 * 1024)                         // Plaintext bytes per data record
+#define MAX_CHUNK_SIZE (8 << 20)                                // Largest chunk size a receiver accepts
+
+// Cipher identifiers negotiated in the handshake and announced in the file metadata
+#define CIPHER_AES_256_GCM 1
+#define CIPHER_CHACHA20_POLY1305 2
+
+// Record flags, authenticated together with the rest of the record header
+#define RECORD_METADATA 0x1     // Record carries metadata instead of file content
+#define RECORD_ENTRIES 0x2      // Record carries a batch of tree entries
+#define RECORD_COMPRESSED 0x4   // Record plaintext is a raw deflate stream of the chunk
+#define RECORD_DELTA 0x8        // Record carries delta instructions instead of file content
+#define RECORD_SIGNATURES 0x10  // Record carries block signatures of the receiver's copy
+#define RECORD_CHUNK_LIST 0x20  // Record carries lengths and hashes of the sender's chunks
+#define RECORD_VERIFY 0x40      // Record carries the root of the sender's tree hash
+#define RECORD_PARITY 0x80      // Record carries the XOR of a span of multicast datagrams
+#define RECORD_TRAILER 0x100    // Record carries the total length of piped input, after its last byte
+
+// Keys and nonce state of one side of a session
+typedef struct {
+    int cipher;                                             // One of the CIPHER_* values
+    unsigned char secret[KEY_LENGTH];                       // Session secret the kernel TLS and channel keys expand from
+    unsigned char key[KEY_LENGTH];                          // Key of records sealed by this side
+    unsigned char peer_key[KEY_LENGTH];                     // Key of records sealed by the peer
+    unsigned char nonce_prefix[NONCE_PREFIX_LENGTH];        // Prefix for records sealed by this side
+    unsigned char peer_nonce_prefix[NONCE_PREFIX_LENGTH];   // Prefix expected on records from the peer
+    _Atomic uint64_t sequence;                              // Counter of records sealed by this side
+    uint16_t peer_flags;                                    // HELLO_* flags the peer advertised
+} crypto_session;
+
+// Authenticated header of a self-contained record
+typedef struct {
+    uint64_t offset;                        // File offset of the plaintext
+    uint32_t length;                        // Plaintext length in bytes
+    uint32_t flags;                         // RECORD_* flags
+    unsigned char nonce[NONCE_LENGTH];      // Nonce the record was sealed with
+} record_header;
 
 /**
- * Encrypts input data using AES-256-CBC.
+ * Checks whether this CPU has AES instructions (AES-NI on x86, the crypto extension on ARMv8).
  *
- * @param plain_text      Input data to encrypt.
- * @param plain_text_len  Length of plain_text.
- * @param key             32-byte encryption key.
- * @param iv              16-byte initialization vector.
- * @param cipher_text     Output buffer for encrypted data.
- * @return                Length of encrypted data on success.
+ * @return 1 if AES is hardware accelerated, 0 otherwise.
  */
-int encrypt(unsigned char *plain_text, int plain_text_len, unsigned char *key, unsigned char *iv, unsigned char *cipher_text) {
-    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();  // Create new encryption context
+int cpu_has_aes(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
 
-    int len, cipher_text_len;
+    return __builtin_cpu_supports("aes") ? 1 : 0;
+#elif defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
 
-    EVP_EncryptInit_ex(context, EVP_aes_256_cbc(), NULL, key, iv);  // Initialize AES-256-CBC cipher
+/**
+ * Picks the cipher both peers run fastest. AES-256-GCM is only chosen when both CPUs
+ * accelerate AES, otherwise ChaCha20-Poly1305 wins on the slower side.
+ *
+ * @param peer_ciphers Bitmask of (1 << CIPHER_*) values the peer supports.
+ * @param peer_has_aes Non-zero if the peer advertised AES acceleration.
+ * @return             The chosen CIPHER_* value, or -1 if there is no common cipher.
+ */
+int choose_cipher(uint16_t peer_ciphers, int peer_has_aes) {
+    int gcm = (peer_ciphers & (1 << CIPHER_AES_256_GCM)) != 0;
+    int chacha = (peer_ciphers & (1 << CIPHER_CHACHA20_POLY1305)) != 0;
 
-    EVP_EncryptUpdate(context, cipher_text, &len, plain_text, plain_text_len);  // Encrypt data
-    cipher_text_len = len;
+    if (gcm && (!chacha || (peer_has_aes && cpu_has_aes()))) return CIPHER_AES_256_GCM;
+    if (chacha) return CIPHER_CHACHA20_POLY1305;
 
-    EVP_EncryptFinal_ex(context, cipher_text + len, &len);  // Finalize encryption (handle padding)
-    cipher_text_len += len;
+    return -1;
+}
 
-    EVP_CIPHER_CTX_free(context);  // Clean up context
+/**
+ * Maps a cipher identifier to its OpenSSL implementation.
+ *
+ * @param cipher One of the CIPHER_* values.
+ * @return       The EVP cipher, or NULL if the identifier is unknown.
+ */
+const EVP_CIPHER *get_cipher(int cipher) {
+    switch (cipher) {
+        case CIPHER_AES_256_GCM: return EVP_aes_256_gcm();
+        case CIPHER_CHACHA20_POLY1305: return EVP_chacha20_poly1305();
+        default: return NULL;
+    }
+}
 
-    return cipher_text_len;
+/**
+ * Generates an ephemeral X25519 key pair for the handshake.
+ *
+ * @param public_key Output buffer for the 32-byte public key.
+ * @return           The private key (free with EVP_PKEY_free), or NULL on failure.
+ */
+EVP_PKEY *generate_key_share(unsigned char *public_key) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    EVP_PKEY *private_key = NULL;
+    size_t public_key_len = KEY_SHARE_LENGTH;
+
+    if (!context) return NULL;
+
+    if (EVP_PKEY_keygen_init(context) != 1 || EVP_PKEY_keygen(context, &private_key) != 1 ||
+        EVP_PKEY_get_raw_public_key(private_key, public_key, &public_key_len) != 1) {
+        EVP_PKEY_free(private_key);
+
+        private_key = NULL;
+    }
+
+    EVP_PKEY_CTX_free(context);
+
+    return private_key;
 }
 
 /**
- * Decrypts encrypted data using AES-256-CBC.
+ * Sets the keys and nonce prefixes of one side from HKDF output holding the client-to-server
+ * key followed by the server-to-client key. Both sides count records from zero, so each
+ * direction needs its own key; the nonce prefix only names the direction.
  *
- * @param cipher_text      Input encrypted data.
- * @param cipher_text_len  Length of cipher_text.
- * @param key              32-byte decryption key.
- * @param iv               16-byte initialization vector.
- * @param plain_text       Output buffer for decrypted data.
- * @return                 Length of decrypted data on success.
+ * @param session   Session to fill in.
+ * @param material  Client-to-server key followed by the server-to-client key.
+ * @param is_client Non-zero on the client.
  */
-int decrypt(unsigned char *cipher_text, int cipher_text_len, unsigned char *key, unsigned char *iv, unsigned char *plain_text) {
-    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();  // Create new decryption context
+void set_direction_keys(crypto_session *session, const unsigned char *material, int is_client) {
+    const unsigned char *to_server = material, *to_client = material + KEY_LENGTH;
 
-    int len, plain_text_len;
+    memcpy(session->key, (is_client) ? to_server : to_client, KEY_LENGTH);
+    memcpy(session->peer_key, (is_client) ? to_client : to_server, KEY_LENGTH);
+    memset(session->nonce_prefix, 0, NONCE_PREFIX_LENGTH);
+    memset(session->peer_nonce_prefix, 0, NONCE_PREFIX_LENGTH);
 
-    EVP_DecryptInit_ex(context, EVP_aes_256_cbc(), NULL, key, iv);  // Initialize AES-256-CBC cipher
+    session->nonce_prefix[0] = (is_client) ? NONCE_TO_SERVER : NONCE_TO_CLIENT;
+    session->peer_nonce_prefix[0] = (is_client) ? NONCE_TO_CLIENT : NONCE_TO_SERVER;
+}
 
-    EVP_DecryptUpdate(context, plain_text, &len, cipher_text, cipher_text_len);  // Decrypt data
-    plain_text_len = len;
+/**
+ * Derives the session secret and one key per direction from the X25519 exchange using
+ * HKDF-SHA256. Both public keys are bound into the derivation so each connection gets
+ * distinct keys.
+ *
+ * @param private_key   This side's ephemeral private key.
+ * @param client_public Client's 32-byte public key.
+ * @param server_public Server's 32-byte public key.
+ * @param is_client     Non-zero when called by the client.
+ * @param session       Output session; cipher must already be set.
+ * @return              0 on success, -1 on failure.
+ */
+int derive_session(EVP_PKEY *private_key, const unsigned char *client_public, const unsigned char *server_public, int is_client, crypto_session *session) {
+    EVP_PKEY *peer_key = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, is_client ? server_public : client_public, KEY_SHARE_LENGTH);
+    EVP_PKEY_CTX *context = NULL;
+    unsigned char secret[32];
+    unsigned char material[3 * KEY_LENGTH];
+    unsigned char info[12 + 2 * KEY_SHARE_LENGTH] = "bytevalve v2";
+    size_t secret_len = sizeof(secret), material_len = sizeof(material);
+    int result = -1;
 
-    EVP_DecryptFinal_ex(context, plain_text + len, &len);  // Finalize decryption (remove padding)
-    plain_text_len += len;
+    if (!peer_key) return -1;
 
-    EVP_CIPHER_CTX_free(context);  // Clean up context
+    memcpy(info + 12, client_public, KEY_SHARE_LENGTH);
+    memcpy(info + 12 + KEY_SHARE_LENGTH, server_public, KEY_SHARE_LENGTH);
 
-    return plain_text_len;
+    // Compute the shared secret
+    context = EVP_PKEY_CTX_new(private_key, NULL);
+
+    if (!context || EVP_PKEY_derive_init(context) != 1 || EVP_PKEY_derive_set_peer(context, peer_key) != 1 ||
+        EVP_PKEY_derive(context, secret, &secret_len) != 1) goto cleanup;
+
+    EVP_PKEY_CTX_free(context);
+
+    // Expand it into the session secret and one key per direction
+    context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+
+    if (!context || EVP_PKEY_derive_init(context) != 1 || EVP_PKEY_CTX_set_hkdf_md(context, EVP_sha256()) != 1 ||
+        EVP_PKEY_CTX_set1_hkdf_key(context, secret, secret_len) != 1 || EVP_PKEY_CTX_add1_hkdf_info(context, info, sizeof(info)) != 1 ||
+        EVP_PKEY_derive(context, material, &material_len) != 1) goto cleanup;
+
+    memcpy(session->secret, material, KEY_LENGTH);
+    set_direction_keys(session, material + KEY_LENGTH, is_client);
+
+    session->sequence = 0;
+    result = 0;
+
+cleanup:
+    OPENSSL_cleanse(secret, sizeof(secret));
+    OPENSSL_cleanse(material, sizeof(material));
+    EVP_PKEY_CTX_free(context);
+    EVP_PKEY_free(peer_key);
+
+    return result;
 }
 
 /**
- * Encrypts file contents and sends them over a socket.
+ * Runs the client side of the handshake: offers the supported ciphers and a key share,
+ * then derives the session from the server's answer.
  *
- * @param in_file      File pointer to the input file.
- * @param buffer_size  Size of the read buffer.
- * @param socket       Socket file descriptor to send data through.
- * @param key          32-byte encryption key.
- * @param iv           16-byte initialization vector.
- * @return             0 on success, -1 on failure.
+ * @param socket  Connected socket.
+ * @param session Output for the negotiated session; if its cipher is already set, only that one is offered.
+ * @param flags   HELLO_* flags describing this connection, added to the supported features.
+ * @return        0 on success, -1 on I/O or key exchange failure, -2 if the server speaks another protocol.
  */
-int encrypt_file(FILE *in_file, int buffer_size, int socket, unsigned char *key, unsigned char *iv) {
-    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
-    if (!context) return -1;
+int client_handshake(int socket, crypto_session *session, uint16_t flags) {
+    hello_message hello = {0}, reply;
+    unsigned char client_public[KEY_SHARE_LENGTH];
+    EVP_PKEY *private_key = generate_key_share(client_public);
+    int result;
+
+    if (!private_key) return -1;
 
-    if (EVP_EncryptInit_ex(context, EVP_aes_256_cbc(), NULL, key, iv) != 1) return -1;
+    hello.flags = (cpu_has_aes() ? HELLO_AES_ACCEL : 0) | HELLO_DEFLATE | HELLO_VERIFY | HELLO_CONTENT_KEY | HELLO_MULTICAST | HELLO_SPARSE | HELLO_PIPED | flags;
+    hello.ciphers = (session->cipher > 0) ? 1 << session->cipher : (1 << CIPHER_AES_256_GCM) | (1 << CIPHER_CHACHA20_POLY1305);
 
-    unsigned char in_buffer[buffer_size];                           // Buffer for plaintext file chunks
-    unsigned char out_buffer[buffer_size + EVP_MAX_BLOCK_LENGTH];   // Buffer for ciphertext output
-    int in_len, out_len;
+    memcpy(hello.key_share, client_public, KEY_SHARE_LENGTH);
 
-    // Read from file and send encrypted chunks
-    while ((in_len = fread(in_buffer, 1, buffer_size, in_file)) > 0) {
-        if (EVP_EncryptUpdate(context, out_buffer, &out_len, in_buffer, in_len) != 1) return -1;
-        if (send(socket, out_buffer, out_len, 0) < 0) return -1;
+    if (send_hello(socket, &hello) < 0) result = -1;
+    else if ((result = recv_hello(socket, &reply)) == 0) {
+        // The server answers with the single cipher it picked
+        session->cipher = reply.ciphers;
+        session->peer_flags = reply.flags;
+
+        if (get_cipher(session->cipher) == NULL) result = -1;
+        else result = derive_session(private_key, client_public, reply.key_share, 1, session);
     }
 
-    // Final encryption block
-    if (EVP_EncryptFinal_ex(context, out_buffer, &out_len) != 1) return -1;
-    if (send(socket, out_buffer, out_len, 0) < 0) return -1;
+    EVP_PKEY_free(private_key);
 
-    EVP_CIPHER_CTX_free(context);
+    return result;
+}
 
-    return 0;
+/**
+ * Runs the server side of the handshake: picks the cipher and answers with its own key share.
+ *
+ * @param socket  Accepted socket.
+ * @param session Output for the negotiated session.
+ * @return        0 on success, -1 on I/O or key exchange failure, -2 if the client speaks another protocol.
+ */
+int server_handshake(int socket, crypto_session *session) {
+    hello_message hello, reply = {0};
+    unsigned char server_public[KEY_SHARE_LENGTH];
+    EVP_PKEY *private_key;
+    int result;
+
+    if ((result = recv_hello(socket, &hello)) < 0) return result;
+    if ((session->cipher = choose_cipher(hello.ciphers, hello.flags & HELLO_AES_ACCEL)) < 0) return -1;
+    if (!(private_key = generate_key_share(server_public))) return -1;
+
+    reply.flags = (cpu_has_aes() ? HELLO_AES_ACCEL : 0) | HELLO_DEFLATE | HELLO_VERIFY | HELLO_CONTENT_KEY | HELLO_MULTICAST | HELLO_SPARSE | HELLO_PIPED | HELLO_SESSION;
+    reply.ciphers = session->cipher;
+    session->peer_flags = hello.flags;
+
+    memcpy(reply.key_share, server_public, KEY_SHARE_LENGTH);
+
+    result = derive_session(private_key, hello.key_share, server_public, 0, session);
+
+    if (result == 0 && send_hello(socket, &reply) < 0) result = -1;
+
+    EVP_PKEY_free(private_key);
+
+    return result;
 }
 
 /**
- * Receives encrypted data from a socket, decrypts it, and writes to a file.
+ * Creates a cipher context bound to the session cipher. The context can be reused for
+ * any number of records, only the nonce changes between them.
  *
- * @param out_file     File pointer to the output file.
- * @param buffer_size  Size of the read buffer.
- * @param socket       Socket file descriptor to receive data from.
- * @param key          32-byte decryption key.
- * @param iv           16-byte initialization vector.
- * @return             0 on success, -1 on failure.
+ * @param cipher     One of the CIPHER_* values.
+ * @param encrypting 1 for sealing, 0 for opening.
+ * @return           The context (free with EVP_CIPHER_CTX_free), or NULL on failure.
  */
-int decrypt_file(FILE *out_file, int buffer_size, int socket, unsigned char *key, unsigned char *iv) {
+EVP_CIPHER_CTX *new_record_context(int cipher, int encrypting) {
     EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
-    if (!context) return -1;
+    const EVP_CIPHER *evp_cipher = get_cipher(cipher);
 
-    if (EVP_DecryptInit_ex(context, EVP_aes_256_cbc(), NULL, key, iv) != 1) return -1;
+    if (!context || !evp_cipher || EVP_CipherInit_ex(context, evp_cipher, NULL, NULL, NULL, encrypting) != 1) {
+        EVP_CIPHER_CTX_free(context);
 
-    unsigned char in_buffer[buffer_size + EVP_MAX_BLOCK_LENGTH];   // Buffer for incoming ciphertext
-    unsigned char out_buffer[buffer_size];                         // Buffer for decrypted plaintext
-    int in_len, out_len;
+        return NULL;
+    }
 
-    // Receive and decrypt data from socket
-    while ((in_len = recv(socket, in_buffer, sizeof(in_buffer), 0)) > 0) {
-        if (EVP_DecryptUpdate(context, out_buffer, &out_len, in_buffer, in_len) != 1) return -1;
+    return context;
+}
 
-        fwrite(out_buffer, 1, out_len, out_file);
-    }
+/**
+ * Encrypts one self-contained record. The output is the record header, the ciphertext
+ * and the tag; the header is authenticated as additional data.
+ *
+ * @param context    Context from new_record_context(cipher, 1).
+ * @param session    Session providing the key and the nonce counter.
+ * @param offset     File offset of the plaintext.
+ * @param flags      RECORD_* flags.
+ * @param plain_text Input data to encrypt.
+ * @param length     Length of plain_text.
+ * @param record     Output buffer, at least length + RECORD_OVERHEAD bytes.
+ * @return           Length of the record on success, -1 on failure.
+ */
+int seal_record(EVP_CIPHER_CTX *context, crypto_session *session, uint64_t offset, uint32_t flags, const unsigned char *plain_text, int length, unsigned char *record) {
+    unsigned char *nonce = record + 16;
+    unsigned char *cipher_text = record + RECORD_HEADER_LENGTH;
+    uint32_t net_length = htonl(length), net_flags = htonl(flags);
+    int len, cipher_text_len;
 
-    // Final decryption block
-    if (EVP_DecryptFinal_ex(context, out_buffer, &out_len) != 1) return -1;
+    // Serialize the header; the nonce is the direction prefix followed by a record counter
+    put_u64(record, offset);
+    memcpy(record + 8, &net_length, 4);
+    memcpy(record + 12, &net_flags, 4);
+    memcpy(nonce, session->nonce_prefix, NONCE_PREFIX_LENGTH);
+    put_u64(nonce + NONCE_PREFIX_LENGTH, session->sequence++);
 
-    fwrite(out_buffer, 1, out_len, out_file);
+    if (EVP_EncryptInit_ex(context, NULL, NULL, session->key, nonce) != 1) return -1;
+    if (EVP_EncryptUpdate(context, NULL, &len, record, RECORD_HEADER_LENGTH) != 1) return -1;
+    if (EVP_EncryptUpdate(context, cipher_text, &len, plain_text, length) != 1) return -1;
 
-    EVP_CIPHER_CTX_free(context);
+    cipher_text_len = len;
 
-    return 0;
+    if (EVP_EncryptFinal_ex(context, cipher_text + len, &len) != 1) return -1;
+
+    cipher_text_len += len;
+
+    if (EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_GET_TAG, TAG_LENGTH, cipher_text + cipher_text_len) != 1) return -1;
+
+    return RECORD_HEADER_LENGTH + cipher_text_len + TAG_LENGTH;
+}
+
+/**
+ * Verifies and decrypts one record produced by seal_record() on the peer.
+ *
+ * @param context    Context from new_record_context(cipher, 0).
+ * @param session    Session providing the peer's key and nonce prefix.
+ * @param record     Record bytes.
+ * @param record_len Length of record.
+ * @param header     Output for the authenticated record header.
+ * @param plain_text Output buffer, at least record_len - RECORD_OVERHEAD bytes.
+ * @return           Length of the plaintext on success, -1 if the record is malformed or forged.
+ */
+int open_record(EVP_CIPHER_CTX *context, crypto_session *session, unsigned char *record, int record_len, record_header *header, unsigned char *plain_text) {
+    uint32_t net_length, net_flags;
+    int len, cipher_text_len = record_len - RECORD_OVERHEAD;
+
+    if (cipher_text_len < 0) return -1;
+
+    memcpy(&net_length, record + 8, 4);
+    memcpy(&net_flags, record + 12, 4);
+    memcpy(header->nonce, record + 16, NONCE_LENGTH);
+
+    header->offset = get_u64(record);
+    header->length = ntohl(net_length);
+    header->flags = ntohl(net_flags);
+
+    // Reject records whose length disagrees with the frame or that were not sealed by the peer
+    if (header->length != (uint32_t)cipher_text_len) return -1;
+    if (memcmp(header->nonce, session->peer_nonce_prefix, NONCE_PREFIX_LENGTH) != 0) return -1;
+
+    if (EVP_DecryptInit_ex(context, NULL, NULL, session->peer_key, header->nonce) != 1) return -1;
+    if (EVP_DecryptUpdate(context, NULL, &len, record, RECORD_HEADER_LENGTH) != 1) return -1;
+    if (EVP_DecryptUpdate(context, plain_text, &len, record + RECORD_HEADER_LENGTH, cipher_text_len) != 1) return -1;
+    if (EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, TAG_LENGTH, record + RECORD_HEADER_LENGTH + cipher_text_len) != 1) return -1;
+    if (EVP_DecryptFinal_ex(context, plain_text + len, &len) != 1) return -1;
+
+    return cipher_text_len;
+}
+
+/**
+ * Hashes a chunk of plaintext with SHA-256.
+ *
+ * @param data   Chunk contents.
+ * @param length Length of data.
+ * @param digest Output buffer for the DIGEST_LENGTH-byte digest.
+ * @return       0 on success, -1 on failure.
+ */
+int digest_chunk(const unsigned char *data, size_t length, unsigned char *digest) {
+    return (EVP_Digest(data, length, digest, NULL, EVP_sha256(), NULL) == 1) ? 0 : -1;
 }
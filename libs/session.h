@@ -0,0 +1,936 @@
+#include "discovery.h"
+
+#define SESSION_WINDOW (4 << 20)            // Bytes a channel carries per direction before the reading side grants more
+#define SESSION_FRAME_LENGTH (256 << 10)    // Most channel bytes carried by one CHANNEL frame
+#define SESSION_MAX_CHANNELS 256            // Channels one session carries at once
+#define SESSION_IDLE_TIMEOUT 300            // Seconds a session host stays up without channels
+#define SESSION_POLL_INTERVAL 1000          // Milliseconds between two idle checks of a session host
+#define SESSION_CHANNEL_INFO "bytevalve channel"
+
+// Bytes that arrived for a channel and wait to be written to its socket pair
+typedef struct channel_buffer {
+    struct channel_buffer *next;
+    uint32_t length;
+    unsigned char data[];
+} channel_buffer;
+
+typedef struct session_mux session_mux;
+
+// One channel of a session. The code using it holds the other end of a socket pair and sees a
+// connection of its own; a pump thread carries what it writes to the peer and a writer thread
+// hands it what the peer sent.
+typedef struct session_channel {
+    session_mux *mux;                   // Session the channel belongs to
+    uint16_t id;                        // Channel id, chosen by the sending side
+    int socket;                         // Session's end of the socket pair
+    uint64_t credit;                    // Bytes the peer still takes on this channel
+    channel_buffer *head, *tail;        // Bytes from the peer not yet written to the socket pair
+    uint64_t queued;                    // Bytes in that queue
+    int peer_closed;                    // The peer writes nothing more
+    int peer_stopped;                   // The peer reads nothing more
+    int threads;                        // Pump and writer threads still running
+    pthread_cond_t changed;             // Signals credit, queued bytes and the flags above
+    struct session_channel *next;
+} session_channel;
+
+// One connection carrying the channels of many transfers
+struct session_mux {
+    int socket;                         // Connection to the peer
+    crypto_session session;             // Session negotiated on the connection, channel keys derive from it
+    int is_client;                      // 1 on the sending side, which opens the channels
+    pthread_mutex_t lock;               // Protects the channels and their state
+    pthread_mutex_t send_lock;          // Keeps frames on the connection whole
+    pthread_cond_t drained;             // Signals that a channel went away or the connection broke
+    session_channel *channels;          // Open channels
+    int channel_count;                  // Number of open channels
+    uint32_t next_id;                   // Id of the next channel opened by this side
+    time_t idle_since;                  // When the last channel went away
+    int failed;                         // 1 once the connection is gone
+    void (*accept)(session_mux *mux, int socket, const crypto_session *session); // Serves a channel the peer opened
+    void *context;                      // Left to the accept callback
+};
+
+// Answer of a session host to a process attaching to it, one per channel
+typedef struct {
+    int32_t result;                     // 0 if a channel socket comes with it, -1 otherwise
+    crypto_session session;             // Keys of the channel
+} channel_grant;
+
+/**
+ * Derives the keys of one channel from the session secret using HKDF-SHA256. Every channel
+ * gets its own secret and one key per direction, so records of different channels or
+ * directions never share a key and nonce.
+ *
+ * @param session   Session negotiated on the connection.
+ * @param channel   Channel id.
+ * @param is_client Non-zero on the side that opened the channel.
+ * @param out       Output for the channel session.
+ * @return          0 on success, -1 on failure.
+ */
+int derive_channel_session(const crypto_session *session, uint16_t channel, int is_client, crypto_session *out) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    unsigned char material[3 * KEY_LENGTH];
+    unsigned char info[sizeof(SESSION_CHANNEL_INFO) + 1];
+    size_t material_len = sizeof(material);
+    int result = -1;
+
+    memcpy(info, SESSION_CHANNEL_INFO, sizeof(SESSION_CHANNEL_INFO) - 1);
+    info[sizeof(SESSION_CHANNEL_INFO) - 1] = channel >> 8;
+    info[sizeof(SESSION_CHANNEL_INFO)] = channel & 0xff;
+
+    if (context && EVP_PKEY_derive_init(context) == 1 && EVP_PKEY_CTX_set_hkdf_md(context, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(context, session->secret, KEY_LENGTH) == 1 && EVP_PKEY_CTX_add1_hkdf_info(context, info, sizeof(info)) == 1 &&
+        EVP_PKEY_derive(context, material, &material_len) == 1) {
+        memcpy(out->secret, material, KEY_LENGTH);
+        set_direction_keys(out, material + KEY_LENGTH, is_client);
+
+        out->cipher = session->cipher;
+        out->peer_flags = session->peer_flags;
+        out->sequence = 0;
+        result = 0;
+    }
+
+    OPENSSL_cleanse(material, sizeof(material));
+    EVP_PKEY_CTX_free(context);
+
+    return result;
+}
+
+/**
+ * Sends a frame of a channel. The payload follows a FRAME_HEADER_LENGTH gap in the buffer, so
+ * header and payload leave in one piece.
+ *
+ * @param mux     Session.
+ * @param type    FRAME_CHANNEL or FRAME_WINDOW.
+ * @param flags   CHANNEL_* flags.
+ * @param channel Channel id.
+ * @param frame   FRAME_HEADER_LENGTH bytes for the header, followed by the payload.
+ * @param length  Payload length in bytes.
+ * @return        0 on success, -1 on failure.
+ */
+int send_channel_frame(session_mux *mux, uint8_t type, uint8_t flags, uint16_t channel, unsigned char *frame, uint32_t length) {
+    put_frame_header(frame, type, flags, length);
+
+    frame[2] = channel >> 8;
+    frame[3] = channel & 0xff;
+
+    pthread_mutex_lock(&mux->send_lock);
+
+    int result = send_all(mux->socket, frame, FRAME_HEADER_LENGTH + length);
+
+    pthread_mutex_unlock(&mux->send_lock);
+
+    return result;
+}
+
+/**
+ * Looks up an open channel. The session lock must be held.
+ *
+ * @param mux Session.
+ * @param id  Channel id.
+ * @return    The channel, or NULL if it is not open.
+ */
+session_channel *find_channel(session_mux *mux, uint16_t id) {
+    session_channel *channel = mux->channels;
+
+    while (channel && channel->id != id) channel = channel->next;
+
+    return channel;
+}
+
+/**
+ * Called by each thread of a channel as it ends; the last one closes the channel.
+ *
+ * @param channel Channel.
+ */
+void release_channel(session_channel *channel) {
+    session_mux *mux = channel->mux;
+    session_channel **link = &mux->channels;
+
+    pthread_mutex_lock(&mux->lock);
+
+    if (--channel->threads > 0) {
+        pthread_mutex_unlock(&mux->lock);
+
+        return;
+    }
+
+    while (*link != channel) link = &(*link)->next;
+
+    *link = channel->next;
+
+    if (--mux->channel_count == 0) mux->idle_since = time(NULL);
+
+    pthread_cond_broadcast(&mux->drained);
+    pthread_mutex_unlock(&mux->lock);
+
+    while (channel->head) {
+        channel_buffer *buffer = channel->head;
+
+        channel->head = buffer->next;
+        free(buffer);
+    }
+
+    close(channel->socket);
+    pthread_cond_destroy(&channel->changed);
+    free(channel);
+}
+
+/**
+ * Pump thread of a channel: sends what the code using the channel writes, as long as the peer
+ * has room for it, then tells the peer that nothing more follows.
+ *
+ * @param arg Pointer to a session_channel structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *channel_pump(void *arg) {
+    session_channel *channel = (session_channel *)arg;
+    session_mux *mux = channel->mux;
+    unsigned char *frame = malloc(FRAME_HEADER_LENGTH + SESSION_FRAME_LENGTH);
+    unsigned char close_frame[FRAME_HEADER_LENGTH];
+    int sending = (frame != NULL);
+
+    while (sending) {
+        uint64_t credit;
+
+        pthread_mutex_lock(&mux->lock);
+
+        while (channel->credit == 0 && !channel->peer_stopped) pthread_cond_wait(&channel->changed, &mux->lock);
+
+        credit = (channel->peer_stopped) ? 0 : channel->credit;
+
+        pthread_mutex_unlock(&mux->lock);
+
+        if (credit == 0) break;
+
+        ssize_t count = recv(channel->socket, frame + FRAME_HEADER_LENGTH, (credit < SESSION_FRAME_LENGTH) ? credit : SESSION_FRAME_LENGTH, 0);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+
+        pthread_mutex_lock(&mux->lock);
+        channel->credit -= count;
+        pthread_mutex_unlock(&mux->lock);
+
+        sending = (send_channel_frame(mux, FRAME_CHANNEL, 0, channel->id, frame, count) == 0);
+    }
+
+    // Writes of the code using the channel fail from now on instead of filling the socket pair
+    shutdown(channel->socket, SHUT_RD);
+    send_channel_frame(mux, FRAME_CHANNEL, CHANNEL_CLOSE, channel->id, close_frame, 0);
+
+    free(frame);
+    release_channel(channel);
+
+    return NULL;
+}
+
+/**
+ * Writer thread of a channel: hands the bytes from the peer to the code using the channel and
+ * grants the peer as many bytes again once they left the queue. If that code went away, the
+ * peer is told to stop and the rest is dropped.
+ *
+ * @param arg Pointer to a session_channel structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *channel_writer(void *arg) {
+    session_channel *channel = (session_channel *)arg;
+    session_mux *mux = channel->mux;
+    unsigned char frame[FRAME_HEADER_LENGTH + sizeof(uint32_t)];
+    int writing = 1;
+
+    while (1) {
+        pthread_mutex_lock(&mux->lock);
+
+        while (!channel->head && !channel->peer_closed) pthread_cond_wait(&channel->changed, &mux->lock);
+
+        channel_buffer *buffer = channel->head;
+
+        if (buffer) {
+            channel->head = buffer->next;
+            channel->queued -= buffer->length;
+
+            if (!channel->head) channel->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&mux->lock);
+
+        if (!buffer) break;
+
+        if (writing && send_all(channel->socket, buffer->data, buffer->length) < 0) {
+            writing = 0;
+            send_channel_frame(mux, FRAME_CHANNEL, CHANNEL_ABORT, channel->id, frame, 0);
+        }
+
+        if (writing) {
+            uint32_t grant = htonl(buffer->length);
+
+            memcpy(frame + FRAME_HEADER_LENGTH, &grant, sizeof(grant));
+            send_channel_frame(mux, FRAME_WINDOW, 0, channel->id, frame, sizeof(grant));
+        }
+
+        free(buffer);
+    }
+
+    // The code using the channel reads the end of the peer's bytes
+    shutdown(channel->socket, SHUT_WR);
+    release_channel(channel);
+
+    return NULL;
+}
+
+/**
+ * Opens a channel and starts its threads.
+ *
+ * @param mux         Session.
+ * @param id          Channel id.
+ * @param peer_socket Output for the socket the code using the channel reads and writes.
+ * @return            0 on success, -1 on failure.
+ */
+int add_channel(session_mux *mux, uint16_t id, int *peer_socket) {
+    session_channel *channel = calloc(1, sizeof(session_channel));
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int pair[2], started = 0;
+
+    if (!channel) return -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        free(channel);
+
+        return -1;
+    }
+
+    channel->mux = mux;
+    channel->id = id;
+    channel->socket = pair[0];
+    channel->credit = SESSION_WINDOW;
+    channel->threads = 2;
+    pthread_cond_init(&channel->changed, NULL);
+
+    pthread_mutex_lock(&mux->lock);
+
+    int failed = mux->failed;
+
+    if (!failed) {
+        channel->next = mux->channels;
+        mux->channels = channel;
+        mux->channel_count++;
+    }
+
+    pthread_mutex_unlock(&mux->lock);
+
+    if (failed) {
+        close(pair[0]);
+        close(pair[1]);
+        pthread_cond_destroy(&channel->changed);
+        free(channel);
+
+        return -1;
+    }
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attributes, channel_pump, channel) == 0) started++;
+    if (started == 1 && pthread_create(&thread, &attributes, channel_writer, channel) == 0) started++;
+
+    pthread_attr_destroy(&attributes);
+
+    if (started < 2) {
+        // The thread that did start sees a broken channel and closes it
+        pthread_mutex_lock(&mux->lock);
+        channel->peer_closed = channel->peer_stopped = 1;
+        pthread_cond_broadcast(&channel->changed);
+        pthread_mutex_unlock(&mux->lock);
+
+        shutdown(pair[0], SHUT_RDWR);
+        close(pair[1]);
+
+        for (; started < 2; started++) release_channel(channel);
+
+        return -1;
+    }
+
+    *peer_socket = pair[1];
+
+    return 0;
+}
+
+/**
+ * Serves a channel the sending side opened: derives its keys, opens it and hands it to the
+ * accept callback.
+ *
+ * @param mux Session.
+ * @param id  Channel id.
+ * @return    0 on success, -1 if the channel cannot be opened.
+ */
+int open_peer_channel(session_mux *mux, uint16_t id) {
+    crypto_session session = {0};
+    int peer_socket;
+
+    pthread_mutex_lock(&mux->lock);
+
+    int refused = (id == 0 || find_channel(mux, id) != NULL || mux->channel_count >= SESSION_MAX_CHANNELS);
+
+    pthread_mutex_unlock(&mux->lock);
+
+    if (refused || derive_channel_session(&mux->session, id, mux->is_client, &session) < 0 || add_channel(mux, id, &peer_socket) < 0) {
+        OPENSSL_cleanse(&session, sizeof(session));
+
+        return -1;
+    }
+
+    mux->accept(mux, peer_socket, &session);
+
+    OPENSSL_cleanse(&session, sizeof(session));
+
+    return 0;
+}
+
+/**
+ * Ends every channel of a session whose connection is gone. The code using them sees its
+ * connection end early.
+ *
+ * @param mux Session.
+ */
+void fail_session(session_mux *mux) {
+    pthread_mutex_lock(&mux->lock);
+
+    mux->failed = 1;
+
+    for (session_channel *channel = mux->channels; channel; channel = channel->next) {
+        channel->peer_closed = channel->peer_stopped = 1;
+
+        shutdown(channel->socket, SHUT_RDWR);
+        pthread_cond_broadcast(&channel->changed);
+    }
+
+    pthread_cond_broadcast(&mux->drained);
+    pthread_mutex_unlock(&mux->lock);
+}
+
+/**
+ * Reads the frames of a session's connection and dispatches them to the channels until the
+ * connection ends. A peer that sends more than a channel's window breaks the session.
+ *
+ * @param mux Session.
+ */
+void run_session(session_mux *mux) {
+    unsigned char refusal[FRAME_HEADER_LENGTH];
+    frame_header header;
+
+    while (recv_frame_header(mux->socket, &header) == 0) {
+        channel_buffer *buffer = NULL;
+        uint32_t grant;
+
+        if (header.type == FRAME_WINDOW) {
+            if (header.length != sizeof(grant) || recv_all(mux->socket, &grant, sizeof(grant)) < 0) break;
+
+            pthread_mutex_lock(&mux->lock);
+
+            session_channel *channel = find_channel(mux, header.channel);
+
+            if (channel) {
+                channel->credit += ntohl(grant);
+                pthread_cond_broadcast(&channel->changed);
+            }
+
+            pthread_mutex_unlock(&mux->lock);
+
+            continue;
+        }
+
+        if (header.type != FRAME_CHANNEL || header.length > SESSION_FRAME_LENGTH) break;
+
+        if (header.length > 0) {
+            if (!(buffer = malloc(sizeof(channel_buffer) + header.length)) || recv_all(mux->socket, buffer->data, header.length) < 0) {
+                free(buffer);
+                break;
+            }
+
+            buffer->next = NULL;
+            buffer->length = header.length;
+        }
+
+        // The receiving side serves every channel the sending side opens, up to a limit
+        if ((header.flags & CHANNEL_OPEN) && !mux->is_client && open_peer_channel(mux, header.channel) < 0) {
+            send_channel_frame(mux, FRAME_CHANNEL, CHANNEL_CLOSE | CHANNEL_ABORT, header.channel, refusal, 0);
+        }
+
+        pthread_mutex_lock(&mux->lock);
+
+        // Bytes for a channel that already closed are dropped
+        session_channel *channel = find_channel(mux, header.channel);
+        int overrun = (channel && buffer && channel->queued + buffer->length > SESSION_WINDOW);
+
+        if (channel && buffer && !overrun) {
+            if (channel->tail) channel->tail->next = buffer;
+            else channel->head = buffer;
+
+            channel->tail = buffer;
+            channel->queued += buffer->length;
+            buffer = NULL;
+        }
+
+        if (channel && (header.flags & CHANNEL_CLOSE)) channel->peer_closed = 1;
+
+        if (channel && (header.flags & CHANNEL_ABORT)) {
+            channel->peer_stopped = 1;
+            shutdown(channel->socket, SHUT_RD);
+        }
+
+        if (channel) pthread_cond_broadcast(&channel->changed);
+
+        pthread_mutex_unlock(&mux->lock);
+
+        free(buffer);
+
+        if (overrun) break;
+    }
+
+    fail_session(mux);
+}
+
+/**
+ * Prepares a session on a connection whose handshake is done.
+ *
+ * @param mux       Session to initialize.
+ * @param socket    Connection to the peer.
+ * @param session   Session negotiated on the connection.
+ * @param is_client 1 on the sending side.
+ */
+void init_session(session_mux *mux, int socket, const crypto_session *session, int is_client) {
+    memset(mux, 0, sizeof(session_mux));
+
+    mux->socket = socket;
+    mux->session = *session;
+    mux->is_client = is_client;
+    mux->next_id = 1;
+    mux->idle_since = time(NULL);
+
+    pthread_mutex_init(&mux->lock, NULL);
+    pthread_mutex_init(&mux->send_lock, NULL);
+    pthread_cond_init(&mux->drained, NULL);
+}
+
+/**
+ * Waits until every channel of a session is closed and releases the session. The connection
+ * must already be shut down.
+ *
+ * @param mux Session.
+ */
+void close_session(session_mux *mux) {
+    pthread_mutex_lock(&mux->lock);
+
+    while (mux->channel_count > 0) pthread_cond_wait(&mux->drained, &mux->lock);
+
+    pthread_mutex_unlock(&mux->lock);
+
+    pthread_mutex_destroy(&mux->lock);
+    pthread_mutex_destroy(&mux->send_lock);
+    pthread_cond_destroy(&mux->drained);
+    OPENSSL_cleanse(&mux->session, sizeof(mux->session));
+}
+
+/**
+ * Session thread of a session host.
+ *
+ * @param arg Pointer to a session_mux structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *session_demux(void *arg) {
+    run_session((session_mux *)arg);
+
+    return NULL;
+}
+
+/**
+ * Builds the address of the control socket of the session to a receiver. It lives in
+ * $XDG_RUNTIME_DIR, or /tmp without one, and is named after the user and the receiver.
+ *
+ * @param address Receiver's IPv4 address.
+ * @param control Output for the socket address.
+ * @return        0 on success, -1 if the path does not fit.
+ */
+int control_address(const char *address, struct sockaddr_un *control) {
+    const char *directory = getenv("XDG_RUNTIME_DIR");
+
+    memset(control, 0, sizeof(struct sockaddr_un));
+    control->sun_family = AF_UNIX;
+
+    if (directory == NULL || *directory == '\0') directory = "/tmp";
+
+    int length = snprintf(control->sun_path, sizeof(control->sun_path), "%s/bytevalve-%u-%s.sock", directory, (unsigned)getuid(), address);
+
+    return (length < (int)sizeof(control->sun_path)) ? 0 : -1;
+}
+
+/**
+ * Checks that the process at the other end of a local socket runs as the same user. The
+ * control socket may sit in a directory other users can write to.
+ *
+ * @param socket Connected local socket.
+ * @return       1 if it is the same user, 0 otherwise.
+ */
+int same_user(int socket) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    return getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+}
+
+/**
+ * Connects to the control socket of a session host.
+ *
+ * @param control Control socket address.
+ * @return        Connected socket, or -1 if no host of this user listens there.
+ */
+int connect_control(const struct sockaddr_un *control) {
+    int control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (control_fd < 0) return -1;
+
+    if (connect(control_fd, (const struct sockaddr *)control, sizeof(struct sockaddr_un)) < 0 || !same_user(control_fd)) {
+        close(control_fd);
+
+        return -1;
+    }
+
+    return control_fd;
+}
+
+/**
+ * Hands a channel to a process attaching to the session host, with its socket as SCM_RIGHTS.
+ *
+ * @param control     Control connection.
+ * @param peer_socket Channel socket, or -1 if the grant carries a refusal.
+ * @param grant       Result and keys of the channel.
+ * @return            0 on success, -1 on failure.
+ */
+int send_grant(int control, int peer_socket, const channel_grant *grant) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } ancillary;
+    struct iovec vector = {(void *)grant, sizeof(channel_grant)};
+    struct msghdr message = {0};
+
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    if (peer_socket >= 0) {
+        memset(&ancillary, 0, sizeof(ancillary));
+
+        message.msg_control = ancillary.space;
+        message.msg_controllen = sizeof(ancillary.space);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+
+        memcpy(CMSG_DATA(header), &peer_socket, sizeof(int));
+    }
+
+    return (sendmsg(control, &message, MSG_NOSIGNAL) == sizeof(channel_grant)) ? 0 : -1;
+}
+
+/**
+ * Receives a channel from the session host.
+ *
+ * @param control Control connection.
+ * @param socket  Output for the channel socket.
+ * @param session Output for the channel session.
+ * @return        0 on success, -1 if the host refused or the connection failed.
+ */
+int recv_grant(int control, int *socket, crypto_session *session) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } ancillary;
+    channel_grant grant = {0};
+    struct iovec vector = {&grant, sizeof(grant)};
+    struct msghdr message = {0};
+    ssize_t received;
+
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = ancillary.space;
+    message.msg_controllen = sizeof(ancillary.space);
+
+    do received = recvmsg(control, &message, MSG_CMSG_CLOEXEC);
+    while (received < 0 && errno == EINTR);
+
+    struct cmsghdr *header = (received > 0) ? CMSG_FIRSTHDR(&message) : NULL;
+
+    *socket = -1;
+
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) memcpy(socket, CMSG_DATA(header), sizeof(int));
+
+    if (received != sizeof(grant) || grant.result != 0 || *socket < 0) {
+        if (*socket >= 0) close(*socket);
+
+        OPENSSL_cleanse(&grant, sizeof(grant));
+
+        return -1;
+    }
+
+    *session = grant.session;
+
+    OPENSSL_cleanse(&grant, sizeof(grant));
+
+    return 0;
+}
+
+/**
+ * Answers one process attaching to the session host: opens the number of channels it asks
+ * for and hands each of them over. The receiver learns of a channel before any of its bytes.
+ *
+ * @param mux     Session.
+ * @param control Control connection.
+ */
+void grant_channels(session_mux *mux, int control) {
+    uint32_t count;
+
+    set_receive_timeout(control, HANDSHAKE_TIMEOUT);
+
+    if (recv_all(control, &count, sizeof(count)) < 0) return;
+
+    for (uint32_t index = 0; index < count && index < MAX_STREAMS; index++) {
+        unsigned char frame[FRAME_HEADER_LENGTH];
+        channel_grant grant = {0};
+        int peer_socket = -1;
+
+        pthread_mutex_lock(&mux->lock);
+
+        int available = (!mux->failed && mux->channel_count < SESSION_MAX_CHANNELS && mux->next_id <= UINT16_MAX);
+        uint16_t id = (available) ? mux->next_id++ : 0;
+
+        pthread_mutex_unlock(&mux->lock);
+
+        grant.result = (available && derive_channel_session(&mux->session, id, mux->is_client, &grant.session) == 0 &&
+                        add_channel(mux, id, &peer_socket) == 0) ? 0 : -1;
+
+        if (grant.result == 0 && send_channel_frame(mux, FRAME_CHANNEL, CHANNEL_OPEN, id, frame, 0) < 0) grant.result = -1;
+
+        int result = (send_grant(control, (grant.result == 0) ? peer_socket : -1, &grant) == 0) ? grant.result : -1;
+
+        // The host keeps only its own end; a channel nobody took ends by itself
+        if (peer_socket >= 0) close(peer_socket);
+
+        OPENSSL_cleanse(&grant, sizeof(grant));
+
+        if (result < 0) break;
+    }
+}
+
+/**
+ * Body of a session host, run in a process of its own. It connects to the receiver once, then
+ * opens channels on that connection for every process attaching through the control socket.
+ * It ends after SESSION_IDLE_TIMEOUT seconds without channels, or once the connection breaks.
+ * The outcome of the start is written to the ready pipe: 0 when the host serves, 1 if the
+ * receiver could not be reached, 2 if it does not serve sessions.
+ *
+ * @param address Receiver's IPv4 address.
+ * @param control Control socket address.
+ * @param ready   Write end of the pipe the starting process waits on.
+ */
+void run_session_host(const char *address, const struct sockaddr_un *control, int ready) {
+    struct sockaddr_in receiver = {0};
+    crypto_session session = {0};
+    session_mux mux;
+    pthread_t demux;
+    char status = 1;
+    int enable = 1;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // The control socket is only for this user
+    umask(077);
+
+    int bound = (listener >= 0 && bind(listener, (const struct sockaddr *)control, sizeof(struct sockaddr_un)) == 0);
+
+    // Another host may have started meanwhile; otherwise the socket was left by one that died
+    if (!bound && listener >= 0 && errno == EADDRINUSE) {
+        int probe = connect_control(control);
+
+        if (probe >= 0) {
+            close(probe);
+
+            status = 0;
+            write(ready, &status, 1);
+            _exit(0);
+        }
+
+        unlink(control->sun_path);
+        bound = (bind(listener, (const struct sockaddr *)control, sizeof(struct sockaddr_un)) == 0);
+    }
+
+    if (!bound || listen(listener, SOMAXCONN) < 0) {
+        write(ready, &status, 1);
+        _exit(1);
+    }
+
+    receiver.sin_family = AF_INET;
+    receiver.sin_port = htons(PORT);
+
+    int connection = (inet_pton(AF_INET, address, &receiver.sin_addr) == 1) ? socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+
+    if (connection >= 0 && connect(connection, (struct sockaddr *)&receiver, sizeof(receiver)) == 0) {
+        set_no_delay(connection);
+        setsockopt(connection, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+        set_receive_timeout(connection, HANDSHAKE_TIMEOUT);
+
+        int handshake = client_handshake(connection, &session, HELLO_SESSION);
+
+        // A receiver that is not a daemon answers the session with an ERROR frame
+        if (handshake == 0) status = ((session.peer_flags & HELLO_SESSION) && receive_ack(connection) == 0) ? 0 : 2;
+        else if (handshake == -2) status = 2;
+    }
+
+    if (status == 0) {
+        set_receive_timeout(connection, 0);
+        init_session(&mux, connection, &session, 1);
+
+        if (pthread_create(&demux, NULL, session_demux, &mux) != 0) status = 1;
+    }
+
+    OPENSSL_cleanse(&session, sizeof(session));
+
+    if (status != 0) {
+        unlink(control->sun_path);
+        write(ready, &status, 1);
+        _exit(1);
+    }
+
+    write(ready, &status, 1);
+    close(ready);
+
+    while (1) {
+        struct pollfd entry = {listener, POLLIN, 0};
+
+        if (poll(&entry, 1, SESSION_POLL_INTERVAL) > 0) {
+            int control_fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+            if (control_fd >= 0 && same_user(control_fd)) grant_channels(&mux, control_fd);
+            if (control_fd >= 0) close(control_fd);
+        }
+
+        pthread_mutex_lock(&mux.lock);
+
+        int done = mux.failed || mux.next_id > UINT16_MAX || (mux.channel_count == 0 && time(NULL) - mux.idle_since >= SESSION_IDLE_TIMEOUT);
+
+        pthread_mutex_unlock(&mux.lock);
+
+        if (done) break;
+    }
+
+    // Later senders start a new host, while the channels still open finish on this one
+    unlink(control->sun_path);
+    close(listener);
+
+    pthread_mutex_lock(&mux.lock);
+
+    while (mux.channel_count > 0 && !mux.failed) pthread_cond_wait(&mux.drained, &mux.lock);
+
+    pthread_mutex_unlock(&mux.lock);
+
+    shutdown(connection, SHUT_RDWR);
+    pthread_join(demux, NULL);
+    close_session(&mux);
+    close(connection);
+
+    _exit(0);
+}
+
+/**
+ * Starts a session host in the background and waits until it serves. The host is detached
+ * from the terminal and reparented to init, so the sender can exit while it keeps running.
+ *
+ * @param address Receiver's IPv4 address.
+ * @param control Control socket address.
+ * @return        0 once the host serves, -1 if the receiver could not be reached, -2 if it does
+ *                not serve sessions.
+ */
+int spawn_session_host(const char *address, const struct sockaddr_un *control) {
+    char status = 1;
+    int ready[2];
+
+    if (pipe2(ready, O_CLOEXEC) < 0) return -1;
+
+    fflush(stdout);
+
+    pid_t child = fork();
+
+    if (child == 0) {
+        if (fork() != 0) _exit(0);
+
+        setsid();
+        signal(SIGPIPE, SIG_IGN);
+
+        int null = open("/dev/null", O_RDWR);
+
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+
+        // Only the ready pipe stays open; the file being sent is not the host's business
+        dup2(ready[1], 3);
+        close_range(4, ~0U, 0);
+
+        run_session_host(address, control, 3);
+    }
+
+    close(ready[1]);
+
+    if (child > 0) waitpid(child, NULL, 0);
+    if (child < 0 || read(ready[0], &status, 1) != 1) status = 1;
+
+    close(ready[0]);
+
+    return (status == 0) ? 0 : (status == 2) ? -2 : -1;
+}
+
+/**
+ * Attaches the streams of a transfer to the session kept open to a receiver, starting the
+ * session host first if none runs. Every stream gets a channel socket and the keys of its
+ * channel in place of a connection and handshake of its own.
+ *
+ * @param address      Receiver's IPv4 address.
+ * @param streams      Streams; their sockets and sessions are filled in.
+ * @param stream_count Number of streams.
+ * @return             0 on success, -1 if no session could be opened, -2 if the receiver
+ *                     does not serve sessions.
+ */
+int attach_session(const char *address, transfer_stream *streams, int stream_count) {
+    struct sockaddr_un control;
+    uint32_t count = stream_count;
+    int result = 0, granted = 0;
+
+    if (control_address(address, &control) < 0) return -1;
+
+    int control_fd = connect_control(&control);
+
+    if (control_fd < 0 && (result = spawn_session_host(address, &control)) == 0) control_fd = connect_control(&control);
+    if (control_fd < 0) return (result < 0) ? result : -1;
+
+    set_receive_timeout(control_fd, HANDSHAKE_TIMEOUT);
+
+    if (send_all(control_fd, &count, sizeof(count)) < 0) result = -1;
+
+    while (result == 0 && granted < stream_count) {
+        if (recv_grant(control_fd, &streams[granted].socket, &streams[granted].session) < 0) result = -1;
+        else granted++;
+    }
+
+    close(control_fd);
+
+    if (result < 0) {
+        for (int index = 0; index < granted; index++) close(streams[index].socket);
+    }
+
+    return result;
+}
@@ -0,0 +1,238 @@
+#include "writeback.h"
+
+#define EXTENT_GROWTH 64                // Entries added whenever an extent list is full
+#define ZERO_WRITE_SIZE (1 << 20)       // Bytes of zeros written at once where holes cannot be punched
+
+/**
+ * Maps the data extents of a file with SEEK_DATA and SEEK_HOLE. Every extent is widened to
+ * whole chunks and touching extents are merged, so a chunk is either sent or a hole from end
+ * to end. A file system that cannot report holes maps the whole file as data.
+ *
+ * @param file         File descriptor.
+ * @param size         File size.
+ * @param chunk_size   Plaintext bytes per chunk.
+ * @param extents      Output for the allocated extents (free with free()).
+ * @param extent_count Output for the number of extents.
+ * @return             0 on success, -1 on failure.
+ */
+int map_data_extents(int file, uint64_t size, uint32_t chunk_size, byte_range **extents, uint32_t *extent_count) {
+    uint32_t capacity = EXTENT_GROWTH;
+    uint64_t offset = 0;
+
+    *extent_count = 0;
+    *extents = malloc(capacity * sizeof(byte_range));
+
+    if (!*extents) return -1;
+
+    while (offset < size) {
+        off_t data = lseek(file, offset, SEEK_DATA), hole;
+
+        // Nothing but a hole is left
+        if (data < 0 && errno == ENXIO) break;
+
+        if (data < 0) {
+            data = offset;
+            hole = size;
+        }
+        else if ((hole = lseek(file, data, SEEK_HOLE)) < 0) hole = size;
+
+        if ((uint64_t)data >= size) break;
+
+        uint64_t start = data - data % chunk_size;
+        uint64_t end = ((uint64_t)hole + chunk_size - 1) / chunk_size * chunk_size;
+
+        if (end > size) end = size;
+
+        if (*extent_count > 0 && (*extents)[*extent_count - 1].offset + (*extents)[*extent_count - 1].length >= start) {
+            (*extents)[*extent_count - 1].length = end - (*extents)[*extent_count - 1].offset;
+        }
+        else {
+            if (*extent_count == capacity) {
+                byte_range *grown = realloc(*extents, (capacity + EXTENT_GROWTH) * sizeof(byte_range));
+
+                if (!grown) {
+                    free(*extents);
+
+                    return -1;
+                }
+
+                *extents = grown;
+                capacity += EXTENT_GROWTH;
+            }
+
+            (*extents)[*extent_count].offset = start;
+            (*extents)[(*extent_count)++].length = end - start;
+        }
+
+        offset = end;
+    }
+
+    return 0;
+}
+
+/**
+ * Adds up the bytes of a list of ranges.
+ *
+ * @param ranges      Ranges.
+ * @param range_count Number of ranges.
+ * @return            Number of bytes covered.
+ */
+uint64_t range_bytes(const byte_range *ranges, uint32_t range_count) {
+    uint64_t total = 0;
+
+    for (uint32_t index = 0; index < range_count; index++) total += ranges[index].length;
+
+    return total;
+}
+
+/**
+ * Keeps the parts of sorted, non-overlapping ranges that lie inside a span.
+ *
+ * @param ranges      Ranges to clip.
+ * @param range_count Number of ranges.
+ * @param span        Span to keep.
+ * @param clipped     Output for the allocated ranges (free with free()).
+ * @param clip_count  Output for the number of ranges.
+ * @return            0 on success, -1 on failure.
+ */
+int clip_ranges(const byte_range *ranges, uint32_t range_count, byte_range span, byte_range **clipped, uint32_t *clip_count) {
+    uint64_t end = span.offset + span.length;
+
+    *clip_count = 0;
+    *clipped = calloc(range_count + 1, sizeof(byte_range));
+
+    if (!*clipped) return -1;
+
+    for (uint32_t index = 0; index < range_count; index++) {
+        uint64_t first = (ranges[index].offset > span.offset) ? ranges[index].offset : span.offset;
+        uint64_t last = (ranges[index].offset + ranges[index].length < end) ? ranges[index].offset + ranges[index].length : end;
+
+        if (first >= last) continue;
+
+        (*clipped)[*clip_count].offset = first;
+        (*clipped)[(*clip_count)++].length = last - first;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks that the extents of a sparse stream start and end on chunk boundaries, so that every
+ * chunk of its span is either carried whole or a hole.
+ *
+ * @param metadata     Stream metadata.
+ * @param extents      Extents received with the metadata.
+ * @param extent_count Number of extents.
+ * @return             0 if the extents are aligned, -1 otherwise.
+ */
+int check_extents(const file_metadata *metadata, const byte_range *extents, uint32_t extent_count) {
+    for (uint32_t index = 0; index < extent_count; index++) {
+        uint64_t end = extents[index].offset + extents[index].length;
+
+        if (extents[index].offset % metadata->chunk_size != 0 || (end % metadata->chunk_size != 0 && end != metadata->size)) return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes zeros over a range, for file systems that cannot punch holes.
+ *
+ * @param file   File descriptor.
+ * @param offset First byte.
+ * @param length Number of bytes.
+ * @return       0 on success, -1 on failure.
+ */
+int write_zeros(int file, uint64_t offset, uint64_t length) {
+    unsigned char *zeros = calloc(1, ZERO_WRITE_SIZE);
+    int result = (zeros) ? 0 : -1;
+
+    while (result == 0 && length > 0) {
+        size_t count = (length < ZERO_WRITE_SIZE) ? length : ZERO_WRITE_SIZE;
+
+        result = pwrite_all(file, zeros, count, offset);
+        offset += count;
+        length -= count;
+    }
+
+    free(zeros);
+
+    return result;
+}
+
+/**
+ * Reserves the data extents of a sparse stream's span and leaves the rest as holes. In a file
+ * kept from an earlier attempt the holes are punched out again, so they read as zeros without
+ * taking disk space. The file must already have its final size.
+ *
+ * @param file         Output file.
+ * @param span         Span carried by the stream.
+ * @param extents      Data extents inside the span.
+ * @param extent_count Number of extents.
+ * @param punch        1 to punch the holes, 0 if the file was just created.
+ * @return             0 on success, -1 on failure (errno is set).
+ */
+int allocate_extents(int file, byte_range span, const byte_range *extents, uint32_t extent_count, int punch) {
+    uint64_t cursor = span.offset;
+
+    for (uint32_t index = 0; index <= extent_count; index++) {
+        uint64_t hole_end = (index < extent_count) ? extents[index].offset : span.offset + span.length;
+
+        if (punch && hole_end > cursor && fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, cursor, hole_end - cursor) < 0) {
+            if (errno != EOPNOTSUPP && errno != ENOSYS) return -1;
+            if (write_zeros(file, cursor, hole_end - cursor) < 0) return -1;
+        }
+
+        if (index == extent_count) break;
+
+        // Like preallocate_file(), a file system without fallocate() simply allocates on write
+        if (extents[index].length > 0 && fallocate(file, 0, extents[index].offset, extents[index].length) < 0 &&
+            errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) return -1;
+
+        cursor = extents[index].offset + extents[index].length;
+    }
+
+    return 0;
+}
+
+/**
+ * Records the chunks of a sparse stream's span that fall in holes: they are marked in the
+ * checkpoint and their leaves are set in the tree hash, both with the digest of zeros, so
+ * neither waits for chunks that are never sent.
+ *
+ * @param span         Span carried by the stream.
+ * @param size         File size.
+ * @param extents      Data extents inside the span.
+ * @param extent_count Number of extents.
+ * @param chunk_size   Plaintext bytes per chunk.
+ * @param resume       Checkpoint of the output file, or NULL.
+ * @param tree         Tree hash of the file, or NULL.
+ * @return             0 on success, -1 on failure.
+ */
+int mark_hole_chunks(byte_range span, uint64_t size, const byte_range *extents, uint32_t extent_count, uint32_t chunk_size, checkpoint *resume, tree_digest *tree) {
+    unsigned char *zeros = calloc(1, chunk_size);
+    unsigned char full_digest[DIGEST_LENGTH], digest[DIGEST_LENGTH];
+    uint64_t cursor = span.offset;
+    int result = (zeros && digest_chunk(zeros, chunk_size, full_digest) == 0) ? 0 : -1;
+
+    for (uint32_t index = 0; result == 0 && index <= extent_count; index++) {
+        uint64_t hole_end = (index < extent_count) ? extents[index].offset : span.offset + span.length;
+
+        for (uint64_t offset = cursor; result == 0 && offset < hole_end; offset += chunk_size) {
+            uint64_t length = (size - offset < chunk_size) ? size - offset : chunk_size;
+
+            // Only the last chunk of the file can be shorter
+            if (length == chunk_size) memcpy(digest, full_digest, DIGEST_LENGTH);
+            else if (digest_chunk(zeros, length, digest) < 0) result = -1;
+
+            if (result == 0) tree_digest_leaf(tree, offset, length, digest);
+            if (result == 0 && resume != NULL && !checkpoint_has(resume, offset / chunk_size)) result = checkpoint_mark(resume, offset, digest);
+        }
+
+        if (index < extent_count) cursor = extents[index].offset + extents[index].length;
+    }
+
+    free(zeros);
+
+    return result;
+}
@@ -0,0 +1,301 @@
+#include "verify.h"
+
+#define STAGE_DISK_READ 0           // Reading the source file
+#define STAGE_CRYPTO 1              // Sealing, opening, compressing and hashing chunks
+#define STAGE_NETWORK 2             // Sending to or receiving from the peer
+#define STAGE_DISK_WRITE 3          // Writing the output file
+#define STAGE_COUNT 4
+
+#define PROGRESS_INTERVAL 250       // Milliseconds between two updates of the progress line
+#define PROGRESS_SMOOTHING 0.3      // Weight of the latest interval in the displayed rate
+
+// Live counters of one transfer. The stages only add to them with relaxed atomics, every
+// reading and formatting happens on the progress thread.
+typedef struct {
+    const char *label;                          // Verb shown on the progress line ("Sending", "Receiving")
+    uint64_t total_bytes;                       // Bytes of the file, 0 if unknown (directories)
+    _Atomic uint64_t done_bytes;                // Bytes moved or found already in place
+    _Atomic uint64_t moved_bytes;               // Bytes that actually went through a stage
+    _Atomic uint64_t stage_ns[STAGE_COUNT];     // Time spent in every stage, summed over its threads
+    uint64_t started;                           // Monotonic nanoseconds at which the transfer started
+    uint64_t finished;                          // Monotonic nanoseconds at which it ended
+    int stopping;                               // Set under lock to stop the progress thread
+    pthread_mutex_t lock;                       // Guards stopping
+    pthread_cond_t wake;                        // Signalled when stopping is set
+    pthread_t thread;                           // Thread drawing the progress line
+    int drawing;                                // 1 while the progress thread runs
+} transfer_telemetry;
+
+transfer_telemetry *live_telemetry = NULL;      // Transfer the stages report to while set
+
+const char *stage_names[STAGE_COUNT] = {"disk_read", "crypto", "network", "disk_write"};
+
+/**
+ * Reads the monotonic clock.
+ *
+ * @return Nanoseconds since an arbitrary point.
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Starts timing a stage. Costs one branch while no transfer is being watched.
+ *
+ * @return The current time to pass to telemetry_stage(), or 0 when there is no telemetry.
+ */
+uint64_t telemetry_clock(void) {
+    return (live_telemetry) ? monotonic_ns() : 0;
+}
+
+/**
+ * Adds the time since telemetry_clock() to a stage.
+ *
+ * @param stage   One of the STAGE_* values.
+ * @param started Value returned by telemetry_clock().
+ */
+void telemetry_stage(int stage, uint64_t started) {
+    transfer_telemetry *telemetry = live_telemetry;
+
+    if (telemetry && started) atomic_fetch_add_explicit(&telemetry->stage_ns[stage], monotonic_ns() - started, memory_order_relaxed);
+}
+
+/**
+ * Counts bytes of the file that went through the last stage.
+ *
+ * @param bytes Number of bytes.
+ */
+void telemetry_bytes(uint64_t bytes) {
+    transfer_telemetry *telemetry = live_telemetry;
+
+    if (telemetry == NULL) return;
+
+    atomic_fetch_add_explicit(&telemetry->done_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&telemetry->moved_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * Counts bytes of the file that do not have to move because the receiver already has them.
+ *
+ * @param bytes Number of bytes.
+ */
+void telemetry_skip(uint64_t bytes) {
+    transfer_telemetry *telemetry = live_telemetry;
+
+    if (telemetry) atomic_fetch_add_explicit(&telemetry->done_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * Formats a byte count with one decimal in the largest binary unit below it.
+ *
+ * @param bytes  Byte count.
+ * @param buffer Output buffer.
+ * @param length Size of buffer.
+ * @return       buffer.
+ */
+const char *format_size(double bytes, char *buffer, size_t length) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+
+    snprintf(buffer, length, (unit == 0) ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+
+    return buffer;
+}
+
+/**
+ * Progress thread: redraws the progress line with the bytes done, the rate over the last
+ * intervals, the percentage and the time left, until the transfer ends.
+ *
+ * @param arg Pointer to a transfer_telemetry structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *progress_reporter(void *arg) {
+    transfer_telemetry *telemetry = (transfer_telemetry *)arg;
+    uint64_t last_bytes = 0, last_time = telemetry->started;
+    double rate = -1;
+
+    pthread_mutex_lock(&telemetry->lock);
+
+    while (!telemetry->stopping) {
+        struct timespec deadline;
+
+        // Sleep one interval, but wake at once when the transfer ends
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        deadline.tv_nsec += PROGRESS_INTERVAL * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (!telemetry->stopping && pthread_cond_timedwait(&telemetry->wake, &telemetry->lock, &deadline) == 0);
+
+        if (telemetry->stopping) break;
+
+        pthread_mutex_unlock(&telemetry->lock);
+
+        uint64_t now = monotonic_ns(), done = atomic_load_explicit(&telemetry->done_bytes, memory_order_relaxed);
+        double interval_rate = (done - last_bytes) / ((now - last_time) / 1e9);
+        char done_text[16], total_text[16], rate_text[16];
+
+        // Smooth the rate so the time left does not jump with every interval
+        rate = (rate < 0) ? interval_rate : PROGRESS_SMOOTHING * interval_rate + (1 - PROGRESS_SMOOTHING) * rate;
+        last_bytes = done;
+        last_time = now;
+
+        printf("\r%s \e[33m%s\e[0m", telemetry->label, format_size(done, done_text, sizeof(done_text)));
+
+        if (telemetry->total_bytes > 0) {
+            printf(" of %s (%.1f%%)", format_size(telemetry->total_bytes, total_text, sizeof(total_text)),
+                   (done < telemetry->total_bytes) ? 100.0 * done / telemetry->total_bytes : 100.0);
+        }
+
+        printf(", %s/s", format_size(rate, rate_text, sizeof(rate_text)));
+
+        if (telemetry->total_bytes > done && rate >= 1) {
+            uint64_t left = (uint64_t)((telemetry->total_bytes - done) / rate);
+
+            printf(", %llu:%02llu left", (unsigned long long)(left / 60), (unsigned long long)(left % 60));
+        }
+        else if (telemetry->total_bytes > done) printf(", stalled");
+
+        // Clear the tail of a longer previous line
+        printf("\e[K");
+        fflush(stdout);
+
+        pthread_mutex_lock(&telemetry->lock);
+    }
+
+    pthread_mutex_unlock(&telemetry->lock);
+
+    printf("\r\e[K");
+    fflush(stdout);
+
+    return NULL;
+}
+
+/**
+ * Starts collecting telemetry for a transfer and draws its progress line.
+ *
+ * @param telemetry   Telemetry to start.
+ * @param label       Verb shown on the progress line.
+ * @param total_bytes Bytes of the file, 0 if unknown.
+ * @param draw        1 to draw the progress line, 0 to only collect counters.
+ */
+void telemetry_start(transfer_telemetry *telemetry, const char *label, uint64_t total_bytes, int draw) {
+    memset(telemetry, 0, sizeof(*telemetry));
+
+    telemetry->label = label;
+    telemetry->total_bytes = total_bytes;
+    telemetry->started = monotonic_ns();
+
+    pthread_mutex_init(&telemetry->lock, NULL);
+    pthread_cond_init(&telemetry->wake, NULL);
+
+    live_telemetry = telemetry;
+
+    if (draw && pthread_create(&telemetry->thread, NULL, progress_reporter, telemetry) == 0) telemetry->drawing = 1;
+}
+
+/**
+ * Stops collecting telemetry and clears the progress line.
+ *
+ * @param telemetry Running telemetry.
+ */
+void telemetry_stop(transfer_telemetry *telemetry) {
+    telemetry->finished = monotonic_ns();
+
+    live_telemetry = NULL;
+
+    pthread_mutex_lock(&telemetry->lock);
+
+    telemetry->stopping = 1;
+
+    pthread_cond_signal(&telemetry->wake);
+    pthread_mutex_unlock(&telemetry->lock);
+
+    if (telemetry->drawing) pthread_join(telemetry->thread, NULL);
+
+    pthread_mutex_destroy(&telemetry->lock);
+    pthread_cond_destroy(&telemetry->wake);
+
+    telemetry->drawing = 0;
+}
+
+/**
+ * Prints where the time of a finished transfer went.
+ *
+ * @param telemetry Stopped telemetry.
+ * @param verb      Past tense shown first ("Sent", "Received").
+ */
+void print_telemetry(const transfer_telemetry *telemetry, const char *verb) {
+    double seconds = (telemetry->finished - telemetry->started) / 1e9;
+    uint64_t moved = atomic_load(&telemetry->moved_bytes);
+    char moved_text[16], rate_text[16];
+
+    printf("%s %s in %.2f s (%s/s); thread time: read %.2f s, crypto %.2f s, network %.2f s, write %.2f s\n", verb,
+           format_size(moved, moved_text, sizeof(moved_text)), seconds, format_size((seconds > 0) ? moved / seconds : 0, rate_text, sizeof(rate_text)),
+           telemetry->stage_ns[STAGE_DISK_READ] / 1e9, telemetry->stage_ns[STAGE_CRYPTO] / 1e9, telemetry->stage_ns[STAGE_NETWORK] / 1e9,
+           telemetry->stage_ns[STAGE_DISK_WRITE] / 1e9);
+    fflush(stdout);
+}
+
+/**
+ * Writes the summary of a finished transfer as JSON for dashboards.
+ *
+ * @param path         Output file.
+ * @param telemetry    Stopped telemetry.
+ * @param role         "sender" or "receiver".
+ * @param metadata     Metadata of the first stream.
+ * @param stream_count Number of streams.
+ * @param error        NULL if the transfer succeeded, otherwise its error message.
+ * @return             0 on success, -1 on failure.
+ */
+int write_stats_json(const char *path, const transfer_telemetry *telemetry, const char *role, const file_metadata *metadata, int stream_count,
+                     const char *error) {
+    FILE *output = fopen(path, "w");
+    double seconds = (telemetry->finished - telemetry->started) / 1e9;
+    uint64_t moved = atomic_load(&telemetry->moved_bytes), done = atomic_load(&telemetry->done_bytes);
+    const char *payloads[] = {"sealed", "plain", "ktls"};
+    const char *ciphers[] = {"none", "aes-256-gcm", "chacha20-poly1305"};
+
+    if (output == NULL) return -1;
+
+    fprintf(output, "{\n  \"role\": \"%s\",\n  \"ok\": %s,\n", role, (error == NULL) ? "true" : "false");
+
+    // File names may hold any byte: quotes and backslashes are escaped, control characters dropped
+    fprintf(output, "  \"name\": \"");
+
+    for (const char *cursor = metadata->name; *cursor; cursor++) {
+        if (*cursor == '"' || *cursor == '\\') fputc('\\', output);
+        if ((unsigned char)*cursor >= 0x20) fputc(*cursor, output);
+    }
+
+    fprintf(output, "\",\n  \"error\": ");
+
+    if (error != NULL) fprintf(output, "\"%s\",\n", error);
+    else fprintf(output, "null,\n");
+
+    fprintf(output, "  \"kind\": \"%s\",\n  \"size\": %llu,\n  \"bytes_transferred\": %llu,\n  \"bytes_reused\": %llu,\n  \"seconds\": %.6f,\n  \"bytes_per_second\": %.0f,\n",
+            (metadata->kind == TRANSFER_TREE) ? "directory" : (metadata->kind == TRANSFER_PIPED) ? "piped" : "file", (unsigned long long)metadata->size, (unsigned long long)moved,
+            (unsigned long long)(done - moved), seconds, (seconds > 0) ? moved / seconds : 0);
+    fprintf(output, "  \"streams\": %d,\n  \"chunk_size\": %u,\n  \"payload\": \"%s\",\n  \"cipher\": \"%s\",\n  \"verify\": %s,\n", stream_count,
+            metadata->chunk_size, (metadata->payload <= PAYLOAD_KTLS) ? payloads[metadata->payload] : "unknown",
+            (metadata->payload == PAYLOAD_PLAIN || metadata->cipher > CIPHER_CHACHA20_POLY1305) ? "none" : ciphers[metadata->cipher], (metadata->verify) ? "true" : "false");
+    fprintf(output, "  \"stage_seconds\": {");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        fprintf(output, "%s\"%s\": %.6f", (stage > 0) ? ", " : "", stage_names[stage], telemetry->stage_ns[stage] / 1e9);
+    }
+
+    fprintf(output, "}\n}\n");
+
+    return (fclose(output) == 0) ? 0 : -1;
+}
@@ -0,0 +1,595 @@
+#include "ktls.h"
+
+#define PORT 52120          // TCP Server Port
+#define BUFFER_SIZE 1024
+
+// One TCP connection carrying a byte range of a transfer
+typedef struct {
+    int socket;                         // Connected socket
+    crypto_session session;             // Keys negotiated on this connection
+    file_metadata metadata;             // Metadata sent or received on this connection
+    int file;                           // File descriptor shared by every stream
+    int basis;                          // Receiver's existing copy a delta is built against
+    struct chunk_store *store;          // Receiver's chunk store when deduplicating, or NULL
+    uint64_t reused_bytes;              // Bytes the receiver took from its existing copy or chunk store
+    uint64_t skipped_entries;           // FIFOs, sockets and devices a tree sender left out
+    uint8_t plan_flags;                 // RESUME_* flags the receiver answered the metadata with
+    int threads;                        // Crypto worker threads for this stream
+    int engine;                         // IO_ENGINE_* used for file and socket I/O
+    int direct;                         // 1 if the receiver writes with O_DIRECT
+    int group;                          // UDP socket joined to the multicast group the file arrives on
+    int compress;                       // 1 if the sender wants to deflate chunks
+    compression_report report;          // Compression totals of the sender
+    byte_range *ranges;                 // Parts of the stream's range still to transfer
+    uint32_t range_count;               // Number of ranges
+    byte_range *extents;                // Data extents of a sparse file inside the stream's range
+    uint32_t extent_count;              // Number of extents
+    checkpoint *resume;                 // Receiver checkpoint shared by every stream
+    tree_digest *tree;                  // Tree hash shared by every stream, or NULL
+    int result;                         // 0 on success, -1 on failure
+    pthread_t thread;                   // Thread running the stream
+} transfer_stream;
+
+/**
+ * Seals the metadata into a record and sends it as a METADATA frame.
+ *
+ * @param socket   Connected socket.
+ * @param session  Negotiated session.
+ * @param metadata Metadata to send.
+ * @return         0 on success, -1 on failure.
+ */
+int send_metadata(int socket, crypto_session *session, const file_metadata *metadata) {
+    unsigned char plain_text[BUFFER_SIZE];
+    unsigned char cipher_text[BUFFER_SIZE + RECORD_OVERHEAD];
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 1);
+    int plain_text_len = encode_metadata(metadata, plain_text, sizeof(plain_text));
+    int cipher_text_len = (context && plain_text_len >= 0) ? seal_record(context, session, 0, RECORD_METADATA, plain_text, plain_text_len, cipher_text) : -1;
+
+    EVP_CIPHER_CTX_free(context);
+
+    if (cipher_text_len < 0) return -1;
+
+    return send_frame(socket, FRAME_METADATA, 0, cipher_text, cipher_text_len);
+}
+
+/**
+ * Receives a METADATA frame, verifies and decrypts the record and parses it.
+ *
+ * @param socket   Connected socket.
+ * @param session  Negotiated session.
+ * @param metadata Output for the parsed metadata.
+ * @return         0 on success, -1 on I/O failure, -3 if the metadata is malformed.
+ */
+int receive_metadata(int socket, crypto_session *session, file_metadata *metadata) {
+    unsigned char cipher_text[BUFFER_SIZE + RECORD_OVERHEAD];
+    unsigned char plain_text[BUFFER_SIZE];
+    record_header record;
+    frame_header header;
+
+    if (recv_frame_header(socket, &header) < 0 || header.type != FRAME_METADATA || header.length > sizeof(cipher_text) ||
+        recv_all(socket, cipher_text, header.length) < 0) return -1;
+
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 0);
+    int plain_text_len = (context) ? open_record(context, session, cipher_text, header.length, &record, plain_text) : -1;
+
+    EVP_CIPHER_CTX_free(context);
+
+    if (plain_text_len <= 0 || record.flags != RECORD_METADATA || decode_metadata(plain_text, plain_text_len, metadata) < 0) return -3;
+    if (metadata->cipher != (uint32_t)session->cipher || metadata->chunk_size == 0 || metadata->chunk_size > MAX_CHUNK_SIZE) return -3;
+
+    return 0;
+}
+
+/**
+ * Sends the stream metadata once the session is negotiated, leaving out what the receiver
+ * did not announce it understands.
+ *
+ * @param stream Stream with its socket, session and metadata set.
+ * @return       0 on success, -1 on failure.
+ */
+int announce_stream(transfer_stream *stream) {
+    stream->metadata.cipher = stream->session.cipher;
+
+    // Without the kernel tls module the stream quietly keeps the user-space records
+    if (stream->metadata.payload == PAYLOAD_KTLS && ktls_attach(stream->socket) < 0) stream->metadata.payload = PAYLOAD_SEALED;
+
+    // Older receivers do not expect a VERIFY frame
+    if (!(stream->session.peer_flags & HELLO_VERIFY)) stream->metadata.verify = 0;
+
+    // Nor can they open records sealed with a content key; they get records of their own session
+    if (!(stream->session.peer_flags & HELLO_CONTENT_KEY)) stream->metadata.content_keyed = 0;
+
+    // Multicast needs both the content key and the repair rounds; other receivers get the file over TCP
+    if (!stream->metadata.content_keyed || !(stream->session.peer_flags & HELLO_MULTICAST)) stream->metadata.multicast_group = 0;
+
+    // Older receivers do not expect the EXTENTS frame and get the holes as zeros
+    if (!(stream->session.peer_flags & HELLO_SPARSE)) stream->metadata.sparse = 0;
+
+    if (send_metadata(stream->socket, &stream->session, &stream->metadata) < 0) return -1;
+    if (stream->metadata.sparse && send_range_frame(stream->socket, FRAME_EXTENTS, stream->extents, stream->extent_count, 0) < 0) return -1;
+
+    return 0;
+}
+
+/**
+ * Connects to the server, runs the client handshake and sends the stream metadata. The
+ * receiver reads the metadata before accepting the next stream, so it goes out right away.
+ *
+ * @param server_ip A string containing the server's IPv4 address.
+ * @param port      TCP port of the server.
+ * @param stream    Stream with its metadata set; the socket, session and cipher are filled in.
+ *                  A session cipher set beforehand is the only one offered.
+ * @return          0 on success, -1 if the connection fails, -2 if the server speaks another
+ *                  protocol or does not answer the handshake, -3 if the address is invalid.
+ */
+int open_stream(const char *server_ip, int port, transfer_stream *stream) {
+    struct sockaddr_in serv_address = {0};
+
+    serv_address.sin_family = AF_INET;
+    serv_address.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, server_ip, &serv_address.sin_addr) <= 0) return -3;
+
+    if ((stream->socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+
+    if (connect(stream->socket, (struct sockaddr *)&serv_address, sizeof(serv_address)) < 0) {
+        close(stream->socket);
+
+        return -1;
+    }
+
+    set_no_delay(stream->socket);
+
+    // Exchange key shares and wait a bounded time for the receiver's answer
+    set_receive_timeout(stream->socket, HANDSHAKE_TIMEOUT);
+
+    if (client_handshake(stream->socket, &stream->session, 0) < 0) {
+        close(stream->socket);
+
+        return -2;
+    }
+
+    set_receive_timeout(stream->socket, 0);
+
+    if (announce_stream(stream) < 0) {
+        close(stream->socket);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Receives the stream metadata once the session is negotiated, with the extents of a sparse
+ * file.
+ *
+ * @param stream Stream whose socket and session are set; the metadata is filled in.
+ * @return       0 on success, -1 on connection failure, -3 if the metadata is malformed.
+ */
+int accept_metadata(transfer_stream *stream) {
+    int result = receive_metadata(stream->socket, &stream->session, &stream->metadata);
+
+    // A sparse file announces the data extents of the span, everything else stays a hole
+    if (result == 0 && stream->metadata.sparse) {
+        byte_range span = {stream->metadata.range_offset, stream->metadata.range_length};
+        uint8_t flags;
+
+        if (recv_range_frame(stream->socket, FRAME_EXTENTS, span, &stream->extents, &stream->extent_count, &flags) < 0) result = -1;
+        else if (check_extents(&stream->metadata, stream->extents, stream->extent_count) < 0) result = -3;
+
+        if (result < 0) {
+            free(stream->extents);
+
+            stream->extents = NULL;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Runs the server handshake on an accepted connection and receives the stream metadata. The
+ * socket is closed on failure.
+ *
+ * @param stream Stream whose socket is set; the session and metadata are filled in.
+ * @return       0 on success, 1 if the connection carries a session of multiplexed channels
+ *               (no metadata was read), -1 on connection failure, -2 if the sender speaks
+ *               another protocol, -3 if the metadata is malformed.
+ */
+int start_stream(transfer_stream *stream) {
+    int result;
+
+    set_no_delay(stream->socket);
+
+    // Wait a bounded time for the handshake so legacy senders cannot hang the receiver
+    set_receive_timeout(stream->socket, HANDSHAKE_TIMEOUT);
+
+    if ((result = server_handshake(stream->socket, &stream->session)) == 0) {
+        result = (stream->session.peer_flags & HELLO_SESSION) ? 1 : accept_metadata(stream);
+    }
+
+    if (result < 0) {
+        close(stream->socket);
+
+        return result;
+    }
+
+    set_receive_timeout(stream->socket, 0);
+
+    return result;
+}
+
+/**
+ * Accepts a connection, runs the server handshake and receives the stream metadata. Sessions
+ * are only served by a daemon; they are turned down and the next connection is accepted.
+ *
+ * @param server_fd Listening socket.
+ * @param stream    Stream whose socket, session and metadata are filled in.
+ * @return          0 on success, -1 on connection failure, -2 if the sender speaks another
+ *                  protocol, -3 if the metadata is malformed.
+ */
+int accept_stream(int server_fd, transfer_stream *stream) {
+    int result = 1;
+
+    while (result == 1) {
+        if ((stream->socket = accept(server_fd, NULL, NULL)) < 0) return -1;
+
+        // The sender falls back to a connection per stream
+        if ((result = start_stream(stream)) == 1) {
+            send_frame(stream->socket, FRAME_ERROR, 0, NULL, 0);
+            close(stream->socket);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Waits for the receiver's ACK frame.
+ *
+ * @param socket Connected socket.
+ * @return       0 if the receiver confirmed the data, -1 otherwise, -3 or -4 if it refused the
+ *               output path (see refusal_result()).
+ */
+int receive_ack(int socket) {
+    frame_header header;
+    uint32_t status;
+
+    if (recv_frame_header(socket, &header) < 0) return -1;
+    if (header.type != FRAME_ACK || header.length != sizeof(status)) return refusal_result(&header);
+    if (recv_all(socket, &status, sizeof(status)) < 0) return -1;
+
+    return (ntohl(status) == 0) ? 0 : -1;
+}
+
+/**
+ * Reads the reason a receiver gave for hanging up while data was still being sent. A refusal
+ * sent before the connection closed is still queued on the socket, so this never waits.
+ *
+ * @param socket Connected socket.
+ * @return       -3 or -4 if the receiver refused the output path (see refusal_result()), -1
+ *               otherwise.
+ */
+int receive_refusal(int socket) {
+    unsigned char raw[FRAME_HEADER_LENGTH];
+
+    if (recv(socket, raw, sizeof(raw), MSG_PEEK | MSG_DONTWAIT) != sizeof(raw)) return -1;
+
+    int result = receive_ack(socket);
+
+    return (result < -1) ? result : -1;
+}
+
+/**
+ * Sends the receiver's verdict as an ACK frame.
+ *
+ * @param socket Connected socket.
+ * @param result 0 if the data arrived intact, -1 otherwise.
+ * @return       0 on success, -1 on failure.
+ */
+int send_ack(int socket, int result) {
+    uint32_t status = htonl((result == 0) ? 0 : 1);
+
+    return send_frame(socket, FRAME_ACK, 0, &status, sizeof(status));
+}
+
+/**
+ * Seals the root of the sender's tree hash into a record and sends it as a VERIFY frame.
+ *
+ * @param socket  Connected socket.
+ * @param session Negotiated session.
+ * @param root    DIGEST_LENGTH-byte root.
+ * @return        0 on success, -1 on failure.
+ */
+int send_verify(int socket, crypto_session *session, const unsigned char *root) {
+    unsigned char record[DIGEST_LENGTH + RECORD_OVERHEAD];
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 1);
+    int record_len = (context) ? seal_record(context, session, 0, RECORD_VERIFY, root, DIGEST_LENGTH, record) : -1;
+
+    EVP_CIPHER_CTX_free(context);
+
+    if (record_len < 0) return -1;
+
+    return send_frame(socket, FRAME_VERIFY, 0, record, record_len);
+}
+
+/**
+ * Receives the VERIFY frame and opens the sender's root.
+ *
+ * @param socket  Connected socket.
+ * @param session Negotiated session.
+ * @param root    Output for the DIGEST_LENGTH-byte root.
+ * @return        0 on success, -1 on failure.
+ */
+int receive_verify(int socket, crypto_session *session, unsigned char *root) {
+    unsigned char record[DIGEST_LENGTH + RECORD_OVERHEAD];
+    record_header header;
+    frame_header frame;
+
+    if (recv_frame_header(socket, &frame) < 0 || frame.type != FRAME_VERIFY || frame.length != sizeof(record)) return -1;
+    if (recv_all(socket, record, sizeof(record)) < 0) return -1;
+
+    EVP_CIPHER_CTX *context = new_record_context(session->cipher, 0);
+    int root_len = (context) ? open_record(context, session, record, sizeof(record), &header, root) : -1;
+
+    EVP_CIPHER_CTX_free(context);
+
+    return (root_len == DIGEST_LENGTH && header.flags == RECORD_VERIFY) ? 0 : -1;
+}
+
+/**
+ * Adds up the bytes a stream was asked to transfer.
+ *
+ * @param stream Stream whose ranges are known.
+ * @return       Number of bytes in the stream's ranges.
+ */
+uint64_t planned_bytes(const transfer_stream *stream) {
+    uint64_t total = 0;
+
+    for (uint32_t index = 0; index < stream->range_count; index++) total += stream->ranges[index].length;
+
+    return total;
+}
+
+/**
+ * Returns the span of the file a stream carries.
+ *
+ * @param metadata Stream metadata.
+ * @return         The stream's byte range.
+ */
+byte_range stream_span(const file_metadata *metadata) {
+    byte_range span = {metadata->range_offset, metadata->range_length};
+
+    return span;
+}
+
+/**
+ * Tells whether a sending stream deflates its chunks: the user asked for it and the receiver
+ * announced in the handshake that it can inflate them.
+ *
+ * @param stream Stream after the handshake.
+ * @return       1 to compress, 0 otherwise.
+ */
+int stream_compresses(const transfer_stream *stream) {
+    return stream->compress && (stream->session.peer_flags & HELLO_DEFLATE) != 0;
+}
+
+/**
+ * Sends the ranges the receiver asked for, switching to kernel TLS first if it agreed to.
+ *
+ * @param stream Stream whose ranges are known.
+ * @param flags  RESUME_* flags of the receiver's plan.
+ * @return       0 on success, -1 on failure.
+ */
+int send_planned(transfer_stream *stream, uint8_t flags) {
+    file_metadata *metadata = &stream->metadata;
+
+    // Switch to kernel TLS at the same point as the receiver, or keep the records if it declined
+    if (metadata->payload == PAYLOAD_KTLS) {
+        if (!(flags & RESUME_KTLS)) metadata->payload = PAYLOAD_SEALED;
+        else if (ktls_install(stream->socket, &stream->session, 1) < 0) return -1;
+    }
+
+    if (metadata->payload != PAYLOAD_SEALED) return send_plain_file(stream->file, stream->ranges, stream->range_count, stream->socket);
+
+    return encrypt_file(stream->file, stream->ranges, stream->range_count, metadata->chunk_size, stream->socket, &stream->session,
+                        stream->threads, stream->engine, stream_compresses(stream), &stream->report, stream->tree);
+}
+
+/**
+ * Stream thread of the sender: waits for the receiver's list of missing ranges, sends them,
+ * then waits for the receiver's ACK. The metadata has already been sent by open_stream().
+ *
+ * @param arg Pointer to a transfer_stream structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *send_stream(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+    uint8_t flags = 0;
+
+    stream->result = recv_ranges(stream->socket, stream_span(&stream->metadata), &stream->ranges, &stream->range_count, &flags);
+
+    // Ranges the receiver already holds count as done
+    if (stream->result == 0) telemetry_skip(stream->metadata.range_length - planned_bytes(stream));
+    if (stream->result == 0) stream->result = send_planned(stream, flags);
+    if (stream->result == 0) stream->result = receive_ack(stream->socket);
+
+    return NULL;
+}
+
+/**
+ * Builds the session the data records of a fan-out are sealed with: the content key every
+ * receiver got in its metadata instead of the connection's own key.
+ *
+ * @param metadata Metadata with content_keyed set.
+ * @param sealing  1 on the sender, 0 on the receiver.
+ * @param session  Output session.
+ */
+void content_session(const file_metadata *metadata, int sealing, crypto_session *session) {
+    memset(session, 0, sizeof(*session));
+
+    session->cipher = metadata->cipher;
+
+    memcpy((sealing) ? session->key : session->peer_key, metadata->content_key, KEY_LENGTH);
+    memcpy((sealing) ? session->nonce_prefix : session->peer_nonce_prefix, metadata->content_key + KEY_LENGTH, NONCE_PREFIX_LENGTH);
+}
+
+/**
+ * Stream thread of the receiver: receives the ranges it asked for and answers with an ACK.
+ *
+ * @param arg Pointer to a transfer_stream structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *receive_stream(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+
+    if (stream->metadata.payload != PAYLOAD_SEALED) {
+        stream->result = receive_plain_file(stream->file, stream->ranges, stream->range_count, stream->socket);
+    }
+    else {
+        crypto_session content, *session = &stream->session;
+
+        // A sender fanning the file out seals it once for every receiver
+        if (stream->metadata.content_keyed) content_session(&stream->metadata, 0, session = &content);
+
+        stream->result = decrypt_file(stream->file, stream->ranges, stream->range_count, stream->metadata.chunk_size,
+                                      stream->socket, session, stream->threads, stream->resume, stream->engine, stream->direct, stream->tree);
+
+        OPENSSL_cleanse(&content, sizeof(content));
+    }
+
+    send_ack(stream->socket, stream->result);
+
+    return NULL;
+}
+
+/**
+ * Sends every stream the ranges of its span that the checkpoint does not hold yet. Streams
+ * using kernel TLS install their keys right after the plan.
+ *
+ * @param streams      Accepted streams.
+ * @param stream_count Number of streams.
+ * @param resume       Checkpoint of the output file, or NULL to ask for every span in full.
+ * @return             0 on success, -1 on failure.
+ */
+int send_resume_plans(transfer_stream *streams, int stream_count, checkpoint *resume) {
+    for (int index = 0; index < stream_count; index++) {
+        transfer_stream *stream = &streams[index];
+        byte_range span = stream_span(&stream->metadata);
+
+        stream->resume = resume;
+
+        // Holes of a sparse file are never asked for; with a checkpoint they are already marked
+        if (resume == NULL && stream->metadata.sparse) {
+            if (clip_ranges(stream->extents, stream->extent_count, span, &stream->ranges, &stream->range_count) < 0) return -1;
+        }
+        else if (resume == NULL) {
+            stream->range_count = (span.length > 0) ? 1 : 0;
+            stream->ranges = malloc(sizeof(byte_range));
+
+            if (!stream->ranges) return -1;
+
+            stream->ranges[0] = span;
+        }
+        else if (checkpoint_missing(resume, span, &stream->ranges, &stream->range_count) < 0) return -1;
+
+        int use_ktls = (stream->metadata.payload == PAYLOAD_KTLS);
+
+        if (send_ranges(stream->socket, stream->ranges, stream->range_count, (use_ktls) ? RESUME_KTLS : 0) < 0) return -1;
+        if (use_ktls && ktls_install(stream->socket, &stream->session, 0) < 0) return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Attaches kernel TLS on every stream that asked for it. A stream this side cannot attach
+ * falls back to user-space records.
+ *
+ * @param streams      Accepted streams.
+ * @param stream_count Number of streams.
+ * @return             1 if any stream moves its content with sendfile() and splice(), 0 otherwise.
+ */
+int accept_zero_copy(transfer_stream *streams, int stream_count) {
+    int zero_copy = 0;
+
+    for (int index = 0; index < stream_count; index++) {
+        file_metadata *metadata = &streams[index].metadata;
+
+        if (metadata->payload == PAYLOAD_KTLS && ktls_attach(streams[index].socket) < 0) metadata->payload = PAYLOAD_SEALED;
+        if (metadata->payload != PAYLOAD_SEALED) zero_copy = 1;
+    }
+
+    return zero_copy;
+}
+
+/**
+ * Splits a file into contiguous, chunk-aligned ranges, one per stream. Small files use fewer
+ * streams so that no stream is left without data.
+ *
+ * @param metadata     Template metadata (size and chunk size set); copied into every stream.
+ * @param streams      Array of at least stream_count streams.
+ * @param stream_count Requested number of streams.
+ * @return             The number of streams actually used.
+ */
+int split_ranges(const file_metadata *metadata, transfer_stream *streams, int stream_count) {
+    uint64_t chunks = (metadata->size + metadata->chunk_size - 1) / metadata->chunk_size;
+
+    if (chunks < (uint64_t)stream_count) stream_count = (chunks > 0) ? (int)chunks : 1;
+
+    uint64_t range = ((chunks + stream_count - 1) / stream_count) * metadata->chunk_size;
+
+    for (int index = 0; index < stream_count; index++) {
+        file_metadata *stream_metadata = &streams[index].metadata;
+        uint64_t offset = (uint64_t)index * range;
+
+        *stream_metadata = *metadata;
+
+        stream_metadata->stream_index = index;
+        stream_metadata->stream_count = stream_count;
+        stream_metadata->range_offset = (offset < metadata->size) ? offset : metadata->size;
+        stream_metadata->range_length = (offset + range < metadata->size) ? range : metadata->size - stream_metadata->range_offset;
+    }
+
+    return stream_count;
+}
+
+/**
+ * Checks that the streams of a transfer describe the same file in the same way and that their
+ * ranges cover the whole file exactly once.
+ *
+ * @param streams      Accepted streams.
+ * @param stream_count Number of streams.
+ * @return             0 if the streams form one transfer, -1 otherwise.
+ */
+int check_ranges(const transfer_stream *streams, int stream_count) {
+    const file_metadata *first = &streams[0].metadata;
+    uint64_t covered = 0;
+
+    for (uint32_t index = 0; index < (uint32_t)stream_count; index++) {
+        const file_metadata *found = NULL;
+
+        // Streams may have connected in any order
+        for (int search = 0; search < stream_count; search++) {
+            if (streams[search].metadata.stream_index == index) found = &streams[search].metadata;
+        }
+
+        if (!found || found->stream_count != first->stream_count || found->size != first->size) return -1;
+        if ((found->payload == PAYLOAD_PLAIN) != (first->payload == PAYLOAD_PLAIN) || found->verify != first->verify || found->sparse != first->sparse) return -1;
+        if (memcmp(found->transfer_id, first->transfer_id, TRANSFER_ID_LENGTH) != 0) return -1;
+
+        // The receiver sets the transfer up from the first stream
+        if (found->chunk_size != first->chunk_size || found->kind != first->kind || found->mode != first->mode || found->cipher != first->cipher) return -1;
+        if (strcmp(found->name, first->name) != 0 || memcmp(found->source_id, first->source_id, SOURCE_ID_LENGTH) != 0) return -1;
+
+        // Every stream of a fan-out opens the same content-keyed records and datagrams
+        if (found->content_keyed != first->content_keyed || memcmp(found->content_key, first->content_key, CONTENT_KEY_LENGTH) != 0) return -1;
+        if (found->multicast_group != first->multicast_group || found->multicast_port != first->multicast_port || found->multicast_payload != first->multicast_payload) return -1;
+        if (found->range_offset != covered) return -1;
+
+        covered += found->range_length;
+    }
+
+    return (covered == first->size) ? 0 : -1;
+}
@@ -0,0 +1,785 @@
+#include "transfer.h"
+
+#define TREE_ENTRY_DIRECTORY 1      // Entry is a directory
+#define TREE_ENTRY_FILE 2           // Entry is a regular file
+#define TREE_ENTRY_SYMLINK 3        // Entry is a symbolic link, its target is sent as its contents
+#define TREE_ENTRY_HEADER 15        // type, mode, size and path length of an encoded entry
+#define TREE_BATCH_ENTRIES 1024     // Most entries announced by one ENTRIES record
+#define TREE_QUEUE_LENGTH 4096      // Entries the walker may run ahead of the packer
+
+// Directory, regular file or symbolic link found by the walker. The path is relative to the tree root.
+typedef struct {
+    uint8_t type;           // One of the TREE_ENTRY_* values
+    uint32_t mode;          // Permission bits
+    uint64_t size;          // Content length (files), target length (links)
+    uint16_t path_length;   // Length of path without the terminator
+    char path[];            // Relative path, NUL-terminated, followed by the NUL-terminated target of a link
+} tree_entry;
+
+// State of the tree sending stages. The walker thread traverses the tree and queues entries,
+// the pipeline source packs them into ENTRIES records followed by the contents of the batch.
+typedef struct {
+    send_state stream;                          // Socket used by send_chunk(); must stay first
+    int root;                                   // Descriptor of the tree root
+    spsc_ring queue;                            // Walker -> packer, in traversal order
+    tree_entry *end_marker;                     // Queued by the walker once the traversal is over
+    _Atomic int stop;                           // Set when the pipeline gives up on the walker
+    int walk_failed;                            // Set by the walker if part of the tree was unreadable
+    uint64_t skipped;                           // FIFOs, sockets and devices the walker left out
+
+    tree_entry *batch[TREE_BATCH_ENTRIES];      // Entries announced by the last ENTRIES record
+    tree_entry *pending;                        // Entry that did not fit in the last batch
+    int batch_count;                            // Number of entries in batch
+    int batch_index;                            // Entry whose contents are being read
+    uint64_t file_offset;                       // Bytes of that entry already packed
+    int file;                                   // Open descriptor of that entry, or -1
+    int finished;                               // The walker's end marker was reached
+    uint64_t sequence;                          // Record number, used as the record offset
+} tree_send_state;
+
+// Entry of an ENTRIES record as decoded by the receiver
+typedef struct {
+    uint8_t type;           // One of the TREE_ENTRY_* values
+    uint32_t mode;          // Permission bits
+    uint64_t size;          // Content length (files), target length (links)
+    const char *path;       // Relative path inside the decoded batch
+} tree_item;
+
+// State of the tree receiving stages
+typedef struct {
+    receive_state stream;                       // Socket and chunk size used by receive_chunk(); must stay first
+    int root;                                   // Descriptor of the output root
+    char *paths;                                // NUL-terminated paths of the current batch
+    tree_item items[TREE_BATCH_ENTRIES];        // Entries of the current batch
+    int count;                                  // Number of entries in items
+    int index;                                  // Entry that receives the next content bytes
+    uint64_t file_offset;                       // Bytes of that entry already written
+    int file;                                   // Open descriptor of that entry, or -1
+    char target[PATH_MAX];                      // Target of that entry if it is a link
+    char *links;                                // Path and target of every link received, one after the other
+    size_t links_length;                        // Bytes used in links
+    size_t links_capacity;                      // Size of the links allocation
+    uint64_t sequence;                          // Record number expected next
+} tree_receive_state;
+
+/**
+ * Queues an entry for the packer, waiting while the queue is full.
+ *
+ * @param state Tree sending state.
+ * @param entry Entry to queue.
+ * @return      0 on success, -1 if the transfer was stopped.
+ */
+int queue_entry(tree_send_state *state, tree_entry *entry) {
+    for (int spin = 0; ring_push(&state->queue, entry) < 0; spin++) {
+        if (state->stop) return -1;
+
+        if (spin < RING_SPIN_LIMIT) sched_yield();
+        else usleep(1000);
+    }
+
+    return 0;
+}
+
+/**
+ * Builds an entry and queues it.
+ *
+ * @param state     Tree sending state.
+ * @param type      One of the TREE_ENTRY_* values.
+ * @param file_stat Status of the entry.
+ * @param path      Path relative to the tree root.
+ * @param target    Target of a symbolic link, or NULL.
+ * @return          0 on success, -1 if the walk has to stop.
+ */
+int queue_path(tree_send_state *state, uint8_t type, const struct stat *file_stat, const char *path, const char *target) {
+    size_t path_length = strlen(path), target_length = (target) ? strlen(target) : 0;
+    tree_entry *entry = malloc(sizeof(tree_entry) + path_length + 1 + target_length + 1);
+
+    if (!entry) {
+        state->walk_failed = 1;
+
+        return -1;
+    }
+
+    entry->type = type;
+    entry->mode = file_stat->st_mode & 0777;
+    entry->size = (type == TREE_ENTRY_FILE) ? (uint64_t)file_stat->st_size : target_length;
+    entry->path_length = path_length;
+
+    memcpy(entry->path, path, path_length + 1);
+    memcpy(entry->path + path_length + 1, (target) ? target : "", target_length + 1);
+
+    if (queue_entry(state, entry) < 0) {
+        free(entry);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Walks a directory depth-first and queues its directories before their contents. Symbolic
+ * links are queued with their target and never followed; FIFOs, sockets and devices are
+ * reported and counted as skipped.
+ *
+ * @param state     Tree sending state.
+ * @param directory Descriptor of the directory (closed on return).
+ * @param prefix    Path of the directory relative to the tree root ("" for the root).
+ * @return          0 on success, -1 if the walk has to stop.
+ */
+int walk_directory(tree_send_state *state, int directory, const char *prefix) {
+    DIR *stream = fdopendir(directory);
+    struct dirent *item;
+
+    if (!stream) {
+        close(directory);
+
+        state->walk_failed = 1;
+
+        return 0;
+    }
+
+    while ((item = readdir(stream)) != NULL) {
+        char path[PATH_MAX];
+        struct stat file_stat;
+
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) continue;
+
+        int path_length = snprintf(path, sizeof(path), "%s%s%s", prefix, (*prefix != '\0') ? "/" : "", item->d_name);
+
+        if (path_length >= (int)sizeof(path) || fstatat(dirfd(stream), item->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("\r\e[31mFileError: Failed to read %s\e[0m\n", path);
+            fflush(stdout);
+
+            state->walk_failed = 1;
+            continue;
+        }
+
+        if (S_ISREG(file_stat.st_mode)) {
+            if (queue_path(state, TREE_ENTRY_FILE, &file_stat, path, NULL) < 0) break;
+        }
+        else if (S_ISLNK(file_stat.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t target_length = readlinkat(dirfd(stream), item->d_name, target, sizeof(target) - 1);
+
+            if (target_length <= 0 || (size_t)target_length == sizeof(target) - 1) {
+                printf("\r\e[31mFileError: Failed to read the link %s\e[0m\n", path);
+                fflush(stdout);
+
+                state->walk_failed = 1;
+                continue;
+            }
+
+            target[target_length] = '\0';
+
+            if (queue_path(state, TREE_ENTRY_SYMLINK, &file_stat, path, target) < 0) break;
+        }
+        else if (S_ISDIR(file_stat.st_mode)) {
+            int child = openat(dirfd(stream), item->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            if (child < 0) {
+                printf("\r\e[31mFileError: Failed to open %s\e[0m\n", path);
+                fflush(stdout);
+
+                state->walk_failed = 1;
+                continue;
+            }
+
+            if (queue_path(state, TREE_ENTRY_DIRECTORY, &file_stat, path, NULL) < 0) {
+                close(child);
+                break;
+            }
+
+            if (walk_directory(state, child, path) < 0) break;
+        }
+        else {
+            // Nothing to copy from a FIFO, socket or device; the sender reports the tree as incomplete
+            printf("\r\e[33mSkipped %s, it is not a file, directory or symbolic link\e[0m\n", path);
+            fflush(stdout);
+
+            state->skipped++;
+        }
+    }
+
+    closedir(stream);
+
+    return (item != NULL) ? -1 : 0;
+}
+
+/**
+ * Walker thread: traverses the whole tree, then queues the end marker.
+ *
+ * @param arg Pointer to a tree_send_state structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *tree_walker(void *arg) {
+    tree_send_state *state = (tree_send_state *)arg;
+    int root = dup(state->root);
+
+    if (root < 0) state->walk_failed = 1;
+    else walk_directory(state, root, "");
+
+    queue_entry(state, state->end_marker);
+
+    return NULL;
+}
+
+/**
+ * Releases the entries of the current batch.
+ *
+ * @param state Tree sending state.
+ */
+void free_batch(tree_send_state *state) {
+    for (int index = 0; index < state->batch_count; index++) free(state->batch[index]);
+
+    if (state->file >= 0) close(state->file);
+
+    state->batch_count = 0;
+    state->batch_index = 0;
+    state->file_offset = 0;
+    state->file = -1;
+}
+
+/**
+ * Packs the contents of the current batch's files and the targets of its links back to back
+ * into a job. Files do not start a new record, so a record may carry the tail of one file and
+ * many small files.
+ *
+ * @param state Tree sending state.
+ * @param job   Job to fill.
+ * @return      Number of bytes packed (0 once the batch is exhausted), -1 on failure.
+ */
+int pack_contents(tree_send_state *state, crypto_job *job) {
+    int length = 0;
+
+    while (length < state->stream.chunk_size && state->batch_index < state->batch_count) {
+        tree_entry *entry = state->batch[state->batch_index];
+
+        if (entry->type == TREE_ENTRY_DIRECTORY || state->file_offset == entry->size) {
+            if (state->file >= 0) close(state->file);
+
+            state->file = -1;
+            state->file_offset = 0;
+            state->batch_index++;
+            continue;
+        }
+
+        if (entry->type == TREE_ENTRY_SYMLINK) {
+            uint64_t remaining = entry->size - state->file_offset;
+            int wanted = (remaining < (uint64_t)(state->stream.chunk_size - length)) ? (int)remaining : state->stream.chunk_size - length;
+
+            memcpy(job->input + length, entry->path + entry->path_length + 1 + state->file_offset, wanted);
+
+            length += wanted;
+            state->file_offset += wanted;
+            continue;
+        }
+
+        if (state->file < 0 && (state->file = openat(state->root, entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+            printf("\r\e[31mFileError: Failed to open %s\e[0m\n", entry->path);
+            fflush(stdout);
+
+            return -1;
+        }
+
+        uint64_t remaining = entry->size - state->file_offset;
+        int wanted = (remaining < (uint64_t)(state->stream.chunk_size - length)) ? (int)remaining : state->stream.chunk_size - length;
+        ssize_t count = pread(state->file, job->input + length, wanted, state->file_offset);
+
+        if (count < 0 && errno == EINTR) continue;
+
+        // The size was announced already, so a file that shrank cannot be sent
+        if (count <= 0) {
+            printf("\r\e[31mFileError: %s changed while it was being sent\e[0m\n", entry->path);
+            fflush(stdout);
+
+            return -1;
+        }
+
+        length += count;
+        state->file_offset += count;
+    }
+
+    return length;
+}
+
+/**
+ * Encodes queued entries into the job as the next batch. Blocks for the first entry only, then
+ * takes whatever the walker already found, so batching never delays the transfer.
+ *
+ * @param state Tree sending state.
+ * @param job   Job to fill.
+ * @return      Number of bytes encoded, 0 once the walker is done, -1 if the walk failed.
+ */
+int pack_entries(tree_send_state *state, crypto_job *job) {
+    tree_entry *entry = (state->pending) ? state->pending : ring_pop(&state->queue);
+    int length = 0;
+
+    state->pending = NULL;
+
+    while (entry) {
+        if (entry == state->end_marker) {
+            state->finished = 1;
+            break;
+        }
+
+        if (length + TREE_ENTRY_HEADER + entry->path_length > state->stream.chunk_size) {
+            state->pending = entry;
+            break;
+        }
+
+        unsigned char *cursor = job->input + length;
+        uint32_t mode = htonl(entry->mode);
+        uint16_t path_length = htons(entry->path_length);
+
+        cursor[0] = entry->type;
+        memcpy(cursor + 1, &mode, 4);
+        put_u64(cursor + 5, entry->size);
+        memcpy(cursor + 13, &path_length, 2);
+        memcpy(cursor + TREE_ENTRY_HEADER, entry->path, entry->path_length);
+
+        length += TREE_ENTRY_HEADER + entry->path_length;
+        state->batch[state->batch_count++] = entry;
+
+        if (state->batch_count == TREE_BATCH_ENTRIES) break;
+
+        entry = ring_try_pop(&state->queue);
+    }
+
+    if (state->finished && state->walk_failed) return -1;
+
+    return length;
+}
+
+/**
+ * Source stage of the tree sender: emits an ENTRIES record, then the packed contents of the
+ * files it announced, then the next ENTRIES record.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Job to fill.
+ * @return         1 if a record was produced, 0 after the last entry, -1 on failure.
+ */
+int read_tree_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    tree_send_state *state = pipeline->state;
+
+    while (1) {
+        int length = pack_contents(state, job);
+
+        if (length < 0) return -1;
+
+        if (length > 0) {
+            job->flags = 0;
+        }
+        else {
+            free_batch(state);
+
+            if (state->finished) return 0;
+            if ((length = pack_entries(state, job)) < 0) return -1;
+            if (length == 0) continue;
+
+            job->flags = RECORD_ENTRIES;
+        }
+
+        job->offset = state->sequence++;
+        job->length = length;
+
+        return 1;
+    }
+}
+
+/**
+ * Sends a directory tree over one connection. The walk, packing, sealing and socket writes run
+ * concurrently, and the END frame follows the last record.
+ *
+ * @param root       Descriptor of the directory to send.
+ * @param chunk_size Plaintext bytes per record.
+ * @param socket     Socket file descriptor to send data through.
+ * @param session    Negotiated session.
+ * @param threads    Number of crypto worker threads.
+ * @param compress   1 to deflate records that shrink before sealing them.
+ * @param report     Output for the compression totals, or NULL.
+ * @param skipped    Output for the number of FIFOs, sockets and devices left out.
+ * @return           0 on success, -1 on failure.
+ */
+int encrypt_tree(int root, int chunk_size, int socket, crypto_session *session, int threads, int compress, compression_report *report,
+                 uint64_t *skipped) {
+    tree_send_state *state = calloc(1, sizeof(tree_send_state));
+    transfer_pipeline pipeline = {0};
+    pthread_t walker;
+    int result = -1;
+
+    if (!state) return -1;
+
+    state->stream.chunk_size = chunk_size;
+    state->stream.socket = socket;
+    state->root = root;
+    state->file = -1;
+    state->end_marker = calloc(1, sizeof(tree_entry));
+
+    if (state->end_marker && ring_init(&state->queue, TREE_QUEUE_LENGTH) == 0) {
+        if (pthread_create(&walker, NULL, tree_walker, state) == 0) {
+            pipeline.session = session;
+            pipeline.encrypting = 1;
+            pipeline.compress = compress;
+            pipeline.source = read_tree_chunk;
+            pipeline.sink = send_chunk;
+            pipeline.state = state;
+
+            result = pipeline_run(&pipeline, threads, chunk_size, chunk_size + RECORD_OVERHEAD);
+
+            if (report) {
+                report->plain_bytes = pipeline.plain_bytes;
+                report->packed_bytes = pipeline.packed_bytes;
+            }
+
+            // Release the walker if it is still waiting for room in the queue
+            state->stop = 1;
+
+            pthread_join(walker, NULL);
+        }
+
+        // Drop whatever the packer did not reach
+        for (tree_entry *entry; (entry = ring_try_pop(&state->queue)) != NULL;) {
+            if (entry != state->end_marker) free(entry);
+        }
+
+        ring_free(&state->queue);
+    }
+
+    if (state->pending != state->end_marker) free(state->pending);
+
+    *skipped = state->skipped;
+
+    free_batch(state);
+    free(state->end_marker);
+    free(state);
+
+    if (result < 0) return -1;
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+/**
+ * Checks that a relative path from the sender stays inside the output root.
+ *
+ * @param path NUL-terminated path.
+ * @return     1 if the path is safe, 0 otherwise.
+ */
+int valid_tree_path(const char *path) {
+    const char *component = path;
+
+    if (*path == '\0' || *path == '/') return 0;
+
+    while (1) {
+        const char *slash = strchr(component, '/');
+        size_t length = (slash) ? (size_t)(slash - component) : strlen(component);
+
+        if (length == 0 || (length == 1 && component[0] == '.') || (length == 2 && strncmp(component, "..", 2) == 0)) return 0;
+        if (!slash) return 1;
+
+        component = slash + 1;
+    }
+}
+
+/**
+ * Decodes an ENTRIES record into the current batch.
+ *
+ * @param state  Tree receiving state.
+ * @param buffer Record plaintext.
+ * @param length Plaintext length.
+ * @return       0 on success, -1 if the batch is malformed.
+ */
+int decode_entries(tree_receive_state *state, const unsigned char *buffer, int length) {
+    char *paths = state->paths;
+    int offset = 0;
+
+    state->count = 0;
+    state->index = 0;
+    state->file_offset = 0;
+
+    while (offset < length) {
+        tree_item *item = &state->items[state->count];
+        uint32_t mode;
+        uint16_t path_length;
+
+        if (state->count == TREE_BATCH_ENTRIES || length - offset < TREE_ENTRY_HEADER) return -1;
+
+        memcpy(&mode, buffer + offset + 1, 4);
+        memcpy(&path_length, buffer + offset + 13, 2);
+
+        item->type = buffer[offset];
+        item->mode = ntohl(mode) & 0777;
+        item->size = get_u64(buffer + offset + 5);
+        path_length = ntohs(path_length);
+        offset += TREE_ENTRY_HEADER;
+
+        if (path_length > length - offset) return -1;
+
+        // Paths are copied with a terminator; the batch never exceeds chunk_size plus one byte per entry
+        memcpy(paths, buffer + offset, path_length);
+        paths[path_length] = '\0';
+
+        item->path = paths;
+        paths += path_length + 1;
+        offset += path_length;
+
+        if ((item->type != TREE_ENTRY_DIRECTORY && item->type != TREE_ENTRY_FILE && item->type != TREE_ENTRY_SYMLINK) || strlen(item->path) != path_length) return -1;
+        if (item->type == TREE_ENTRY_SYMLINK && (item->size == 0 || item->size >= PATH_MAX)) return -1;
+        if (!valid_tree_path(item->path)) return -1;
+
+        state->count++;
+    }
+
+    return 0;
+}
+
+/**
+ * Remembers a received link until the tree is complete.
+ *
+ * @param state Tree receiving state whose target holds the whole link target.
+ * @param item  Link entry.
+ * @return      0 on success, -1 on failure or if the target holds a NUL byte.
+ */
+int defer_link(tree_receive_state *state, const tree_item *item) {
+    size_t path_length = strlen(item->path);
+    size_t needed = state->links_length + path_length + 1 + item->size + 1;
+
+    state->target[item->size] = '\0';
+
+    if (strlen(state->target) != item->size) return -1;
+
+    if (needed > state->links_capacity) {
+        size_t capacity = (needed > 2 * state->links_capacity) ? needed : 2 * state->links_capacity;
+        char *links = realloc(state->links, capacity);
+
+        if (!links) return -1;
+
+        state->links = links;
+        state->links_capacity = capacity;
+    }
+
+    memcpy(state->links + state->links_length, item->path, path_length + 1);
+    memcpy(state->links + state->links_length + path_length + 1, state->target, item->size + 1);
+
+    state->links_length = needed;
+
+    return 0;
+}
+
+/**
+ * Creates every link of the tree. This runs after every other entry is in place, so no entry
+ * can be written through a link the sender announced. A link left by an earlier transfer is
+ * replaced.
+ *
+ * @param state Tree receiving state.
+ * @return      0 on success, -1 on failure.
+ */
+int create_links(tree_receive_state *state) {
+    size_t offset = 0;
+
+    while (offset < state->links_length) {
+        const char *path = state->links + offset;
+        const char *target = path + strlen(path) + 1;
+        struct stat file_stat;
+
+        if (symlinkat(target, state->root, path) < 0) {
+            if (errno != EEXIST || fstatat(state->root, path, &file_stat, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISLNK(file_stat.st_mode)) return -1;
+            if (unlinkat(state->root, path, 0) < 0 || symlinkat(target, state->root, path) < 0) return -1;
+        }
+
+        offset = (target - state->links) + strlen(target) + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Creates directories, completes files and collects links of the current batch until an
+ * entry still needs content bytes.
+ *
+ * @param state Tree receiving state.
+ * @return      0 on success, -1 on failure.
+ */
+int settle_entries(tree_receive_state *state) {
+    while (state->index < state->count) {
+        tree_item *item = &state->items[state->index];
+
+        if (item->type == TREE_ENTRY_SYMLINK) {
+            if (state->file_offset < item->size) break;
+            if (defer_link(state, item) < 0) return -1;
+
+            state->file_offset = 0;
+            state->index++;
+            continue;
+        }
+
+        if (item->type == TREE_ENTRY_DIRECTORY) {
+            struct stat file_stat;
+
+            // The owner keeps write access so the directory can be filled
+            if (mkdirat(state->root, item->path, item->mode | S_IRWXU) < 0) {
+                if (errno != EEXIST || fstatat(state->root, item->path, &file_stat, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(file_stat.st_mode)) return -1;
+            }
+
+            state->index++;
+            continue;
+        }
+
+        if (state->file < 0) {
+            state->file = openat(state->root, item->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, item->mode);
+
+            if (state->file < 0 || fchmod(state->file, item->mode) < 0) return -1;
+        }
+
+        if (state->file_offset < item->size) break;
+
+        close(state->file);
+
+        state->file = -1;
+        state->file_offset = 0;
+        state->index++;
+    }
+
+    return 0;
+}
+
+/**
+ * Sink stage of the tree receiver: decodes ENTRIES records and spreads content records over
+ * the files and links they announced.
+ *
+ * @param pipeline Running pipeline.
+ * @param job      Opened job.
+ * @return         0 on success, -1 on failure.
+ */
+int write_tree_chunk(transfer_pipeline *pipeline, crypto_job *job) {
+    tree_receive_state *state = pipeline->state;
+    int offset = 0;
+
+    if (job->offset != state->sequence++) return -1;
+
+    if (job->flags == RECORD_ENTRIES) {
+        // A new batch may only start once every file of the previous one is complete
+        if (state->index < state->count || decode_entries(state, job->output, job->result) < 0) return -1;
+
+        return settle_entries(state);
+    }
+
+    if (job->flags != 0) return -1;
+
+    while (offset < job->result) {
+        if (settle_entries(state) < 0 || state->index == state->count) return -1;
+
+        uint64_t remaining = state->items[state->index].size - state->file_offset;
+        int wanted = (remaining < (uint64_t)(job->result - offset)) ? (int)remaining : job->result - offset;
+
+        // Link targets were checked to fit in the buffer when the batch was decoded
+        if (state->items[state->index].type == TREE_ENTRY_SYMLINK) {
+            memcpy(state->target + state->file_offset, job->output + offset, wanted);
+
+            offset += wanted;
+            state->file_offset += wanted;
+            continue;
+        }
+
+        ssize_t count = write(state->file, job->output + offset, wanted);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+
+        offset += count;
+        state->file_offset += count;
+    }
+
+    return settle_entries(state);
+}
+
+/**
+ * Receives a directory tree until the END frame and recreates it under the output root.
+ *
+ * @param root       Descriptor of the output root directory.
+ * @param chunk_size Largest plaintext size of a record.
+ * @param socket     Socket file descriptor to receive data from.
+ * @param session    Negotiated session.
+ * @param threads    Number of crypto worker threads.
+ * @return           0 if every announced entry was recreated, -1 on failure.
+ */
+int decrypt_tree(int root, int chunk_size, int socket, crypto_session *session, int threads) {
+    tree_receive_state *state = calloc(1, sizeof(tree_receive_state));
+    transfer_pipeline pipeline = {0};
+    int result = -1;
+
+    if (!state) return -1;
+
+    state->stream.chunk_size = chunk_size;
+    state->stream.socket = socket;
+    state->root = root;
+    state->file = -1;
+    state->paths = malloc(chunk_size + TREE_BATCH_ENTRIES);
+
+    if (state->paths) {
+        pipeline.session = session;
+        pipeline.encrypting = 0;
+        pipeline.source = receive_chunk;
+        pipeline.sink = write_tree_chunk;
+        pipeline.state = state;
+
+        result = pipeline_run(&pipeline, threads, chunk_size + RECORD_OVERHEAD, chunk_size);
+    }
+
+    if (result == 0 && state->index < state->count) result = -1;
+    if (result == 0) result = create_links(state);
+    if (state->file >= 0) close(state->file);
+
+    free(state->paths);
+    free(state->links);
+    free(state);
+
+    return result;
+}
+
+/**
+ * Creates the output root of a tree transfer if needed and opens it.
+ *
+ * @param path Output directory.
+ * @param mode Permission bits of the sender's root directory.
+ * @return     Directory descriptor, or -1 on failure.
+ */
+int open_tree_root(const char *path, uint32_t mode) {
+    if (mkdir(path, (mode & 0777) | S_IRWXU) < 0 && errno != EEXIST) return -1;
+
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Stream thread of the tree sender: sends the tree, then waits for the receiver's ACK.
+ *
+ * @param arg Pointer to a transfer_stream structure whose file is the root directory.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *send_tree(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+
+    stream->result = encrypt_tree(stream->file, stream->metadata.chunk_size, stream->socket, &stream->session, stream->threads,
+                                  stream_compresses(stream), &stream->report, &stream->skipped_entries);
+
+    // A receiver that refused the output hung up while the tree was being sent
+    stream->result = (stream->result == 0) ? receive_ack(stream->socket) : receive_refusal(stream->socket);
+
+    return NULL;
+}
+
+/**
+ * Stream thread of the tree receiver: recreates the tree and answers with an ACK.
+ *
+ * @param arg Pointer to a transfer_stream structure whose file is the output root.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *receive_tree(void *arg) {
+    transfer_stream *stream = (transfer_stream *)arg;
+
+    stream->result = decrypt_tree(stream->file, stream->metadata.chunk_size, stream->socket, &stream->session, stream->threads);
+
+    send_ack(stream->socket, stream->result);
+
+    return NULL;
+}
@@ -0,0 +1,281 @@
+#include "checkpoint.h"
+
+#define URING_ENTRIES 64        // Submission queue entries per ring
+
+// Minimal io_uring instance driven through the raw system calls. Each ring belongs to a single
+// thread; a pipeline gives its source and its sink one ring each.
+typedef struct {
+    int fd;                         // io_uring file descriptor, or -1
+    unsigned entries;               // Submission queue size
+    _Atomic unsigned *sq_head;      // Consumed by the kernel
+    _Atomic unsigned *sq_tail;      // Published by us
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;      // Consumed by us
+    _Atomic unsigned *cq_tail;      // Published by the kernel
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;      // Submission queue entries
+    struct io_uring_cqe *cqes;      // Completion queue entries
+    void *sq_ring;                  // Mapping of the submission ring
+    size_t sq_ring_size;
+    void *cq_ring;                  // Mapping of the completion ring (may alias sq_ring)
+    size_t cq_ring_size;
+    size_t sqes_size;               // Size of the sqes mapping
+    unsigned queued;                // Entries written since the last submit
+    int fixed_buffers;              // 1 if the pipeline buffers are registered as buffer 0
+    int fixed_file;                 // Descriptor registered as file 0, or -1
+} io_ring;
+
+/**
+ * Releases a ring created by io_ring_init().
+ *
+ * @param ring Ring to free.
+ */
+void io_ring_free(io_ring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = -1;
+    ring->fixed_file = -1;
+}
+
+/**
+ * Creates an io_uring instance and maps its queues.
+ *
+ * @param ring    Ring to initialize.
+ * @param entries Submission queue size.
+ * @return        0 on success, -1 if the kernel does not provide io_uring.
+ */
+int io_ring_init(io_ring *ring, unsigned entries) {
+    struct io_uring_params params = {0};
+
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fixed_file = -1;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->fd < 0) return -1;
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with one call
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        io_ring_free(ring);
+
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) ring->cq_ring = ring->sq_ring;
+    else ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+
+        io_ring_free(ring);
+
+        return -1;
+    }
+
+    unsigned char *sq = ring->sq_ring, *cq = ring->cq_ring;
+
+    ring->sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Registers one buffer so fixed reads and writes skip the per-request page pinning.
+ *
+ * @param ring   Ring to register with.
+ * @param base   Start of the buffer.
+ * @param length Length of the buffer.
+ * @return       0 on success, -1 on failure (plain reads and writes still work).
+ */
+int io_ring_register_buffer(io_ring *ring, void *base, size_t length) {
+    struct iovec buffer = {base, length};
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &buffer, 1) < 0) return -1;
+
+    ring->fixed_buffers = 1;
+
+    return 0;
+}
+
+/**
+ * Registers the descriptor a ring works on, so requests skip the per-request file lookup.
+ *
+ * @param ring Ring to register with.
+ * @param file Descriptor to register as file 0.
+ * @return     0 on success, -1 on failure (requests then use the descriptor directly).
+ */
+int io_ring_register_file(io_ring *ring, int file) {
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &file, 1) < 0) return -1;
+
+    ring->fixed_file = file;
+
+    return 0;
+}
+
+/**
+ * Returns a cleared submission entry, or NULL if the queue is full.
+ *
+ * @param ring Ring to take the entry from.
+ * @return     The entry.
+ */
+struct io_uring_sqe *io_ring_sqe(io_ring *ring) {
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->queued;
+
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) >= ring->entries) return NULL;
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    ring->queued++;
+
+    return sqe;
+}
+
+/**
+ * Sets the operation and target of a submission entry, using the registered slot if the
+ * descriptor is the registered one.
+ *
+ * @param ring   Ring the entry belongs to.
+ * @param sqe    Entry from io_ring_sqe().
+ * @param opcode IORING_OP_* value.
+ * @param file   Descriptor the operation works on.
+ */
+void io_ring_target(io_ring *ring, struct io_uring_sqe *sqe, uint8_t opcode, int file) {
+    sqe->opcode = opcode;
+
+    if (file == ring->fixed_file) {
+        sqe->fd = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else sqe->fd = file;
+}
+
+/**
+ * Publishes the queued entries and waits for completions, all in one system call.
+ *
+ * @param ring     Ring to submit.
+ * @param wait_for Number of completions to wait for.
+ * @return         0 on success, -1 on failure.
+ */
+int io_ring_submit(io_ring *ring, unsigned wait_for) {
+    unsigned submit = ring->queued;
+
+    atomic_store_explicit(ring->sq_tail, atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + submit, memory_order_release);
+
+    ring->queued = 0;
+
+    while (submit > 0 || wait_for > 0) {
+        int result = syscall(__NR_io_uring_enter, ring->fd, submit, wait_for, (wait_for > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (result < 0 && errno == EINTR) {
+            submit = 0;
+            continue;
+        }
+
+        return (result < 0) ? -1 : 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Pops one completion.
+ *
+ * @param ring      Ring to reap.
+ * @param user_data Output for the request's user data.
+ * @param result    Output for the request's result.
+ * @return          1 if a completion was popped, 0 if none is ready.
+ */
+int io_ring_complete(io_ring *ring, uint64_t *user_data, int *result) {
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) return 0;
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+
+    return 1;
+}
+
+/**
+ * Submits the queued entries and waits until all of them completed. Entries must carry
+ * their index as user data.
+ *
+ * @param ring    Ring to run.
+ * @param results Output for the result of each entry, indexed by user data.
+ * @param count   Number of entries queued.
+ * @return        0 on success, -1 if the ring failed.
+ */
+int io_ring_run(io_ring *ring, int *results, unsigned count) {
+    unsigned reaped = 0;
+
+    if (io_ring_submit(ring, count) < 0) return -1;
+
+    while (reaped < count) {
+        uint64_t user_data;
+        int result;
+
+        if (!io_ring_complete(ring, &user_data, &result)) {
+            if (io_ring_submit(ring, count - reaped) < 0) return -1;
+
+            continue;
+        }
+
+        if (user_data < count) results[user_data] = result;
+
+        reaped++;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether the kernel lets this process use io_uring.
+ *
+ * @return 1 if io_uring is available, 0 otherwise.
+ */
+int io_uring_available() {
+    io_ring ring;
+
+    if (io_ring_init(&ring, 2) < 0) return 0;
+
+    io_ring_free(&ring);
+
+    return 1;
+}
@@ -0,0 +1,220 @@
+#include "compress.h"
+
+#define VERIFY_PARENT 0x01              // Prefix of an inner node, so it never hashes like a leaf
+#define VERIFY_ROOT 0x02                // Prefix of the root, which also covers the file and leaf sizes
+#define VERIFY_MAX_LEAVES (1 << 23)     // Most leaves a tree hash keeps in memory (1 TiB at the default chunk size)
+
+// Tree hash of a file: every chunk_size chunk is a leaf hashed on its own, so leaves can be
+// computed in any order and on any thread, and only the small tree above them is serial.
+typedef struct {
+    uint64_t size;              // Size of the file
+    uint32_t chunk_size;        // Bytes per leaf (the last one may be shorter)
+    uint64_t leaf_count;        // Number of leaves, at least one
+    unsigned char *leaves;      // SHA-256 of every leaf
+    uint8_t *known;             // 1 once a leaf's digest is in leaves
+} tree_digest;
+
+// Worker of tree_digest_fill(): hashes the missing leaves of a contiguous share
+typedef struct {
+    tree_digest *tree;          // Tree being filled
+    int file;                   // File the leaves are read from
+    uint64_t first;             // First leaf of the share
+    uint64_t last;              // One past the last leaf of the share
+    int result;                 // 0 on success, -1 on failure
+    pthread_t thread;           // Thread hashing the share
+} leaf_worker;
+
+/**
+ * Prepares a tree hash with no known leaves.
+ *
+ * @param tree       Tree to initialize.
+ * @param size       Size of the file.
+ * @param chunk_size Bytes per leaf.
+ * @return           0 on success, -1 if the file has too many leaves or allocation fails.
+ */
+int tree_digest_init(tree_digest *tree, uint64_t size, uint32_t chunk_size) {
+    memset(tree, 0, sizeof(*tree));
+
+    if (chunk_size == 0) return -1;
+
+    tree->size = size;
+    tree->chunk_size = chunk_size;
+    tree->leaf_count = (size > 0) ? (size + chunk_size - 1) / chunk_size : 1;
+
+    if (tree->leaf_count > VERIFY_MAX_LEAVES) return -1;
+
+    tree->leaves = malloc(tree->leaf_count * DIGEST_LENGTH);
+    tree->known = calloc(tree->leaf_count, 1);
+
+    return (tree->leaves && tree->known) ? 0 : -1;
+}
+
+/**
+ * Releases a tree created by tree_digest_init().
+ *
+ * @param tree Tree to free.
+ */
+void tree_digest_free(tree_digest *tree) {
+    free(tree->leaves);
+    free(tree->known);
+
+    memset(tree, 0, sizeof(*tree));
+}
+
+/**
+ * Records the digest of a chunk if it is exactly one leaf. Other chunks are ignored, their
+ * leaves are hashed later by tree_digest_fill(). Streams record disjoint leaves, so they
+ * share a tree without locking.
+ *
+ * @param tree   Tree to update, or NULL.
+ * @param offset File offset of the chunk.
+ * @param length Length of the chunk.
+ * @param digest SHA-256 of the chunk.
+ */
+void tree_digest_leaf(tree_digest *tree, uint64_t offset, int length, const unsigned char *digest) {
+    if (tree == NULL || offset % tree->chunk_size != 0 || offset >= tree->size) return;
+
+    uint64_t index = offset / tree->chunk_size;
+    uint64_t expected = (tree->size - offset < tree->chunk_size) ? tree->size - offset : tree->chunk_size;
+
+    if ((uint64_t)length != expected) return;
+
+    memcpy(tree->leaves + index * DIGEST_LENGTH, digest, DIGEST_LENGTH);
+
+    tree->known[index] = 1;
+}
+
+/**
+ * Leaf worker thread: reads and hashes every leaf of its share that is still unknown.
+ *
+ * @param arg Pointer to a leaf_worker structure.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *leaf_worker_run(void *arg) {
+    leaf_worker *worker = (leaf_worker *)arg;
+    tree_digest *tree = worker->tree;
+    unsigned char *buffer = malloc(tree->chunk_size);
+
+    worker->result = (buffer) ? 0 : -1;
+
+    for (uint64_t index = worker->first; worker->result == 0 && index < worker->last; index++) {
+        if (tree->known[index]) continue;
+
+        uint64_t offset = index * tree->chunk_size;
+        size_t length = (tree->size - offset < tree->chunk_size) ? tree->size - offset : tree->chunk_size;
+        size_t done = 0;
+
+        while (done < length) {
+            ssize_t result = pread(worker->file, buffer + done, length - done, offset + done);
+
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break;
+
+            done += result;
+        }
+
+        if (done < length || digest_chunk(buffer, length, tree->leaves + index * DIGEST_LENGTH) < 0) worker->result = -1;
+        else tree->known[index] = 1;
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+/**
+ * Reads and hashes the leaves no transfer stage recorded (resumed, reused or zero-copy
+ * chunks), spreading them over several threads.
+ *
+ * @param tree    Tree to complete.
+ * @param file    File the tree describes.
+ * @param threads Number of hashing threads.
+ * @return        0 once every leaf is known, -1 on failure.
+ */
+int tree_digest_fill(tree_digest *tree, int file, int threads) {
+    uint64_t missing = 0;
+
+    for (uint64_t index = 0; index < tree->leaf_count; index++) missing += !tree->known[index];
+
+    if (missing == 0) return 0;
+    if (threads < 1) threads = 1;
+    if ((uint64_t)threads > missing) threads = (int)missing;
+
+    leaf_worker *workers = calloc(threads, sizeof(leaf_worker));
+    int result = (workers) ? 0 : -1;
+
+    // Contiguous shares keep every thread's reads sequential
+    for (int index = 0; result == 0 && index < threads; index++) {
+        leaf_worker *worker = &workers[index];
+
+        worker->tree = tree;
+        worker->file = file;
+        worker->first = tree->leaf_count * index / threads;
+        worker->last = tree->leaf_count * (index + 1) / threads;
+
+        if (pthread_create(&worker->thread, NULL, leaf_worker_run, worker) != 0) {
+            worker->thread = 0;
+            leaf_worker_run(worker);
+        }
+    }
+
+    for (int index = 0; workers && index < threads; index++) {
+        if (workers[index].thread) pthread_join(workers[index].thread, NULL);
+        if (workers[index].result < 0) result = -1;
+    }
+
+    free(workers);
+
+    return result;
+}
+
+/**
+ * Combines the leaves pairwise, level by level, into the root. An odd node at the end of a
+ * level moves up unchanged. The root also covers the file size and the leaf size, so the
+ * same bytes cut differently never share a root.
+ *
+ * @param tree Tree whose leaves are all known.
+ * @param root Output for the DIGEST_LENGTH-byte root.
+ * @return     0 on success, -1 if a leaf is missing or hashing fails.
+ */
+int tree_digest_root(const tree_digest *tree, unsigned char *root) {
+    uint64_t count = tree->leaf_count;
+    unsigned char *level = malloc(count * DIGEST_LENGTH);
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    unsigned char parent = VERIFY_PARENT, prefix[13] = {VERIFY_ROOT};
+    uint32_t net_chunk_size = htonl(tree->chunk_size);
+    int result = (level && context) ? 0 : -1;
+
+    for (uint64_t index = 0; result == 0 && index < count; index++) {
+        if (!tree->known[index]) result = -1;
+    }
+
+    if (result == 0) memcpy(level, tree->leaves, count * DIGEST_LENGTH);
+
+    while (result == 0 && count > 1) {
+        uint64_t parents = 0;
+
+        for (uint64_t index = 0; result == 0 && index + 1 < count; index += 2) {
+            if (EVP_DigestInit_ex(context, EVP_sha256(), NULL) != 1 || EVP_DigestUpdate(context, &parent, 1) != 1 ||
+                EVP_DigestUpdate(context, level + index * DIGEST_LENGTH, 2 * DIGEST_LENGTH) != 1 ||
+                EVP_DigestFinal_ex(context, level + parents * DIGEST_LENGTH, NULL) != 1) result = -1;
+
+            parents++;
+        }
+
+        if (count % 2) memmove(level + parents++ * DIGEST_LENGTH, level + (count - 1) * DIGEST_LENGTH, DIGEST_LENGTH);
+
+        count = parents;
+    }
+
+    put_u64(prefix + 1, tree->size);
+    memcpy(prefix + 9, &net_chunk_size, 4);
+
+    if (result == 0 && (EVP_DigestInit_ex(context, EVP_sha256(), NULL) != 1 || EVP_DigestUpdate(context, prefix, sizeof(prefix)) != 1 ||
+        EVP_DigestUpdate(context, level, DIGEST_LENGTH) != 1 || EVP_DigestFinal_ex(context, root, NULL) != 1)) result = -1;
+
+    EVP_MD_CTX_free(context);
+    free(level);
+
+    return result;
+}
@@ -0,0 +1,328 @@
+#include "telemetry.h"
+
+#define WRITEBACK_BLOCK_SIZE (1 << 20)      // Bytes of contiguous plaintext gathered into one disk write
+#define WRITEBACK_BLOCKS 8                  // Blocks per writer; once all of them wait for the disk the socket waits too
+#define WRITEBACK_MAX_CHUNKS 256            // Most chunks one block vouches for in the checkpoint
+#define DIRECT_IO_ALIGNMENT 4096            // Alignment of the offset, length and buffer of an O_DIRECT write
+
+// A run of contiguous plaintext waiting to be written
+typedef struct {
+    uint64_t offset;                // File offset of the first byte
+    size_t length;                  // Bytes gathered so far
+    unsigned char *data;            // block_size bytes, aligned for O_DIRECT
+    int chunk_count;                // Chunks gathered so far
+    uint64_t chunk_offsets[WRITEBACK_MAX_CHUNKS];                   // Offsets of the chunks, for the checkpoint
+    unsigned char digests[WRITEBACK_MAX_CHUNKS][DIGEST_LENGTH];     // Digests of the chunks, for the checkpoint
+} writeback_block;
+
+// Write-behind thread of one receiving stream. The pipeline's sink gathers opened chunks into
+// large blocks and hands them over, so socket reads and opening go on while the thread waits
+// for the disk. The fixed number of blocks bounds how far the network can run ahead.
+typedef struct {
+    int file;                       // Output file
+    int direct;                     // Second descriptor of the output file opened with O_DIRECT, or -1
+    checkpoint *resume;             // Checkpoint updated once a block is written, or NULL
+    size_t block_size;              // Capacity of every block, a multiple of DIRECT_IO_ALIGNMENT
+    int max_chunks;                 // Chunks a block holds before it is handed over
+    writeback_block blocks[WRITEBACK_BLOCKS];
+    unsigned char *memory;          // Single allocation backing every block
+    size_t memory_size;             // Size of memory
+    writeback_block *current;       // Block the sink is filling, or NULL
+    spsc_ring free_blocks;          // Writer -> sink
+    spsc_ring full_blocks;          // Sink -> writer
+    writeback_block end_marker;     // Pushed after the last block
+    uint64_t pending_offset;        // Buffered range the kernel was last asked to write out (writer thread)
+    uint64_t pending_length;        // Length of that range, 0 if none
+    pthread_t thread;               // Runs writeback_worker()
+    int running;                    // 1 while the thread runs
+    _Atomic int failed;             // Set by the thread when a write fails
+} write_behind;
+
+/**
+ * Reads exactly length bytes at an offset.
+ *
+ * @param file   File descriptor.
+ * @param buffer Destination.
+ * @param length Bytes to read.
+ * @param offset File offset.
+ * @return       0 on success, -1 on failure or if the file ends first.
+ */
+int pread_all(int file, unsigned char *buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t count = pread(file, buffer + done, length - done, offset + done);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+
+        done += count;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes exactly length bytes at an offset.
+ *
+ * @param file   File descriptor.
+ * @param buffer Source.
+ * @param length Bytes to write.
+ * @param offset File offset.
+ * @return       0 on success, -1 on failure.
+ */
+int pwrite_all(int file, const unsigned char *buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t count = pwrite(file, buffer + done, length - done, offset + done);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+
+        done += count;
+    }
+
+    return 0;
+}
+
+/**
+ * Sizes an output file and reserves its blocks up front, so the disk fills without
+ * fragmenting and a full disk is reported before any data moves. File systems without
+ * fallocate() keep a sparse file.
+ *
+ * @param file Output file.
+ * @param size Final size in bytes.
+ * @return     0 on success, -1 on failure (errno is ENOSPC if the disk is too small).
+ */
+int preallocate_file(int file, uint64_t size) {
+    if (ftruncate(file, size) < 0) return -1;
+    if (size == 0 || fallocate(file, 0, 0, size) == 0) return 0;
+
+    return (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL) ? 0 : -1;
+}
+
+/**
+ * Writes one block. With O_DIRECT the aligned part bypasses the page cache and the tail of
+ * the file goes through it. Buffered data is pushed out right away and the block before it
+ * is waited for, so each stream leaves at most two blocks of dirty pages behind.
+ *
+ * @param writer Write-behind state (writer thread).
+ * @param block  Block to write.
+ * @return       0 on success, -1 on failure.
+ */
+int write_block(write_behind *writer, writeback_block *block) {
+    size_t direct_length = 0;
+
+    if (writer->direct >= 0 && block->offset % DIRECT_IO_ALIGNMENT == 0) {
+        direct_length = block->length & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+
+        if (direct_length > 0 && pwrite_all(writer->direct, block->data, direct_length, block->offset) < 0) {
+            // Some file systems accept O_DIRECT in open() and only refuse it on write
+            if (errno != EINVAL) return -1;
+
+            close(writer->direct);
+
+            writer->direct = -1;
+            direct_length = 0;
+        }
+    }
+
+    if (block->length > direct_length) {
+        uint64_t offset = block->offset + direct_length, length = block->length - direct_length;
+
+        if (pwrite_all(writer->file, block->data + direct_length, length, offset) < 0) return -1;
+
+        sync_file_range(writer->file, offset, length, SYNC_FILE_RANGE_WRITE);
+
+        if (writer->pending_length > 0) {
+            sync_file_range(writer->file, writer->pending_offset, writer->pending_length,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+
+        writer->pending_offset = offset;
+        writer->pending_length = length;
+    }
+
+    // Chunks only count as received once they are written
+    for (int index = 0; writer->resume && index < block->chunk_count; index++) {
+        if (checkpoint_mark(writer->resume, block->chunk_offsets[index], block->digests[index]) < 0) return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write-behind thread: writes full blocks in the order they arrive and hands them back.
+ *
+ * @param arg Pointer to the write_behind state.
+ * @return    NULL (no return value as it is intended to be used with pthreads)
+ */
+void *writeback_worker(void *arg) {
+    write_behind *writer = (write_behind *)arg;
+
+    while (1) {
+        writeback_block *block = ring_pop(&writer->full_blocks);
+
+        if (block == &writer->end_marker) break;
+
+        if (!writer->failed) {
+            uint64_t clock = telemetry_clock();
+
+            if (write_block(writer, block) < 0) writer->failed = 1;
+
+            telemetry_stage(STAGE_DISK_WRITE, clock);
+        }
+
+        block->length = 0;
+        block->chunk_count = 0;
+
+        ring_push(&writer->free_blocks, block);
+    }
+
+    return NULL;
+}
+
+/**
+ * Releases everything allocated by writeback_open().
+ *
+ * @param writer Write-behind state whose thread has stopped.
+ */
+void writeback_free(write_behind *writer) {
+    ring_free(&writer->free_blocks);
+    ring_free(&writer->full_blocks);
+
+    if (writer->memory) munmap(writer->memory, writer->memory_size);
+    if (writer->direct >= 0) close(writer->direct);
+
+    writer->memory = NULL;
+    writer->direct = -1;
+}
+
+/**
+ * Starts the write-behind thread of a receiving stream.
+ *
+ * @param writer     Write-behind state to initialize.
+ * @param file       Output file, already sized.
+ * @param chunk_size Largest plaintext size of a chunk.
+ * @param resume     Checkpoint to mark written chunks in, or NULL.
+ * @param direct     1 to bypass the page cache with O_DIRECT where the file system allows it.
+ * @return           0 on success, -1 on failure.
+ */
+int writeback_open(write_behind *writer, int file, uint32_t chunk_size, checkpoint *resume, int direct) {
+    size_t block_size = (chunk_size > WRITEBACK_BLOCK_SIZE) ? chunk_size : WRITEBACK_BLOCK_SIZE;
+
+    memset(writer, 0, sizeof(*writer));
+
+    writer->file = file;
+    writer->direct = -1;
+    writer->resume = resume;
+    writer->block_size = (block_size + DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+    writer->max_chunks = (chunk_size > 0 && writer->block_size / chunk_size < WRITEBACK_MAX_CHUNKS) ? writer->block_size / chunk_size : WRITEBACK_MAX_CHUNKS;
+    writer->memory_size = writer->block_size * WRITEBACK_BLOCKS;
+    writer->memory = mmap(NULL, writer->memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (writer->max_chunks < 1) writer->max_chunks = 1;
+
+    if (writer->memory == MAP_FAILED) writer->memory = NULL;
+
+    if (!writer->memory || ring_init(&writer->free_blocks, WRITEBACK_BLOCKS) < 0 || ring_init(&writer->full_blocks, WRITEBACK_BLOCKS + 1) < 0) {
+        writeback_free(writer);
+
+        return -1;
+    }
+
+    // O_DIRECT needs its own open file description; the shared one stays buffered for the
+    // other streams and for the unaligned tail
+    if (direct) {
+        char path[64];
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", file);
+
+        writer->direct = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+    }
+
+    for (int index = 0; index < WRITEBACK_BLOCKS; index++) {
+        writer->blocks[index].data = writer->memory + (size_t)index * writer->block_size;
+
+        ring_push(&writer->free_blocks, &writer->blocks[index]);
+    }
+
+    if (pthread_create(&writer->thread, NULL, writeback_worker, writer) != 0) {
+        writeback_free(writer);
+
+        return -1;
+    }
+
+    writer->running = 1;
+
+    return 0;
+}
+
+/**
+ * Copies an opened chunk into the block being filled. A block is handed to the thread once
+ * it is full or the next chunk does not follow it; if every block is still waiting for the
+ * disk, this waits for one to come back.
+ *
+ * @param writer Write-behind state (sink thread).
+ * @param data   Plaintext of the chunk.
+ * @param length Length of the chunk.
+ * @param offset File offset of the chunk.
+ * @param digest Digest of the chunk for the checkpoint (read only if the writer has one).
+ * @return       0 on success, -1 if an earlier write failed.
+ */
+int writeback_write(write_behind *writer, const unsigned char *data, size_t length, uint64_t offset, const unsigned char *digest) {
+    writeback_block *block = writer->current;
+
+    if (writer->failed) return -1;
+
+    if (block && (block->offset + block->length != offset || block->length + length > writer->block_size)) {
+        ring_push(&writer->full_blocks, block);
+
+        block = writer->current = NULL;
+    }
+
+    if (!block) {
+        block = writer->current = ring_pop(&writer->free_blocks);
+        block->offset = offset;
+    }
+
+    memcpy(block->data + block->length, data, length);
+
+    if (writer->resume) memcpy(block->digests[block->chunk_count], digest, DIGEST_LENGTH);
+
+    block->chunk_offsets[block->chunk_count++] = offset;
+    block->length += length;
+
+    if (block->length == writer->block_size || block->chunk_count == writer->max_chunks) {
+        ring_push(&writer->full_blocks, block);
+
+        writer->current = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Hands over the last block, waits until everything is written and stops the thread.
+ *
+ * @param writer Write-behind state started by writeback_open().
+ * @return       0 if every block was written, -1 otherwise.
+ */
+int writeback_close(write_behind *writer) {
+    if (!writer->running) return -1;
+
+    if (writer->current) ring_push(&writer->full_blocks, writer->current);
+
+    ring_push(&writer->full_blocks, &writer->end_marker);
+    pthread_join(writer->thread, NULL);
+
+    int result = (writer->failed) ? -1 : 0;
+
+    writer->current = NULL;
+    writer->running = 0;
+
+    writeback_free(writer);
+
+    return result;
+}
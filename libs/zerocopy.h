@@ -0,0 +1,156 @@
+#include "pipeline.h"
+
+#define PLAIN_FRAME_LENGTH (4 << 20)    // Largest DATA frame of an unencrypted transfer
+#define PIPE_BUFFER_SIZE (1 << 20)      // Capacity requested for the splice pipe
+
+/**
+ * Sends a frame header that announces more data, so it shares a segment with the payload.
+ *
+ * @param socket Connected socket.
+ * @param length Payload length of the DATA frame.
+ * @return       0 on success, -1 on failure.
+ */
+int send_plain_header(int socket, uint32_t length) {
+    unsigned char header[FRAME_HEADER_LENGTH];
+    size_t sent = 0;
+
+    put_frame_header(header, FRAME_DATA, 0, length);
+
+    while (sent < sizeof(header)) {
+        ssize_t count = send(socket, header + sent, sizeof(header) - sent, MSG_MORE | MSG_NOSIGNAL);
+
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return -1;
+
+        sent += count;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends the given ranges of a file as unencrypted DATA frames followed by an END frame. The
+ * content goes from the page cache to the socket with sendfile() and is never copied into
+ * user space. The caller must ignore SIGPIPE.
+ *
+ * @param in_file     File descriptor of the input file.
+ * @param ranges      Ranges to send, sorted by offset.
+ * @param range_count Number of ranges.
+ * @param socket      Socket file descriptor to send data through.
+ * @return            0 on success, -1 on failure.
+ */
+int send_plain_file(int in_file, const byte_range *ranges, uint32_t range_count, int socket) {
+    uint32_t range_index = 0;
+    uint64_t offset = 0;
+
+    while (next_range_offset(ranges, range_count, &range_index, &offset)) {
+        const byte_range *range = &ranges[range_index];
+        uint64_t remaining = range->offset + range->length - offset;
+        uint32_t length = (remaining < PLAIN_FRAME_LENGTH) ? (uint32_t)remaining : PLAIN_FRAME_LENGTH;
+        off_t position = offset;
+
+        if (send_plain_header(socket, length) < 0) return -1;
+
+        // sendfile() only returns 0 at the end of the file, which means it shrank
+        while ((uint64_t)position < offset + length) {
+            uint64_t clock = telemetry_clock();
+            ssize_t count = sendfile(socket, in_file, &position, offset + length - position);
+
+            telemetry_stage(STAGE_NETWORK, clock);
+
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) return -1;
+
+            telemetry_bytes(count);
+        }
+
+        offset += length;
+    }
+
+    return send_frame(socket, FRAME_END, 0, NULL, 0);
+}
+
+/**
+ * Moves one DATA frame payload from the socket into the file through a pipe with splice().
+ *
+ * @param socket   Connected socket positioned at the payload.
+ * @param pipe_fds Pipe used as the kernel-side buffer (empty on entry and on return).
+ * @param out_file File descriptor of the output file.
+ * @param offset   Offset the payload is written at.
+ * @param length   Payload length.
+ * @return         0 on success, -1 on failure.
+ */
+int splice_frame(int socket, const int *pipe_fds, int out_file, uint64_t offset, uint32_t length) {
+    uint32_t done = 0;
+
+    while (done < length) {
+        uint64_t clock = telemetry_clock();
+        ssize_t pending = splice(socket, NULL, pipe_fds[1], NULL, length - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        telemetry_stage(STAGE_NETWORK, clock);
+
+        if (pending < 0 && errno == EINTR) continue;
+        if (pending <= 0) return -1;
+
+        // Drain the pipe completely before reading more from the socket
+        while (pending > 0) {
+            loff_t position = offset + done;
+
+            clock = telemetry_clock();
+
+            ssize_t count = splice(pipe_fds[0], NULL, out_file, &position, pending, SPLICE_F_MOVE);
+
+            telemetry_stage(STAGE_DISK_WRITE, clock);
+
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) return -1;
+
+            telemetry_bytes(count);
+
+            pending -= count;
+            done += count;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Receives unencrypted DATA frames until the END frame and writes them at their offsets with
+ * splice(). Every frame must continue the expected ranges exactly, and the END frame is only
+ * accepted once every range has arrived.
+ *
+ * @param out_file    File descriptor of the output file.
+ * @param ranges      Ranges the sender was asked for, sorted by offset.
+ * @param range_count Number of ranges.
+ * @param socket      Socket file descriptor to receive data from.
+ * @return            0 if every range arrived, -1 on failure.
+ */
+int receive_plain_file(int out_file, const byte_range *ranges, uint32_t range_count, int socket) {
+    uint32_t range_index = 0;
+    uint64_t offset = 0;
+    int pipe_fds[2], result = 0;
+
+    if (pipe(pipe_fds) < 0) return -1;
+
+    // A larger pipe moves more pages per splice() call; the default size still works
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+
+    while (result == 0) {
+        frame_header header;
+
+        if (recv_frame_header(socket, &header) < 0) result = -1;
+        else if (header.type == FRAME_END && header.length == 0) break;
+        else if (header.type != FRAME_DATA || header.length == 0 || !next_range_offset(ranges, range_count, &range_index, &offset)) result = -1;
+        else if (header.length > ranges[range_index].offset + ranges[range_index].length - offset) result = -1;
+        else if (splice_frame(socket, pipe_fds, out_file, offset, header.length) < 0) result = -1;
+        else offset += header.length;
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    if (result < 0) return -1;
+
+    return next_range_offset(ranges, range_count, &range_index, &offset) ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+# Helpers shared by the shell tests. run.sh exports BUILD_DIR, which holds the bytevalve build.
+
+BYTEVALVE="$BUILD_DIR/bytevalve"
+WORK_DIR=$(mktemp -d)
+RECEIVER_PID=""
+
+cleanup() {
+    [ -n "$RECEIVER_PID" ] && kill_receiver
+
+    rm -rf "$WORK_DIR"
+}
+
+trap cleanup EXIT
+
+# Prints the reason and fails the test
+fail() {
+    echo -e "\e[31m$1\e[0m"
+
+    exit 1
+}
+
+# Starts a receiver in the directory given first, with the remaining arguments. Its output
+# goes to $WORK_DIR/receiver.log.
+start_receiver() {
+    local DIR="$1"
+
+    shift
+
+    (cd "$DIR" && exec "$BYTEVALVE" -r "$@") > "$WORK_DIR/receiver.log" 2>&1 &
+    RECEIVER_PID=$!
+
+    # Give the receiver time to listen
+    sleep 0.3
+}
+
+# Stops the receiver right away
+kill_receiver() {
+    kill "$RECEIVER_PID" 2>/dev/null
+    wait "$RECEIVER_PID" 2>/dev/null
+
+    RECEIVER_PID=""
+}
+
+# Waits up to five seconds for the receiver to exit, then stops it
+stop_receiver() {
+    for _ in $(seq 50); do
+        kill -0 "$RECEIVER_PID" 2>/dev/null || break
+        sleep 0.1
+    done
+
+    kill_receiver
+}
+
+# Sends a file to the local receiver. Its output goes to $WORK_DIR/sender.log.
+send_file() {
+    "$BYTEVALVE" -s 127.0.0.1 "$@" > "$WORK_DIR/sender.log" 2>&1
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Builds ByteValve and runs every test_* file in this directory against the build. The
+# transfer tests listen on the default port on loopback, so no other receiver may be running.
+
+# Define the libraries ByteValve links against
+LIBS="-lcrypto -lpthread -lz"
+
+cd "$(dirname "$0")/.." || exit 1
+
+export BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+if ! gcc -O2 -o "$BUILD_DIR/bytevalve" bytevalve.c $LIBS; then
+    echo -e "\e[31mFailed to build ByteValve\e[0m"
+
+    exit 1
+fi
+
+FAILED=0
+
+for TEST in tests/test_*; do
+    NAME=$(basename "$TEST")
+
+    # C tests include the libraries directly, shell tests drive the built binary
+    case "$TEST" in
+        *.c) gcc -O2 -o "$BUILD_DIR/${NAME%.c}" "$TEST" $LIBS && "$BUILD_DIR/${NAME%.c}" ;;
+        *.sh) bash "$TEST" ;;
+    esac
+
+    if [ $? -eq 0 ]; then
+        echo -e "\e[32mPASS\e[0m $NAME"
+    else
+        echo -e "\e[31mFAIL\e[0m $NAME"
+
+        FAILED=$((FAILED + 1))
+    fi
+done
+
+if [ $FAILED -gt 0 ]; then
+    echo -e "\n\e[31m$FAILED test(s) failed\e[0m"
+
+    exit 1
+fi
+
+echo -e "\n\e[32mAll tests passed\e[0m"
@@ -0,0 +1,54 @@
+#include "../libs/transfer.h"
+
+int failures = 0;
+
+void keep_metadata(file_metadata *metadata) { (void)metadata; }
+void change_chunk_size(file_metadata *metadata) { metadata->chunk_size *= 2; }
+void change_kind(file_metadata *metadata) { metadata->kind = TRANSFER_TREE; }
+void change_mode(file_metadata *metadata) { metadata->mode ^= 0200; }
+void change_cipher(file_metadata *metadata) { metadata->cipher = CIPHER_CHACHA20_POLY1305; }
+void change_name(file_metadata *metadata) { strcpy(metadata->name, "other.bin"); }
+void change_source_id(file_metadata *metadata) { metadata->source_id[0] ^= 1; }
+void change_content_key(file_metadata *metadata) { metadata->content_key[0] ^= 1; }
+void change_multicast(file_metadata *metadata) { metadata->multicast_port++; }
+void change_range(file_metadata *metadata) { metadata->range_offset -= metadata->chunk_size; }
+
+/**
+ * Splits a file over three streams, lets change() alter the last one and checks that
+ * check_ranges() returns the expected verdict.
+ *
+ * @param what     Description of the change.
+ * @param change   Function altering the metadata of the last stream.
+ * @param expected Expected return value of check_ranges().
+ */
+void expect_ranges(const char *what, void (*change)(file_metadata *), int expected) {
+    transfer_stream streams[3] = {0};
+    file_metadata metadata = {.size = 10 << 20, .mode = 0644, .cipher = CIPHER_AES_256_GCM, .chunk_size = 1 << 20};
+
+    strcpy(metadata.name, "file.bin");
+
+    int stream_count = split_ranges(&metadata, streams, 3);
+
+    change(&streams[stream_count - 1].metadata);
+
+    if (check_ranges(streams, stream_count) != expected) {
+        printf("\e[31mcheck_ranges() does not return %d for %s\e[0m\n", expected, what);
+
+        failures++;
+    }
+}
+
+int main(void) {
+    expect_ranges("matching streams", keep_metadata, 0);
+    expect_ranges("a different chunk size", change_chunk_size, -1);
+    expect_ranges("a different kind", change_kind, -1);
+    expect_ranges("a different mode", change_mode, -1);
+    expect_ranges("a different cipher", change_cipher, -1);
+    expect_ranges("a different name", change_name, -1);
+    expect_ranges("a different source version", change_source_id, -1);
+    expect_ranges("a different content key", change_content_key, -1);
+    expect_ranges("a different multicast group", change_multicast, -1);
+    expect_ranges("overlapping ranges", change_range, -1);
+
+    return (failures == 0) ? 0 : 1;
+}
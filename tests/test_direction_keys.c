@@ -0,0 +1,95 @@
+#include "../libs/session.h"
+
+int failures = 0;
+
+/**
+ * Seals a record on one session and checks whether another session opens it.
+ *
+ * @param what     Description of the pair of sessions.
+ * @param sealer   Session sealing the record.
+ * @param opener   Session opening the record.
+ * @param expected Non-zero if the record must open.
+ */
+void expect_open(const char *what, crypto_session *sealer, crypto_session *opener, int expected) {
+    EVP_CIPHER_CTX *seal_context = new_record_context(sealer->cipher, 1);
+    EVP_CIPHER_CTX *open_context = new_record_context(opener->cipher, 0);
+    unsigned char plain_text[64] = "bytevalve", output[64];
+    unsigned char record[sizeof(plain_text) + RECORD_OVERHEAD];
+    record_header header;
+    int record_len = seal_record(seal_context, sealer, 0, 0, plain_text, sizeof(plain_text), record);
+    int opened = record_len > 0 && open_record(open_context, opener, record, record_len, &header, output) == (int)sizeof(plain_text);
+
+    if (opened != expected) {
+        printf("\e[31mA record %s %s\e[0m\n", (expected) ? "does not open for" : "opens for", what);
+
+        failures++;
+    }
+
+    EVP_CIPHER_CTX_free(seal_context);
+    EVP_CIPHER_CTX_free(open_context);
+}
+
+/**
+ * Checks that each direction of a pair of sessions has its own key and opens only the
+ * records of the other side.
+ *
+ * @param what   Description of the pair of sessions.
+ * @param client Client side.
+ * @param server Server side.
+ */
+void expect_directions(const char *what, crypto_session *client, crypto_session *server) {
+    char description[128];
+
+    if (memcmp(client->key, client->peer_key, KEY_LENGTH) == 0) {
+        printf("\e[31mBoth directions of the %s share one key\e[0m\n", what);
+
+        failures++;
+    }
+
+    if (memcmp(client->key, server->peer_key, KEY_LENGTH) != 0 || memcmp(server->key, client->peer_key, KEY_LENGTH) != 0) {
+        printf("\e[31mThe keys of the %s do not match across sides\e[0m\n", what);
+
+        failures++;
+    }
+
+    snprintf(description, sizeof(description), "the server of the %s", what);
+    expect_open(description, client, server, 1);
+
+    snprintf(description, sizeof(description), "the client of the %s", what);
+    expect_open(description, server, client, 1);
+
+    snprintf(description, sizeof(description), "the client reflecting its own %s record", what);
+    expect_open(description, client, client, 0);
+}
+
+int main(void) {
+    crypto_session client = {.cipher = CIPHER_AES_256_GCM}, server = {.cipher = CIPHER_AES_256_GCM};
+    crypto_session client_channel = {0}, server_channel = {0}, other_channel = {0};
+    unsigned char client_public[KEY_SHARE_LENGTH], server_public[KEY_SHARE_LENGTH];
+    EVP_PKEY *client_key = generate_key_share(client_public);
+    EVP_PKEY *server_key = generate_key_share(server_public);
+
+    if (!client_key || !server_key || derive_session(client_key, client_public, server_public, 1, &client) < 0 ||
+        derive_session(server_key, client_public, server_public, 0, &server) < 0) {
+        printf("\e[31mThe session cannot be derived\e[0m\n");
+
+        return 1;
+    }
+
+    expect_directions("session", &client, &server);
+
+    if (derive_channel_session(&client, 1, 1, &client_channel) < 0 || derive_channel_session(&server, 1, 0, &server_channel) < 0 ||
+        derive_channel_session(&server, 2, 0, &other_channel) < 0) {
+        printf("\e[31mThe channel sessions cannot be derived\e[0m\n");
+
+        return 1;
+    }
+
+    expect_directions("channel", &client_channel, &server_channel);
+    expect_open("another channel", &client_channel, &other_channel, 0);
+
+    EVP_PKEY_free(client_key);
+    EVP_PKEY_free(server_key);
+
+    return (failures == 0) ? 0 : 1;
+}
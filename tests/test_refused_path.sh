@@ -0,0 +1,30 @@
+# A daemon that refuses the output path tells the sender why
+
+source "$(dirname "$0")/common.sh"
+
+NAME=$(printf 'f%.0s' $(seq 200)).bin
+DEEP="$WORK_DIR/out"
+
+mkdir "$WORK_DIR/in" "$DEEP"
+head -c 100000 /dev/urandom > "$WORK_DIR/in/$NAME"
+
+# Nest the output directory until <directory>/<name> no longer fits in PATH_MAX
+(
+    cd "$DEEP" || exit 1
+
+    for _ in $(seq 16); do
+        DIR=$(printf 'd%.0s' $(seq 250))
+
+        mkdir "$DIR" && cd "$DIR" || exit 1
+    done
+) || fail "Failed to create the output directory"
+
+for _ in $(seq 16); do DEEP="$DEEP/$(printf 'd%.0s' $(seq 250))"; done
+
+start_receiver "$WORK_DIR" "$DEEP" --daemon
+send_file "$WORK_DIR/in/$NAME" && fail "The transfer succeeded although the output path is too long"
+kill_receiver
+
+grep -q "The receiver cannot use the output path of $NAME" "$WORK_DIR/sender.log" || fail "The sender did not report the refusal: $(tail -1 "$WORK_DIR/sender.log")"
+
+exit 0
@@ -0,0 +1,27 @@
+# A receiver that cannot open the output file must not leave a resume checkpoint behind
+
+source "$(dirname "$0")/common.sh"
+
+mkdir "$WORK_DIR/in" "$WORK_DIR/out"
+head -c 3000000 /dev/urandom > "$WORK_DIR/in/file.bin"
+
+# A directory in place of the output file makes opening it fail
+mkdir "$WORK_DIR/out/file.bin"
+
+start_receiver "$WORK_DIR/out"
+send_file "$WORK_DIR/in/file.bin" && fail "The transfer succeeded although the output file cannot be opened"
+stop_receiver
+
+[ -e "$WORK_DIR/out/file.bin.bvresume" ] && fail "The failed transfer left file.bin.bvresume behind"
+
+# A complete transfer removes its checkpoint as well
+rmdir "$WORK_DIR/out/file.bin"
+
+start_receiver "$WORK_DIR/out"
+send_file "$WORK_DIR/in/file.bin" || fail "The transfer failed: $(tail -1 "$WORK_DIR/sender.log")"
+stop_receiver
+
+cmp -s "$WORK_DIR/in/file.bin" "$WORK_DIR/out/file.bin" || fail "The received file differs from the source"
+[ -e "$WORK_DIR/out/file.bin.bvresume" ] && fail "The complete transfer left file.bin.bvresume behind"
+
+exit 0
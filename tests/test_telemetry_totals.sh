@@ -0,0 +1,49 @@
+# Delta and deduplicated transfers must count the bytes the receiver rebuilds from its own copy
+# or chunk store, so the moved and reused bytes add up to the file size on both sides
+
+source "$(dirname "$0")/common.sh"
+
+# Prints a number field of a stats JSON file
+stats_field() {
+    sed -n "s/^  \"$2\": \([0-9]*\),\$/\1/p" "$1"
+}
+
+# Checks that the totals of a stats JSON file add up to the file size and that some bytes were reused
+check_totals() {
+    local size=$(stat -c %s "$WORK_DIR/in/file.bin")
+    local moved=$(stats_field "$1" bytes_transferred) reused=$(stats_field "$1" bytes_reused)
+
+    [ -n "$moved" ] && [ -n "$reused" ] || fail "$2 wrote no byte totals to $(basename "$1")"
+    [ "$reused" -gt 0 ] || fail "$2 reports no reused bytes"
+    [ $((moved + reused)) -eq "$size" ] || fail "$2 counts $moved moved and $reused reused bytes of $size"
+}
+
+mkdir "$WORK_DIR/in" "$WORK_DIR/out" "$WORK_DIR/store"
+head -c 3000000 /dev/urandom > "$WORK_DIR/in/file.bin"
+
+# Delta: the receiver holds a copy with a few changed bytes
+cp "$WORK_DIR/in/file.bin" "$WORK_DIR/out/file.bin"
+printf 'changed' | dd of="$WORK_DIR/out/file.bin" bs=1 seek=1000000 conv=notrunc 2> /dev/null
+
+start_receiver "$WORK_DIR/out" --stats-json "$WORK_DIR/receiver.json"
+send_file "$WORK_DIR/in/file.bin" --delta --stats-json "$WORK_DIR/sender.json" || fail "The delta transfer failed: $(tail -1 "$WORK_DIR/sender.log")"
+stop_receiver
+
+cmp -s "$WORK_DIR/in/file.bin" "$WORK_DIR/out/file.bin" || fail "The delta transfer rebuilt a different file"
+check_totals "$WORK_DIR/sender.json" "The delta sender"
+check_totals "$WORK_DIR/receiver.json" "The delta receiver"
+
+# Dedup: the first transfer fills the chunk store, the second takes every chunk from it
+for round in 1 2; do
+    rm -f "$WORK_DIR/out/file.bin" "$WORK_DIR/sender.json" "$WORK_DIR/receiver.json"
+
+    start_receiver "$WORK_DIR/out" --chunk-store "$WORK_DIR/store" --stats-json "$WORK_DIR/receiver.json"
+    send_file "$WORK_DIR/in/file.bin" --dedup --stats-json "$WORK_DIR/sender.json" || fail "The dedup transfer failed: $(tail -1 "$WORK_DIR/sender.log")"
+    stop_receiver
+done
+
+cmp -s "$WORK_DIR/in/file.bin" "$WORK_DIR/out/file.bin" || fail "The dedup transfer rebuilt a different file"
+check_totals "$WORK_DIR/sender.json" "The dedup sender"
+check_totals "$WORK_DIR/receiver.json" "The dedup receiver"
+
+exit 0
@@ -0,0 +1,35 @@
+# A directory is recreated with its symbolic links, and a tree holding a FIFO is reported as incomplete
+
+source "$(dirname "$0")/common.sh"
+
+mkdir -p "$WORK_DIR/tree/sub" "$WORK_DIR/out"
+head -c 300000 /dev/urandom > "$WORK_DIR/tree/sub/file.bin"
+ln -s sub/file.bin "$WORK_DIR/tree/link"
+ln -s sub "$WORK_DIR/tree/directory_link"
+ln -s /nonexistent/target "$WORK_DIR/tree/sub/dangling"
+
+# Sending twice replaces the links the first transfer created
+for round in 1 2; do
+    start_receiver "$WORK_DIR/out"
+    send_file "$WORK_DIR/tree" || fail "The tree transfer failed: $(tail -1 "$WORK_DIR/sender.log")"
+    stop_receiver
+done
+
+diff -r --no-dereference "$WORK_DIR/tree" "$WORK_DIR/out/tree" > /dev/null || fail "The received tree differs from the source"
+[ "$(readlink "$WORK_DIR/out/tree/link")" = "sub/file.bin" ] || fail "link was not recreated as a symbolic link"
+[ "$(readlink "$WORK_DIR/out/tree/directory_link")" = "sub" ] || fail "directory_link was not recreated as a symbolic link"
+[ "$(readlink "$WORK_DIR/out/tree/sub/dangling")" = "/nonexistent/target" ] || fail "sub/dangling was not recreated as a symbolic link"
+
+# A FIFO cannot be copied: the rest arrives, but the sender says the copy is incomplete
+mkfifo "$WORK_DIR/tree/fifo"
+rm -rf "$WORK_DIR/out/tree"
+
+start_receiver "$WORK_DIR/out"
+send_file "$WORK_DIR/tree" && fail "The sender reported a tree without its FIFO as complete"
+stop_receiver
+
+grep -q "Skipped fifo" "$WORK_DIR/sender.log" || fail "The sender did not report the skipped FIFO"
+grep -q "the copy is incomplete" "$WORK_DIR/sender.log" || fail "The sender did not report the tree as incomplete"
+cmp -s "$WORK_DIR/tree/sub/file.bin" "$WORK_DIR/out/tree/sub/file.bin" || fail "The files next to the FIFO were not received"
+
+exit 0